@@ -46,7 +46,9 @@ typedef int (*connect_t)(const char *alias, size_t size,
  * learn_t - Learning callback type.
  *
  * @param message   The message to learn.  For chats, this is the chat message
- *                  itself.  It is not used for joins and parts.
+ *                  itself.  It is not used for joins and parts.  It is only
+ *                  valid during the callback unless retained with
+ *                  motmot_retain.
  * @param len       The size of that message.
  * @param alias     String handle identifying a client.  For chats, it is the
  *                  message source; for joins and parts, it is the joining or
@@ -77,6 +79,47 @@ typedef void *(*enter_t)(void *data);
  */
 typedef void (*leave_t)(void *data);
 
+/**
+ * writable_t - Callback type for notifying the client that it may resume
+ * sending in a session after motmot_send returned MOTMOT_WOULDBLOCK.
+ *
+ * @param data      Data pointer used by the client to identify the session.
+ */
+typedef void (*writable_t)(void *data);
+
+/**
+ * history_t - Callback type for chats read back from a session's history by
+ * motmot_history.
+ *
+ * @param inum      Sequence number of the instance the chat was learned in.
+ *                  Several chats may share one.
+ * @param timestamp When we learned the chat, in microseconds since the
+ *                  epoch.
+ * @param message   The chat message.  It is only valid during the callback.
+ * @param len       The size of that message.
+ * @param alias     String handle of the message source.
+ * @param size      Length of the alias.
+ * @param data      Data pointer used by the client to identify the session.
+ * @returns         0 to continue, nonzero to stop reading the history.
+ */
+typedef int (*history_t)(unsigned inum, long long timestamp,
+    const void *message, size_t len, const char *alias, size_t size,
+    void *data);
+
+/**
+ * MOTMOT_HISTORY_END - Passed to motmot_history with a negative count to read
+ * the newest chats in a session's history.
+ */
+#define MOTMOT_HISTORY_END  (~0U)
+
+/**
+ * MOTMOT_WOULDBLOCK - Returned by motmot_send and motmot_invite when our
+ * connection to some participant of the session is too backed up to take
+ * the message.  The message is not sent; the client should try again once
+ * its writable callback is invoked for the session.
+ */
+#define MOTMOT_WOULDBLOCK   (-1)
+
 /**
  * motmot_init - Initialize libmotmot.
  *
@@ -95,6 +138,104 @@ typedef void (*leave_t)(void *data);
 int motmot_init(connect_t connect, learn_t chat, learn_t join, learn_t part,
     enter_t enter, leave_t leave, const char *alias, size_t size);
 
+/**
+ * motmot_batch - Configure how chats are coalesced into batches while we are
+ * the proposer.  Batching trades a little latency for far fewer decrees
+ * under load; members of a batch are still learned in the order sent.
+ * Batching is off by default.
+ *
+ * This function may be called at any time after motmot_init.
+ *
+ * @param size      Maximum number of chats per batch; 1 disables batching.
+ * @param msecs     Longest time in milliseconds a chat may wait for its
+ *                  batch to fill.
+ * @returns         0 on success, nonzero on error.
+ */
+int motmot_batch(unsigned size, unsigned msecs);
+
+/**
+ * motmot_multileader - Choose whether chats in the sessions we start are
+ * decreed by their senders in instances of their own, rather than all being
+ * funneled through the session's proposer.  This spreads the work of
+ * ordering chats across the session and spares senders a round trip to the
+ * proposer, at the cost of a null decree from each idle participant for
+ * every round of instances.  Sessions we join follow the choice of their
+ * creator.
+ *
+ * This function may be called at any time after motmot_init; it affects
+ * only sessions started afterwards.
+ *
+ * @param enable    Nonzero to share instances among participants.
+ */
+void motmot_multileader(int enable);
+
+/**
+ * motmot_thrifty - Choose whether, in large sessions, we send the decrees we
+ * make to just enough of the other participants to have them chosen, rather
+ * than to everyone.  We prefer the participants who have been quickest to
+ * respond, and fall back to everyone else if they are slow to do so.  The
+ * rest still learn every chat.  This roughly halves the ordering traffic we
+ * send as proposer, at the cost of some latency if a participant we rely on
+ * drops out.
+ *
+ * This function may be called at any time after motmot_init.
+ *
+ * @param enable    Nonzero to send decrees to a quorum only.
+ */
+void motmot_thrifty(int enable);
+
+/**
+ * motmot_truncate_majority - Choose whether, in the sessions we run, we
+ * discard history once most participants have seen it, rather than once
+ * every connected participant has.  A participant who falls too far behind
+ * is then brought up to date with the recent chats it missed rather than
+ * the full history, but one slow participant no longer makes everyone hold
+ * on to the history it has yet to see.
+ *
+ * This function may be called at any time after motmot_init.
+ *
+ * @param enable    Nonzero to truncate once a majority has caught up.
+ */
+void motmot_truncate_majority(int enable);
+
+/**
+ * motmot_durable - Choose whether we log the state of our sessions under the
+ * Motmot home directory, so that they survive our crashing.  Everything we
+ * vote on is on disk before anyone else hears of it; disk writes are synced
+ * once for everything we do in a single iteration of the main loop.
+ *
+ * Turning logging on also recovers the sessions we were logging when we last
+ * stopped, calling the enter callback for each one and delivering its recent
+ * history as if we had just joined.  It should therefore be called once the
+ * client is ready for sessions, after motmot_init.  Sessions which parted us
+ * while we were away end as soon as we learn of it.
+ *
+ * @param enable    Nonzero to log sessions and recover those already logged.
+ * @returns         0 on success, nonzero on error.
+ */
+int motmot_durable(int enable);
+
+/**
+ * motmot_keep_history - Choose whether we keep every chat learned in our
+ * sessions on disk, so that the client may read back its scrollback with
+ * motmot_history rather than keeping it in memory.  A session's history is
+ * deleted when the session ends.
+ *
+ * This function may be called at any time after motmot_init; chats learned
+ * while it is off are not kept.
+ *
+ * @param enable    Nonzero to keep chat history.
+ */
+void motmot_keep_history(int enable);
+
+/**
+ * motmot_set_writable - Register a callback to be invoked whenever a backed
+ * up connection drains, for each session using the connection.
+ *
+ * @param writable  Client callback invoked when sends may be resumed.
+ */
+void motmot_set_writable(writable_t writable);
+
 /**
  * motmot_session - Start a new motmot chat.
  *
@@ -120,7 +261,8 @@ int motmot_watch(GIOChannel *channel);
  *                  used to uniquely identify the invitee.
  * @param size      Length of the alias.
  * @param data      Data pointer used by motmot to identify the session.
- * @returns         0 on success, nonzero on error.
+ * @returns         0 on success, MOTMOT_WOULDBLOCK if the invitation could
+ *                  not be queued, other nonzero values on error.
  */
 int motmot_invite(const char *alias, size_t size, void *data);
 
@@ -138,8 +280,61 @@ int motmot_disconnect(void *data);
  * @param message   The message to be sent.
  * @param len       The length of that message.
  * @param data      Data pointer used by motmot to identify the session.
- * @returns         0 on success, nonzero on error.
+ * @returns         0 on success, MOTMOT_WOULDBLOCK if the message could not
+ *                  be queued, other nonzero values on error.
  */
 int motmot_send(const char *message, size_t len, void *data);
 
+/**
+ * motmot_history - Read back chats from a session's history, oldest first.
+ * Chats are read directly from the history on disk, so paging through even a
+ * very long history costs little memory.  Chats sharing an instance are
+ * always delivered together, so the client may page forward from one past
+ * the last instance it was given, or backward from the first.
+ *
+ * @param data      Data pointer used by motmot to identify the session.
+ * @param from_inum If count is positive, the first instance to deliver chats
+ *                  from; otherwise, the instance to deliver chats from before.
+ * @param count     Number of chats to deliver, rounded up to a whole
+ *                  instance; negative to deliver that many of the chats
+ *                  preceding from_inum.
+ * @param cb        Client callback invoked for each chat.
+ * @returns         0 on success, nonzero on error or if history is not kept.
+ */
+int motmot_history(void *data, unsigned from_inum, int count, history_t cb);
+
+/**
+ * motmot_cork - Hold all outgoing network traffic, across all sessions, until
+ * a matching call to motmot_uncork.  Ordinarily, everything queued during
+ * one iteration of the main loop is written at the start of the next; a
+ * client sending a burst of messages from several callbacks may cork to
+ * have them written together.  Corks nest.
+ */
+void motmot_cork(void);
+
+/**
+ * motmot_uncork - Release a cork taken with motmot_cork.  Once every cork is
+ * released, held traffic is written on the next iteration of the main loop.
+ */
+void motmot_uncork(void);
+
+/**
+ * motmot_retain - Keep the message passed to a learn callback valid after the
+ * callback returns, instead of copying it.  This may only be called from
+ * within a learn callback; for joins and parts, the message and the alias
+ * are the same buffer and are retained together.
+ *
+ * @returns         Handle for the retained message, to be passed to
+ *                  motmot_release when the client is done with it, or NULL
+ *                  if the message is empty.
+ */
+void *motmot_retain(void);
+
+/**
+ * motmot_release - Release a message kept with motmot_retain.
+ *
+ * @param handle    Handle returned by motmot_retain.
+ */
+void motmot_release(void *handle);
+
 #endif // __MOTMOT_H__
@@ -8,6 +8,7 @@
 #include "common/msgpack_io.h"
 
 #define BUFSIZE 4096
+#define HIGH_WATER (1024 * 1024)
 
 struct msgpack_conn {
   GIOChannel *mc_channel;
@@ -196,11 +197,17 @@ msgpack_conn_write(GIOChannel *channel, GIOCondition condition, void *data)
 }
 
 /**
- * msgpack_conn_send - Send the contents of a buffer to a conn.
+ * msgpack_conn_send - Send the contents of a buffer to a conn.  If the conn
+ * already has more than HIGH_WATER bytes waiting to be written, nothing is
+ * sent and we return nonzero.
  */
 int
 msgpack_conn_send(struct msgpack_conn *conn, const char *buffer, size_t length)
 {
+  if (conn->mc_write_buffer->len > HIGH_WATER) {
+    return 1;
+  }
+
   // If there was no data in the buffer to begin with, it means we weren't
   // subscribed to write events.  Since we're populating the buffer now, let's
   // start listening.
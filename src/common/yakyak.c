@@ -42,3 +42,14 @@ yakyak_size(struct yakyak *yy)
 {
   return yy->buf->size;
 }
+
+/**
+ * Take ownership of the packed data, leaving the yak empty.  The data must
+ * be released with free().
+ */
+char *
+yakyak_release(struct yakyak *yy, size_t *size)
+{
+  *size = yy->buf->size;
+  return msgpack_sbuffer_release(yy->buf);
+}
@@ -22,5 +22,6 @@ void yakyak_destroy(struct yakyak *);
 void yakyak_begin_array(struct yakyak *, size_t);
 char *yakyak_data(struct yakyak *);
 size_t yakyak_size(struct yakyak *);
+char *yakyak_release(struct yakyak *, size_t *);
 
 #endif /* __MOTMOT_YAKYAK_H__ */
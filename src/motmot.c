@@ -6,6 +6,7 @@
 
 #include "motmot.h"
 #include "paxos.h"
+#include "util/paxos_io.h"
 
 /**
  * motmot_init - Initialize libmotmot.
@@ -23,6 +24,72 @@ motmot_init(connect_t connect, learn_t chat, learn_t join, learn_t part,
   return paxos_init(connect, &learn, enter, leave, alias, size);
 }
 
+/**
+ * motmot_batch - Configure the coalescing of chats into batch decrees.
+ */
+int
+motmot_batch(unsigned size, unsigned msecs)
+{
+  return paxos_set_batching(size, msecs);
+}
+
+/**
+ * motmot_multileader - Configure whether new sessions share instances among
+ * their participants.
+ */
+void
+motmot_multileader(int enable)
+{
+  paxos_set_mencius(enable);
+}
+
+/**
+ * motmot_thrifty - Configure whether we send decrees to a quorum only.
+ */
+void
+motmot_thrifty(int enable)
+{
+  paxos_set_thrifty(enable);
+}
+
+/**
+ * motmot_truncate_majority - Configure whether we truncate history once a
+ * majority of participants has seen it.
+ */
+void
+motmot_truncate_majority(int enable)
+{
+  paxos_set_sync_majority(enable);
+}
+
+/**
+ * motmot_durable - Configure whether our sessions are logged to disk,
+ * recovering those we were logging if so.
+ */
+int
+motmot_durable(int enable)
+{
+  return paxos_set_wal(enable);
+}
+
+/**
+ * motmot_keep_history - Configure whether we keep chat history on disk.
+ */
+void
+motmot_keep_history(int enable)
+{
+  paxos_set_history(enable);
+}
+
+/**
+ * motmot_set_writable - Register the client's writable callback.
+ */
+void
+motmot_set_writable(writable_t writable)
+{
+  paxos_set_writable(writable);
+}
+
 /**
  * motmot_session - Start a new motmot chat.
  */
@@ -67,3 +134,49 @@ motmot_send(const char *message, size_t len, void *data)
 {
   return paxos_request(data, DEC_CHAT, message, len);
 }
+
+/**
+ * motmot_history - Read back chats from a session's history.
+ */
+int
+motmot_history(void *data, unsigned from_inum, int count, history_t cb)
+{
+  return paxos_history(data, from_inum, count, cb);
+}
+
+/**
+ * motmot_cork - Hold outgoing traffic until motmot_uncork.
+ */
+void
+motmot_cork()
+{
+  paxos_io_cork();
+}
+
+/**
+ * motmot_uncork - Release a cork taken with motmot_cork.
+ */
+void
+motmot_uncork()
+{
+  paxos_io_uncork();
+}
+
+/**
+ * motmot_retain - Keep the message being learned valid after the learn
+ * callback returns.
+ */
+void *
+motmot_retain()
+{
+  return paxos_retain();
+}
+
+/**
+ * motmot_release - Release a message kept with motmot_retain.
+ */
+void
+motmot_release(void *handle)
+{
+  paxos_release(handle);
+}
@@ -0,0 +1,278 @@
+/**
+ * openhash_factory.h - Macros for implementing and declaring open-addressing
+ * hash tables for an arbitrary paxos_* struct.
+ *
+ * Elements are stored by pointer in a power-of-two array of slots and found
+ * by linear probing from the hash of their ID; removal uses backward-shift
+ * deletion, so we never need tombstones.  Every table also threads its
+ * elements on a BSD list in insertion order, which gives us cheap iteration
+ * and oldest-first eviction.
+ *
+ * All open hash factory macros assume that the element struct...
+ * - includes a BSD list entry field;
+ * - has a name of the form paxos_*; and
+ * - includes an ID field which uniquely identifies all instances of the
+ *   struct.
+ */
+
+#include <assert.h>
+#include <glib.h>
+
+#include "containers/list.h"
+
+#define OPENHASH_MIN_SIZE   64
+
+#define OPENHASH_HEAD(name, type)                                           \
+  struct name {                                                             \
+    struct type **oh_slots;   /* slot array */                              \
+    unsigned oh_size;         /* number of slots; a power of two */         \
+    unsigned oh_count;        /* number of elements */                      \
+    LIST_HEAD(, type) oh_order;   /* elements in insertion order */         \
+  }
+
+#define OPENHASH_EMPTY(head)  ((head)->oh_count == 0)
+
+#define OPENHASH_COUNT(head)  ((head)->oh_count)
+
+/* Iterate over elements from oldest to newest insertion. */
+#define OPENHASH_FOREACH(var, head, field)  \
+  LIST_FOREACH(var, &(head)->oh_order, field)
+
+/* The oldest element in the table. */
+#define OPENHASH_OLDEST(head)   LIST_FIRST(&(head)->oh_order)
+
+/**
+ * Factory for implementing open hash initialization for a Paxos struct.
+ *
+ * @param name        Name of the struct, i.e., struct paxos_{name}.
+ */
+#define OPENHASH_IMPLEMENT_INIT(name)                                       \
+  inline void                                                               \
+  name##_container_init(name##_container *head)                             \
+  {                                                                         \
+    head->oh_slots = NULL;                                                  \
+    head->oh_size = 0;                                                      \
+    head->oh_count = 0;                                                     \
+    LIST_INIT(&head->oh_order);                                             \
+  }
+
+/**
+ * Factory for implementing open hash creation for a Paxos struct.
+ *
+ * @param name        Name of the struct, i.e., struct paxos_{name}.
+ */
+#define OPENHASH_IMPLEMENT_NEW(name)                                        \
+  inline name##_container *                                                 \
+  name##_container_new()                                                    \
+  {                                                                         \
+    name##_container *head = g_malloc(sizeof(*head));                       \
+    name##_container_init(head);                                            \
+    return head;                                                            \
+  }
+
+/**
+ * Factory for implementing open hash destruction for a Paxos struct.  This
+ * destroys all the elements and frees the slot array, but does not free the
+ * table head itself.
+ *
+ * @param name        Name of the struct, i.e., struct paxos_{name}.
+ * @param le_field    Name of the struct's list entry field.
+ * @param destroy     Callback for destroying an element struct; should have
+ *                    signature:  void (*)(struct paxos_{name} *);
+ */
+#define OPENHASH_IMPLEMENT_DESTROY(name, le_field, destroy)                 \
+  void                                                                      \
+  name##_container_destroy(name##_container *head)                          \
+  {                                                                         \
+    struct paxos_##name *it;                                                \
+                                                                            \
+    LIST_WHILE_FIRST(it, &head->oh_order) {                                 \
+      LIST_REMOVE(&head->oh_order, it, le_field);                           \
+      destroy(it);                                                          \
+    }                                                                       \
+                                                                            \
+    g_free(head->oh_slots);                                                 \
+    name##_container_init(head);                                            \
+  }
+
+/**
+ * Factory for implementing the slot probe for a Paxos struct.  Returns the
+ * index of the slot holding the given ID, or of the empty slot at which the
+ * probe for it terminated.  The table must have at least one empty slot.
+ *
+ * @param name        Name of the struct, i.e., struct paxos_{name}.
+ * @param id_t        Type of the ID used to identify the paxos_{name}
+ *                    elements.
+ * @param id_field    Name of the struct's ID field.
+ * @param hash        Hash function for IDs; should have signature:
+ *                    unsigned (*)(id_t);
+ * @param compare     Callback for comparing two IDs; should have signature:
+ *                    int (*)(id_t, id_t);
+ */
+#define OPENHASH_IMPLEMENT_PROBE(name, id_t, id_field, hash, compare)       \
+  static unsigned                                                           \
+  name##_probe(name##_container *head, id_t id)                             \
+  {                                                                         \
+    unsigned i, mask = head->oh_size - 1;                                   \
+                                                                            \
+    for (i = hash(id) & mask; head->oh_slots[i] != NULL;                    \
+        i = (i + 1) & mask) {                                               \
+      if (compare(id, head->oh_slots[i]->id_field) == 0) {                  \
+        break;                                                              \
+      }                                                                     \
+    }                                                                       \
+                                                                            \
+    return i;                                                               \
+  }
+
+/**
+ * Factory for implementing open hash find for a Paxos struct.
+ *
+ * @param name        Name of the struct, i.e., struct paxos_{name}.
+ * @param id_t        Type of the ID used to identify the paxos_{name}
+ *                    elements.
+ */
+#define OPENHASH_IMPLEMENT_FIND(name, id_t)                                 \
+  struct paxos_##name *                                                     \
+  name##_find(name##_container *head, id_t id)                              \
+  {                                                                         \
+    if (head->oh_count == 0) {                                              \
+      return NULL;                                                          \
+    }                                                                       \
+    return head->oh_slots[name##_probe(head, id)];                          \
+  }
+
+/**
+ * Factory for implementing open hash insert for a Paxos struct.  If an
+ * element with the same ID is already in the table, it is returned and the
+ * new element is not inserted.
+ *
+ * We keep the load factor at or below 3/4, rehashing in insertion order
+ * whenever we need to grow.
+ *
+ * @param name        Name of the struct, i.e., struct paxos_{name}.
+ * @param le_field    Name of the struct's list entry field.
+ * @param id_field    Name of the struct's ID field.
+ */
+#define OPENHASH_IMPLEMENT_INSERT(name, le_field, id_field)                 \
+  static void                                                               \
+  name##_container_grow(name##_container *head)                             \
+  {                                                                         \
+    struct paxos_##name *it;                                                \
+                                                                            \
+    g_free(head->oh_slots);                                                 \
+    head->oh_size = head->oh_size ? head->oh_size << 1 : OPENHASH_MIN_SIZE; \
+    head->oh_slots = g_malloc0(head->oh_size * sizeof(*head->oh_slots));    \
+                                                                            \
+    LIST_FOREACH(it, &head->oh_order, le_field) {                           \
+      head->oh_slots[name##_probe(head, it->id_field)] = it;                \
+    }                                                                       \
+  }                                                                         \
+                                                                            \
+  struct paxos_##name *                                                     \
+  name##_insert(name##_container *head, struct paxos_##name *elt)           \
+  {                                                                         \
+    unsigned i;                                                             \
+                                                                            \
+    if ((head->oh_count + 1) * 4 > head->oh_size * 3) {                     \
+      name##_container_grow(head);                                          \
+    }                                                                       \
+                                                                            \
+    i = name##_probe(head, elt->id_field);                                  \
+    if (head->oh_slots[i] != NULL) {                                        \
+      return head->oh_slots[i];                                             \
+    }                                                                       \
+                                                                            \
+    head->oh_slots[i] = elt;                                                \
+    head->oh_count++;                                                       \
+    LIST_INSERT_TAIL(&head->oh_order, elt, le_field);                       \
+    return elt;                                                             \
+  }
+
+/**
+ * Factory for implementing open hash remove for a Paxos struct.  The element
+ * is not destroyed.
+ *
+ * After emptying the element's slot, we walk the rest of its probe cluster
+ * and shift back any element whose home slot does not lie cyclically in
+ * (hole, position], so that no probe is cut short by the new hole.
+ *
+ * @param name        Name of the struct, i.e., struct paxos_{name}.
+ * @param le_field    Name of the struct's list entry field.
+ * @param id_field    Name of the struct's ID field.
+ * @param hash        Hash function for IDs; should have signature:
+ *                    unsigned (*)(id_t);
+ */
+#define OPENHASH_IMPLEMENT_REMOVE(name, le_field, id_field, hash)           \
+  void                                                                      \
+  name##_remove(name##_container *head, struct paxos_##name *elt)           \
+  {                                                                         \
+    unsigned i, j, k, mask = head->oh_size - 1;                             \
+                                                                            \
+    i = name##_probe(head, elt->id_field);                                  \
+    assert(head->oh_slots[i] == elt);                                       \
+                                                                            \
+    for (j = (i + 1) & mask; head->oh_slots[j] != NULL; j = (j + 1) & mask) { \
+      k = hash(head->oh_slots[j]->id_field) & mask;                         \
+      if ((i < j) ? (k <= i || k > j) : (k <= i && k > j)) {                \
+        head->oh_slots[i] = head->oh_slots[j];                              \
+        i = j;                                                              \
+      }                                                                     \
+    }                                                                       \
+    head->oh_slots[i] = NULL;                                               \
+                                                                            \
+    head->oh_count--;                                                       \
+    LIST_REMOVE(&head->oh_order, elt, le_field);                            \
+  }
+
+/**
+ * Factory for implementing open hash replace for a Paxos struct.  The new
+ * element takes the place of an old one with the same ID, both in its slot
+ * and in insertion order.  The old element is not destroyed.
+ *
+ * @param name        Name of the struct, i.e., struct paxos_{name}.
+ * @param le_field    Name of the struct's list entry field.
+ * @param id_field    Name of the struct's ID field.
+ */
+#define OPENHASH_IMPLEMENT_REPLACE(name, le_field, id_field)                \
+  void                                                                      \
+  name##_replace(name##_container *head, struct paxos_##name *old,          \
+      struct paxos_##name *elt)                                             \
+  {                                                                         \
+    unsigned i;                                                             \
+                                                                            \
+    i = name##_probe(head, old->id_field);                                  \
+    assert(head->oh_slots[i] == old);                                       \
+    head->oh_slots[i] = elt;                                                \
+                                                                            \
+    LIST_INSERT_BEFORE(&head->oh_order, old, elt, le_field);                \
+    LIST_REMOVE(&head->oh_order, old, le_field);                            \
+  }
+
+/**
+ * Declare an open hash type and open hash utility prototypes.
+ */
+#define OPENHASH_DECLARE(name, id_t)                                        \
+  typedef OPENHASH_HEAD(name##_container, paxos_##name) name##_container;   \
+  inline void name##_container_init(name##_container *);                    \
+  inline name##_container *name##_container_new(void);                      \
+  void name##_container_destroy(name##_container *);                        \
+  struct paxos_##name *name##_find(name##_container *, id_t);               \
+  struct paxos_##name *name##_insert(name##_container *,                    \
+      struct paxos_##name *);                                               \
+  void name##_remove(name##_container *, struct paxos_##name *);           \
+  void name##_replace(name##_container *, struct paxos_##name *,            \
+      struct paxos_##name *);
+
+/**
+ * Implement an open hash container for a particular Paxos struct.
+ */
+#define OPENHASH_IMPLEMENT(name, id_t, le_field, id_field, hash, cmp, dstr)  \
+  OPENHASH_IMPLEMENT_INIT(name);                                            \
+  OPENHASH_IMPLEMENT_NEW(name);                                             \
+  OPENHASH_IMPLEMENT_DESTROY(name, le_field, dstr);                         \
+  OPENHASH_IMPLEMENT_PROBE(name, id_t, id_field, hash, cmp);                \
+  OPENHASH_IMPLEMENT_FIND(name, id_t);                                      \
+  OPENHASH_IMPLEMENT_INSERT(name, le_field, id_field);                      \
+  OPENHASH_IMPLEMENT_REMOVE(name, le_field, id_field, hash);                \
+  OPENHASH_IMPLEMENT_REPLACE(name, le_field, id_field);
@@ -0,0 +1,284 @@
+/**
+ * ring_factory.h - Macros for implementing and declaring ring buffer types
+ * for an arbitrary paxos_* struct.
+ *
+ * A ring is a contiguous array of element pointers, sized to a power of two
+ * and indexed by (id - base), where base is the ID of the oldest slot.  This
+ * gives us O(1) lookup and insertion by ID, and O(1) (amortized over the
+ * elements destroyed) truncation of a prefix by simply advancing the head.
+ * Slots for which no element has been inserted are NULL.
+ *
+ * All ring factory macros assume that the element struct...
+ * - has a name of the form paxos_*; and
+ * - includes an unsigned integral ID field which uniquely identifies and
+ *   totally orders all instances of the struct.
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <glib.h>
+
+#define RING_MIN_SIZE   64
+
+#define RING_HEAD(name, type, id_t)                                         \
+  struct name {                                                             \
+    struct type **rh_slots;   /* slot array */                              \
+    unsigned rh_size;         /* number of slots; a power of two */         \
+    unsigned rh_head;         /* slot index of rh_base */                   \
+    unsigned rh_span;         /* slots from rh_base through the last elt */ \
+    unsigned rh_count;        /* number of non-NULL slots */                \
+    id_t rh_base;             /* ID of the element in slot rh_head */       \
+  }
+
+#define RING_EMPTY(head)  ((head)->rh_count == 0)
+
+#define RING_COUNT(head)  ((head)->rh_count)
+
+/* The ID of the first slot, and one past the ID of the last element. */
+#define RING_BASE(head)   ((head)->rh_base)
+#define RING_END(head)    ((head)->rh_base + (head)->rh_span)
+
+/* Pointer to the slot storing the element at a given offset from the base. */
+#define RING_SLOT(head, off)  \
+  (&(head)->rh_slots[((head)->rh_head + (off)) & ((head)->rh_size - 1)])
+
+/* The last element of a nonempty ring. */
+#define RING_LAST(head)   (*RING_SLOT((head), (head)->rh_span - 1))
+
+/**
+ * Factory for implementing ring initialization for a Paxos struct.
+ *
+ * @param name        Name of the struct, i.e., struct paxos_{name}.
+ */
+#define RING_IMPLEMENT_INIT(name)                                           \
+  inline void                                                               \
+  name##_container_init(name##_container *head)                             \
+  {                                                                         \
+    memset(head, 0, sizeof(*head));                                         \
+  }
+
+/**
+ * Factory for implementing ring creation for a Paxos struct.
+ *
+ * @param name        Name of the struct, i.e., struct paxos_{name}.
+ */
+#define RING_IMPLEMENT_NEW(name)                                            \
+  inline name##_container *                                                 \
+  name##_container_new()                                                    \
+  {                                                                         \
+    name##_container *head = g_malloc(sizeof(*head));                       \
+    name##_container_init(head);                                            \
+    return head;                                                            \
+  }
+
+/**
+ * Factory for implementing ring destruction for a Paxos struct.  This
+ * destroys all the elements and frees the slot array, but does not free
+ * the ring head itself.
+ *
+ * @param name        Name of the struct, i.e., struct paxos_{name}.
+ * @param destroy     Callback for destroying an element struct; should have
+ *                    signature:  void (*)(struct paxos_{name} *);
+ */
+#define RING_IMPLEMENT_DESTROY(name, destroy)                               \
+  void                                                                      \
+  name##_container_destroy(name##_container *head)                          \
+  {                                                                         \
+    unsigned off;                                                           \
+    struct paxos_##name **slot;                                             \
+                                                                            \
+    for (off = 0; off < head->rh_span; ++off) {                             \
+      slot = RING_SLOT(head, off);                                          \
+      if (*slot != NULL) {                                                  \
+        destroy(*slot);                                                     \
+      }                                                                     \
+    }                                                                       \
+                                                                            \
+    g_free(head->rh_slots);                                                 \
+    name##_container_init(head);                                            \
+  }
+
+/**
+ * Factory for implementing ring find for a Paxos struct.
+ *
+ * @param name        Name of the struct, i.e., struct paxos_{name}.
+ * @param id_t        Type of the ID used to index the paxos_{name} elements.
+ */
+#define RING_IMPLEMENT_FIND(name, id_t)                                     \
+  struct paxos_##name *                                                     \
+  name##_find(name##_container *head, id_t id)                              \
+  {                                                                         \
+    if (id < head->rh_base || id - head->rh_base >= head->rh_span) {        \
+      return NULL;                                                          \
+    }                                                                       \
+    return *RING_SLOT(head, id - head->rh_base);                            \
+  }
+
+/**
+ * Factory for implementing ring insert for a Paxos struct.
+ *
+ * If an element with the same ID is already in the ring, it is returned and
+ * the new element is not inserted.  Otherwise, we grow the slot array as
+ * necessary to cover the new ID, which may lie on either side of the current
+ * range, and return the new element.
+ *
+ * @param name        Name of the struct, i.e., struct paxos_{name}.
+ * @param id_t        Type of the ID used to index the paxos_{name} elements.
+ * @param id_field    Name of the struct's ID field.
+ */
+#define RING_IMPLEMENT_INSERT(name, id_t, id_field)                         \
+  static void                                                               \
+  name##_container_grow(name##_container *head, unsigned need)              \
+  {                                                                         \
+    unsigned off, size;                                                     \
+    struct paxos_##name **slots;                                            \
+                                                                            \
+    for (size = RING_MIN_SIZE; size < need; size <<= 1);                    \
+    slots = g_malloc0(size * sizeof(*slots));                               \
+                                                                            \
+    /* Unroll the old ring into the front of the new one. */                \
+    for (off = 0; off < head->rh_span; ++off) {                             \
+      slots[off] = *RING_SLOT(head, off);                                   \
+    }                                                                       \
+                                                                            \
+    g_free(head->rh_slots);                                                 \
+    head->rh_slots = slots;                                                 \
+    head->rh_size = size;                                                   \
+    head->rh_head = 0;                                                      \
+  }                                                                         \
+                                                                            \
+  struct paxos_##name *                                                     \
+  name##_insert(name##_container *head, struct paxos_##name *elt)           \
+  {                                                                         \
+    id_t id = elt->id_field;                                                \
+    unsigned shift;                                                         \
+    struct paxos_##name **slot;                                             \
+                                                                            \
+    if (head->rh_count == 0) {                                              \
+      /* Rebase an empty ring at the new element. */                        \
+      if (head->rh_size == 0) {                                             \
+        name##_container_grow(head, 1);                                     \
+      }                                                                     \
+      head->rh_base = id;                                                   \
+      head->rh_span = 0;                                                    \
+    } else if (id < head->rh_base) {                                        \
+      /* Extend the ring backwards to cover the new ID. */                  \
+      shift = head->rh_base - id;                                           \
+      if (head->rh_span + shift > head->rh_size) {                          \
+        name##_container_grow(head, head->rh_span + shift);                 \
+      }                                                                     \
+      head->rh_head = (head->rh_head - shift) & (head->rh_size - 1);        \
+      head->rh_base = id;                                                   \
+      head->rh_span += shift;                                               \
+    }                                                                       \
+                                                                            \
+    /* Extend the ring forwards to cover the new ID. */                     \
+    if (id - head->rh_base >= head->rh_size) {                              \
+      name##_container_grow(head, id - head->rh_base + 1);                  \
+    }                                                                       \
+    if (id - head->rh_base >= head->rh_span) {                              \
+      head->rh_span = id - head->rh_base + 1;                               \
+    }                                                                       \
+                                                                            \
+    slot = RING_SLOT(head, id - head->rh_base);                             \
+    if (*slot != NULL) {                                                    \
+      return *slot;                                                         \
+    }                                                                       \
+                                                                            \
+    *slot = elt;                                                            \
+    head->rh_count++;                                                       \
+    return elt;                                                             \
+  }
+
+/**
+ * Factory for implementing ring remove for a Paxos struct.  The element is
+ * not destroyed.
+ *
+ * @param name        Name of the struct, i.e., struct paxos_{name}.
+ * @param id_field    Name of the struct's ID field.
+ */
+#define RING_IMPLEMENT_REMOVE(name, id_field)                               \
+  void                                                                      \
+  name##_remove(name##_container *head, struct paxos_##name *elt)           \
+  {                                                                         \
+    struct paxos_##name **slot;                                             \
+                                                                            \
+    slot = RING_SLOT(head, elt->id_field - head->rh_base);                  \
+    assert(*slot == elt);                                                   \
+                                                                            \
+    *slot = NULL;                                                           \
+    head->rh_count--;                                                       \
+                                                                            \
+    /* Pull the end of the ring back to the last remaining element. */      \
+    while (head->rh_span > 0 && RING_LAST(head) == NULL) {                  \
+      head->rh_span--;                                                      \
+    }                                                                       \
+  }
+
+/**
+ * Factory for implementing ring prefix truncation for a Paxos struct.  All
+ * elements with ID < id are destroyed and the base is advanced to id.
+ *
+ * @param name        Name of the struct, i.e., struct paxos_{name}.
+ * @param id_t        Type of the ID used to index the paxos_{name} elements.
+ * @param destroy     Callback for destroying an element struct; should have
+ *                    signature:  void (*)(struct paxos_{name} *);
+ */
+#define RING_IMPLEMENT_TRUNCATE(name, id_t, destroy)                        \
+  void                                                                      \
+  name##_truncate(name##_container *head, id_t id)                          \
+  {                                                                         \
+    unsigned off, shift;                                                    \
+    struct paxos_##name **slot;                                             \
+                                                                            \
+    if (id <= head->rh_base) {                                              \
+      return;                                                               \
+    }                                                                       \
+                                                                            \
+    shift = id - head->rh_base;                                             \
+    if (shift > head->rh_span) {                                            \
+      shift = head->rh_span;                                                \
+    }                                                                       \
+                                                                            \
+    for (off = 0; off < shift; ++off) {                                     \
+      slot = RING_SLOT(head, off);                                          \
+      if (*slot != NULL) {                                                  \
+        destroy(*slot);                                                     \
+        *slot = NULL;                                                       \
+        head->rh_count--;                                                   \
+      }                                                                     \
+    }                                                                       \
+                                                                            \
+    /* Advance the head. */                                                 \
+    if (head->rh_size > 0) {                                                \
+      head->rh_head = (head->rh_head + shift) & (head->rh_size - 1);        \
+    }                                                                       \
+    head->rh_span -= shift;                                                 \
+    head->rh_base = id;                                                     \
+  }
+
+/**
+ * Declare a ring type and ring utility prototypes.
+ */
+#define RING_DECLARE(name, id_t)                                            \
+  typedef RING_HEAD(name##_container, paxos_##name, id_t) name##_container; \
+  inline void name##_container_init(name##_container *);                    \
+  inline name##_container *name##_container_new(void);                      \
+  void name##_container_destroy(name##_container *);                        \
+  struct paxos_##name *name##_find(name##_container *, id_t);               \
+  struct paxos_##name *name##_insert(name##_container *,                    \
+      struct paxos_##name *);                                               \
+  void name##_remove(name##_container *, struct paxos_##name *);            \
+  void name##_truncate(name##_container *, id_t);
+
+/**
+ * Implement a ring container for a particular Paxos struct.
+ */
+#define RING_IMPLEMENT(name, id_t, id_field, dstr)                          \
+  RING_IMPLEMENT_INIT(name);                                                \
+  RING_IMPLEMENT_NEW(name);                                                 \
+  RING_IMPLEMENT_DESTROY(name, dstr);                                       \
+  RING_IMPLEMENT_FIND(name, id_t);                                          \
+  RING_IMPLEMENT_INSERT(name, id_t, id_field);                              \
+  RING_IMPLEMENT_REMOVE(name, id_field);                                    \
+  RING_IMPLEMENT_TRUNCATE(name, id_t, dstr);
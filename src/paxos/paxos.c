@@ -16,6 +16,9 @@
 #include "util/paxos_io.h"
 #include "util/paxos_print.h"
 
+#define BATCH_SIZE    1       // default maximum number of chats per decree
+#define BATCH_WINDOW  5       // default milliseconds to coalesce chats for
+
 // Global system state.
 struct paxos_state state;
 
@@ -40,7 +43,10 @@ paxos_init(connect_t connect, struct learn_table *learn, enter_t enter,
   state.learn.join = learn->join;
   state.learn.part = learn->part;
 
-  LIST_INIT(&state.sessions);
+  state.batch_size = BATCH_SIZE;
+  state.batch_window = BATCH_WINDOW;
+
+  paxos_io_init();
 
   connect_hashinit();
   state.connections = connect_container_new();
@@ -48,6 +54,12 @@ paxos_init(connect_t connect, struct learn_table *learn, enter_t enter,
     return 1;
   }
 
+  LIST_INIT(&state.slist);
+  state.sessions = session_container_new();
+  if (state.sessions == NULL) {
+    return 1;
+  }
+
   state.self = connect_new(alias, size);
   state.self->pc_refs++;  // Global reference.
   connect_insert(state.connections, state.self);
@@ -55,13 +67,98 @@ paxos_init(connect_t connect, struct learn_table *learn, enter_t enter,
   return 0;
 }
 
+/**
+ * paxos_set_batching - Configure how the proposer coalesces chat requests.
+ *
+ * A batch is decreed as soon as it holds size requests, or window
+ * milliseconds after its first request was queued.  A size of 1 disables
+ * batching.
+ */
+int
+paxos_set_batching(unsigned size, unsigned window)
+{
+  if (size == 0) {
+    return 1;
+  }
+
+  state.batch_size = size;
+  state.batch_window = window;
+
+  return 0;
+}
+
+/**
+ * paxos_set_mencius - Choose whether the sessions we start have their
+ * instances owned round-robin by the acceptors, rather than all decreed by
+ * the proposer.  Sessions we join follow the choice of their creator.
+ */
+void
+paxos_set_mencius(int mencius)
+{
+  state.mencius = mencius;
+}
+
+/**
+ * paxos_set_thrifty - Choose whether we send our decrees to just a quorum of
+ * acceptors in large sessions, falling back to the rest only if the quorum
+ * is slow to vote.
+ */
+void
+paxos_set_thrifty(int thrifty)
+{
+  state.thrifty = thrifty;
+}
+
+/**
+ * paxos_set_sync_majority - Choose whether we truncate the logs of sessions
+ * we propose for once a majority of acceptors has learned them, leaving any
+ * stragglers to catch up from a snapshot, rather than waiting on every live
+ * acceptor.
+ */
+void
+paxos_set_sync_majority(int sync_majority)
+{
+  state.sync_majority = sync_majority;
+}
+
+/**
+ * paxos_set_wal - Choose whether we log the state of our sessions so that
+ * they survive a crash.  Turning logging on recovers whatever sessions we
+ * were logging before.
+ */
+int
+paxos_set_wal(int wal)
+{
+  state.wal = wal;
+  return wal ? wal_recover() : 0;
+}
+
+/**
+ * paxos_set_history - Choose whether we keep the chats learned in our
+ * sessions on disk for the client's scrollback.
+ */
+void
+paxos_set_history(int history)
+{
+  state.history = history;
+}
+
+/**
+ * paxos_set_writable - Set the callback for notifying the client that it may
+ * resume sending in a session.
+ */
+void
+paxos_set_writable(writable_t writable)
+{
+  state.writable = writable;
+}
+
 /**
  * paxos_start - Start up the Paxos protocol with ourselves as the proposer.
  */
 void *
 paxos_start(void *data)
 {
-  pax_uuid_t *uuid;
   struct paxos_request *req;
   struct paxos_instance *inst;
   struct paxos_connect *conn;
@@ -81,19 +178,18 @@ paxos_start(void *data)
   pax->gen_high = 1;
 
   // Submit a join request to the cache.
-  req = g_malloc0(sizeof(*req));
+  req = request_new();
 
   req->pr_val.pv_dkind = DEC_JOIN;
   req->pr_val.pv_reqid.id = pax->self_id;
   req->pr_val.pv_reqid.gen = (++pax->req_id);
 
-  req->pr_size = conn->pc_alias.size;
-  req->pr_data = g_memdup(conn->pc_alias.data, conn->pc_alias.size);
+  request_set_data(req, conn->pc_alias.data, conn->pc_alias.size);
 
-  LIST_INSERT_TAIL(&pax->rcache, req, pr_le);
+  request_insert(&pax->rcache, req);
 
   // Artificially generate an initial commit, without learning.
-  inst = g_malloc0(sizeof(*inst));
+  inst = instance_new();
   header_init(&inst->pi_hdr, OP_DECREE, 1);
 
   inst->pi_committed = true;
@@ -106,19 +202,17 @@ paxos_start(void *data)
   memcpy(&inst->pi_val, &req->pr_val, sizeof(req->pr_val));
 
   // Initialize the ilist.
-  LIST_INSERT_HEAD(&pax->ilist, inst, pi_le);
+  instance_insert(&pax->ilist, inst);
   pax->ibase = 1;
 
   // Set up the learn protocol parameters to start at the next instance.
   pax->ihole = 2;
-  pax->istart = inst;
 
   // Add ourselves to the acceptor list.
   acc = g_malloc0(sizeof(*acc));
   acc->pa_paxid = pax->self_id;
   acc->pa_peer = NULL;
-  acc->pa_size = conn->pc_alias.size;
-  acc->pa_desc = g_memdup(conn->pc_alias.data, conn->pc_alias.size);
+  acceptor_set_desc(acc, conn->pc_alias.data, conn->pc_alias.size);
 
   LIST_INSERT_HEAD(&pax->alist, acc, pa_le);
   pax->live_count = 1;
@@ -126,10 +220,20 @@ paxos_start(void *data)
   // Set ourselves as the proposer.
   pax->proposer = acc;
 
-  // Add a sync for this session.
-  uuid = g_malloc0(sizeof(*uuid));
-  *uuid = *pax->session_id;
-  g_timeout_add_seconds(1, paxos_sync, uuid);
+  // Take ownership of every instance, if acceptors are to own them, until
+  // others join.
+  pax->mencius = state.mencius;
+  if (pax->mencius) {
+    mencius_init();
+  }
+
+  // Start syncing this session, and logging it if we do.  If we can't start
+  // a log, carry on without one rather than leave a partial log behind.
+  sync_start();
+  if (wal_checkpoint()) {
+    g_warning("paxos_start: Could not log session; continuing without.");
+    wal_remove();
+  }
 
   return pax;
 }
@@ -146,8 +250,11 @@ paxos_end(void *session)
   // that no more calls into Paxos will be made for the terminating session.
   state.leave(pax->client_data);
 
-  // Destroy the session.
-  LIST_REMOVE(&state.sessions, pax, session_le);
+  // Destroy the session, along with any log or history of it.
+  wal_remove();
+  history_remove();
+  session_remove(state.sessions, pax);
+  LIST_REMOVE(&state.slist, pax, session_le);
   session_destroy(pax);
   pax = NULL;
 
@@ -175,29 +282,24 @@ paxos_register_connection(GIOChannel *chan)
 int
 paxos_drop_connection(struct paxos_peer *source)
 {
-  int r = 0, found;
+  int r = 0;
   struct paxos_acceptor *acc;
 
-  // Process the drop for every session.
-  // XXX: Have a single global list of connections.
-  LIST_FOREACH(pax, &state.sessions, session_le) {
-    found = false;
-
-    // If the acceptor is participating in this session, mark it as dead.
-    LIST_FOREACH(acc, &pax->alist, pa_le) {
-      if (acc->pa_peer == source) {
-        paxos_peer_destroy(acc->pa_peer);
-        acc->pa_peer = NULL;
-        pax->live_count--;
-        found = true;
-        break;
-      }
-    }
+  // Process the drop for every session in which the peer participates; we
+  // consult the peer's reverse index rather than scanning every session.
+  LIST_WHILE_FIRST(acc, paxos_peer_acceptors(source)) {
+    pax = acc->pa_session;
+    acceptor_set_peer(acc, NULL);
 
-    if (!found) {
+    // Acceptors whose hellos we deferred have not been counted as live, so
+    // there is nothing more to do for them.
+    if (acceptor_find(&pax->adefer, acc->pa_paxid) == acc) {
       continue;
     }
 
+    // Otherwise, the acceptor is participating in this session; mark it dead.
+    pax->live_count--;
+
     if (is_proposer()) {
       // If we are the proposer, decree a part for the acceptor.
       ERR_ACCUM(r, proposer_decree_part(acc, 0));
@@ -211,9 +313,63 @@ paxos_drop_connection(struct paxos_peer *source)
     }
   }
 
+  paxos_peer_destroy(source);
   return r;
 }
 
+/**
+ * paxos_drain_connection - Account for a connection which is no longer
+ * congested.
+ *
+ * Client requests may have been refused in any of the sessions which use the
+ * connection, so let the client know it can send in them again.
+ */
+void
+paxos_drain_connection(struct paxos_peer *source)
+{
+  struct paxos_acceptor *acc;
+
+  if (state.writable == NULL) {
+    return;
+  }
+
+  // Sessions which are still backed up on some other connection will keep
+  // refusing requests, so only tell the client about the rest.
+  LIST_FOREACH(acc, paxos_peer_acceptors(source), pa_peer_le) {
+    pax = acc->pa_session;
+    if (!session_congested()) {
+      state.writable(pax->client_data);
+    }
+  }
+}
+
+/**
+ * paxos_slow_connection - Account for a connection which has fallen
+ * hopelessly behind.
+ *
+ * We drop such a connection as though it had been lost, unless it leads to
+ * the proposer of one of our sessions.  Dropping the proposer would only
+ * have us elect ourselves in its place; instead, we keep the connection and
+ * simply keep refusing client requests until it drains.
+ *
+ * Returns nonzero if the connection was dropped.
+ */
+int
+paxos_slow_connection(struct paxos_peer *source)
+{
+  struct paxos_acceptor *acc;
+
+  LIST_FOREACH(acc, paxos_peer_acceptors(source), pa_peer_le) {
+    if (acc == acc->pa_session->proposer) {
+      return 0;
+    }
+  }
+
+  g_warning("paxos_slow_connection: Dropping chronically slow peer.");
+  paxos_drop_connection(source);
+  return 1;
+}
+
 /**
  * proposer_dispatch - Process a message as the (self-determined) proposer.
  */
@@ -236,13 +392,29 @@ proposer_dispatch(struct paxos_peer *source, struct paxos_header *hdr,
       r = proposer_ack_promise(hdr, o);
       break;
     case OP_DECREE:
-      // Invalid system state; kill the offender.
-      r = proposer_force_kill(source);
+      // If acceptors own instances, we take decrees from owners like anyone
+      // else.  Otherwise, this is an invalid system state; kill the offender.
+      if (pax->mencius) {
+        r = acceptor_ack_decree(hdr, o);
+      } else {
+        r = proposer_force_kill(source);
+      }
       break;
     case OP_ACCEPT:
-      r = proposer_ack_accept(hdr);
+      r = proposer_ack_accept(source, hdr);
+      break;
+    case OP_ACCEPTS:
+      r = proposer_ack_accepts(source, hdr, o);
       break;
     case OP_COMMIT:
+      // As with decrees.
+      if (pax->mencius) {
+        r = acceptor_ack_commit(hdr, o);
+      } else {
+        r = proposer_force_kill(source);
+      }
+      break;
+    case OP_FENCE:
       // Invalid system state; kill the offender.
       r = proposer_force_kill(source);
       break;
@@ -264,6 +436,10 @@ proposer_dispatch(struct paxos_peer *source, struct paxos_header *hdr,
     case OP_HELLO:
       r = paxos_ack_hello(source, hdr);
       break;
+    case OP_HISTORY:
+      // Invalid system state; kill the offender.
+      r = proposer_force_kill(source);
+      break;
 
     case OP_REDIRECT:
       r = proposer_ack_redirect(hdr, o);
@@ -279,11 +455,11 @@ proposer_dispatch(struct paxos_peer *source, struct paxos_header *hdr,
       break;
 
     case OP_RETRY:
-      r = proposer_ack_retry(hdr);
+      r = paxos_ack_retry(source, hdr, o);
       break;
     case OP_RECOMMIT:
-      // Invalid system state; kill the offender.
-      r = proposer_force_kill(source);
+      // Another acceptor may be answering a retry we sent before we became
+      // the proposer; we have no use for it now.
       break;
 
     case OP_SYNC:
@@ -297,6 +473,9 @@ proposer_dispatch(struct paxos_peer *source, struct paxos_header *hdr,
       // Invalid system state; kill the offender.
       r = proposer_force_kill(source);
       break;
+    case OP_CATCHUP:
+      // As with recommits, ignore stale answers to our retries.
+      break;
   }
 
   return r;
@@ -326,11 +505,22 @@ acceptor_dispatch(struct paxos_peer *source, struct paxos_header *hdr,
       r = acceptor_ack_decree(hdr, o);
       break;
     case OP_ACCEPT:
-      // Ignore accepts.
+      // Ignore accepts, unless they're for our decrees as an owner.
+      if (pax->mencius) {
+        r = proposer_ack_accept(source, hdr);
+      }
+      break;
+    case OP_ACCEPTS:
+      if (pax->mencius) {
+        r = proposer_ack_accepts(source, hdr, o);
+      }
       break;
     case OP_COMMIT:
       r = acceptor_ack_commit(hdr, o);
       break;
+    case OP_FENCE:
+      r = acceptor_ack_fence(hdr);
+      break;
 
     case OP_REQUEST:
       r = acceptor_ack_request(source, hdr, o);
@@ -348,6 +538,9 @@ acceptor_dispatch(struct paxos_peer *source, struct paxos_header *hdr,
     case OP_HELLO:
       r = paxos_ack_hello(source, hdr);
       break;
+    case OP_HISTORY:
+      r = acceptor_ack_history(hdr, o);
+      break;
 
     case OP_REDIRECT:
       // Ignore redirects.
@@ -360,7 +553,7 @@ acceptor_dispatch(struct paxos_peer *source, struct paxos_header *hdr,
       break;
 
     case OP_RETRY:
-      // Ignore retries.
+      r = paxos_ack_retry(source, hdr, o);
       break;
     case OP_RECOMMIT:
       r = acceptor_ack_recommit(hdr, o);
@@ -375,6 +568,9 @@ acceptor_dispatch(struct paxos_peer *source, struct paxos_header *hdr,
     case OP_TRUNCATE:
       r = acceptor_ack_truncate(hdr, o);
       break;
+    case OP_CATCHUP:
+      r = acceptor_ack_catchup(hdr, o);
+      break;
   }
 
   return 0;
@@ -387,35 +583,45 @@ int
 paxos_dispatch(struct paxos_peer *source, const msgpack_object *o)
 {
   int r;
-  struct paxos_header *hdr;
+  unsigned long allocs;
+  struct paxos_header hdr;
 
   assert(o->type == MSGPACK_OBJECT_ARRAY);
   assert(o->via.array.size > 0 && o->via.array.size <= 2);
 
-  // Unpack the Paxos header.  This may be clobbered by the proposer/acceptor
-  // routines which the dispatch functions call.
-  hdr = g_malloc0(sizeof(*hdr));
-  paxos_header_unpack(hdr, o->via.array.ptr);
+  // Unpack the Paxos header onto the stack.  This may be clobbered by the
+  // proposer/acceptor routines which the dispatch functions call.
+  //
+  // Handlers should defer any allocation until they know that the message
+  // will be retained, so that ignored and duplicate messages cost us nothing
+  // on the heap.  We keep count so that this can be checked; the unit test
+  // in test/unit/dispatch.c counts every heap allocation toward the stats.
+  paxos_header_unpack(&hdr, o->via.array.ptr);
+  allocs = state.stats.ps_allocs;
 
   // Bind `pax` to the session identified in the message header.
-  pax = session_find(&state.sessions, &hdr->ph_session);
+  pax = session_find(state.sessions, &hdr.ph_session);
   if (pax == NULL) {
     // If we have no session, wait for a welcome message.
-    if (hdr->ph_opcode == OP_WELCOME) {
-      r = acceptor_ack_welcome(source, hdr, o->via.array.ptr + 1);
+    if (hdr.ph_opcode == OP_WELCOME) {
+      r = acceptor_ack_welcome(source, &hdr, o->via.array.ptr + 1);
     } else {
       r = 0;
     }
   } else {
     // Switch on the type of message received.
     if (is_proposer()) {
-      r = proposer_dispatch(source, hdr, o->via.array.ptr + 1);
+      r = proposer_dispatch(source, &hdr, o->via.array.ptr + 1);
     } else {
-      r = acceptor_dispatch(source, hdr, o->via.array.ptr + 1);
+      r = acceptor_dispatch(source, &hdr, o->via.array.ptr + 1);
     }
   }
 
-  g_free(hdr);
+  state.stats.ps_dispatched++;
+  if (state.stats.ps_allocs != allocs) {
+    state.stats.ps_allocating++;
+  }
+
   return r;
 }
 
@@ -440,9 +646,10 @@ proposer_force_kill(struct paxos_peer *source)
   // Cry.
   g_critical("paxos_dispatch: Two live proposers detected.");
 
-  // Find our acceptor object.
-  LIST_FOREACH(acc, &pax->alist, pa_le) {
-    if (acc->pa_peer == source) {
+  // Find our acceptor object among the peer's memberships.
+  LIST_FOREACH(acc, paxos_peer_acceptors(source), pa_peer_le) {
+    if (acc->pa_session == pax &&
+        acceptor_find(&pax->adefer, acc->pa_paxid) != acc) {
       // Decree a kill for the acceptor.
       return proposer_decree_part(acc, 1);
     }
@@ -25,14 +25,27 @@ struct learn_table {
 /* Paxos protocol interface. */
 int paxos_init(connect_t, struct learn_table *, enter_t, leave_t,
     const char *, size_t);
+int paxos_set_batching(unsigned, unsigned);
+void paxos_set_mencius(int);
+void paxos_set_thrifty(int);
+void paxos_set_sync_majority(int);
+int paxos_set_wal(int);
+void paxos_set_history(int);
+void paxos_set_writable(writable_t);
 void *paxos_start(void *);
 int paxos_end(void *data);
 
 int paxos_register_connection(GIOChannel *);
 int paxos_drop_connection(struct paxos_peer *);
+void paxos_drain_connection(struct paxos_peer *);
+int paxos_slow_connection(struct paxos_peer *);
 
 int paxos_request(struct paxos_session *, dkind_t, const void *, size_t len);
 int paxos_sync(void *);
+int paxos_history(void *, paxid_t, int, history_t);
+
+void *paxos_retain(void);
+void paxos_release(void *);
 
 /**
  *    Wire Protocol:
@@ -46,29 +59,52 @@ int paxos_sync(void *);
  * - OP_PROMISE: A variable-length array of packed paxos_instance objects.
  * - OP_DECREE: The paxos_value of the decree.
  * - OP_ACCEPT: None.
+ * - OP_ACCEPTS: The instance number of the last decree accepted.
  * - OP_COMMIT: The paxos_value of the commit.
+ * - OP_FENCE: None.
+ *
+ * A paxos_value decreeing a DEC_BATCH carries a fifth element, the array of
+ * its member request IDs flattened into (id, gen) pairs.
  *
  * - OP_WELCOME: An array consisting of the starting instance number (which
- *   respects truncation), the alist, and the ilist of the proposer, used
- *   to initialize the newcomer.
+ *   respects truncation), the alist, the ilist of the proposer from the
+ *   newcomer's JOIN onward, the requests decreed in that part of the ilist,
+ *   and a snapshot of the proposer's learned state, used to initialize the
+ *   newcomer.  The session information which precedes the starting instance
+ *   number is followed by a flag indicating whether the session's instances
+ *   are owned round-robin by its acceptors.  The ilist sent is only the
+ *   first chunk of it; the rest follows in OP_HISTORY.
  * - OP_HELLO: None.
+ * - OP_HISTORY: An array of a further chunk of the ilist sent with a
+ *   welcome, along with an array of the requests decreed in it which the
+ *   proposer chose to inline.
  *
  * - OP_REQUEST: The paxos_request object.
  * - OP_RETRIEVE: A msgpack array containing the ID of the retriever and
- *   the paxos_value referencing the request.
- * - OP_RESEND: The paxos_request object being resent.
+ *   an array of the paxos_values referencing the requests it is missing.
+ * - OP_RESEND: A msgpack array containing a flag which is set on the last
+ *   resend answering a retrieve, and an array of the paxos_request objects
+ *   being resent.
  *
  * - OP_REDIRECT: The header of the message that resulted in our redirecting.
  * - OP_REFUSE: The header of the message that resulted in our refusal, along
  *   with the request ID of the offending request.
  * - OP_REJECT: None.
  *
- * - OP_RETRY: None.
- * - OP_COMMIT: The paxos_value of the commit.
+ * - OP_RETRY: The last instance number of the range of commits wanted.
+ * - OP_RECOMMIT: A msgpack array containing an array of the committed
+ *   paxos_instance objects we have in the range, sent back to the retrier
+ *   alone, and an array of the paxos_request objects they decree.  A
+ *   recommit for instance 0, with both arrays empty, means that we were too
+ *   busy to answer.
  *
  * - OP_SYNC: None.
  * - OP_LAST: The instance number of the acceptor's last contiguous learn.
  * - OP_TRUNCATE: The new starting point of the instance log.
+ * - OP_CATCHUP: An array consisting of the alist, the ilist of the sender
+ *   from the instance in the header onward, the requests decreed in that
+ *   part of the ilist, and a snapshot of the sender's learned state, used
+ *   to bring an acceptor which fell behind a truncation up to date.
  *
  * The message formats of the various Paxos structures can be found in
  * paxos_msgpack.c.
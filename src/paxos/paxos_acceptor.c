@@ -50,26 +50,40 @@ acceptor_promise(struct paxos_header *hdr)
 {
   int r;
   size_t count;
+  paxid_t start, inum;
   struct paxos_instance *it;
   struct yakyak yy;
 
+  // Our promise carries every vote we have cast, so any accepts which we
+  // have not yet sent are moot.
+  pax->arange.ar_first = 0;
+  pax->arange.ar_last = 0;
+
+  // If acceptors own instances, we can't take their decrees again until the
+  // new proposer has fenced off the instances it recovers.
+  pax->marmed = false;
+
   // Set our ballot to the one given in the prepare.
   pax->ballot.id = hdr->ph_ballot.id;
   pax->ballot.gen = hdr->ph_ballot.gen;
   pax->gen_high = pax->ballot.gen;
 
+  // Make sure we remember our promise.
+  ERR_RET(r, wal_ballot());
+  ERR_RET(r, wal_sync());
+
   // Start off the payload with the header.
   hdr->ph_opcode = OP_PROMISE;
   yakyak_init(&yy, 2);
   paxos_header_pack(&yy, hdr);
 
+  // Determine how many accepts we need to send back, starting at the
+  // lowest-numbered instance requested.
+  start = MAX(hdr->ph_inum, RING_BASE(&pax->ilist));
   count = 0;
-
-  // Determine how many accepts we need to send back.
-  LIST_FOREACH_REV(it, &pax->ilist, pi_le) {
-    count++;
-    if (hdr->ph_inum >= it->pi_hdr.ph_inum) {
-      break;
+  for (inum = start; inum < RING_END(&pax->ilist); ++inum) {
+    if (instance_find(&pax->ilist, inum) != NULL) {
+      count++;
     }
   }
 
@@ -77,8 +91,11 @@ acceptor_promise(struct paxos_header *hdr)
   yakyak_begin_array(&yy, count);
 
   // Pack all the instances starting at the lowest-numbered instance requested.
-  for (; it != (void *)&pax->ilist; it = LIST_NEXT(it, pi_le)) {
-    paxos_instance_pack(&yy, it);
+  for (inum = start; inum < RING_END(&pax->ilist); ++inum) {
+    it = instance_find(&pax->ilist, inum);
+    if (it != NULL) {
+      paxos_instance_pack(&yy, it);
+    }
   }
 
   // Send off our payload.
@@ -94,10 +111,14 @@ acceptor_promise(struct paxos_header *hdr)
  * Move to commit the given value for the given Paxos instance.  If the decree
  * is a part and we believe that the target of the part is still live, we may
  * also reject.
+ *
+ * If acceptors own instances, the decree may also come from the owner of the
+ * instance rather than the proposer.
  */
 int
 acceptor_ack_decree(struct paxos_header *hdr, msgpack_object *o)
 {
+  int r;
   struct paxos_value val;
   struct paxos_acceptor *acc;
   struct paxos_instance *inst;
@@ -111,13 +132,21 @@ acceptor_ack_decree(struct paxos_header *hdr, msgpack_object *o)
   // ballot, we could break correctness guarantees if we responded later to
   // a decree with our lower local ballot number.
   if (ballot_compare(hdr->ph_ballot, pax->ballot) != 0) {
-    return 0;
+    if (!mencius_accepts(hdr)) {
+      return 0;
+    }
+  } else {
+    // Our local notion of the ballot should match our notion of the
+    // proposer.  Only when failover has just occurred but we have not yet
+    // received the new proposer's prepare is this not the case.
+    assert(pax->proposer->pa_paxid == pax->ballot.id);
   }
 
-  // Our local notion of the ballot should match our notion of the proposer.
-  // Only when failover has just occurred but we have not yet received the new
-  // proposer's prepare is this not the case.
-  assert(pax->proposer->pa_paxid == pax->ballot.id);
+  // Skip any of our own instances which this decree has passed by.
+  mencius_observe(hdr->ph_inum);
+
+  // Commit whatever the proposer's watermark allows us to.
+  ERR_RET(r, acceptor_ack_commit_mark(hdr, hdr->ph_commit, true));
 
   // Unpack the value and see if it decrees a part.  If so, but if the target
   // acceptor is still alive, reject the decree.
@@ -134,14 +163,15 @@ acceptor_ack_decree(struct paxos_header *hdr, msgpack_object *o)
   if (inst == NULL) {
     // We haven't seen this instance, so initialize a new one.  Our commit
     // flags are all zeroed so we don't need to initialize them.
-    inst = g_malloc0(sizeof(*inst));
+    inst = instance_new();
     memcpy(&inst->pi_hdr, hdr, sizeof(*hdr));
-    memcpy(&inst->pi_val, &val, sizeof(val));
+    paxos_value_unpack_batch(&inst->pi_val, &inst->pi_batch, o);
 
-    // Insert into the ilist and update istart.
-    instance_insert_and_upstart(inst);
+    // Insert into the ilist.
+    instance_insert(&pax->ilist, inst);
 
     // Accept the decree.
+    ERR_RET(r, wal_instance(inst));
     return acceptor_accept(hdr);
   } else {
     // We found an instance of the same number.
@@ -155,10 +185,13 @@ acceptor_ack_decree(struct paxos_header *hdr, msgpack_object *o)
       return acceptor_accept(hdr);
     } else if (ballot_compare(hdr->ph_ballot, inst->pi_hdr.ph_ballot) >= 0) {
       // Otherwise, if the decree has a ballot number equal to or higher than
-      // that of our instance, switch the new value in and accept.
+      // that of our instance, switch the new value in and accept.  If we
+      // decreed the old value as an owner, it needs another instance.
+      ERR_RET(r, mencius_reclaim(inst, &val));
       memcpy(&inst->pi_hdr, hdr, sizeof(*hdr));
-      memcpy(&inst->pi_val, &val, sizeof(val));
+      paxos_value_unpack_batch(&inst->pi_val, &inst->pi_batch, o);
 
+      ERR_RET(r, wal_instance(inst));
       return acceptor_accept(hdr);
     }
   }
@@ -167,21 +200,116 @@ acceptor_ack_decree(struct paxos_header *hdr, msgpack_object *o)
 }
 
 /**
- * acceptor_accept - Notify the proposer that we accept their decree.
+ * acceptor_accept_idle - GEvent-friendly wrapper around acceptor_accept_flush,
+ * run once per main loop iteration while we have accepts pending.
+ */
+static int
+acceptor_accept_idle(void *data)
+{
+  // Set the session.  We parametrize the source with a pointer to a session
+  // ID when we add it to the main event loop.
+  pax = session_find(state.sessions, (pax_uuid_t *)data);
+
+  if (pax != NULL) {
+    // The source is removed when we return.
+    pax->arange.ar_source = 0;
+    acceptor_accept_flush();
+  }
+
+  return FALSE;
+}
+
+/**
+ * acceptor_accept - Notify the decreer that we accept their decree.
+ *
+ * Rather than answering every decree immediately, we accumulate accepts for
+ * consecutive instances at the same ballot and send them to the decreer as
+ * a single range once the current pass of the main loop is done.  The
+ * decreer is the proposer unless acceptors own instances.
  */
 int
 acceptor_accept(struct paxos_header *hdr)
 {
   int r;
+  pax_uuid_t *uuid;
+  struct paxos_arange *ar = &pax->arange;
+
+  // Extend the pending range if the accept follows on from it.
+  if (ar->ar_first != 0 && hdr->ph_inum == ar->ar_last + 1 &&
+      ballot_compare(hdr->ph_ballot, ar->ar_ballot) == 0) {
+    ar->ar_last = hdr->ph_inum;
+    return 0;
+  }
+
+  // Otherwise, send off what we have and start a new range.
+  ERR_RET(r, acceptor_accept_flush());
+  ar->ar_ballot = hdr->ph_ballot;
+  ar->ar_first = hdr->ph_inum;
+  ar->ar_last = hdr->ph_inum;
+
+  // Make sure the range is flushed after this pass of the main loop.  We use
+  // default priority so that a steady stream of decrees can't starve us.
+  if (ar->ar_source == 0) {
+    uuid = g_malloc0(sizeof(*uuid));
+    *uuid = *pax->session_id;
+    ar->ar_source = g_idle_add_full(G_PRIORITY_DEFAULT, acceptor_accept_idle,
+        uuid, g_free);
+  }
+
+  return 0;
+}
+
+/**
+ * acceptor_accept_flush - Send the decreer our pending range of accepts.
+ *
+ * A range of a single instance is sent as a plain accept; longer ranges are
+ * sent as a header identifying the first instance, followed by the number of
+ * the last.
+ */
+int
+acceptor_accept_flush()
+{
+  int r;
+  struct paxos_header hdr;
+  struct paxos_acceptor *acc;
+  struct paxos_arange *ar = &pax->arange;
   struct yakyak yy;
 
-  // Pack a header.
-  hdr->ph_opcode = OP_ACCEPT;
-  yakyak_init(&yy, 1);
-  paxos_header_pack(&yy, hdr);
+  if (ar->ar_first == 0) {
+    return 0;
+  }
+
+  // Our votes must be on disk before they are counted.  Every accept since
+  // our last flush shares the one sync.
+  ERR_RET(r, wal_sync());
+
+  // Initialize a header for the range.
+  header_init(&hdr, OP_ACCEPT, ar->ar_first);
+  hdr.ph_ballot = ar->ar_ballot;
+  if (ar->ar_last != ar->ar_first) {
+    hdr.ph_opcode = OP_ACCEPTS;
+  }
+
+  // Pack the accepts.
+  yakyak_init(&yy, hdr.ph_opcode == OP_ACCEPTS ? 2 : 1);
+  paxos_header_pack(&yy, &hdr);
+  if (hdr.ph_opcode == OP_ACCEPTS) {
+    paxos_paxid_pack(&yy, ar->ar_last);
+  }
+
+  ar->ar_first = 0;
+  ar->ar_last = 0;
+
+  // If the decreer we accepted for has since gone away, there's nobody left
+  // who cares about our votes.  We also have no connection to ourselves.
+  acc = acceptor_find(&pax->alist, hdr.ph_ballot.id);
+  if (acc == NULL || acc->pa_peer == NULL) {
+    yakyak_destroy(&yy);
+    return 0;
+  }
 
   // Send the payload.
-  r = paxos_send_to_proposer(&yy);
+  r = paxos_send(acc, &yy);
   yakyak_destroy(&yy);
 
   return r;
@@ -197,8 +325,21 @@ acceptor_accept(struct paxos_header *hdr)
 int
 acceptor_ack_commit(struct paxos_header *hdr, msgpack_object *o)
 {
+  int r;
+  struct paxos_value val;
   struct paxos_instance *inst;
 
+  // Skip any of our own instances which this commit has passed by.
+  mencius_observe(hdr->ph_inum);
+
+  // Commit whatever the proposer's watermark allows us to below this commit.
+  // If we are still missing anything, committing this instance will ask for
+  // a retry, so don't do so here.
+  if (hdr->ph_inum > 0) {
+    ERR_RET(r, acceptor_ack_commit_mark(hdr, MIN(hdr->ph_commit,
+        hdr->ph_inum - 1), false));
+  }
+
   // Retrieve the instance struct corresponding to the inum.
   inst = instance_find(&pax->ilist, hdr->ph_inum);
 
@@ -206,9 +347,9 @@ acceptor_ack_commit(struct paxos_header *hdr, msgpack_object *o)
   // we can trust the majority and commit anyway.  Our commit flags are
   // all zeroed so we don't need to initialize them.
   if (inst == NULL) {
-    inst = g_malloc0(sizeof(*inst));
+    inst = instance_new();
     memcpy(&inst->pi_hdr, hdr, sizeof(*hdr));
-    instance_insert_and_upstart(inst);
+    instance_insert(&pax->ilist, inst);
   }
 
   // If we committed already, we know that a quorum has the same value that
@@ -220,9 +361,47 @@ acceptor_ack_commit(struct paxos_header *hdr, msgpack_object *o)
 
   // It's possible that we accepted a decree for inst->pi_inum which was never
   // committed, and then we received a commit for a later ballot for which
-  // we never received the original decree.  So, we always reset the value.
-  paxos_value_unpack(&inst->pi_val, o);
+  // we never received the original decree.  So, we always reset the value,
+  // first finding another instance for it if we decreed it as an owner.
+  paxos_value_unpack(&val, o);
+  ERR_RET(r, mencius_reclaim(inst, &val));
+  paxos_value_unpack_batch(&inst->pi_val, &inst->pi_batch, o);
 
   // Perform the commit.
   return paxos_commit(inst);
 }
+
+/**
+ * acceptor_ack_commit_mark - Commit instances up through a commit watermark.
+ *
+ * The proposer decrees only one value per instance at any ballot it holds,
+ * so if we accepted an instance at the ballot of the watermark's message, we
+ * know its committed value.  Membership changes are the exception; we always
+ * wait for their explicit commits.
+ *
+ * We stop at the first instance whose value we do not know, retrying it if
+ * desired should it not turn up shortly.
+ */
+int
+acceptor_ack_commit_mark(struct paxos_header *hdr, paxid_t mark, int retry)
+{
+  int r;
+  paxid_t inum;
+  struct paxos_instance *inst;
+
+  for (inum = pax->ihole; inum <= mark; ++inum) {
+    inst = instance_find(&pax->ilist, inum);
+    if (inst != NULL && inst->pi_committed) {
+      continue;
+    }
+
+    if (inst == NULL || commit_needs_sent(inst->pi_val.pv_dkind) ||
+        ballot_compare(inst->pi_hdr.ph_ballot, hdr->ph_ballot) != 0) {
+      return retry ? acceptor_hole(mark) : 0;
+    }
+
+    ERR_RET(r, paxos_commit(inst));
+  }
+
+  return 0;
+}
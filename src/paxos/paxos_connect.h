@@ -14,7 +14,7 @@
     struct paxos_acceptor *acc;                                 \
                                                                 \
     k = data;                                                   \
-    pax = session_find(&state.sessions, k->pk_session_id);      \
+    pax = session_find(state.sessions, k->pk_session_id);       \
     if (pax == NULL) {                                          \
       return 0;                                                 \
     }                                                           \
@@ -16,15 +16,150 @@
 #include "util/paxos_io.h"
 #include "util/paxos_print.h"
 
+#define WELCOME_CHUNK_BYTES   (64 * 1024)   // target size of a welcome chunk
+#define WELCOME_INLINE_MAX    (16 * 1024)   // largest request we inline
+#define WELCOME_INLINE_BYTES  (64 * 1024)   // most request data we inline
+#define WELCOME_INST_BYTES    64            // rough packed size of an instance
+#define WELCOME_WINDOW        (256 * 1024)  // most we queue to a new acceptor
+#define WELCOME_BACKOFF       20            // ms to wait on a backed-up peer
+#define CATCHUP_INTERVAL      1000000       // least usecs between catch-ups
+
+/**
+ * welcome_start - The first instance we send a new acceptor with its
+ * welcome.  Everything before it is summarized by our snapshot.
+ */
+static inline paxid_t
+welcome_start(paxid_t paxid)
+{
+  return MAX(paxid, pax->ibase);
+}
+
+/**
+ * welcome_request - Find the ith request decreed by an instance if it is in
+ * our cache and small enough to inline within what remains of our budget,
+ * else return NULL.  The budget is charged for the request.
+ */
+static struct paxos_request *
+welcome_request(struct paxos_instance *inst, unsigned i, size_t *budget)
+{
+  struct paxos_request *req;
+
+  req = instance_request(inst, i);
+  if (req == NULL || req->pr_size > WELCOME_INLINE_MAX ||
+      req->pr_size > *budget) {
+    return NULL;
+  }
+  *budget -= req->pr_size;
+  return req;
+}
+
+/**
+ * welcome_pack_range - Pack the instances in [first, last) as an array,
+ * followed by an array of the requests they decree which we can inline.
+ *
+ * We inline requests oldest first until we have packed WELCOME_INLINE_BYTES
+ * of them.  The newcomer retrieves the rest as it commits, which spreads
+ * them over as many resends, from as many acceptors, as it takes, rather
+ * than putting them all in one message ahead of everyone else's traffic.
+ */
+static void
+welcome_pack_range(struct yakyak *yy, paxid_t first, paxid_t last)
+{
+  paxid_t inum;
+  unsigned i, count, nreqs;
+  size_t budget;
+  struct paxos_instance *inst;
+  struct paxos_request *req;
+
+  // Count everything up front, since msgpack needs array sizes first.
+  count = 0;
+  nreqs = 0;
+  budget = WELCOME_INLINE_BYTES;
+  for (inum = first; inum < last; ++inum) {
+    inst = instance_find(&pax->ilist, inum);
+    if (inst == NULL) {
+      continue;
+    }
+    count++;
+    for (i = 0; i < instance_nrequests(inst); ++i) {
+      nreqs += welcome_request(inst, i, &budget) != NULL;
+    }
+  }
+
+  yakyak_begin_array(yy, count);
+  for (inum = first; inum < last; ++inum) {
+    inst = instance_find(&pax->ilist, inum);
+    if (inst != NULL) {
+      paxos_instance_pack(yy, inst);
+    }
+  }
+
+  // Make the same choices as we did counting.
+  yakyak_begin_array(yy, nreqs);
+  budget = WELCOME_INLINE_BYTES;
+  for (inum = first; inum < last; ++inum) {
+    inst = instance_find(&pax->ilist, inum);
+    if (inst == NULL) {
+      continue;
+    }
+    for (i = 0; i < instance_nrequests(inst); ++i) {
+      req = welcome_request(inst, i, &budget);
+      if (req != NULL) {
+        paxos_request_pack(yy, req);
+      }
+    }
+  }
+}
+
+/**
+ * welcome_chunk_end - Work out where a chunk of a welcome starting at first
+ * should end, taking instances until they and the requests we would inline
+ * with them fill out a chunk, but always at least one.
+ */
+static paxid_t
+welcome_chunk_end(paxid_t first, paxid_t end)
+{
+  paxid_t last;
+  unsigned i;
+  size_t bytes, budget;
+  struct paxos_instance *inst;
+  struct paxos_request *req;
+
+  bytes = 0;
+  budget = WELCOME_INLINE_BYTES;
+  for (last = first; last < end &&
+      (last == first || bytes < WELCOME_CHUNK_BYTES); ++last) {
+    inst = instance_find(&pax->ilist, last);
+    if (inst == NULL) {
+      continue;
+    }
+    bytes += WELCOME_INST_BYTES;
+    for (i = 0; i < instance_nrequests(inst); ++i) {
+      req = welcome_request(inst, i, &budget);
+      if (req != NULL) {
+        bytes += req->pr_size;
+      }
+    }
+  }
+
+  return last;
+}
+
 /**
  * proposer_welcome - Welcome a new protocol participant by passing along
  *
  * struct {
  *   paxos_header hdr;
  *   struct {
- *     paxid_t ibase;
+ *     struct {
+ *       pax_uuid_t session_id;
+ *       paxid_t ibase;
+ *       bool mencius;
+ *     } session_info;
  *     paxos_acceptor alist[];
  *     paxos_instance ilist[];
+ *     paxos_request requests[];
+ *     paxos_snapshot snapshot;
  *   } init_info;
  * }
  *
@@ -33,8 +168,16 @@
  * We also send over our list of acceptors and instances to start the new
  * acceptor off.
  *
- * We avoid sending over our request cache to reduce strain on the network;
- * the new acceptor can issue retrieves to obtain any necessary requests.
+ * In place of our log before the newcomer's JOIN, we send a snapshot of the
+ * state we have learned, whose scrollback is bounded; see paxos_snapshot.c.
+ * So that welcoming a newcomer to a busy session doesn't hold up everyone
+ * else behind a single enormous message, the welcome itself carries only
+ * the first chunk of our log from the JOIN onward, with a bounded amount of
+ * the requests it decrees inlined.  The newcomer is live as soon as it takes
+ * the welcome.  The rest of the log follows in chunks of OP_HISTORY, paced
+ * by how quickly the newcomer drains them and sent only when we have
+ * nothing more pressing to do; see welcome_pump().  Requests we don't
+ * inline, the newcomer retrieves in paced resends.
  *
  * We also initiate the connection to the new acceptor, but we assume that
  * the rest of the acceptor object has been initialized already.
@@ -53,6 +196,102 @@ proposer_welcome(struct paxos_acceptor *acc)
   return 0;
 }
 
+/**
+ * welcome_chunk - Send the next chunk of a welcome to a new acceptor.
+ */
+static int
+welcome_chunk(struct paxos_acceptor *acc, struct paxos_welcome *pw)
+{
+  int r;
+  paxid_t last;
+  struct paxos_header hdr;
+  struct yakyak yy;
+
+  // Skip anything which has been truncated since we started.
+  pw->pw_next = MAX(pw->pw_next, RING_BASE(&pax->ilist));
+  if (pw->pw_next >= pw->pw_end) {
+    return 0;
+  }
+  last = welcome_chunk_end(pw->pw_next, pw->pw_end);
+
+  header_init(&hdr, OP_HISTORY, pw->pw_next);
+
+  yakyak_init(&yy, 2);
+  paxos_header_pack(&yy, &hdr);
+  yakyak_begin_array(&yy, 2);
+  welcome_pack_range(&yy, pw->pw_next, last);
+  r = paxos_send(acc, &yy);
+  yakyak_destroy(&yy);
+
+  pw->pw_next = last;
+  return r;
+}
+
+/**
+ * welcome_pump - Send a chunk of its welcome to each new acceptor which
+ * isn't backed up, so long as the main loop has nothing else to do.
+ */
+static int
+welcome_pump(void *data)
+{
+  bool sent;
+  pax_uuid_t *uuid;
+  struct paxos_welcome *pw, *next;
+  struct paxos_acceptor *acc;
+
+  // Set the session.  We parametrize the source with a pointer to a session
+  // ID when we add it to the main event loop.
+  pax = session_find(state.sessions, (pax_uuid_t *)data);
+  if (pax == NULL) {
+    return FALSE;
+  }
+
+  // The source is removed when we return.
+  pax->wsource = 0;
+
+  sent = false;
+  for (pw = LIST_FIRST(&pax->wlist); pw != (void *)&pax->wlist; pw = next) {
+    next = LIST_NEXT(pw, pw_le);
+
+    // If the new acceptor has gone away, or if we've lost the proposership,
+    // give up on the transfer; the acceptor retries whatever it lacks.
+    acc = acceptor_find(&pax->alist, pw->pw_paxid);
+    if (acc != NULL && acc->pa_peer != NULL && is_proposer() &&
+        pw->pw_next < pw->pw_end) {
+      if (paxos_peer_queued(acc->pa_peer) > WELCOME_WINDOW) {
+        continue;
+      }
+      if (welcome_chunk(acc, pw) == 0) {
+        sent = true;
+        if (pw->pw_next < pw->pw_end) {
+          continue;
+        }
+      }
+    }
+
+    LIST_REMOVE(&pax->wlist, pw, pw_le);
+    g_free(pw);
+  }
+
+  if (LIST_EMPTY(&pax->wlist)) {
+    return FALSE;
+  }
+
+  // Keep going while we're making progress; otherwise, give the backed up
+  // acceptors some time to drain.
+  uuid = g_malloc0(sizeof(*uuid));
+  *uuid = *pax->session_id;
+  if (sent) {
+    pax->wsource = g_idle_add_full(G_PRIORITY_DEFAULT_IDLE, welcome_pump,
+        uuid, g_free);
+  } else {
+    pax->wsource = g_timeout_add_full(G_PRIORITY_DEFAULT_IDLE,
+        WELCOME_BACKOFF, welcome_pump, uuid, g_free);
+  }
+
+  return FALSE;
+}
+
 /**
  * continue_welcome - Register our connection to the new acceptor, decreeing
  * a part if connection failed.
@@ -62,12 +301,14 @@ do_continue_welcome(GIOChannel *chan, struct paxos_acceptor *acc,
     struct paxos_continuation *k)
 {
   int r;
+  paxid_t start, last, end;
+  pax_uuid_t *uuid;
   struct paxos_header hdr;
   struct paxos_acceptor *acc_it;
-  struct paxos_instance *inst_it;
+  struct paxos_welcome *pw;
   struct yakyak yy;
 
-  acc->pa_peer = paxos_peer_init(chan);
+  acceptor_set_peer(acc, paxos_peer_init(chan));
   if (acc->pa_peer != NULL) {
     pax->live_count++;
   } else {
@@ -81,12 +322,14 @@ do_continue_welcome(GIOChannel *chan, struct paxos_acceptor *acc,
   // Pack the header into a new payload.
   yakyak_init(&yy, 2);
   paxos_header_pack(&yy, &hdr);
-  yakyak_begin_array(&yy, 3);
+  yakyak_begin_array(&yy, 5);
 
-  // Start off the info payload with the session ID and ibase.
-  yakyak_begin_array(&yy, 2);
+  // Start off the info payload with the session ID, ibase, and whether
+  // acceptors own instances.
+  yakyak_begin_array(&yy, 3);
   paxos_uuid_pack(&yy, pax->session_id);
   paxos_paxid_pack(&yy, pax->ibase);
+  msgpack_pack_int(yy.pk, pax->mencius);
 
   // Pack the entire alist.  Hopefully we don't have too many un-parted
   // dropped acceptors (we shouldn't).
@@ -95,17 +338,41 @@ do_continue_welcome(GIOChannel *chan, struct paxos_acceptor *acc,
     paxos_acceptor_pack(&yy, acc_it);
   }
 
-  // Pack the entire ilist.
-  yakyak_begin_array(&yy, LIST_COUNT(&pax->ilist));
-  LIST_FOREACH(inst_it, &pax->ilist, pi_le) {
-    paxos_instance_pack(&yy, inst_it);
-  }
+  // Pack the first chunk of the ilist from the new acceptor's JOIN onward,
+  // along with the requests it decrees.
+  start = welcome_start(acc->pa_paxid);
+  end = RING_END(&pax->ilist);
+  last = welcome_chunk_end(start, end);
+  welcome_pack_range(&yy, start, last);
+
+  // Finish off with a snapshot standing in for everything before.
+  snapshot_pack(&yy);
 
   // Send the welcome.
   r = paxos_send(acc, &yy);
   yakyak_destroy(&yy);
+  if (r) {
+    return r;
+  }
 
-  return r;
+  // Stream the rest of the ilist.  Anything we decree from here on, the new
+  // acceptor hears of like everyone else.
+  if (last < end) {
+    pw = g_malloc0(sizeof(*pw));
+    pw->pw_paxid = acc->pa_paxid;
+    pw->pw_next = last;
+    pw->pw_end = end;
+    LIST_INSERT_TAIL(&pax->wlist, pw, pw_le);
+
+    if (pax->wsource == 0) {
+      uuid = g_malloc0(sizeof(*uuid));
+      *uuid = *pax->session_id;
+      pax->wsource = g_idle_add_full(G_PRIORITY_DEFAULT_IDLE, welcome_pump,
+          uuid, g_free);
+    }
+  }
+
+  return 0;
 }
 CONNECTINUATE(welcome);
 
@@ -113,15 +380,18 @@ CONNECTINUATE(welcome);
  * acceptor_ack_welcome - Be welcomed to the Paxos system.
  *
  * This allows us to populate our ballot, alist, and ilist, as well as to
- * learn our assigned paxid.  We populate our request cache on-demand with
- * out-of-band retrieve messages.
+ * learn our assigned paxid.  We populate our request cache with the
+ * requests inlined in the welcome and in the history which follows it, and
+ * on-demand with out-of-band retrieve messages.  The snapshot in the
+ * welcome gives us our client's scrollback, and tells us how much of the
+ * ilist the proposer has already learned.
  */
 int
 acceptor_ack_welcome(struct paxos_peer *source, struct paxos_header *hdr,
     msgpack_object *o)
 {
   int r;
-  pax_uuid_t *uuid;
+  paxid_t inum;
   msgpack_object *arr, *p, *pend;
   struct paxos_acceptor *acc;
   struct paxos_instance *inst;
@@ -139,21 +409,25 @@ acceptor_ack_welcome(struct paxos_peer *source, struct paxos_header *hdr,
 
   // Make sure the payload is well-formed.
   assert(o->type == MSGPACK_OBJECT_ARRAY);
-  assert(o->via.array.size == 3);
+  assert(o->via.array.size == 5);
   arr = o->via.array.ptr;
 
-  // Unpack the session ID and ibase.
+  // Unpack the session ID, ibase, and instance ownership mode.
   assert(arr->type == MSGPACK_OBJECT_ARRAY);
+  assert(arr->via.array.size == 3);
   p = (arr++)->via.array.ptr;
 
   paxos_uuid_unpack(pax->session_id, p++);
   assert(p->type == MSGPACK_OBJECT_POSITIVE_INTEGER);
   pax->ibase = (p++)->via.u64;
+  assert(p->type == MSGPACK_OBJECT_POSITIVE_INTEGER);
+  pax->mencius = (p++)->via.u64;
 
-  // Add a sync for this session.
-  uuid = g_malloc0(sizeof(*uuid));
-  *uuid = *pax->session_id;
-  g_timeout_add_seconds(1, paxos_sync, uuid);
+  // Now that we know our session ID, make the session available for lookup.
+  session_insert(state.sessions, pax);
+
+  // Start syncing this session.
+  sync_start();
 
   // Make sure the alist is well-formed.
   assert(arr->type == MSGPACK_OBJECT_ARRAY);
@@ -173,7 +447,7 @@ acceptor_ack_welcome(struct paxos_peer *source, struct paxos_header *hdr,
     if (acc->pa_paxid == hdr->ph_ballot.id) {
       // Don't send a hello to the proposer.
       pax->proposer = acc;
-      pax->proposer->pa_peer = source;
+      acceptor_set_peer(pax->proposer, source);
       pax->live_count++;
     } else if (acc->pa_paxid != pax->self_id) {
       // Connect to everyone but ourselves.  When we continue, we will say
@@ -190,39 +464,98 @@ acceptor_ack_welcome(struct paxos_peer *source, struct paxos_header *hdr,
 
   // Unpack the ilist.
   for (; p != pend; ++p) {
-    inst = g_malloc0(sizeof(*inst));
+    inst = instance_new();
+    paxos_instance_unpack(inst, p);
+    instance_insert(&pax->ilist, inst);
+  }
+
+  // Cache the inlined requests.
+  request_unpack_cache(arr++);
+
+  // Take on the snapshot, which reflects everything up to our ihole.  We
+  // no-op learns of the commits it covers.
+  pax->ihole = snapshot_unpack(arr) + 1;
+  for (inum = welcome_start(pax->self_id); inum < pax->ihole; ++inum) {
+    inst = instance_find(&pax->ilist, inum);
+    if (inst != NULL) {
+      inst->pi_cached = true;
+      inst->pi_learned = true;
+    }
+  }
+
+  // Work out which instances we'll own, if acceptors own instances.
+  if (pax->mencius) {
+    mencius_join();
+  }
+
+  // Start logging the session if we do.
+  ERR_RET(r, wal_checkpoint());
+
+  // Learn anything which the proposer had committed but not yet learned.
+  inst = instance_find(&pax->ilist, pax->ihole);
+  if (inst != NULL && inst->pi_committed) {
+    return paxos_commit(inst);
+  }
+
+  return 0;
+}
+
+/**
+ * acceptor_ack_history - Take on a further chunk of the ilist which came
+ * with our welcome.  We have been live since we were welcomed; this fills in
+ * our log between the first chunk and whatever we have heard of since.
+ */
+int
+acceptor_ack_history(struct paxos_header *hdr, msgpack_object *o)
+{
+  int r;
+  msgpack_object *p, *pend;
+  struct paxos_instance *inst, *it;
+
+  // Make sure the payload is well-formed.
+  assert(o->type == MSGPACK_OBJECT_ARRAY);
+  assert(o->via.array.size == 2);
+  assert(o->via.array.ptr->type == MSGPACK_OBJECT_ARRAY);
+  p = o->via.array.ptr->via.array.ptr;
+  pend = p + o->via.array.ptr->via.array.size;
+
+  // Merge in the chunk, skipping anything we have since truncated and
+  // taking its commits over whatever we have heard of ourselves.
+  for (; p != pend; ++p) {
+    inst = instance_new();
     paxos_instance_unpack(inst, p);
-    LIST_INSERT_TAIL(&pax->ilist, inst, pi_le);
-  }
-
-  // Determine our ihole.  The first instance in the ilist should always have
-  // the instance number pax->ibase, so we start searching there.
-  inst = LIST_FIRST(&pax->ilist);
-  pax->ihole = pax->ibase;
-  for (;; inst = LIST_NEXT(inst, pi_le), ++pax->ihole) {
-    // If we reached the end of the list, set pax->istart to the last existing
-    // instance.
-    if (inst == (void *)&pax->ilist) {
-      pax->istart = LIST_LAST(&pax->ilist);
-      break;
+    if (inst->pi_hdr.ph_inum < pax->ibase) {
+      instance_destroy(inst);
+      continue;
     }
 
-    // If we skipped over an instance number because we were missing an
-    // instance, set pax->istart to the last instance before the hole.
-    if (inst->pi_hdr.ph_inum != pax->ihole) {
-      pax->istart = LIST_PREV(inst, pi_le);
-      break;
+    it = instance_insert(&pax->ilist, inst);
+    if (it != inst) {
+      if (!it->pi_committed && inst->pi_committed) {
+        memcpy(&it->pi_hdr, &inst->pi_hdr, sizeof(inst->pi_hdr));
+        memcpy(&it->pi_val, &inst->pi_val, sizeof(inst->pi_val));
+        g_free(it->pi_batch);
+        it->pi_batch = inst->pi_batch;
+        inst->pi_batch = NULL;
+        it->pi_committed = true;
+      }
+      instance_destroy(inst);
     }
 
-    // If we found an uncommitted instance, set pax->istart to it.
-    if (!inst->pi_committed) {
-      pax->istart = inst;
-      break;
+    // Our snapshot already covers anything before our hole.
+    if (it->pi_hdr.ph_inum < pax->ihole) {
+      it->pi_cached = true;
+      it->pi_learned = true;
     }
+  }
 
-    // For now, we no-op learns of old commits when we join the system.
-    inst->pi_cached = 1;
-    inst->pi_learned = 1;
+  // Cache the inlined requests.
+  request_unpack_cache(o->via.array.ptr + 1);
+
+  // Learn whatever the chunk lets us.
+  inst = instance_find(&pax->ilist, pax->ihole);
+  if (inst != NULL && inst->pi_committed) {
+    ERR_RET(r, paxos_commit(inst));
   }
 
   return 0;
@@ -238,7 +571,7 @@ do_continue_ack_welcome(GIOChannel *chan, struct paxos_acceptor *acc,
 {
   int r;
 
-  acc->pa_peer = paxos_peer_init(chan);
+  acceptor_set_peer(acc, paxos_peer_init(chan));
   if (acc->pa_peer != NULL) {
     pax->live_count++;
     ERR_RET(r, paxos_hello(acc));
@@ -301,14 +634,14 @@ paxos_ack_hello(struct paxos_peer *source, struct paxos_header *hdr)
   if (acc == NULL) {
     acc = g_malloc0(sizeof(*acc));
     acc->pa_paxid = hdr->ph_inum;
-    acc->pa_peer = source;
+    acceptor_set_peer(acc, source);
     acceptor_insert(&pax->adefer, acc);
     return 0;
   }
 
   if (acc->pa_peer == NULL) {
     // If there is no peer, just attach it.
-    acc->pa_peer = source;
+    acceptor_set_peer(acc, source);
     pax->live_count++;
 
     // Update the proposer if necessary.  If we thought we were the proposer,
@@ -326,7 +659,7 @@ paxos_ack_hello(struct paxos_peer *source, struct paxos_header *hdr)
     // keep the peer created by the higher-ranking (i.e., lower-ID) acceptor,
     // so if our rank is lower, switch in the correct peer.
     paxos_peer_destroy(acc->pa_peer);
-    acc->pa_peer = source;
+    acceptor_set_peer(acc, source);
   }
 
   // Suppose the source of the hello is the proposer.  The proposer only says
@@ -360,6 +693,276 @@ paxos_ack_hello(struct paxos_peer *source, struct paxos_header *hdr)
   if (hdr->ph_inum == pax->proposer->pa_paxid) {
     pax->ballot.id = hdr->ph_ballot.id;
     pax->ballot.gen = hdr->ph_ballot.gen;
+    return wal_ballot();
+  }
+
+  return 0;
+}
+
+/**
+ * paxos_catchup - Bring an acceptor which has fallen behind our log's
+ * truncation point up to date by passing along
+ *
+ * struct {
+ *   paxos_header hdr;
+ *   struct {
+ *     paxos_acceptor alist[];
+ *     paxos_instance ilist[];
+ *     paxos_request requests[];
+ *     paxos_snapshot snapshot;
+ *   } catchup_info;
+ * }
+ *
+ * This is much like a welcome, except that the acceptor already has a
+ * session, so we send only the part of our log which the snapshot doesn't
+ * reflect, starting from our last learn; we give its instance number in
+ * ph_inum.  The acceptor may ask several times before it hears back, so we
+ * send at most one catch-up every CATCHUP_INTERVAL microseconds.
+ *
+ * Since a catch-up reflects only what we have learned, any acceptor which
+ * is ahead of the laggard can send one, not just the proposer.
+ */
+int
+paxos_catchup(struct paxos_acceptor *acc)
+{
+  int r;
+  gint64 now;
+  struct paxos_header hdr;
+  struct paxos_acceptor *acc_it;
+  struct yakyak yy;
+
+  now = g_get_monotonic_time();
+  if (acc->pa_caughtup != 0 && now - acc->pa_caughtup < CATCHUP_INTERVAL) {
+    return 0;
+  }
+  acc->pa_caughtup = now;
+
+  // Initialize a header.
+  header_init(&hdr, OP_CATCHUP, pax->ihole - 1);
+
+  // Pack the header into a new payload.
+  yakyak_init(&yy, 2);
+  paxos_header_pack(&yy, &hdr);
+  yakyak_begin_array(&yy, 4);
+
+  // Pack the alist, which the acceptor may have missed changes to.
+  yakyak_begin_array(&yy, LIST_COUNT(&pax->alist));
+  LIST_FOREACH(acc_it, &pax->alist, pa_le) {
+    paxos_acceptor_pack(&yy, acc_it);
+  }
+
+  // Pack the ilist from our last learn onward, along with the requests it
+  // decrees, and finish off with a snapshot standing in for everything
+  // before.
+  welcome_pack_range(&yy, hdr.ph_inum, RING_END(&pax->ilist));
+  snapshot_pack(&yy);
+
+  // Send the catch-up.
+  r = paxos_send(acc, &yy);
+  yakyak_destroy(&yy);
+
+  return r;
+}
+
+/**
+ * catchup_listed - Check whether a packed alist includes an acceptor.
+ */
+static bool
+catchup_listed(msgpack_object *o, paxid_t paxid)
+{
+  msgpack_object *p, *pend;
+
+  p = o->via.array.ptr;
+  pend = o->via.array.ptr + o->via.array.size;
+
+  for (; p != pend; ++p) {
+    assert(p->type == MSGPACK_OBJECT_ARRAY && p->via.array.size > 0);
+    if (p->via.array.ptr->via.u64 == paxid) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/**
+ * catchup_alist - Bring our alist in line with the proposer's, learning the
+ * joins and parts we missed.  We clear member if we ourselves were parted.
+ */
+static int
+catchup_alist(msgpack_object *o, bool *member)
+{
+  int r;
+  msgpack_object *p, *pend;
+  struct paxos_acceptor *acc, *next, *listed;
+  struct paxos_continuation *k;
+
+  // Make sure the alist is well-formed.
+  assert(o->type == MSGPACK_OBJECT_ARRAY);
+  p = o->via.array.ptr;
+  pend = o->via.array.ptr + o->via.array.size;
+
+  // Learn the parts of any acceptors the proposer no longer lists.
+  for (acc = LIST_FIRST(&pax->alist); acc != (void *)&pax->alist;
+      acc = next) {
+    next = LIST_NEXT(acc, pa_le);
+    if (catchup_listed(o, acc->pa_paxid)) {
+      continue;
+    }
+
+    state.learn_buf = acc->pa_buf;
+    state.learn.part(acc->pa_desc, acc->pa_size, acc->pa_desc, acc->pa_size,
+        pax->client_data);
+    state.learn_buf = NULL;
+
+    if (acc->pa_paxid == pax->self_id) {
+      *member = false;
+      return 0;
+    }
+
+    LIST_REMOVE(&pax->alist, acc, pa_le);
+    if (acc->pa_peer != NULL) {
+      pax->live_count--;
+    }
+    if (acc == pax->proposer) {
+      pax->proposer = NULL;
+    }
+    acceptor_destroy(acc);
+  }
+
+  // Learn the joins of any acceptors we have yet to hear of.  As when we
+  // learn a join, we may already have had a hello from the newcomer.
+  for (; p != pend; ++p) {
+    listed = g_malloc0(sizeof(*listed));
+    paxos_acceptor_unpack(listed, p);
+    if (acceptor_find(&pax->alist, listed->pa_paxid) != NULL) {
+      acceptor_destroy(listed);
+      continue;
+    }
+
+    acc = acceptor_find(&pax->adefer, listed->pa_paxid);
+    if (acc != NULL) {
+      LIST_REMOVE(&pax->adefer, acc, pa_le);
+      acceptor_set_desc(acc, listed->pa_desc, listed->pa_size);
+      acceptor_destroy(listed);
+      if (acc->pa_peer != NULL) {
+        pax->live_count++;
+      }
+    } else {
+      acc = listed;
+    }
+    acceptor_insert(&pax->alist, acc);
+
+    // Connect to the newcomer if it hasn't connected to us.
+    if (acc->pa_peer == NULL) {
+      k = continuation_new(continue_ack_welcome, acc->pa_paxid);
+      ERR_RET(r, state.connect(acc->pa_desc, acc->pa_size, &k->pk_cb));
+    }
+
+    state.learn_buf = acc->pa_buf;
+    state.learn.join(acc->pa_desc, acc->pa_size, acc->pa_desc, acc->pa_size,
+        pax->client_data);
+    state.learn_buf = NULL;
+  }
+
+  if (pax->proposer == NULL) {
+    reset_proposer();
+  }
+
+  *member = true;
+  return 0;
+}
+
+/**
+ * acceptor_ack_catchup - Catch up with the acceptor who answered our retry
+ * after we fell behind its truncation point.
+ *
+ * We take on the sender's membership, drop our log before the instance in
+ * the header, and merge in the sender's log from there on.  The snapshot
+ * then gives our client the chats it missed, insofar as they are still in
+ * the sender's scrollback, and moves our hole past everything it reflects.
+ */
+int
+acceptor_ack_catchup(struct paxos_header *hdr, msgpack_object *o)
+{
+  int r;
+  bool member;
+  paxid_t inum;
+  msgpack_object *arr, *p, *pend;
+  struct paxos_instance *inst, *it;
+
+  // Ignore catch-ups we no longer need, such as a second answer to our
+  // retries.
+  if (hdr->ph_inum < pax->ihole) {
+    return 0;
+  }
+
+  // Make sure the payload is well-formed.
+  assert(o->type == MSGPACK_OBJECT_ARRAY);
+  assert(o->via.array.size == 4);
+  arr = o->via.array.ptr;
+
+  // Take on the membership.  If we were parted while we were behind, leave.
+  ERR_RET(r, catchup_alist(arr++, &member));
+  if (!member) {
+    return paxos_end(pax);
+  }
+
+  // Drop everything the snapshot stands in for.
+  pax->ibase = hdr->ph_inum;
+  pax->sync_prev = hdr->ph_inum;
+  ilist_truncate_prefix(&pax->ilist, pax->ibase);
+
+  // Make sure the ilist is well-formed.
+  assert(arr->type == MSGPACK_OBJECT_ARRAY);
+  pend = arr->via.array.ptr + arr->via.array.size;
+  p = (arr++)->via.array.ptr;
+
+  // Merge in the sender's ilist, taking its commits over whatever we
+  // accepted ourselves.
+  for (; p != pend; ++p) {
+    inst = instance_new();
+    paxos_instance_unpack(inst, p);
+
+    it = instance_insert(&pax->ilist, inst);
+    if (it == inst) {
+      continue;
+    }
+
+    if (!it->pi_committed && inst->pi_committed) {
+      memcpy(&it->pi_hdr, &inst->pi_hdr, sizeof(inst->pi_hdr));
+      memcpy(&it->pi_val, &inst->pi_val, sizeof(inst->pi_val));
+      g_free(it->pi_batch);
+      it->pi_batch = inst->pi_batch;
+      inst->pi_batch = NULL;
+      it->pi_committed = true;
+    }
+    instance_destroy(inst);
+  }
+
+  // Cache the inlined requests.
+  request_unpack_cache(arr++);
+
+  // Take on the snapshot, which reflects everything up to our new ihole.
+  pax->ihole = snapshot_unpack(arr) + 1;
+  for (inum = pax->ibase; inum < pax->ihole; ++inum) {
+    inst = instance_find(&pax->ilist, inum);
+    if (inst != NULL) {
+      inst->pi_cached = true;
+      inst->pi_learned = true;
+    }
+  }
+
+  // Owners take turns afresh after the membership we just took on.
+  mencius_reslot(pax->ihole - 1);
+
+  // Our log no longer reflects anything we dropped.
+  ERR_RET(r, wal_checkpoint());
+
+  // Learn anything which the sender had committed but not yet learned.
+  inst = instance_find(&pax->ilist, pax->ihole);
+  if (inst != NULL && inst->pi_committed) {
+    return paxos_commit(inst);
   }
 
   return 0;
@@ -0,0 +1,580 @@
+/**
+ * paxos_history.c - On-disk history of the chats learned in a session, for
+ * the client's scrollback.
+ *
+ * When history is enabled, every chat we hand the client is also appended to
+ * the session's history under HISTORY_DIR in the Motmot home directory.  The
+ * history is a sequence of segment files, each created at HISTORY_SEG_SIZE
+ * bytes and mapped into memory whole, into which we copy records of
+ *
+ *  - the instance the chat was learned in,
+ *  - when we learned it,
+ *  - the alias of its sender at the time, and
+ *  - the chat itself,
+ *
+ * back to back.  A record whose instance number is 0 marks the end of the
+ * segment, which is how the untouched remainder of a new segment reads.
+ *
+ * Serving scrollback reads records straight out of the mapped segments, so
+ * only the pages a query actually touches are ever brought in.  To find our
+ * place without scanning, we keep a sparse index of each segment holding the
+ * offset of every HISTORY_STRIDE'th record.  Since records are filed in
+ * order of instance, we can binary search the index, then walk at most
+ * HISTORY_STRIDE records.  We only index a segment once a query reaches it.
+ *
+ * Chats which a snapshot delivers as scrollback are filed under the last
+ * instance the snapshot reflects.  If we reopen the history of a session we
+ * have recovered, we file nothing up to the last instance it already holds,
+ * since we are relearning those chats.  A session's history is deleted when
+ * the session ends.
+ */
+
+#include <fcntl.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#include "paxos.h"
+#include "paxos_protocol.h"
+#include "paxos_state.h"
+
+#define HISTORY_DIR       "history"           // directory of histories in the home
+#define HISTORY_SEG_SIZE  (16 * 1024 * 1024)  // bytes in a new segment
+#define HISTORY_STRIDE    64                  // records per index entry
+#define HISTORY_ALIGN     8                   // alignment of each record
+
+/* Header of a record, followed by the alias and then the chat. */
+struct history_record {
+  gint64 hr_time;             // microseconds since the epoch when learned
+  paxid_t hr_inum;            // instance learned in; 0 past the last record
+  guint32 hr_alias_size;      // size of the sender's alias
+  guint32 hr_size;            // size of the chat
+};
+
+/* A mapped segment of a history. */
+struct history_segment {
+  char *hg_map;               // the segment, mapped whole
+  size_t hg_size;             // size of the segment
+  size_t hg_end;              // offset past the last record, once indexed
+  bool hg_indexed;            // have we built the index yet?
+  unsigned hg_count;          // number of records, once indexed
+  paxid_t hg_last;            // instance of the last record, once indexed
+  unsigned hg_isize;          // capacity of hg_index
+  size_t *hg_index;           // offset of every HISTORY_STRIDE'th record
+};
+
+/* Position of a record in a history. */
+struct history_pos {
+  unsigned hp_seg;            // index of the segment; past the last at end
+  unsigned hp_ord;            // index of the record in its segment
+  size_t hp_off;              // offset of the record in its segment
+};
+
+/**
+ * history_dir - Get the path of a session's history.  The caller must g_free
+ * the path.
+ */
+static char *
+history_dir(pax_uuid_t *uuid)
+{
+  char name[32];
+
+  g_snprintf(name, sizeof(name), "%016" G_GINT64_MODIFIER "x",
+      (guint64)*uuid);
+  return g_build_filename(motmot_home_dir(), HISTORY_DIR, name, NULL);
+}
+
+/**
+ * history_seg_path - Get the path of the i'th segment of a history.  The
+ * caller must g_free the path.
+ */
+static char *
+history_seg_path(struct paxos_history *h, unsigned i)
+{
+  char name[32];
+
+  g_snprintf(name, sizeof(name), "%08x.seg", i);
+  return g_build_filename(h->hs_dir, name, NULL);
+}
+
+/**
+ * history_reclen - Get the number of bytes a record takes up.
+ */
+static inline size_t
+history_reclen(size_t alias_size, size_t size)
+{
+  size_t len = sizeof(struct history_record) + alias_size + size;
+  return (len + HISTORY_ALIGN - 1) & ~(size_t)(HISTORY_ALIGN - 1);
+}
+
+/**
+ * history_record_at - Get the record at an offset into a segment, or NULL if
+ * there is none there.
+ */
+static struct history_record *
+history_record_at(struct history_segment *seg, size_t off)
+{
+  struct history_record *rec;
+
+  if (off + sizeof(*rec) > seg->hg_size) {
+    return NULL;
+  }
+  rec = (struct history_record *)(seg->hg_map + off);
+  if (rec->hr_inum == 0 ||
+      off + history_reclen(rec->hr_alias_size, rec->hr_size) > seg->hg_size) {
+    return NULL;
+  }
+
+  return rec;
+}
+
+/**
+ * history_index_add - Add a record at the given offset to a segment, noting
+ * it in the index if need be.
+ */
+static void
+history_index_add(struct history_segment *seg, size_t off)
+{
+  if (seg->hg_count % HISTORY_STRIDE == 0) {
+    if (seg->hg_count / HISTORY_STRIDE == seg->hg_isize) {
+      seg->hg_isize = MAX(2 * seg->hg_isize, 16);
+      seg->hg_index = g_renew(size_t, seg->hg_index, seg->hg_isize);
+    }
+    seg->hg_index[seg->hg_count / HISTORY_STRIDE] = off;
+  }
+  seg->hg_count++;
+}
+
+/**
+ * history_index - Build the sparse index of a segment, if we haven't yet.
+ * We stop at anything out of order, which can only be a record torn by a
+ * crash.
+ */
+static void
+history_index(struct history_segment *seg)
+{
+  size_t off;
+  paxid_t prev;
+  struct history_record *rec;
+
+  if (seg->hg_indexed) {
+    return;
+  }
+  seg->hg_indexed = true;
+
+  prev = 0;
+  for (off = 0; (rec = history_record_at(seg, off)) != NULL; ) {
+    if (rec->hr_inum < prev) {
+      break;
+    }
+    prev = rec->hr_inum;
+
+    history_index_add(seg, off);
+    seg->hg_last = rec->hr_inum;
+    off += history_reclen(rec->hr_alias_size, rec->hr_size);
+  }
+  seg->hg_end = off;
+}
+
+/**
+ * history_seg_open - Map the next segment of a history, creating it with the
+ * given size if it does not exist.  Returns NULL if there is no such segment
+ * and size is 0, or on error.
+ */
+static struct history_segment *
+history_seg_open(struct paxos_history *h, size_t size)
+{
+  int fd;
+  char *path;
+  void *map;
+  struct stat st;
+  struct history_segment *seg;
+
+  path = history_seg_path(h, h->hs_count);
+  fd = open(path, O_RDWR | (size ? O_CREAT | O_EXCL : 0), 0600);
+  g_free(path);
+  if (fd < 0) {
+    if (size) {
+      g_warning("history_seg_open: Could not create history segment.");
+    }
+    return NULL;
+  }
+
+  // A new segment is all zeroes, i.e., empty, and takes no space on disk
+  // until we write to it.
+  if ((size && ftruncate(fd, size)) || fstat(fd, &st) || st.st_size == 0) {
+    g_warning("history_seg_open: Could not size history segment.");
+    close(fd);
+    return NULL;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    g_warning("history_seg_open: Could not map history segment.");
+    return NULL;
+  }
+
+  if (h->hs_count == h->hs_size) {
+    h->hs_size = MAX(2 * h->hs_size, 16);
+    h->hs_segs = g_renew(struct history_segment, h->hs_segs, h->hs_size);
+  }
+
+  seg = &h->hs_segs[h->hs_count++];
+  memset(seg, 0, sizeof(*seg));
+  seg->hg_map = map;
+  seg->hg_size = st.st_size;
+  return seg;
+}
+
+/**
+ * history_open - Get the history of the session, mapping whatever we already
+ * have of it the first time.  Returns NULL if history is disabled.
+ */
+static struct paxos_history *
+history_open()
+{
+  unsigned i;
+  struct paxos_history *h;
+  struct history_segment *seg;
+
+  if (pax->history != NULL || !state.history) {
+    return pax->history;
+  }
+
+  h = g_malloc0(sizeof(*h));
+  h->hs_dir = history_dir(pax->session_id);
+  g_mkdir_with_parents(h->hs_dir, 0700);
+
+  while (history_seg_open(h, 0) != NULL);
+
+  // Find how far we got before.  Only the last segment can be empty.
+  for (i = h->hs_count; i > 0 && h->hs_resume == 0; --i) {
+    seg = &h->hs_segs[i - 1];
+    history_index(seg);
+    h->hs_resume = seg->hg_last;
+  }
+
+  pax->history = h;
+  return h;
+}
+
+/**
+ * history_destroy - Unmap a session's history.
+ */
+void
+history_destroy(struct paxos_history *h)
+{
+  unsigned i;
+
+  if (h == NULL) {
+    return;
+  }
+
+  for (i = 0; i < h->hs_count; ++i) {
+    munmap(h->hs_segs[i].hg_map, h->hs_segs[i].hg_size);
+    g_free(h->hs_segs[i].hg_index);
+  }
+  g_free(h->hs_segs);
+  g_free(h->hs_dir);
+  g_free(h);
+}
+
+/**
+ * history_remove - Delete the session's history, since we won't be back.
+ */
+void
+history_remove()
+{
+  unsigned i;
+  char *path;
+  struct paxos_history *h;
+
+  h = history_open();
+  if (h == NULL) {
+    return;
+  }
+
+  for (i = 0; ; ++i) {
+    path = history_seg_path(h, i);
+    if (g_unlink(path)) {
+      g_free(path);
+      break;
+    }
+    g_free(path);
+  }
+  g_rmdir(h->hs_dir);
+
+  pax->history = NULL;
+  history_destroy(h);
+}
+
+/**
+ * history_append - File a chat we have just learned in the session's
+ * history.  The history is only for the client's benefit, so we make do
+ * without it on error.
+ */
+void
+history_append(paxid_t inum, const void *alias, size_t alias_size,
+    const void *data, size_t size)
+{
+  size_t len;
+  struct paxos_history *h;
+  struct history_segment *seg;
+  struct history_record rec;
+
+  h = history_open();
+  if (h == NULL || inum <= h->hs_resume) {
+    return;
+  }
+  len = history_reclen(alias_size, size);
+
+  // Start a new segment if the record won't fit in the last.
+  seg = NULL;
+  if (h->hs_count > 0) {
+    seg = &h->hs_segs[h->hs_count - 1];
+    history_index(seg);
+  }
+  if (seg == NULL || seg->hg_end + len > seg->hg_size) {
+    seg = history_seg_open(h, MAX(HISTORY_SEG_SIZE, len));
+    if (seg == NULL) {
+      return;
+    }
+    history_index(seg);
+  }
+
+  // Copy in the record, filling in its header last, and clear whatever a
+  // crash may have left after it.
+  rec.hr_time = g_get_real_time();
+  rec.hr_inum = inum;
+  rec.hr_alias_size = alias_size;
+  rec.hr_size = size;
+  memcpy(seg->hg_map + seg->hg_end + sizeof(rec), alias, alias_size);
+  memcpy(seg->hg_map + seg->hg_end + sizeof(rec) + alias_size, data, size);
+  memcpy(seg->hg_map + seg->hg_end, &rec, sizeof(rec));
+  if (seg->hg_end + len + sizeof(rec) <= seg->hg_size) {
+    memset(seg->hg_map + seg->hg_end + len, 0, sizeof(rec));
+  }
+
+  history_index_add(seg, seg->hg_end);
+  seg->hg_last = inum;
+  seg->hg_end += len;
+}
+
+/**
+ * history_record - Get the record at a position, or NULL at the end.
+ */
+static struct history_record *
+history_record(struct paxos_history *h, struct history_pos *pos)
+{
+  struct history_segment *seg;
+
+  if (pos->hp_seg >= h->hs_count) {
+    return NULL;
+  }
+  seg = &h->hs_segs[pos->hp_seg];
+  if (pos->hp_ord >= seg->hg_count) {
+    return NULL;
+  }
+  return (struct history_record *)(seg->hg_map + pos->hp_off);
+}
+
+/**
+ * history_next - Advance a position to the next record.
+ */
+static void
+history_next(struct paxos_history *h, struct history_pos *pos)
+{
+  struct history_segment *seg;
+  struct history_record *rec;
+
+  rec = history_record(h, pos);
+  pos->hp_ord++;
+  pos->hp_off += history_reclen(rec->hr_alias_size, rec->hr_size);
+
+  // Move on to the start of the next nonempty segment if need be.
+  for (;;) {
+    seg = &h->hs_segs[pos->hp_seg];
+    history_index(seg);
+    if (pos->hp_ord < seg->hg_count) {
+      break;
+    }
+
+    pos->hp_seg++;
+    pos->hp_ord = 0;
+    pos->hp_off = 0;
+    if (pos->hp_seg == h->hs_count) {
+      break;
+    }
+  }
+}
+
+/**
+ * history_locate - Set a position to the record with the given ordinal in
+ * the given segment, which must be indexed.
+ */
+static void
+history_locate(struct paxos_history *h, struct history_pos *pos,
+    unsigned segno, unsigned ord)
+{
+  unsigned i;
+  struct history_segment *seg;
+
+  seg = &h->hs_segs[segno];
+  pos->hp_seg = segno;
+  pos->hp_ord = ord - ord % HISTORY_STRIDE;
+  pos->hp_off = seg->hg_index[ord / HISTORY_STRIDE];
+  for (i = ord % HISTORY_STRIDE; i > 0; --i) {
+    history_next(h, pos);
+  }
+}
+
+/**
+ * history_seek - Find the first record of an instance no earlier than inum.
+ */
+static void
+history_seek(struct paxos_history *h, paxid_t inum, struct history_pos *pos)
+{
+  unsigned segno, lo, hi, mid;
+  struct history_segment *seg;
+  struct history_record *rec;
+
+  // Find the last segment starting no later than inum.  Every segment but
+  // perhaps the last has at least one record.
+  for (segno = h->hs_count; segno > 0; --segno) {
+    seg = &h->hs_segs[segno - 1];
+    rec = history_record_at(seg, 0);
+    if (rec != NULL && rec->hr_inum <= inum) {
+      break;
+    }
+  }
+  if (segno == 0) {
+    segno = 1;
+  }
+
+  pos->hp_seg = segno - 1;
+  pos->hp_ord = 0;
+  pos->hp_off = 0;
+  if (pos->hp_seg >= h->hs_count) {
+    return;
+  }
+  seg = &h->hs_segs[pos->hp_seg];
+  history_index(seg);
+  if (seg->hg_count == 0) {
+    pos->hp_seg = h->hs_count;
+    return;
+  }
+
+  // Find the last index entry before inum, and walk from there.
+  lo = 0;
+  hi = (seg->hg_count + HISTORY_STRIDE - 1) / HISTORY_STRIDE;
+  while (hi - lo > 1) {
+    mid = lo + (hi - lo) / 2;
+    rec = (struct history_record *)(seg->hg_map +
+        seg->hg_index[mid]);
+    if (rec->hr_inum < inum) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  history_locate(h, pos, pos->hp_seg, lo * HISTORY_STRIDE);
+
+  while ((rec = history_record(h, pos)) != NULL && rec->hr_inum < inum) {
+    history_next(h, pos);
+  }
+}
+
+/**
+ * history_back - Move a position back by up to count records.
+ */
+static void
+history_back(struct paxos_history *h, struct history_pos *pos,
+    unsigned count)
+{
+  unsigned segno, ord;
+  struct history_segment *seg;
+
+  segno = pos->hp_seg;
+  ord = pos->hp_ord;
+  while (count > ord && segno > 0) {
+    count -= ord;
+    seg = &h->hs_segs[--segno];
+    history_index(seg);
+    ord = seg->hg_count;
+  }
+  ord -= MIN(count, ord);
+
+  if (segno == pos->hp_seg && ord == pos->hp_ord) {
+    return;
+  }
+  history_locate(h, pos, segno, ord);
+}
+
+/**
+ * paxos_history - Hand the client chats from a session's history: at least
+ * count of them starting with the first instance no earlier than inum if
+ * count is positive, or at least -count of them from before that instance
+ * if not.  Whole instances are always delivered, so the client can page
+ * through by the instance numbers it is given.
+ */
+int
+paxos_history(void *session, paxid_t inum, int count, history_t cb)
+{
+  unsigned delivered;
+  paxid_t last;
+  struct paxos_history *h;
+  struct history_pos pos, end;
+  struct history_record *rec;
+
+  pax = (struct paxos_session *)session;
+  h = history_open();
+  if (h == NULL) {
+    return 1;
+  }
+
+  history_seek(h, inum, &pos);
+  end.hp_seg = h->hs_count;
+  end.hp_ord = 0;
+
+  // To page backward, find where to start, and back up to the start of its
+  // instance.
+  if (count < 0) {
+    end = pos;
+    history_back(h, &pos, -count);
+    rec = history_record(h, &pos);
+    if (rec == NULL || rec->hr_inum >= inum) {
+      return 0;
+    }
+    history_seek(h, rec->hr_inum, &pos);
+    count = 0;
+  }
+
+  delivered = 0;
+  last = 0;
+  while ((rec = history_record(h, &pos)) != NULL) {
+    if (pos.hp_seg == end.hp_seg && pos.hp_ord == end.hp_ord) {
+      break;
+    }
+    if (count > 0 && delivered >= (unsigned)count && rec->hr_inum != last) {
+      break;
+    }
+
+    if (cb(rec->hr_inum, rec->hr_time, (char *)(rec + 1) + rec->hr_alias_size,
+          rec->hr_size, (char *)(rec + 1), rec->hr_alias_size,
+          pax->client_data)) {
+      break;
+    }
+    delivered++;
+    last = rec->hr_inum;
+
+    history_next(h, &pos);
+  }
+
+  return 0;
+}
@@ -13,6 +13,7 @@
 #include "paxos_state.h"
 #include "paxos_util.h"
 #include "containers/list.h"
+#include "util/paxos_buf.h"
 #include "util/paxos_io.h"
 #include "util/paxos_print.h"
 
@@ -42,19 +43,15 @@ paxos_commit(struct paxos_instance *inst)
   // Mark the commit.
   inst->pi_committed = true;
 
-  // Pull the request from the request cache if applicable.
-  if (request_needs_cached(inst->pi_val.pv_dkind)) {
-    req = request_find(&pax->rcache, inst->pi_val.pv_reqid);
-
-    // If we can't find a request and need one, send out a retrieve to the
-    // request originator and defer the commit.
-    if (req == NULL) {
-      return paxos_retrieve(inst);
-    }
+  // If we are missing any of the requests decreed by the instance, send out
+  // retrieves to the request originators and defer the commit.
+  if (!instance_has_requests(inst)) {
+    return paxos_retrieve(inst);
   }
 
-  // Mark the cache.
+  // Mark the cache, and log the commit now that we can log its requests.
   inst->pi_cached = true;
+  ERR_RET(r, wal_instance(inst));
 
   // We should already have committed and learned everything before the hole.
   assert(inst->pi_hdr.ph_inum >= pax->ihole);
@@ -67,24 +64,26 @@ paxos_commit(struct paxos_instance *inst)
       return 0;
     }
 
+    // If acceptors own instances, the hole's owner may simply not have
+    // decreed it yet, so we wait out a full round of instances past it.
+    if (pax->mencius &&
+        inst->pi_hdr.ph_inum < pax->ihole + LIST_COUNT(&pax->alist)) {
+      return 0;
+    }
+
     // If the hole has committed but is just waiting on a retrieve, we'll learn
     // when we receive the resend.
-    if (pax->istart->pi_hdr.ph_inum == pax->ihole && pax->istart->pi_committed) {
-      assert(!pax->istart->pi_cached);
+    it = instance_find(&pax->ilist, pax->ihole);
+    if (it != NULL && it->pi_committed) {
+      assert(!it->pi_cached);
       return 0;
     }
 
-    // The hole is either missing or uncommitted and we are not the proposer,
-    // so issue a retry.
-    return acceptor_retry(pax->ihole);
+    // The hole is either missing or uncommitted and we are not the proposer.
+    // The commit may just be late, so give it a moment before retrying.
+    return acceptor_hole(inst->pi_hdr.ph_inum - 1);
   }
 
-  // Set pax->istart to point to the instance numbered pax->ihole.
-  if (pax->istart->pi_hdr.ph_inum != pax->ihole) {
-    pax->istart = LIST_NEXT(pax->istart, pi_le);
-  }
-  assert(pax->istart->pi_hdr.ph_inum == pax->ihole);
-
   // Now learn as many contiguous commits as we can.  This function is the
   // only path by which we learn commits, and we always learn in contiguous
   // blocks.  Therefore, it is an invariant of our system that all the
@@ -92,26 +91,11 @@ paxos_commit(struct paxos_instance *inst)
   // none of the instances geq to pax->ihole are learned (although some may
   // be committed).
   //
-  // We iterate over the instance list, detecting and breaking if we find a
-  // hole and learning whenever we don't.
-  for (it = pax->istart; ; it = LIST_NEXT(it, pi_le), ++pax->ihole) {
-    // If we reached the end of the list, set pax->istart to the last existing
-    // instance.
-    if (it == (void *)&pax->ilist) {
-      pax->istart = LIST_LAST(&pax->ilist);
-      break;
-    }
-
-    // If we skipped over an instance number because we were missing an
-    // instance, set pax->istart to the last instance before the hole.
-    if (it->pi_hdr.ph_inum != pax->ihole) {
-      pax->istart = LIST_PREV(it, pi_le);
-      break;
-    }
-
-    // If we found an uncommitted or uncached instance, set pax->istart to it.
-    if (!it->pi_committed || !it->pi_cached) {
-      pax->istart = it;
+  // We walk the instance log from the hole, breaking if we find a missing,
+  // uncommitted, or uncached instance and learning whenever we don't.
+  for (;; ++pax->ihole) {
+    it = instance_find(&pax->ilist, pax->ihole);
+    if (it == NULL || !it->pi_committed || !it->pi_cached) {
       break;
     }
 
@@ -120,7 +104,8 @@ paxos_commit(struct paxos_instance *inst)
     assert(!it->pi_learned);
 
     // Grab its associated request.  This is guaranteed to exist because we
-    // have checked that pi_cached holds.
+    // have checked that pi_cached holds.  Batches look up their members when
+    // they are learned.
     req = NULL;
     if (request_needs_cached(it->pi_val.pv_dkind)) {
       req = request_find(&pax->rcache, it->pi_val.pv_reqid);
@@ -131,9 +116,50 @@ paxos_commit(struct paxos_instance *inst)
     ERR_RET(r, paxos_learn(it, req));
   }
 
+  // Owners who were waiting for us to learn may be able to decree again.
+  mencius_observe(pax->ihole - 1);
+
+  // Stop waiting on our hole if it has filled, and truncate sooner if our
+  // log has grown large.
+  acceptor_hole_check();
+  sync_check();
+
   return 0;
 }
 
+/**
+ * paxos_learn_chat - Deliver a chat request to the client.
+ */
+static void
+paxos_learn_chat(struct paxos_instance *inst, struct paxos_request *req)
+{
+  struct paxos_acceptor *acc;
+
+  // Grab the message sender.
+  acc = acceptor_find(&pax->alist, req->pr_val.pv_reqid.id);
+  assert(acc != NULL);
+
+  // Once the last chat we sent to the proposer is learned, we can go back to
+  // decreeing our own without reordering them.
+  if (acc->pa_paxid == pax->self_id &&
+      req->pr_val.pv_reqid.gen == pax->mrouted) {
+    pax->mrouted = 0;
+  }
+
+  // Keep the chat for the scrollback of future newcomers and for the
+  // client's history, and count it towards the size of our log.
+  snapshot_chat(req, acc);
+  pax->sync_bytes += req->pr_size;
+  history_append(inst->pi_hdr.ph_inum, acc->pa_desc, acc->pa_size,
+      req->pr_data, req->pr_size);
+
+  // Invoke client learning callback.
+  state.learn_buf = req->pr_buf;
+  state.learn.chat(req->pr_data, req->pr_size, acc->pa_desc, acc->pa_size,
+      pax->client_data);
+  state.learn_buf = NULL;
+}
+
 /**
  * paxos_learn - Do something useful with the value of a commit.
  *
@@ -144,6 +170,7 @@ int
 paxos_learn(struct paxos_instance *inst, struct paxos_request *req)
 {
   int r = 0;
+  unsigned i;
   struct paxos_acceptor *acc;
 
   // Mark the learn.
@@ -155,13 +182,16 @@ paxos_learn(struct paxos_instance *inst, struct paxos_request *req)
       break;
 
     case DEC_CHAT:
-      // Grab the message sender.
-      acc = acceptor_find(&pax->alist, req->pr_val.pv_reqid.id);
-      assert(acc != NULL);
+      paxos_learn_chat(inst, req);
+      break;
 
-      // Invoke client learning callback.
-      state.learn.chat(req->pr_data, req->pr_size, acc->pa_desc, acc->pa_size,
-          pax->client_data);
+    case DEC_BATCH:
+      // Learn each member of the batch in the order it was decreed.
+      for (i = 0; i < inst->pi_val.pv_extra; ++i) {
+        req = request_find(&pax->rcache, inst->pi_batch[i]);
+        assert(req != NULL);
+        paxos_learn_chat(inst, req);
+      }
       break;
 
     case DEC_JOIN:
@@ -171,19 +201,25 @@ paxos_learn(struct paxos_instance *inst, struct paxos_request *req)
 
       if (acc != NULL) {
         // We found a deferred hello.  To complete the hello, just move our
-        // acceptor over to the alist and increment the live count.
+        // acceptor over to the alist and increment the live count, unless
+        // its connection has since dropped.
         LIST_REMOVE(&pax->adefer, acc, pa_le);
-        pax->live_count++;
+        if (acc->pa_peer != NULL) {
+          pax->live_count++;
+        }
       } else {
         // We have not yet gotten the hello, so create a new acceptor.
         acc = g_malloc0(sizeof(*acc));
         acc->pa_paxid = inst->pi_hdr.ph_inum;
       }
       acceptor_insert(&pax->alist, acc);
+      mencius_reslot(inst->pi_hdr.ph_inum);
+      snapshot_mark(req->pr_val.pv_reqid);
 
-      // Copy over the identity information.
+      // Share the identity information with the request.
       acc->pa_size = req->pr_size;
-      acc->pa_desc = g_memdup(req->pr_data, req->pr_size);
+      acc->pa_desc = req->pr_data;
+      acc->pa_buf = paxos_buf_ref(req->pr_buf);
 
       // If we are the proposer, we are responsible for connecting to the new
       // acceptor, as well as for sending the new acceptor its paxid and other
@@ -193,8 +229,10 @@ paxos_learn(struct paxos_instance *inst, struct paxos_request *req)
       }
 
       // Invoke client learning callback.
+      state.learn_buf = req->pr_buf;
       state.learn.join(req->pr_data, req->pr_size, acc->pa_desc, acc->pa_size,
           pax->client_data);
+      state.learn_buf = NULL;
       break;
 
     case DEC_PART:
@@ -210,8 +248,10 @@ paxos_learn(struct paxos_instance *inst, struct paxos_request *req)
       }
 
       // Invoke client learning callback.
+      state.learn_buf = acc->pa_buf;
       state.learn.part(acc->pa_desc, acc->pa_size, acc->pa_desc, acc->pa_size,
           pax->client_data);
+      state.learn_buf = NULL;
 
       // If we are being parted, leave the protocol.
       if (acc->pa_paxid == pax->self_id) {
@@ -224,14 +264,18 @@ paxos_learn(struct paxos_instance *inst, struct paxos_request *req)
       if (acc->pa_peer != NULL) {
         pax->live_count--;
       }
+      mencius_reslot(inst->pi_hdr.ph_inum);
 
       // If we just parted our proposer, "elect" a new one.  If it's us, send
-      // a prepare.
+      // a prepare.  Otherwise, if we're the proposer and acceptors own
+      // instances, recover the departed acceptor's.
       if (acc->pa_paxid == pax->proposer->pa_paxid) {
         reset_proposer();
         if (is_proposer()) {
           r = proposer_prepare(acc);
         }
+      } else if (pax->mencius && is_proposer()) {
+        r = mencius_part();
       }
 
       // Free the parted acceptor.
@@ -242,3 +286,23 @@ paxos_learn(struct paxos_instance *inst, struct paxos_request *req)
 
   return r;
 }
+
+/**
+ * paxos_retain - Take a reference to the buffer holding the message passed to
+ * the learn callback currently being invoked, so that the client may keep
+ * using the message without copying it.
+ */
+void *
+paxos_retain()
+{
+  return paxos_buf_ref(state.learn_buf);
+}
+
+/**
+ * paxos_release - Drop a reference taken by paxos_retain.
+ */
+void
+paxos_release(void *handle)
+{
+  paxos_buf_unref(handle);
+}
@@ -0,0 +1,463 @@
+/**
+ * paxos_mencius.c - Round-robin ownership of instances, letting every
+ * acceptor decree its own chats.
+ *
+ * Ordinarily, every decree is made by the proposer, so every chat costs its
+ * sender a trip to the proposer before it can be decreed.  When a session
+ * shares its instances among its acceptors, in the manner of Mencius, each
+ * instance is instead owned by one acceptor, with ownership passing
+ * round-robin among the acceptors in rank order.  Owners decree their chats
+ * in their own instances under their own ID and the generation of the
+ * current ballot, and collect the votes and broadcast the commits for them
+ * just as the proposer would.  Since we learn in instance order, an owner
+ * with nothing to say must not hold everyone up; once it sees a decree in a
+ * later instance, it skips each of its earlier instances with a null decree.
+ *
+ * The proposer retains its usual role in everything else.  It alone decrees
+ * membership changes, in its own instances, and when it prepares, it
+ * recovers every instance up to the last one seen by its quorum, owners'
+ * included.  Acceptors refuse owners' decrees from the time they promise
+ * until the proposer fences off the recovered instances, after which owners
+ * resume decreeing past the fence.  Chats which an owner loses to the
+ * recovery are decreed again in a later instance.  The proposer prepares
+ * likewise after any acceptor leaves, after which it is safe for it to fill
+ * in the departed owner's instances with null decrees.
+ *
+ * Ownership follows the acceptor list, which changes with each membership
+ * decree.  So that every owner can tell which instances are its own well
+ * before it learns everything preceding them, a membership change learned
+ * at instance i takes effect only at instance i + MENCIUS_LAG, and owners
+ * decree only within MENCIUS_LAG instances of their first unlearned one.
+ *
+ * An acceptor which has been assigned no instances yet, e.g., one which has
+ * just joined, sends its chats to the proposer to be decreed as usual.
+ */
+
+#include <assert.h>
+#include <glib.h>
+
+#include "common/yakyak.h"
+
+#include "paxos.h"
+#include "paxos_connect.h"
+#include "paxos_protocol.h"
+#include "paxos_state.h"
+#include "paxos_util.h"
+#include "containers/list.h"
+#include "util/paxos_io.h"
+#include "util/paxos_print.h"
+
+// Number of instances for which a membership change is deferred before it
+// reassigns ownership.
+#define MENCIUS_LAG   64
+
+/**
+ * mencius_assign - Assign the instances from a given instance onward to the
+ * current acceptors, dropping any assignments which are no longer needed.
+ */
+static void
+mencius_assign(paxid_t from)
+{
+  unsigned i = 0;
+  struct paxos_slots *slots, *it;
+  struct paxos_acceptor *acc;
+
+  slots = g_malloc0(sizeof(*slots));
+  slots->ps_from = from;
+  slots->ps_count = LIST_COUNT(&pax->alist);
+  slots->ps_owners = g_new(paxid_t, slots->ps_count);
+
+  // The alist is kept in rank order.
+  LIST_FOREACH(acc, &pax->alist, pa_le) {
+    slots->ps_owners[i++] = acc->pa_paxid;
+  }
+
+  LIST_INSERT_HEAD(&pax->slots, slots, ps_le);
+
+  // We never need to know the owners of instances we have learned, so once
+  // an assignment covers our hole, everything older can go.
+  LIST_FOREACH(it, &pax->slots, ps_le) {
+    if (it->ps_from <= pax->ihole) {
+      break;
+    }
+  }
+  if (it == (void *)&pax->slots) {
+    return;
+  }
+  while (LIST_NEXT(it, ps_le) != (void *)&pax->slots) {
+    slots = LIST_NEXT(it, ps_le);
+    LIST_REMOVE(&pax->slots, slots, ps_le);
+    g_free(slots->ps_owners);
+    g_free(slots);
+  }
+}
+
+/**
+ * mencius_init - Start a session of our own with all its instances ours.
+ */
+void
+mencius_init()
+{
+  mencius_assign(pax->ihole);
+  pax->mfence = pax->ihole - 1;
+  pax->marmed = true;
+}
+
+/**
+ * mencius_join - Set up ownership upon being welcomed into a session.
+ *
+ * Our acceptor list reflects the last membership change among the instances
+ * we were given, so its assignment takes effect after that change as usual.
+ * We know nothing of any earlier assignments, but none of those instances
+ * are ours, and we take their owners' decrees on trust.
+ *
+ * Everything before our hole was recovered before it was decreed, so we can
+ * take decrees in any instance past it.
+ */
+void
+mencius_join()
+{
+  paxid_t inum, last;
+  struct paxos_instance *inst;
+
+  // Our own join is the earliest change we might find; if the log has been
+  // truncated past it, assume that the change was just before the base.
+  last = MAX(pax->self_id, RING_BASE(&pax->ilist) - 1);
+
+  for (inum = last + 1; inum < pax->ihole; ++inum) {
+    inst = instance_find(&pax->ilist, inum);
+    if (inst != NULL && (inst->pi_val.pv_dkind == DEC_JOIN ||
+        inst->pi_val.pv_dkind == DEC_PART ||
+        inst->pi_val.pv_dkind == DEC_KILL)) {
+      last = inum;
+    }
+  }
+
+  mencius_assign(last + MENCIUS_LAG);
+  pax->mfence = pax->ihole - 1;
+  pax->marmed = true;
+}
+
+/**
+ * mencius_reslot - Reassign ownership after learning a membership change in
+ * instance inum.
+ */
+void
+mencius_reslot(paxid_t inum)
+{
+  if (pax->mencius) {
+    mencius_assign(inum + MENCIUS_LAG);
+  }
+}
+
+/**
+ * mencius_owner - Get the ID of the owner of an instance, or 0 if we don't
+ * know it.
+ */
+paxid_t
+mencius_owner(paxid_t inum)
+{
+  struct paxos_slots *it;
+
+  LIST_FOREACH(it, &pax->slots, ps_le) {
+    if (it->ps_from <= inum) {
+      return it->ps_owners[(inum - it->ps_from) % it->ps_count];
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * mencius_next - Get the first instance we own and have yet to decree, or 0
+ * if we may not decree yet.
+ */
+paxid_t
+mencius_next()
+{
+  paxid_t inum;
+
+  if (!pax->marmed) {
+    return 0;
+  }
+
+  inum = MAX(pax->mnext, MAX(pax->ihole, pax->mfence + 1));
+  for (; inum < pax->ihole + MENCIUS_LAG; ++inum) {
+    if (mencius_owner(inum) == pax->self_id) {
+      pax->mnext = inum;
+      return inum;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * mencius_decrees - Check whether we should decree a request of the given
+ * kind ourselves.
+ *
+ * We decree our own chats if we have an instance for them, or if earlier
+ * chats are already waiting for one.  Once we have sent a chat to the
+ * proposer, we keep doing so until it has been learned, so that our chats
+ * are learned in the order we sent them.
+ */
+bool
+mencius_decrees(dkind_t dkind)
+{
+  if (!pax->mencius || dkind != DEC_CHAT || pax->mrouted != 0) {
+    return false;
+  }
+
+  return !LIST_EMPTY(&pax->idefer) || next_instance() != 0;
+}
+
+/**
+ * mencius_accepts - Check whether a decree made under a ballot other than
+ * ours comes from the owner of its instance, and whether we may accept it.
+ */
+bool
+mencius_accepts(struct paxos_header *hdr)
+{
+  paxid_t owner;
+
+  if (!pax->mencius || !pax->marmed) {
+    return false;
+  }
+
+  // Owners decree only under the generation of the ballot we promised, and
+  // only beyond the instances its proposer recovered.
+  if (hdr->ph_ballot.gen != pax->ballot.gen || hdr->ph_inum <= pax->mfence) {
+    return false;
+  }
+
+  owner = mencius_owner(hdr->ph_inum);
+  return owner == 0 || owner == hdr->ph_ballot.id;
+}
+
+/**
+ * mencius_null - Make a null decree with which to skip an instance.
+ */
+static struct paxos_instance *
+mencius_null()
+{
+  struct paxos_instance *inst;
+
+  inst = instance_new();
+  inst->pi_val.pv_dkind = DEC_NULL;
+  inst->pi_val.pv_reqid.id = pax->self_id;
+  inst->pi_val.pv_reqid.gen = (++pax->req_id);
+
+  return inst;
+}
+
+/**
+ * mencius_resume - Decree whatever we can in our own instances.
+ *
+ * We first decree anything we deferred for want of an instance, then skip
+ * any of our instances which others have already passed.  As proposer, we
+ * also fill in instances left behind by departed owners.
+ */
+int
+mencius_resume()
+{
+  int r;
+  paxid_t inum, owner;
+  struct paxos_instance *inst;
+
+  // Decree everything we've been holding, in order.
+  LIST_WHILE_FIRST(inst, &pax->idefer) {
+    if (next_instance() == 0) {
+      return 0;
+    }
+    LIST_REMOVE(&pax->idefer, inst, pi_le);
+    ERR_RET(r, proposer_decree(inst));
+  }
+
+  // Rather than skip an instance while chats wait in a batch, put the batch
+  // in it.
+  inum = next_instance();
+  if (inum != 0 && inum < pax->mseen && pax->batch != NULL) {
+    ERR_RET(r, proposer_batch_flush());
+  }
+
+  // Skip our instances which others have passed.
+  while ((inum = next_instance()) != 0 && inum < pax->mseen) {
+    ERR_RET(r, proposer_decree(mencius_null()));
+  }
+
+  if (!is_proposer() || !pax->marmed) {
+    return 0;
+  }
+
+  // Fill in for owners who have left.  We prepared after each of them left,
+  // so anything they decreed beyond the fence was never chosen, and nobody
+  // will accept anything more from them.
+  for (inum = MAX(pax->ihole, pax->mfence + 1);
+      inum < pax->mseen && inum < pax->ihole + MENCIUS_LAG; ++inum) {
+    owner = mencius_owner(inum);
+    if (owner == 0 || acceptor_find(&pax->alist, owner) != NULL) {
+      continue;
+    }
+
+    inst = instance_find(&pax->ilist, inum);
+    if (inst != NULL) {
+      if (inst->pi_committed ||
+          ballot_compare(inst->pi_hdr.ph_ballot, pax->ballot) == 0) {
+        continue;
+      }
+      instance_remove(&pax->ilist, inst);
+      instance_destroy(inst);
+    }
+
+    ERR_RET(r, proposer_decree_at(mencius_null(), inum));
+  }
+
+  return 0;
+}
+
+/**
+ * mencius_idle - GEvent-friendly wrapper around mencius_resume, run once per
+ * main loop iteration after we've seen others' decrees.
+ */
+static int
+mencius_idle(void *data)
+{
+  // Set the session.  We parametrize the source with a pointer to a session
+  // ID when we add it to the main event loop.
+  pax = session_find(state.sessions, (pax_uuid_t *)data);
+
+  if (pax != NULL) {
+    // The source is removed when we return.
+    pax->mskip_source = 0;
+    mencius_resume();
+  }
+
+  return FALSE;
+}
+
+/**
+ * mencius_observe - Note that instances up through inum have been taken, so
+ * that we skip any of ours below it once this pass of the main loop is done.
+ */
+void
+mencius_observe(paxid_t inum)
+{
+  pax_uuid_t *uuid;
+
+  if (!pax->mencius) {
+    return;
+  }
+
+  pax->mseen = MAX(pax->mseen, inum);
+
+  // We use default priority so that a steady stream of decrees can't keep
+  // us from skipping, and hence everyone from learning.
+  if (pax->mskip_source == 0) {
+    uuid = g_malloc0(sizeof(*uuid));
+    *uuid = *pax->session_id;
+    pax->mskip_source = g_idle_add_full(G_PRIORITY_DEFAULT, mencius_idle,
+        uuid, g_free);
+  }
+}
+
+/**
+ * mencius_reclaim - Decree one of our chats again if the value we decreed
+ * for it is about to be replaced.
+ *
+ * If an instance we decreed takes on a different value, ours was never
+ * chosen, so we must find it another instance.
+ */
+int
+mencius_reclaim(struct paxos_instance *inst, struct paxos_value *val)
+{
+  struct paxos_instance *copy;
+
+  if (!pax->mencius || inst->pi_committed ||
+      inst->pi_hdr.ph_ballot.id != pax->self_id ||
+      ppair_compare(inst->pi_val.pv_reqid, val->pv_reqid) == 0) {
+    return 0;
+  }
+
+  // Skips and membership changes need not be reclaimed.
+  if (inst->pi_val.pv_dkind != DEC_CHAT &&
+      inst->pi_val.pv_dkind != DEC_BATCH) {
+    return 0;
+  }
+
+  // Hand the value off to a new instance.
+  copy = instance_new();
+  memcpy(&copy->pi_val, &inst->pi_val, sizeof(inst->pi_val));
+  copy->pi_batch = inst->pi_batch;
+  inst->pi_batch = NULL;
+
+  return proposer_decree(copy);
+}
+
+/**
+ * mencius_part - Recover the instances of an acceptor which has left, so
+ * that we can fill them in.
+ *
+ * If we are already preparing, the acceptor may have promised our ballot
+ * before it left and decreed under it, so we must prepare once more.
+ */
+int
+mencius_part()
+{
+  if (pax->prep != NULL) {
+    pax->mreprep = true;
+    return 0;
+  }
+
+  return proposer_prepare(NULL);
+}
+
+/**
+ * proposer_fence - Let the owners resume decreeing past the instances
+ * recovered by our prepare.
+ */
+int
+proposer_fence(paxid_t fence)
+{
+  int r;
+  struct paxos_header hdr;
+  struct yakyak yy;
+
+  if (pax->mreprep) {
+    pax->mreprep = false;
+    return proposer_prepare(NULL);
+  }
+
+  pax->mfence = fence;
+  pax->marmed = true;
+
+  // Pack and broadcast the fence.
+  header_init(&hdr, OP_FENCE, fence);
+
+  yakyak_init(&yy, 1);
+  paxos_header_pack(&yy, &hdr);
+  r = paxos_broadcast(&yy);
+  yakyak_destroy(&yy);
+  if (r) {
+    return r;
+  }
+
+  return mencius_resume();
+}
+
+/**
+ * acceptor_ack_fence - Resume taking decrees from owners.
+ */
+int
+acceptor_ack_fence(struct paxos_header *hdr)
+{
+  // The fence only concerns the ballot it was made for, which should be the
+  // one we have most recently promised.
+  if (ballot_compare(hdr->ph_ballot, pax->ballot) != 0) {
+    return 0;
+  }
+
+  pax->mfence = hdr->ph_inum;
+  pax->marmed = true;
+
+  return mencius_resume();
+}
@@ -83,14 +83,19 @@ proposer_prepare(struct paxos_acceptor *old_proposer)
   pax->prep->pp_ballot.id = pax->self_id;
   pax->prep->pp_ballot.gen = ++pax->gen_high;
 
+  // Make sure we never prepare the same ballot twice.
+  ERR_RET(r, wal_ballot());
+  ERR_RET(r, wal_sync());
+
+  // Our own promise counts toward the prepare, so like any other acceptor,
+  // we stop taking decrees from owners until we've fenced off the recovery.
+  pax->marmed = false;
+
   // Initialize our counters.  Our only initial acceptor is ourselves, and no
   // one initially redirects.
   pax->prep->pp_acks = 1;
   pax->prep->pp_redirects = 0;
 
-  // Cache the current istart.
-  pax->prep->pp_istart = pax->istart;
-
   // If we aren't repreparing (in which case we pass in old_proposer as NULL),
   // we should queue up deferred parts or kills for every dropped acceptor we
   // have in our list.  We force kills for all the acceptors ranked higher
@@ -123,6 +128,7 @@ proposer_prepare(struct paxos_acceptor *old_proposer)
   hdr.ph_ballot.gen = pax->prep->pp_ballot.gen;
   hdr.ph_opcode = OP_PREPARE;
   hdr.ph_inum = pax->ihole;
+  hdr.ph_commit = 0;
 
   // Pack and broadcast the prepare.
   yakyak_init(&yy, 1);
@@ -133,27 +139,6 @@ proposer_prepare(struct paxos_acceptor *old_proposer)
   return r;
 }
 
-/**
- * Helper routine to obtain the instance on ilist with the closest instance
- * number <= inum.  We are passed in an iterator to simulate a continuation.
- */
-static struct paxos_instance *
-get_instance_glb(struct paxos_instance *it, instance_container *ilist,
-    paxid_t inum)
-{
-  struct paxos_instance *prev;
-
-  prev = NULL;
-  for (; it != (void *)ilist; it = LIST_NEXT(it, pi_le)) {
-    if (it->pi_hdr.ph_inum > inum) {
-      break;
-    }
-    prev = it;
-  }
-
-  return prev;
-}
-
 /**
  * proposer_ack_promise - Acknowledge an acceptor's promise.
  *
@@ -190,20 +175,24 @@ proposer_ack_promise(struct paxos_header *hdr, msgpack_object *o)
   // Initialize loop variables.
   p = o->via.array.ptr;
   pend = o->via.array.ptr + o->via.array.size;
-  it = pax->prep->pp_istart;
 
-  // Loop through all the vote information.  Note that we assume the votes
-  // are sorted by instance number.
+  // Loop through all the vote information.
   inst = NULL;
   for (; p != pend; ++p) {
-    // Allocate an instance if necessary and unpack into it.  Note that if
-    // paxos_instance contained any pointers which required deallocation,
-    // we would need to destroy it each iteration.
+    // Allocate an instance if necessary and unpack into it.  Unpacking
+    // replaces any batch members left over from the previous iteration, so
+    // the scratch instance can be reused as is.
     if (inst == NULL) {
-      inst = g_malloc0(sizeof(*inst));
+      inst = instance_new();
     }
     paxos_instance_unpack(inst, p);
 
+    // We have already committed and learned everything below our hole, so
+    // we can skip any votes for those instances.
+    if (inst->pi_hdr.ph_inum < pax->ihole) {
+      continue;
+    }
+
     // Mark everything uncommitted.  We don't care whether any acceptors
     // have already committed; we can safely ask them to recommit without
     // violating correctness.
@@ -211,21 +200,12 @@ proposer_ack_promise(struct paxos_header *hdr, msgpack_object *o)
     inst->pi_cached = false;
     inst->pi_learned = false;
 
-    // Get the closest instance with lesser or equal instance number.  After
-    // starting Paxos, our instance list is guaranteed to always be nonempty,
-    // so this should always return a valid instance (so long as we don't
-    // pass an iterator which already has a higher inum).
-    it = get_instance_glb(it, &pax->ilist, inst->pi_hdr.ph_inum);
-    assert(it != NULL);
+    // See if we have an instance of the same number.
+    it = instance_find(&pax->ilist, inst->pi_hdr.ph_inum);
 
-    if (it->pi_hdr.ph_inum < inst->pi_hdr.ph_inum) {
-      // The closest instance is strictly lower in number, so insert after.
-      LIST_INSERT_AFTER(&pax->ilist, it, inst, pi_le);
-
-      // Update pax->istart if we just instantiated our hole.
-      if (inst->pi_hdr.ph_inum == pax->ihole) {
-        pax->istart = inst;
-      }
+    if (it == NULL) {
+      // We have not seen this instance, so just insert it.
+      instance_insert(&pax->ilist, inst);
 
       // We need to allocate a new scratch instance in the next iteration.
       inst = NULL;
@@ -236,13 +216,18 @@ proposer_ack_promise(struct paxos_header *hdr, msgpack_object *o)
       if (!it->pi_committed &&
           ballot_compare(inst->pi_hdr.ph_ballot, it->pi_hdr.ph_ballot) > 0) {
         // Perform the switch; reuse the old allocation in the next iteration.
-        LIST_INSERT_AFTER(&pax->ilist, it, inst, pi_le);
-        LIST_REMOVE(&pax->ilist, it, pi_le);
+        instance_remove(&pax->ilist, it);
+        instance_insert(&pax->ilist, inst);
         swap((void **)&inst, (void **)&it);
       }
     }
   }
 
+  // Free our leftover scratch instance.
+  if (inst != NULL) {
+    instance_destroy(inst);
+  }
+
   // Acknowledge the promise.
   pax->prep->pp_acks++;
 
@@ -254,26 +239,21 @@ proposer_ack_promise(struct paxos_header *hdr, msgpack_object *o)
   // Set our ballot to the prepare ballot.
   pax->ballot.id = pax->prep->pp_ballot.id;
   pax->ballot.gen = pax->prep->pp_ballot.gen;
+  ERR_RET(r, wal_ballot());
 
   // For each Paxos instance for which we don't have a commit, send a decree.
-  for (it = pax->prep->pp_istart, inum = pax->ihole; ; ++inum) {
-    // Get the closest instance with number <= inum.
-    it = get_instance_glb(it, &pax->ilist, inum);
-    assert(it != NULL);
+  // We stop after the last instance number seen by a quorum of the entire
+  // Paxos system.
+  for (inum = pax->ihole; inum < RING_END(&pax->ilist); ++inum) {
+    it = instance_find(&pax->ilist, inum);
 
     // Do not redecree by default.
     inst = NULL;
 
-    if (it->pi_hdr.ph_inum < inum) {
-      // If inum is strictly past the last instance number seen by a quorum
-      // of the entire Paxos system, we're done.
-      if (it == LIST_LAST(&pax->ilist)) {
-        break;
-      }
-
+    if (it == NULL) {
       // Nobody in the quorum (including ourselves) has heard of this instance,
       // so make a null decree.
-      inst = g_malloc0(sizeof(*inst));
+      inst = instance_new();
 
       inst->pi_hdr.ph_inum = inum;
 
@@ -281,12 +261,7 @@ proposer_ack_promise(struct paxos_header *hdr, msgpack_object *o)
       inst->pi_val.pv_reqid.id = pax->self_id;
       inst->pi_val.pv_reqid.gen = (++pax->req_id);
 
-      LIST_INSERT_AFTER(&pax->ilist, it, inst, pi_le);
-
-      // Update pax->istart if we just instantiated our hole.
-      if (inst->pi_hdr.ph_inum == pax->ihole) {
-        pax->istart = inst;
-      }
+      instance_insert(&pax->ilist, inst);
     } else if (!it->pi_committed) {
       // The quorum has seen this instance before, but we have not committed
       // it.  By the first part of ack_promise, the vote we have here is the
@@ -299,7 +274,8 @@ proposer_ack_promise(struct paxos_header *hdr, msgpack_object *o)
       header_init(&inst->pi_hdr, OP_DECREE, inst->pi_hdr.ph_inum);
       instance_init_metadata(inst);
 
-      // Pack and broadcast the decree.
+      // Log our own vote, and pack and broadcast the decree.
+      ERR_RET(r, wal_instance(inst));
       ERR_RET(r, paxos_broadcast_instance(inst));
     }
   }
@@ -308,6 +284,12 @@ proposer_ack_promise(struct paxos_header *hdr, msgpack_object *o)
   g_free(pax->prep);
   pax->prep = NULL;
 
+  // If acceptors own instances, they may resume decreeing in them past our
+  // recovery, and we decree whatever we deferred in our own.
+  if (pax->mencius) {
+    return proposer_fence(inum - 1);
+  }
+
   // Decree ALL the deferred things!  This includes decreeing parts for any
   // dropped acceptors, in particular the old proposer.
   LIST_WHILE_FIRST(inst, &pax->idefer) {
@@ -323,23 +305,63 @@ proposer_ack_promise(struct paxos_header *hdr, msgpack_object *o)
  *
  * This function should be called with a paxos_instance struct that has a
  * well-defined value; however, the remaining fields will be rewritten.
+ *
+ * If acceptors own instances and we have none free, we hold onto the decree
+ * until we do; see mencius_resume().
  */
 int
 proposer_decree(struct paxos_instance *inst)
+{
+  paxid_t inum;
+
+  inum = next_instance();
+  if (inum == 0) {
+    LIST_INSERT_TAIL(&pax->idefer, inst, pi_le);
+    return 0;
+  }
+  pax->mnext = inum + 1;
+
+  return proposer_decree_at(inst, inum);
+}
+
+/**
+ * proposer_decree_at - Broadcast a decree for a given instance.
+ */
+int
+proposer_decree_at(struct paxos_instance *inst, paxid_t inum)
 {
   int r;
 
-  // Update the header.
-  header_init(&inst->pi_hdr, OP_DECREE, next_instance());
+  // Update the header.  We decree under our own ID, which differs from that
+  // of the ballot only when we decree in our own instances as an owner.
+  header_init(&inst->pi_hdr, OP_DECREE, inum);
+  inst->pi_hdr.ph_ballot.id = pax->self_id;
 
   // Zero out the metadata and mark one vote.
   instance_init_metadata(inst);
 
-  // Insert into the ilist, updating istart.
-  instance_insert_and_upstart(inst);
-
-  // Pack and broadcast the decree.
-  ERR_RET(r, paxos_broadcast_instance(inst));
+  // Insert into the ilist, and log our own vote.
+  instance_insert(&pax->ilist, inst);
+  ERR_RET(r, wal_instance(inst));
+
+  // Pack and send the decree, letting the acceptors know how far we have
+  // committed.  Owners' commits are all sent explicitly, so there's no
+  // watermark to give if acceptors own instances.  If we only send to a
+  // quorum, the rest never see the watermark, so we leave bringing them up
+  // to date to the idle commit.
+  if (!pax->mencius) {
+    inst->pi_hdr.ph_commit = pax->ihole - 1;
+  }
+  if (thrifty_decrees(inst->pi_val.pv_dkind)) {
+    r = thrifty_decree(inst);
+  } else {
+    pax->cmark = MAX(pax->cmark, inst->pi_hdr.ph_commit);
+    r = paxos_broadcast_instance(inst);
+  }
+  inst->pi_hdr.ph_commit = 0;
+  if (r) {
+    return r;
+  }
 
   // Do we constitute a majority ourselves?  If so, commit!
   if (inst->pi_votes >= majority()) {
@@ -350,26 +372,23 @@ proposer_decree(struct paxos_instance *inst)
 }
 
 /**
- * proposer_ack_accept - Acknowledge an acceptor's accept.
- *
- * Just increment the vote count of the appropriate Paxos instance and commit
+ * proposer_credit_vote - Credit an acceptor's vote to an instance and commit
  * if we have a majority.
  */
-int
-proposer_ack_accept(struct paxos_header *hdr)
+static int
+proposer_credit_vote(paxid_t inum)
 {
   struct paxos_instance *inst;
 
-  // If we successfully prepared, we retain the proposership and the ballot
-  // we prepared until we leave the system.  Thus, it should not be possible
-  // for the ballot not to match here.
-  assert(ballot_compare(hdr->ph_ballot, pax->ballot) == 0);
+  // Find the decree of the correct instance.  Late votes may arrive for
+  // instances which have since been committed and truncated; ignore them.
+  inst = instance_find(&pax->ilist, inum);
+  if (inst == NULL) {
+    return 0;
+  }
 
-  // Find the decree of the correct instance and increment the vote count.
-  inst = instance_find(&pax->ilist, hdr->ph_inum);
+  // Increment the vote count, but ignore the vote if we've already committed.
   inst->pi_votes++;
-
-  // Ignore the vote if we've already committed.
   if (inst->pi_committed) {
     return 0;
   }
@@ -383,22 +402,169 @@ proposer_ack_accept(struct paxos_header *hdr)
 }
 
 /**
- * proposer_commit - Broadcast a commit message for a given Paxos instance.
+ * proposer_ack_accept - Acknowledge an acceptor's accept.
+ *
+ * Just increment the vote count of the appropriate Paxos instance and commit
+ * if we have a majority.  If acceptors own instances, we also collect the
+ * votes for our own decrees as an owner this way, proposer or not.
+ */
+int
+proposer_ack_accept(struct paxos_peer *source, struct paxos_header *hdr)
+{
+  // If we successfully prepared, we retain the proposership and the ballot
+  // we prepared until we leave the system.  Acceptors hold on to accepts
+  // briefly before sending them, however, so we may receive a few which
+  // were meant for the proposer we replaced, or for our own decrees under
+  // an earlier ballot; ignore them.
+  if (hdr->ph_ballot.id != pax->self_id ||
+      hdr->ph_ballot.gen != pax->ballot.gen) {
+    return 0;
+  }
+
+  thrifty_sample(source, hdr->ph_inum);
+  return proposer_credit_vote(hdr->ph_inum);
+}
+
+/**
+ * proposer_ack_accepts - Acknowledge an acceptor's accepts for a range of
+ * consecutive instances.
+ *
+ * The header identifies the first instance of the range, and the payload is
+ * the number of the last.
+ */
+int
+proposer_ack_accepts(struct paxos_peer *source, struct paxos_header *hdr,
+    msgpack_object *o)
+{
+  int r;
+  paxid_t inum, last;
+
+  // Ignore stale accepts as above.
+  if (hdr->ph_ballot.id != pax->self_id ||
+      hdr->ph_ballot.gen != pax->ballot.gen) {
+    return 0;
+  }
+
+  paxos_paxid_unpack(&last, o);
+  thrifty_sample(source, last);
+
+  // Credit the votes in order, so that commits also go out in order.
+  for (inum = hdr->ph_inum; inum <= last; ++inum) {
+    ERR_RET(r, proposer_credit_vote(inum));
+  }
+
+  return 0;
+}
+
+/**
+ * proposer_commit_idle - GEvent-friendly wrapper around proposer_commit_flush,
+ * run when the main loop has nothing else to do.
+ */
+static int
+proposer_commit_idle(void *data)
+{
+  // Set the session.  We parametrize the source with a pointer to a session
+  // ID when we add it to the main event loop.
+  pax = session_find(state.sessions, (pax_uuid_t *)data);
+
+  if (pax != NULL) {
+    // The source is removed when we return.
+    pax->cmark_source = 0;
+    if (is_proposer()) {
+      proposer_commit_flush();
+    }
+  }
+
+  return FALSE;
+}
+
+/**
+ * proposer_commit - Commit a value for a given Paxos instance.
  *
  * This should only be called when we receive a majority vote for a decree.
- * We broadcast a commit message and mark the instance committed.
+ * We mark the instance committed and learn it ourselves.
+ *
+ * Decrees which change the membership of the system, as well as all decrees
+ * if acceptors own instances, are committed with an explicit broadcast right
+ * away.  Other commits are instead carried to the acceptors by the commit
+ * watermark of our subsequent decrees; once we go idle, we send a standalone
+ * commit to bring everyone up to date.  Acceptors who never received a
+ * decree we sent only to a quorum get an explicit commit instead.
  */
 int
 proposer_commit(struct paxos_instance *inst)
 {
   int r;
+  pax_uuid_t *uuid;
+
+  // Our own vote must be on disk before anyone learns of the commit.
+  ERR_RET(r, wal_sync());
 
   // Modify the instance header.
   inst->pi_hdr.ph_opcode = OP_COMMIT;
 
-  // Pack and broadcast the commit.
-  ERR_RET(r, paxos_broadcast_instance(inst));
+  if (pax->mencius || commit_needs_sent(inst->pi_val.pv_dkind)) {
+    // Make sure the acceptors have heard about everything before this commit
+    // first, so that they don't go asking for retries.
+    ERR_RET(r, proposer_commit_flush());
+
+    // Pack and broadcast the commit.
+    ERR_RET(r, paxos_broadcast_instance(inst));
+  } else {
+    if (inst->pi_thrifty) {
+      ERR_RET(r, thrifty_commit(inst));
+    }
+
+    if (pax->cmark_source == 0) {
+      uuid = g_malloc0(sizeof(*uuid));
+      *uuid = *pax->session_id;
+      pax->cmark_source = g_idle_add_full(G_PRIORITY_DEFAULT_IDLE,
+          proposer_commit_idle, uuid, g_free);
+    }
+  }
+  inst->pi_thrifty = false;
 
   // Commit and learn the value ourselves.
   return paxos_commit(inst);
 }
+
+/**
+ * proposer_commit_flush - Bring the acceptors' commits up to our own.
+ *
+ * We broadcast a standalone commit of our last contiguous learn, carrying it
+ * as the commit watermark.  Acceptors which are missing any of the values
+ * will retry them.
+ */
+int
+proposer_commit_flush()
+{
+  int r;
+  struct paxos_header hdr;
+  struct paxos_instance *inst;
+  struct yakyak yy;
+
+  // If we've told everyone about all our learns, there is nothing to do.
+  // Nor is there if acceptors own instances, since every commit is sent.
+  if (pax->mencius || pax->ihole - 1 <= pax->cmark) {
+    return 0;
+  }
+  pax->cmark = pax->ihole - 1;
+
+  // If the instance has been truncated, everyone has learned it already.
+  inst = instance_find(&pax->ilist, pax->cmark);
+  if (inst == NULL) {
+    return 0;
+  }
+
+  // The value was chosen, so we can vouch for it under our own ballot.
+  header_init(&hdr, OP_COMMIT, pax->cmark);
+  hdr.ph_commit = pax->cmark;
+
+  yakyak_init(&yy, 2);
+  paxos_header_pack(&yy, &hdr);
+  paxos_value_pack_batch(&yy, &inst->pi_val, inst->pi_batch);
+  r = paxos_broadcast(&yy);
+  yakyak_destroy(&yy);
+
+  return r;
+}
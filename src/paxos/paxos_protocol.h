@@ -20,22 +20,59 @@ int paxos_learn(struct paxos_instance *, struct paxos_request *);
 int proposer_prepare(struct paxos_acceptor *);
 int proposer_ack_promise(struct paxos_header *, msgpack_object *);
 int proposer_decree(struct paxos_instance *);
-int proposer_ack_accept(struct paxos_header *);
+int proposer_decree_at(struct paxos_instance *, paxid_t);
+int proposer_ack_accept(struct paxos_peer *, struct paxos_header *);
+int proposer_ack_accepts(struct paxos_peer *, struct paxos_header *,
+    msgpack_object *);
 int proposer_commit(struct paxos_instance *);
+int proposer_commit_flush(void);
+int proposer_batch_flush(void);
 
 /* Acceptor operations. */
 int acceptor_ack_prepare(struct paxos_peer *, struct paxos_header *);
 int acceptor_promise(struct paxos_header *);
 int acceptor_ack_decree(struct paxos_header *, msgpack_object *);
 int acceptor_accept(struct paxos_header *);
+int acceptor_accept_flush(void);
 int acceptor_ack_commit(struct paxos_header *, msgpack_object *);
+int acceptor_ack_commit_mark(struct paxos_header *, paxid_t, int);
+
+/* Instance ownership protocol. */
+void mencius_init(void);
+void mencius_join(void);
+void mencius_reslot(paxid_t);
+paxid_t mencius_owner(paxid_t);
+paxid_t mencius_next(void);
+bool mencius_decrees(dkind_t);
+bool mencius_accepts(struct paxos_header *);
+int mencius_resume(void);
+void mencius_observe(paxid_t);
+int mencius_reclaim(struct paxos_instance *, struct paxos_value *);
+int mencius_part(void);
+int proposer_fence(paxid_t);
+int acceptor_ack_fence(struct paxos_header *);
+
+/* Quorum-only decrees. */
+bool thrifty_decrees(dkind_t);
+int thrifty_decree(struct paxos_instance *);
+int thrifty_commit(struct paxos_instance *);
+void thrifty_sample(struct paxos_peer *, paxid_t);
+
+/* Learned-state snapshots. */
+void snapshot_mark(reqid_t);
+void snapshot_chat(struct paxos_request *, struct paxos_acceptor *);
+void snapshot_pack(struct yakyak *);
+paxid_t snapshot_unpack(msgpack_object *);
 
 /* Participant initiation protocol. */
 int proposer_welcome(struct paxos_acceptor *);
 int acceptor_ack_welcome(struct paxos_peer *, struct paxos_header *,
     msgpack_object *);
+int acceptor_ack_history(struct paxos_header *, msgpack_object *);
 int paxos_hello(struct paxos_acceptor *);
 int paxos_ack_hello(struct paxos_peer *, struct paxos_header *);
+int paxos_catchup(struct paxos_acceptor *);
+int acceptor_ack_catchup(struct paxos_header *, msgpack_object *);
 
 /* Out-of-band request protocol. */
 int proposer_ack_request(struct paxos_header *, msgpack_object *);
@@ -44,8 +81,9 @@ int acceptor_ack_request(struct paxos_peer *, struct paxos_header *,
 int paxos_retrieve(struct paxos_instance *);
 int paxos_ack_retrieve(struct paxos_header *, msgpack_object *);
 int paxos_resend(struct paxos_acceptor *, struct paxos_header *,
-    struct paxos_request *);
+    struct paxos_request **, unsigned, bool);
 int paxos_ack_resend(struct paxos_header *, msgpack_object *);
+void request_unpack_cache(msgpack_object *);
 
 /* Reconnect protocol. */
 int acceptor_redirect(struct paxos_peer *, struct paxos_header *);
@@ -57,18 +95,37 @@ int acceptor_reject(struct paxos_header *);
 int proposer_ack_reject(struct paxos_header *);
 
 /* Retry protocol. */
-int acceptor_retry(paxid_t);
-int proposer_ack_retry(struct paxos_header *);
-int proposer_recommit(struct paxos_header *, struct paxos_instance *);
+int acceptor_retry(paxid_t, paxid_t);
+int acceptor_hole(paxid_t);
+void acceptor_hole_check(void);
+int paxos_ack_retry(struct paxos_peer *, struct paxos_header *,
+    msgpack_object *);
+int paxos_recommit(struct paxos_acceptor *, paxid_t, paxid_t);
 int acceptor_ack_recommit(struct paxos_header *, msgpack_object *);
 
 /* Log sync protocol. */
+void sync_start(void);
+void sync_check(void);
 int proposer_sync(void);
 int acceptor_ack_sync(struct paxos_header *);
 int acceptor_last(struct paxos_header *);
 int proposer_ack_last(struct paxos_header *, msgpack_object *);
 int proposer_truncate(struct paxos_header *);
 int acceptor_ack_truncate(struct paxos_header *, msgpack_object *);
+void ilist_truncate_prefix(instance_container *, paxid_t);
+
+/* Write-ahead log. */
+int wal_sync(void);
+int wal_ballot(void);
+int wal_instance(struct paxos_instance *);
+int wal_checkpoint(void);
+int wal_truncate(void);
+void wal_remove(void);
+int wal_recover(void);
+
+/* Chat history. */
+void history_append(paxid_t, const void *, size_t, const void *, size_t);
+void history_remove(void);
 
 /* Connection establishment continuations. */
 int continue_welcome(GIOChannel *, void *);
@@ -162,7 +162,7 @@ do_continue_ack_redirect(GIOChannel *chan, struct paxos_acceptor *acc,
   pax->prep = NULL;
 
   // Register the reconnection; on failure, reprepare.
-  acc->pa_peer = paxos_peer_init(chan);
+  acceptor_set_peer(acc, paxos_peer_init(chan));
   if (acc->pa_peer != NULL) {
     // Account for a new acceptor.
     pax->live_count++;
@@ -176,7 +176,9 @@ do_continue_ack_redirect(GIOChannel *chan, struct paxos_acceptor *acc,
     // Destroy the defer list; we're finished trying to prepare.
     // XXX: Do we want to somehow pass it to the real proposer?  How do we
     // know which requests were made for us?
-    instance_container_destroy(&pax->idefer);
+    instance_list_destroy(&pax->idefer);
+    batch_destroy(pax->batch);
+    pax->batch = NULL;
 
     // Say hello.
     return paxos_hello(acc);
@@ -291,7 +293,7 @@ do_continue_ack_refuse(GIOChannel *chan, struct paxos_acceptor *acc,
   }
 
   // Register the reconnection.
-  acc->pa_peer = paxos_peer_init(chan);
+  acceptor_set_peer(acc, paxos_peer_init(chan));
   if (acc->pa_peer != NULL) {
     // Account for a new acceptor.
     pax->live_count++;
@@ -303,7 +305,9 @@ do_continue_ack_refuse(GIOChannel *chan, struct paxos_acceptor *acc,
     // out about the drop and then reprepare.
     g_free(pax->prep);
     pax->prep = NULL;
-    instance_container_destroy(&pax->idefer);
+    instance_list_destroy(&pax->idefer);
+    batch_destroy(pax->batch);
+    pax->batch = NULL;
 
     // Say hello.
     ERR_ACCUM(r, paxos_hello(acc));
@@ -442,7 +446,7 @@ do_continue_ack_reject(GIOChannel *chan, struct paxos_acceptor *acc,
     return 0;
   }
 
-  acc->pa_peer = paxos_peer_init(chan);
+  acceptor_set_peer(acc, paxos_peer_init(chan));
   if (acc->pa_peer != NULL) {
     // Account for a new live connection.
     pax->live_count++;
@@ -458,6 +462,7 @@ do_continue_ack_reject(GIOChannel *chan, struct paxos_acceptor *acc,
 
   // Reset the instance metadata, marking one vote.
   instance_init_metadata(inst);
+  ERR_RET(r, wal_instance(inst));
 
   // Decree null if the reconnect succeeded, else redecree the part.
   return paxos_broadcast_instance(inst);
@@ -16,19 +16,16 @@
 #include "util/paxos_io.h"
 #include "util/paxos_print.h"
 
+#define RETRIEVE_MAX    256             // most requests asked for at once
+#define RESEND_BYTES    (256 * 1024)    // request bytes per resend, roughly
+
 /**
- * proposer_decree_request - Helper function for proposers to decree requests.
+ * proposer_decree_instance - Send a decree for a new instance if we're not
+ * preparing; if we are, defer it.
  */
 static int
-proposer_decree_request(struct paxos_request *req)
+proposer_decree_instance(struct paxos_instance *inst)
 {
-  struct paxos_instance *inst;
-
-  // Allocate an instance and copy in the value from the request.
-  inst = g_malloc0(sizeof(*inst));
-  memcpy(&inst->pi_val, &req->pr_val, sizeof(req->pr_val));
-
-  // Send a decree if we're not preparing; if we are, defer it.
   if (pax->prep != NULL) {
     LIST_INSERT_TAIL(&pax->idefer, inst, pi_le);
     return 0;
@@ -37,6 +34,125 @@ proposer_decree_request(struct paxos_request *req)
   }
 }
 
+/**
+ * proposer_batch_timeout - GEvent-friendly wrapper around
+ * proposer_batch_flush, for batches whose window has closed.
+ */
+static int
+proposer_batch_timeout(void *data)
+{
+  // Set the session.  We parametrize the timeout with a pointer to a session
+  // ID when we add it to the main event loop.
+  pax = session_find(state.sessions, (pax_uuid_t *)data);
+
+  if (pax != NULL && pax->batch != NULL) {
+    // The source is removed when we return.
+    pax->batch->pb_timer = 0;
+    proposer_batch_flush();
+  }
+
+  return FALSE;
+}
+
+/**
+ * proposer_batch_add - Queue a chat request to be decreed as part of a batch,
+ * starting a new batch if necessary.
+ */
+static int
+proposer_batch_add(reqid_t reqid)
+{
+  pax_uuid_t *uuid;
+  struct paxos_batch *batch;
+
+  batch = pax->batch;
+  if (batch == NULL) {
+    batch = g_malloc0(sizeof(*batch));
+    batch->pb_size = state.batch_size;
+    batch->pb_reqids = g_new(reqid_t, batch->pb_size);
+
+    // Close the batch's window after a while even if it never fills.
+    uuid = g_malloc0(sizeof(*uuid));
+    *uuid = *pax->session_id;
+    batch->pb_timer = g_timeout_add_full(G_PRIORITY_DEFAULT,
+        state.batch_window, proposer_batch_timeout, uuid, g_free);
+
+    pax->batch = batch;
+  }
+
+  batch->pb_reqids[batch->pb_count++] = reqid;
+
+  // Decree the batch as soon as it's full.
+  if (batch->pb_count == batch->pb_size) {
+    return proposer_batch_flush();
+  }
+  return 0;
+}
+
+/**
+ * proposer_batch_flush - Decree the batch of chat requests we have been
+ * coalescing, if any.
+ *
+ * Every decree we make for a request which isn't batched must be preceded by
+ * a flush, so that requests are committed in the order we received them.
+ */
+int
+proposer_batch_flush()
+{
+  struct paxos_batch *batch;
+  struct paxos_instance *inst;
+
+  batch = pax->batch;
+  if (batch == NULL) {
+    return 0;
+  }
+  pax->batch = NULL;
+
+  inst = instance_new();
+
+  if (batch->pb_count == 1) {
+    // A batch of one is just a chat.
+    inst->pi_val.pv_dkind = DEC_CHAT;
+    inst->pi_val.pv_reqid = batch->pb_reqids[0];
+    inst->pi_val.pv_extra = 0;
+  } else {
+    // Give the batch a request ID of our own and hand it the members.
+    inst->pi_val.pv_dkind = DEC_BATCH;
+    inst->pi_val.pv_reqid.id = pax->self_id;
+    inst->pi_val.pv_reqid.gen = (++pax->req_id);
+    inst->pi_val.pv_extra = batch->pb_count;
+    inst->pi_batch = batch->pb_reqids;
+    batch->pb_reqids = NULL;
+  }
+
+  batch_destroy(batch);
+
+  return proposer_decree_instance(inst);
+}
+
+/**
+ * proposer_decree_request - Helper function for proposers to decree requests.
+ *
+ * Chats are coalesced into batches if batching is enabled; everything else
+ * is decreed on its own, after any pending batch.
+ */
+static int
+proposer_decree_request(struct paxos_value *val)
+{
+  int r;
+  struct paxos_instance *inst;
+
+  if (val->pv_dkind == DEC_CHAT && state.batch_size > 1) {
+    return proposer_batch_add(val->pv_reqid);
+  }
+  ERR_RET(r, proposer_batch_flush());
+
+  // Allocate an instance and copy in the value from the request.
+  inst = instance_new();
+  memcpy(&inst->pi_val, val, sizeof(*val));
+
+  return proposer_decree_instance(inst);
+}
+
 /**
  * paxos_request - Request that the proposer make a decree for us.
  *
@@ -52,7 +168,7 @@ int
 paxos_request(struct paxos_session *session, dkind_t dkind, const void *msg,
     size_t len)
 {
-  int r, needs_cached;
+  int r, needs_cached, decrees;
   struct paxos_header hdr;
   struct paxos_request *req;
   struct yakyak yy;
@@ -66,28 +182,42 @@ paxos_request(struct paxos_session *session, dkind_t dkind, const void *msg,
     return 1;
   }
 
+  // Refuse the request if we're already falling behind on our writes.  The
+  // client's writable callback will let it know when to try again.
+  if (session_congested()) {
+    return MOTMOT_WOULDBLOCK;
+  }
+
   // Do we need to cache this request?
   needs_cached = request_needs_cached(dkind);
 
+  // Will we decree it in an instance of our own?
+  decrees = mencius_decrees(dkind);
+
   // Initialize a header.  We overload ph_inum to the ID of the acceptor who
-  // we believe to be the proposer.
-  header_init(&hdr, OP_REQUEST, pax->proposer->pa_paxid);
+  // we believe to be the proposer, or to 0 if we'll decree it ourselves.
+  header_init(&hdr, OP_REQUEST, decrees ? 0 : pax->proposer->pa_paxid);
 
   // Allocate a request and initialize it.
-  req = g_malloc0(sizeof(*req));
+  req = request_new();
   req->pr_val.pv_dkind = dkind;
   req->pr_val.pv_reqid.id = pax->self_id;
   req->pr_val.pv_reqid.gen = (++pax->req_id);  // Increment our req_id.
   req->pr_val.pv_extra = 0; // Always 0 for requests.
 
-  req->pr_size = len;
-  req->pr_data = g_memdup(msg, len);
+  request_set_data(req, msg, len);
 
   // Add it to the request cache if needed.
   if (needs_cached) {
     request_insert(&pax->rcache, req);
   }
 
+  // If acceptors own instances but we're leaving this chat to the proposer,
+  // remember it so that our later chats don't overtake it.
+  if (pax->mencius && dkind == DEC_CHAT && !decrees && !is_proposer()) {
+    pax->mrouted = req->pr_val.pv_reqid.gen;
+  }
+
   if (!is_proposer() || needs_cached) {
     // We need to send iff either we are not the proposer or the request
     // has nontrivial data.
@@ -108,9 +238,10 @@ paxos_request(struct paxos_session *session, dkind_t dkind, const void *msg,
     }
   }
 
-  // Decree the request if we're the proposer; otherwise just return.
-  if (is_proposer()) {
-    return proposer_decree_request(req);
+  // Decree the request if we're the proposer or if it's ours to decree;
+  // otherwise just return.
+  if (is_proposer() || decrees) {
+    return proposer_decree_request(&req->pr_val);
   } else {
     return 0;
   }
@@ -122,12 +253,13 @@ paxos_request(struct paxos_session *session, dkind_t dkind, const void *msg,
 int
 proposer_ack_request(struct paxos_header *hdr, msgpack_object *o)
 {
+  struct paxos_value val;
   struct paxos_request *req;
   struct paxos_acceptor *acc;
 
-  // Allocate a request and unpack into it.
-  req = g_malloc0(sizeof(*req));
-  paxos_request_unpack(req, o);
+  // Peek at the request's value; we don't allocate anything until we know
+  // that we're going to keep the request.
+  paxos_request_unpack_value(&val, o);
 
   // The requester overloads ph_inst to the ID of the acceptor it believes
   // to be the proposer.  If the requester has a live connection to us but
@@ -140,17 +272,25 @@ proposer_ack_request(struct paxos_header *hdr, msgpack_object *o)
   // our decree until after our prepare.  If we indeed are not the proposer,
   // our prepare will fail, and we will be redirected at that point.
   if (hdr->ph_inum > pax->self_id) {
-    acc = acceptor_find(&pax->alist, req->pr_val.pv_reqid.id);
-    request_destroy(req);
+    acc = acceptor_find(&pax->alist, val.pv_reqid.id);
     return proposer_decree_part(acc, 1);
   }
 
-  // Add it to the request cache if needed.
-  if (request_needs_cached(req->pr_val.pv_dkind)) {
+  // Add it to the request cache if needed and if we don't have it already.
+  if (request_needs_cached(val.pv_dkind) &&
+      request_find(&pax->rcache, val.pv_reqid) == NULL) {
+    req = request_new();
+    paxos_request_unpack(req, o);
     request_insert(&pax->rcache, req);
   }
 
-  return proposer_decree_request(req);
+  // The requester may be decreeing the request itself, in which case we need
+  // only have cached it.
+  if (hdr->ph_inum == 0) {
+    return 0;
+  }
+
+  return proposer_decree_request(&val);
 }
 
 /**
@@ -161,14 +301,22 @@ int
 acceptor_ack_request(struct paxos_peer *source, struct paxos_header *hdr,
     msgpack_object *o)
 {
+  struct paxos_value val;
   struct paxos_request *req;
 
-  // Allocate a request and unpack into it.
-  req = g_malloc0(sizeof(*req));
-  paxos_request_unpack(req, o);
-
-  // Add it to the request cache.
-  request_insert(&pax->rcache, req);
+  // Add the request to the request cache, unless this is a duplicate, or a
+  // straggler of a request which was learned before we joined and which
+  // would thus never be truncated.
+  paxos_request_unpack_value(&val, o);
+  req = request_find(&pax->rcache, val.pv_reqid);
+  if (req == NULL && request_learned(val.pv_reqid)) {
+    return 0;
+  }
+  if (req == NULL) {
+    req = request_new();
+    paxos_request_unpack(req, o);
+    request_insert(&pax->rcache, req);
+  }
 
   // The requester overloads ph_inst to the acceptor it believes to be the
   // proposer.  If we are incorrectly identified as the proposer (i.e., if
@@ -181,34 +329,105 @@ acceptor_ack_request(struct paxos_peer *source, struct paxos_header *hdr,
 }
 
 /**
- * paxos_retrieve - Ask the originator of request data to send us data which
- * we do not have in our cache.
+ * retrieve_missing - Find our entry for a request we are missing, or NULL if
+ * we have none.
+ */
+static struct paxos_missing *
+retrieve_missing(reqid_t reqid)
+{
+  return missing_find(&pax->retrieval.pr_missing, reqid);
+}
+
+/**
+ * retrieve_add - Note that we are missing a request decreed in instance
+ * inum.  If we already asked for it, we ask again.
+ */
+static void
+retrieve_add(paxid_t inum, struct paxos_value *val)
+{
+  struct paxos_missing *pm;
+
+  pm = retrieve_missing(val->pv_reqid);
+  if (pm != NULL) {
+    pm->pm_retrieve = 0;
+    return;
+  }
+
+  pm = g_malloc0(sizeof(*pm));
+  pm->pm_inum = inum;
+  memcpy(&pm->pm_val, val, sizeof(*val));
+  missing_insert(&pax->retrieval.pr_missing, pm);
+}
+
+/**
+ * retrieve_target - Choose whom to ask for missing requests.
  *
- * We call this function when and only when we are issued a commit for an
- * instance whose associated request is not in our request cache.
+ * The proposer has every request it has committed until it truncates them,
+ * so we ask it if we can, and otherwise the live acceptor with the lowest
+ * RTT we know of.  Only if that acceptor turns out not to have a request do
+ * we ask its originator.  Returns NULL if there is no one to ask, in which
+ * case we ask everyone.
  */
-int
-paxos_retrieve(struct paxos_instance *inst)
+static struct paxos_acceptor *
+retrieve_target()
+{
+  struct paxos_acceptor *acc, *best;
+
+  if (!is_proposer() && pax->proposer != NULL &&
+      pax->proposer->pa_peer != NULL) {
+    return pax->proposer;
+  }
+
+  best = NULL;
+  LIST_FOREACH(acc, &pax->alist, pa_le) {
+    if (acc->pa_peer == NULL || acc->pa_paxid == pax->self_id) {
+      continue;
+    }
+    if (best == NULL || (acc->pa_srtt != 0 &&
+        (best->pa_srtt == 0 || acc->pa_srtt < best->pa_srtt))) {
+      best = acc;
+    }
+  }
+
+  return best;
+}
+
+/**
+ * retrieve_send - Ask an acceptor for a list of the requests we are missing,
+ * chained through pm_next from pm.
+ *
+ * struct {
+ *   paxos_header hdr;
+ *   struct {
+ *     paxid_t retriever;
+ *     paxos_value values[];
+ *   } retrieve;
+ * }
+ *
+ * The header carries the ID of the retrieve in ph_inum.
+ */
+static int
+retrieve_send(struct paxos_acceptor *acc, paxid_t id,
+    struct paxos_missing *pm, unsigned count)
 {
   int r;
   struct paxos_header hdr;
-  struct paxos_acceptor *acc;
   struct yakyak yy;
 
-  // Initialize a header.  We set ph_inum to the instance number of the
-  // request.
-  header_init(&hdr, OP_RETRIEVE, inst->pi_hdr.ph_inum);
+  // Initialize a header.
+  header_init(&hdr, OP_RETRIEVE, id);
 
   // Pack the retrieve.
   yakyak_init(&yy, 2);
   paxos_header_pack(&yy, &hdr);
   yakyak_begin_array(&yy, 2);
   paxos_paxid_pack(&yy, pax->self_id);
-  paxos_value_pack(&yy, &inst->pi_val);
+  yakyak_begin_array(&yy, count);
+  for (; pm != NULL; pm = pm->pm_next) {
+    paxos_value_pack(&yy, &pm->pm_val);
+  }
 
-  // Determine the request originator and send.  If we are no longer connected
-  // to the request originator, broadcast the retrieve instead.
-  acc = acceptor_find(&pax->alist, inst->pi_val.pv_reqid.id);
+  // Send it, or broadcast it if we're not connected to the target.
   if (acc == NULL || acc->pa_peer == NULL) {
     r = paxos_broadcast(&yy);
   } else {
@@ -219,17 +438,175 @@ paxos_retrieve(struct paxos_instance *inst)
   return r;
 }
 
+/* Missing requests being gathered into a retrieve for a single target. */
+struct retrieve_group {
+  struct paxos_acceptor *rg_acc;    // acceptor to ask
+  paxid_t rg_id;                    // ID of the retrieve
+  unsigned rg_count;                // number of requests asked for
+  struct paxos_missing *rg_first;   // first request asked for
+  struct paxos_missing *rg_last;    // last request asked for
+};
+
 /**
- * paxos_ack_retrieve - Acknowledge a retrieve.
+ * retrieve_flush - Ask for every missing request we have yet to ask for,
+ * batching together up to RETRIEVE_MAX of those with the same target.
  *
- * This basically just unpacks and wraps a resend.
+ * We make a single pass over the missing requests, chaining each onto the
+ * latest retrieve for its target.  Apart from the requests we must ask
+ * their originators for, every request has the same target, so there are
+ * few retrieves to choose among.
+ */
+static int
+retrieve_flush()
+{
+  int r = 0;
+  unsigned i, ngroups, size;
+  struct paxos_acceptor *target, *acc;
+  struct paxos_missing *pm;
+  struct retrieve_group *groups, *rg;
+
+  target = retrieve_target();
+  groups = NULL;
+  ngroups = 0;
+  size = 0;
+
+  OPENHASH_FOREACH(pm, &pax->retrieval.pr_missing, pm_le) {
+    if (pm->pm_retrieve != 0) {
+      continue;
+    }
+
+    if (pm->pm_direct) {
+      acc = acceptor_find(&pax->alist, pm->pm_val.pv_reqid.id);
+    } else {
+      acc = target;
+    }
+
+    // Find the latest retrieve for the target, starting a new one if there
+    // is none or if it is full.
+    i = ngroups;
+    while (i > 0 && groups[i - 1].rg_acc != acc) {
+      --i;
+    }
+    if (i == 0 || groups[i - 1].rg_count == RETRIEVE_MAX) {
+      if (ngroups == size) {
+        size = MAX(2 * size, 4);
+        groups = g_renew(struct retrieve_group, groups, size);
+      }
+      rg = &groups[ngroups++];
+      rg->rg_acc = acc;
+      rg->rg_id = ++pax->retrieval.pr_id;
+      rg->rg_count = 0;
+      rg->rg_first = NULL;
+    } else {
+      rg = &groups[i - 1];
+    }
+
+    pm->pm_retrieve = rg->rg_id;
+    pm->pm_next = NULL;
+    if (rg->rg_first == NULL) {
+      rg->rg_first = pm;
+    } else {
+      rg->rg_last->pm_next = pm;
+    }
+    rg->rg_last = pm;
+    rg->rg_count++;
+  }
+
+  for (i = 0; i < ngroups; ++i) {
+    ERR_ACCUM(r, retrieve_send(groups[i].rg_acc, groups[i].rg_id,
+          groups[i].rg_first, groups[i].rg_count));
+  }
+
+  g_free(groups);
+  return r;
+}
+
+/**
+ * retrieve_idle - GEvent-friendly wrapper around retrieve_flush.
+ */
+static int
+retrieve_idle(void *data)
+{
+  // Set the session.  We parametrize the source with a pointer to a session
+  // ID when we add it to the main event loop.
+  pax = session_find(state.sessions, (pax_uuid_t *)data);
+  if (pax == NULL) {
+    return FALSE;
+  }
+
+  // The source is removed when we return.
+  pax->retrieval.pr_source = 0;
+  retrieve_flush();
+
+  return FALSE;
+}
+
+/**
+ * retrieve_schedule - Flush our retrieves once we're done with the messages
+ * at hand, so that the requests they show us to be missing go out together.
+ */
+static void
+retrieve_schedule()
+{
+  pax_uuid_t *uuid;
+
+  if (pax->retrieval.pr_source == 0) {
+    uuid = g_malloc0(sizeof(*uuid));
+    *uuid = *pax->session_id;
+    pax->retrieval.pr_source = g_idle_add_full(G_PRIORITY_DEFAULT,
+        retrieve_idle, uuid, g_free);
+  }
+}
+
+/**
+ * paxos_retrieve - Retrieve the data of requests which we do not have in our
+ * cache.
+ *
+ * We call this function when and only when we are issued a commit for an
+ * instance whose associated requests are not all in our request cache.
+ * The requests are retrieved in bulk along with any others we find missing
+ * before we return to the main loop.
+ */
+int
+paxos_retrieve(struct paxos_instance *inst)
+{
+  unsigned i;
+  struct paxos_value val;
+
+  if (inst->pi_val.pv_dkind != DEC_BATCH) {
+    retrieve_add(inst->pi_hdr.ph_inum, &inst->pi_val);
+  } else {
+    // Retrieve each batch member we are missing; the members are all chats.
+    val.pv_dkind = DEC_CHAT;
+    val.pv_extra = 0;
+    for (i = 0; i < inst->pi_val.pv_extra; ++i) {
+      if (request_find(&pax->rcache, inst->pi_batch[i]) == NULL) {
+        val.pv_reqid = inst->pi_batch[i];
+        retrieve_add(inst->pi_hdr.ph_inum, &val);
+      }
+    }
+  }
+
+  retrieve_schedule();
+  return 0;
+}
+
+/**
+ * paxos_ack_retrieve - Acknowledge a retrieve by resending whichever of the
+ * requests we have.
+ *
+ * We always resend something, even if it's an empty array, so that the
+ * retriever knows to ask elsewhere for anything we left out.
  */
 int paxos_ack_retrieve(struct paxos_header *hdr, msgpack_object *o)
 {
+  int r = 0;
   paxid_t paxid;
-  msgpack_object *p;
+  unsigned count, start, end;
+  size_t bytes;
+  msgpack_object *p, *q, *qend;
   struct paxos_value val;
-  struct paxos_request *req;
+  struct paxos_request **reqs;
   struct paxos_acceptor *acc;
 
   // Make sure the payload is well-formed.
@@ -237,32 +614,66 @@ int paxos_ack_retrieve(struct paxos_header *hdr, msgpack_object *o)
   assert(o->via.array.size == 2);
   p = o->via.array.ptr;
 
-  // Unpack the retriever's ID and the value being retrieved.
+  // Unpack the retriever's ID and look it up.
   paxos_paxid_unpack(&paxid, p++);
-  paxos_value_unpack(&val, p++);
-
-  // Retrieve the request.
-  assert(request_needs_cached(val.pv_dkind));
-  req = request_find(&pax->rcache, val.pv_reqid);
-  if (req != NULL) {
-    // If we have the request, look up the recipient and resend.
-    acc = acceptor_find(&pax->alist, paxid);
-    return paxos_resend(acc, hdr, req);
-  } else {
-    // If we don't have the request either, just return.
+  acc = acceptor_find(&pax->alist, paxid);
+  if (acc == NULL || acc->pa_peer == NULL) {
     return 0;
   }
+
+  // Gather up the requests we have.
+  assert(p->type == MSGPACK_OBJECT_ARRAY);
+  q = p->via.array.ptr;
+  qend = p->via.array.ptr + p->via.array.size;
+  reqs = g_new(struct paxos_request *, p->via.array.size + 1);
+
+  count = 0;
+  for (; q != qend; ++q) {
+    paxos_value_unpack(&val, q);
+    assert(request_needs_cached(val.pv_dkind));
+    reqs[count] = request_find(&pax->rcache, val.pv_reqid);
+    if (reqs[count] != NULL) {
+      count++;
+    }
+  }
+
+  // Resend them, RESEND_BYTES or so at a time.
+  start = 0;
+  do {
+    bytes = 0;
+    for (end = start; end < count && bytes < RESEND_BYTES; ++end) {
+      bytes += reqs[end]->pr_size;
+    }
+    ERR_ACCUM(r, paxos_resend(acc, hdr, reqs + start, end - start,
+        end == count));
+    start = end;
+  } while (start < count);
+
+  g_free(reqs);
+  return r;
 }
 
 /**
  * paxos_resend - Resend request data that some acceptor didn't have at
  * commit time.
+ *
+ * struct {
+ *   paxos_header hdr;
+ *   struct {
+ *     bool last;
+ *     paxos_request requests[];
+ *   } resend;
+ * }
+ *
+ * The header echoes the ID of the retrieve we are answering, and last is
+ * set on our final resend in answer to it.
  */
 int
 paxos_resend(struct paxos_acceptor *acc, struct paxos_header *hdr,
-    struct paxos_request *req)
+    struct paxos_request **reqs, unsigned count, bool last)
 {
   int r;
+  unsigned i;
   struct yakyak yy;
 
   // Modify the header.
@@ -271,48 +682,153 @@ paxos_resend(struct paxos_acceptor *acc, struct paxos_header *hdr,
   // Just pack and send the resend.
   yakyak_init(&yy, 2);
   paxos_header_pack(&yy, hdr);
-  paxos_request_pack(&yy, req);
+  yakyak_begin_array(&yy, 2);
+  last ? msgpack_pack_true(yy.pk) : msgpack_pack_false(yy.pk);
+  yakyak_begin_array(&yy, count);
+  for (i = 0; i < count; ++i) {
+    paxos_request_pack(&yy, reqs[i]);
+  }
   r = paxos_send(acc, &yy);
   yakyak_destroy(&yy);
 
   return r;
 }
 
+/**
+ * retrieve_settle - Stop retrieving the requests we now have, committing
+ * again any instance for which we now have every request.  If this was the
+ * last resend for retrieve id, anything it didn't give us we ask the
+ * request's originator for, unless we already did, in which case we give up
+ * until the instance is committed to us again.
+ */
+static int
+retrieve_settle(paxid_t id, bool last)
+{
+  int r = 0;
+  unsigned i, nready;
+  bool refetch = false;
+  paxid_t *ready;
+  struct paxos_retrieval *rv = &pax->retrieval;
+  struct paxos_missing *pm, *next;
+  struct paxos_instance *inst;
+
+  ready = g_new(paxid_t, OPENHASH_COUNT(&rv->pr_missing) + 1);
+  nready = 0;
+
+  for (pm = OPENHASH_OLDEST(&rv->pr_missing);
+      pm != (void *)&rv->pr_missing.oh_order; pm = next) {
+    next = LIST_NEXT(pm, pm_le);
+
+    if (request_find(&pax->rcache, pm->pm_val.pv_reqid) != NULL) {
+      ready[nready++] = pm->pm_inum;
+      missing_remove(&rv->pr_missing, pm);
+      missing_destroy(pm);
+      continue;
+    }
+
+    // Drop anything we've since learned some other way.
+    inst = instance_find(&pax->ilist, pm->pm_inum);
+    if (inst == NULL || inst->pi_cached) {
+      missing_remove(&rv->pr_missing, pm);
+      missing_destroy(pm);
+      continue;
+    }
+
+    if (last && pm->pm_retrieve == id) {
+      if (pm->pm_direct) {
+        missing_remove(&rv->pr_missing, pm);
+        missing_destroy(pm);
+        continue;
+      }
+      pm->pm_direct = true;
+      pm->pm_retrieve = 0;
+      refetch = true;
+    }
+  }
+
+  if (refetch) {
+    retrieve_schedule();
+  }
+
+  // Commit again wherever we now have every request.
+  for (i = 0; i < nready; ++i) {
+    inst = instance_find(&pax->ilist, ready[i]);
+    if (inst != NULL && inst->pi_committed && !inst->pi_cached &&
+        instance_has_requests(inst)) {
+      ERR_ACCUM(r, paxos_commit(inst));
+    }
+  }
+
+  g_free(ready);
+  return r;
+}
+
 /**
  * paxos_ack_resend - Receive a resend of request data, and re-commit the
- * instance to which the request belongs.
+ * instances to which the requests belong.
  */
 int
 paxos_ack_resend(struct paxos_header *hdr, msgpack_object *o)
 {
-  struct paxos_instance *inst;
+  bool last;
+  msgpack_object *p, *q, *qend;
+  struct paxos_value val;
   struct paxos_request *req;
 
-  // Grab the instance for which we wanted the request.  If we find that it
-  // has already been cached and learned since we began our retrieval, we can
-  // just return.
-  //
-  // Note also that an instance should only be NULL if it was committed and
-  // learned and then truncated in a sync operation.
-  inst = instance_find(&pax->ilist, hdr->ph_inum);
-  if (inst == NULL || inst->pi_cached) {
-    return 0;
-  }
+  // Make sure the payload is well-formed.
+  assert(o->type == MSGPACK_OBJECT_ARRAY);
+  assert(o->via.array.size == 2);
+  p = o->via.array.ptr;
 
-  // See if we already got the request.  It is possible that we received a
-  // commit message for the instance before the original request broadcast
-  // reached us.  However, since the instance-request mapping is one way, we
-  // wait until a resend is received before committing.
-  req = request_find(&pax->rcache, inst->pi_val.pv_reqid);
-  if (req == NULL) {
-    // Allocate a request and unpack it.
-    req = g_malloc0(sizeof(*req));
-    paxos_request_unpack(req, o);
+  assert(p->type == MSGPACK_OBJECT_BOOLEAN);
+  last = (p++)->via.boolean;
+
+  // Cache each request we're still missing.  It is possible that we
+  // received a commit message for an instance before the original request
+  // broadcast reached us, and that we have since gotten it.  However, since
+  // the instance-request mapping is one way, we wait until a resend is
+  // received before committing.
+  assert(p->type == MSGPACK_OBJECT_ARRAY);
+  q = p->via.array.ptr;
+  qend = p->via.array.ptr + p->via.array.size;
+  for (; q != qend; ++q) {
+    paxos_request_unpack_value(&val, q);
+    if (retrieve_missing(val.pv_reqid) == NULL ||
+        request_find(&pax->rcache, val.pv_reqid) != NULL) {
+      continue;
+    }
 
-    // Insert it to our request cache.
+    req = request_new();
+    paxos_request_unpack(req, q);
     request_insert(&pax->rcache, req);
   }
 
-  // Commit again, now that we have the associated request.
-  return paxos_commit(inst);
+  return retrieve_settle(hdr->ph_inum, last);
+}
+
+/**
+ * request_unpack_cache - Cache any requests inlined alongside instances we
+ * have been sent which we don't already have.
+ */
+void
+request_unpack_cache(msgpack_object *o)
+{
+  msgpack_object *p, *pend;
+  struct paxos_value val;
+  struct paxos_request *req;
+
+  assert(o->type == MSGPACK_OBJECT_ARRAY);
+  p = o->via.array.ptr;
+  pend = o->via.array.ptr + o->via.array.size;
+
+  for (; p != pend; ++p) {
+    paxos_request_unpack_value(&val, p);
+    if (request_find(&pax->rcache, val.pv_reqid) != NULL) {
+      continue;
+    }
+
+    req = request_new();
+    paxos_request_unpack(req, p);
+    request_insert(&pax->rcache, req);
+  }
 }
@@ -1,5 +1,33 @@
 /**
  * paxos_retry.c - Protocol for obtaining missing commits.
+ *
+ * An acceptor who finds itself missing commits asks another acceptor for
+ * the whole range it is missing at once, and that acceptor sends the commits
+ * it has in that range back to just the retrier, packed RECOMMIT_BATCH to a
+ * message along with the requests they decree.  We answer at most RETRY_MAX
+ * instances per retry, so that an acceptor far behind us doesn't hold up
+ * everyone else behind a single burst; it simply retries for the rest once
+ * it has learned these.
+ *
+ * The proposer is already the busiest member of the session, so we only ask
+ * it as a last resort.  We first retry with whichever acceptor we last
+ * retried with, and then with others chosen at random, so that acceptors
+ * recovering at once spread their retries around; once RETRY_PEER_TRIES
+ * retries in a row have failed to shrink our hole, we ask the proposer.
+ * Anyone answering a retry spends a byte budget which refills at SERVE_RATE
+ * and is shared by all of its sessions, and skips retriers whose links are
+ * backed up, so that catching others up never crowds out live traffic.
+ * Whatever it leaves out is simply retried.  If it can't answer at all, it
+ * says that it is busy, and the retrier tries someone else without counting
+ * the retry against the acceptor.
+ *
+ * Commits often arrive out of order, or a little late when the proposer's
+ * uplink backs up, so an acceptor doesn't retry as soon as it sees a hole.
+ * Instead, it arms a timer, which is cancelled if the hole fills on its own.
+ * Each retry which fails to shrink the hole doubles the wait for the next,
+ * while one which does shrink it resets the wait, since the retries are
+ * evidently being answered.  Waits are jittered so that acceptors missing
+ * the same commits don't all retry at once.
  */
 
 #include <assert.h>
@@ -16,98 +44,514 @@
 #include "util/paxos_io.h"
 #include "util/paxos_print.h"
 
+#define RETRY_MAX           4096          // most instances we answer per retry
+#define RETRY_PEER_TRIES    2             // retries before asking the proposer
+#define RECOMMIT_BATCH      128           // most commits we pack in one recommit
+#define RECOMMIT_BYTES      (64 * 1024)   // request bytes per recommit, roughly
+#define RECOMMIT_INLINE_MAX (16 * 1024)   // largest request we inline
+#define SERVE_RATE          (512 * 1024)  // bytes/sec of recommits we send
+#define SERVE_BURST         (128 * 1024)  // most recommit bytes sent at once
+#define HOLE_WAIT_MIN       50            // ms to wait on a hole before retrying
+#define HOLE_WAIT_MAX       4000          // longest ms to wait between retries
+
 /**
- * acceptor_retry - Ask the proposer to give us a commit we are missing.
+ * retry_send - Ask an acceptor to give us the commits we are missing in
+ * [first, last].
  */
-int
-acceptor_retry(paxid_t hole)
+static int
+retry_send(struct paxos_acceptor *acc, paxid_t first, paxid_t last)
 {
   int r;
   struct paxos_header hdr;
   struct yakyak yy;
 
+  if (acc == NULL || acc->pa_peer == NULL) {
+    return 1;
+  }
+
+  state.stats.ps_retries++;
+  if (acc != pax->proposer) {
+    state.stats.ps_peer_retries++;
+  }
+
   // Initialize a header.
-  header_init(&hdr, OP_RETRY, hole);
+  header_init(&hdr, OP_RETRY, first);
 
   // Pack and send the payload.
-  yakyak_init(&yy, 1);
+  yakyak_init(&yy, 2);
   paxos_header_pack(&yy, &hdr);
-  r = paxos_send_to_proposer(&yy);
+  paxos_paxid_pack(&yy, MAX(first, last));
+  r = paxos_send(acc, &yy);
   yakyak_destroy(&yy);
 
   return r;
 }
 
 /**
- * proposer_ack_retry - See if we have committed a decree and send it back
- * to an interested acceptor.
+ * acceptor_retry - Ask the proposer to give us the commits we are missing
+ * in [first, last].
  */
 int
-proposer_ack_retry(struct paxos_header *hdr)
+acceptor_retry(paxid_t first, paxid_t last)
 {
-  struct paxos_instance *inst;
+  return retry_send(pax->proposer, first, last);
+}
+
+/**
+ * retry_candidate - Check whether we may retry our hole with an acceptor
+ * other than the proposer.
+ */
+static inline bool
+retry_candidate(struct paxos_acceptor *acc)
+{
+  return acc != NULL && acc->pa_peer != NULL &&
+      acc->pa_paxid != pax->self_id && acc != pax->proposer;
+}
+
+/**
+ * retry_peer - Choose whom to retry our hole with next.
+ */
+static struct paxos_acceptor *
+retry_peer()
+{
+  unsigned n, pick;
+  struct paxos_acceptor *acc, *last;
+
+  // If our last retry shrank the hole, we start over with the acceptor who
+  // answered it.
+  if (pax->ihole > pax->hfirst) {
+    pax->htries = 0;
+  }
+  pax->hfirst = pax->ihole;
+
+  if (pax->htries++ >= RETRY_PEER_TRIES) {
+    return pax->proposer;
+  }
+
+  last = acceptor_find(&pax->alist, pax->hpeer);
+  if (!retry_candidate(last)) {
+    last = NULL;
+  } else if (pax->htries == 1) {
+    return last;
+  }
+
+  // Otherwise, pick someone else at random.
+  n = 0;
+  LIST_FOREACH(acc, &pax->alist, pa_le) {
+    n += retry_candidate(acc) && acc != last;
+  }
+  if (n == 0) {
+    return last != NULL ? last : pax->proposer;
+  }
+
+  pick = g_random_int_range(0, n);
+  LIST_FOREACH(acc, &pax->alist, pa_le) {
+    if (retry_candidate(acc) && acc != last && pick-- == 0) {
+      break;
+    }
+  }
+
+  pax->hpeer = acc->pa_paxid;
+  return acc;
+}
+
+static int hole_timeout(void *);
+
+/**
+ * hole_schedule - Arm the hole timer for about hwait milliseconds.
+ */
+static void
+hole_schedule()
+{
+  unsigned wait;
+  pax_uuid_t *uuid;
+
+  // Jitter the wait by up to a quarter either way.
+  wait = g_random_int_range(pax->hwait * 3 / 4, pax->hwait * 5 / 4 + 1);
+
+  uuid = g_malloc0(sizeof(*uuid));
+  *uuid = *pax->session_id;
+  pax->hsource = g_timeout_add_full(G_PRIORITY_DEFAULT, wait, hole_timeout,
+      uuid, g_free);
+}
 
-  // Find the requested instance.
-  inst = instance_find(&pax->ilist, hdr->ph_inum);
-  assert(inst != NULL);
+/**
+ * hole_timeout - Retry our hole if it has yet to fill.  If it has shrunk
+ * since we last retried, we wait as briefly as at first for the next retry;
+ * otherwise, we wait twice as long.
+ */
+static int
+hole_timeout(void *data)
+{
+  bool progress;
+
+  // Set the session.  We parametrize the source with a pointer to a session
+  // ID when we add it to the main event loop.
+  pax = session_find(state.sessions, (pax_uuid_t *)data);
+  if (pax == NULL) {
+    return FALSE;
+  }
+
+  // The source is removed when we return.
+  pax->hsource = 0;
+
+  // A catch-up may have taken us past the hole without our noticing, and if
+  // we have since become the proposer, there's no one to ask.
+  if (pax->ihole > pax->hlast || is_proposer()) {
+    pax->hwait = 0;
+    return FALSE;
+  }
+
+  // Note whether we've made progress before retry_peer() moves the mark.
+  progress = pax->ihole > pax->hfirst;
+
+  retry_send(retry_peer(), pax->ihole, pax->hlast);
+  pax->hretried = true;
 
-  // Recommit if it's been committed; otherwise, just don't respond.
-  if (inst->pi_committed) {
-    return proposer_recommit(hdr, inst);
+  if (progress) {
+    pax->hwait = HOLE_WAIT_MIN;
   } else {
+    pax->hwait = MIN(2 * pax->hwait, HOLE_WAIT_MAX);
+  }
+  hole_schedule();
+
+  return FALSE;
+}
+
+/**
+ * acceptor_hole - Note that we are missing commits up through last, and
+ * retry them unless they turn up shortly.
+ */
+int
+acceptor_hole(paxid_t last)
+{
+  pax->hlast = MAX(pax->hlast, last);
+
+  // If we are already waiting on the hole, there's nothing more to do.
+  if (pax->hsource != 0) {
+    state.stats.ps_hole_repeats++;
     return 0;
   }
+
+  pax->hwait = HOLE_WAIT_MIN;
+  pax->htries = 0;
+  pax->hfirst = pax->ihole;
+  pax->hretried = false;
+  hole_schedule();
+
+  return 0;
+}
+
+/**
+ * acceptor_hole_check - Stop waiting on our hole if it has filled.
+ */
+void
+acceptor_hole_check()
+{
+  if (pax->hsource == 0 || pax->ihole <= pax->hlast) {
+    return;
+  }
+
+  // If we never retried, the hole filled on its own.
+  if (!pax->hretried) {
+    state.stats.ps_unretried++;
+  }
+
+  g_source_remove(pax->hsource);
+  pax->hsource = 0;
+  pax->hwait = 0;
 }
 
 /**
- * proposer_recommit - Resend a commit to an acceptor.
+ * paxos_ack_retry - Send the commits an acceptor is missing back to it.  If
+ * we have truncated any of them, the acceptor has fallen behind, and we help
+ * it catch up instead.
  */
 int
-proposer_recommit(struct paxos_header *hdr, struct paxos_instance *inst)
+paxos_ack_retry(struct paxos_peer *source, struct paxos_header *hdr,
+    msgpack_object *o)
+{
+  paxid_t last;
+  struct paxos_acceptor *acc;
+
+  // Only answer acceptors we know.
+  acc = peer_acceptor(source);
+  if (acc == NULL) {
+    return 0;
+  }
+
+  if (hdr->ph_inum < RING_BASE(&pax->ilist)) {
+    return paxos_catchup(acc);
+  }
+
+  paxos_paxid_unpack(&last, o);
+  last = MIN(last, hdr->ph_inum + RETRY_MAX - 1);
+
+  return paxos_recommit(acc, hdr->ph_inum, last);
+}
+
+/**
+ * recommit_budget - Top up the bytes we may spend on recommits, and check
+ * whether we have any left.
+ */
+static bool
+recommit_budget()
+{
+  gint64 now, elapsed;
+
+  now = g_get_monotonic_time();
+  elapsed = MIN(now - state.serve_stamp, G_USEC_PER_SEC);
+  state.serve_stamp = now;
+
+  state.serve_tokens = MIN(SERVE_BURST,
+      state.serve_tokens + elapsed * SERVE_RATE / G_USEC_PER_SEC);
+  return state.serve_tokens > 0;
+}
+
+/**
+ * recommit_request - Find the ith request decreed by an instance if it is in
+ * our cache and small enough to inline, else return NULL.
+ */
+static struct paxos_request *
+recommit_request(struct paxos_instance *inst, unsigned i)
+{
+  struct paxos_request *req;
+
+  req = instance_request(inst, i);
+  if (req == NULL || req->pr_size > RECOMMIT_INLINE_MAX) {
+    return NULL;
+  }
+  return req;
+}
+
+/**
+ * recommit_batch - Send a batch of commits to an acceptor, along with the
+ * requests they decree which we can inline.
+ */
+static int
+recommit_batch(struct paxos_acceptor *acc, struct paxos_instance **batch,
+    unsigned count)
 {
   int r;
+  unsigned i, j, nreqs;
+  struct paxos_header hdr;
+  struct paxos_request *req;
   struct yakyak yy;
 
-  // Modify the header.
-  hdr->ph_opcode = OP_RECOMMIT;
+  // Initialize a header.
+  header_init(&hdr, OP_RECOMMIT, batch[0]->pi_hdr.ph_inum);
+
+  // Pack the commits.
+  yakyak_init(&yy, 2);
+  paxos_header_pack(&yy, &hdr);
+  yakyak_begin_array(&yy, 2);
+  yakyak_begin_array(&yy, count);
+  nreqs = 0;
+  for (i = 0; i < count; ++i) {
+    paxos_instance_pack(&yy, batch[i]);
+    for (j = 0; j < instance_nrequests(batch[i]); ++j) {
+      nreqs += recommit_request(batch[i], j) != NULL;
+    }
+  }
+
+  // Pack the requests.
+  yakyak_begin_array(&yy, nreqs);
+  for (i = 0; i < count; ++i) {
+    for (j = 0; j < instance_nrequests(batch[i]); ++j) {
+      req = recommit_request(batch[i], j);
+      if (req != NULL) {
+        paxos_request_pack(&yy, req);
+      }
+    }
+  }
+
+  // Send the recommit, paying for it out of our budget.
+  state.serve_tokens -= yakyak_size(&yy);
+  r = paxos_send(acc, &yy);
+  yakyak_destroy(&yy);
+
+  return r;
+}
+
+/**
+ * recommit_busy - Tell an acceptor that we are too busy to answer its retry
+ * at all.  This is an empty recommit for instance 0.
+ */
+static int
+recommit_busy(struct paxos_acceptor *acc)
+{
+  int r;
+  struct paxos_header hdr;
+  struct yakyak yy;
+
+  state.stats.ps_throttled++;
+  if (acc->pa_peer == NULL) {
+    return 0;
+  }
+
+  header_init(&hdr, OP_RECOMMIT, 0);
 
-  // Pack and send the recommit.
   yakyak_init(&yy, 2);
-  paxos_header_pack(&yy, hdr);
-  paxos_value_pack(&yy, &(inst->pi_val));
-  r = paxos_broadcast(&yy);
+  paxos_header_pack(&yy, &hdr);
+  yakyak_begin_array(&yy, 2);
+  yakyak_begin_array(&yy, 0);
+  yakyak_begin_array(&yy, 0);
+  r = paxos_send(acc, &yy);
   yakyak_destroy(&yy);
 
   return r;
 }
 
 /**
- * acceptor_ack_recommit - Fill in a missing commit.
+ * paxos_recommit - Resend the commits we have in [first, last] to an
+ * acceptor, as far as our budget allows.
+ *
+ * If acceptors own instances, or if we are not the proposer, we may not
+ * have heard of some of them ourselves yet; we just leave those out.
  */
-int acceptor_ack_recommit(struct paxos_header *hdr, msgpack_object *o)
+int
+paxos_recommit(struct paxos_acceptor *acc, paxid_t first, paxid_t last)
 {
+  int r;
+  paxid_t inum;
+  unsigned i, count;
+  size_t bytes;
+  bool sent;
+  struct paxos_instance *inst, *batch[RECOMMIT_BATCH];
+  struct paxos_request *req;
+
+  // Don't pile onto a link which is already backed up.
+  if (acc->pa_peer == NULL || paxos_peer_congested(acc->pa_peer)) {
+    return recommit_busy(acc);
+  }
+
+  count = 0;
+  bytes = 0;
+  sent = false;
+  for (inum = first; inum <= last && inum < RING_END(&pax->ilist); ++inum) {
+    inst = instance_find(&pax->ilist, inum);
+    assert(inst != NULL || pax->mencius || !is_proposer());
+    if (inst == NULL || !inst->pi_committed) {
+      continue;
+    }
+
+    batch[count++] = inst;
+    for (i = 0; i < instance_nrequests(inst); ++i) {
+      req = recommit_request(inst, i);
+      bytes += req != NULL ? req->pr_size : 0;
+    }
+
+    if (count == RECOMMIT_BATCH || bytes >= RECOMMIT_BYTES) {
+      if (!recommit_budget()) {
+        break;
+      }
+      ERR_RET(r, recommit_batch(acc, batch, count));
+      sent = true;
+      count = 0;
+      bytes = 0;
+    }
+  }
+
+  if (count > 0 && recommit_budget()) {
+    ERR_RET(r, recommit_batch(acc, batch, count));
+    count = 0;
+    sent = true;
+  }
+
+  // If we ran out of budget partway, the acceptor retries for the rest
+  // once it has learned what we sent.
+  if (count > 0) {
+    if (!sent) {
+      return recommit_busy(acc);
+    }
+    state.stats.ps_throttled++;
+  }
+
+  return 0;
+}
+
+/**
+ * acceptor_recommit - Fill in a single missing commit, taking ownership of
+ * the instance we unpacked it into.
+ */
+static int
+acceptor_recommit(struct paxos_instance *fresh)
+{
+  int r;
   struct paxos_instance *inst;
 
   // Check if we've already committed since we sent the retry.  If we have,
-  // just return.
-  inst = instance_find(&pax->ilist, hdr->ph_inum);
-  if (inst != NULL && inst->pi_committed) {
+  // or if we have since learned and truncated it, we're done.
+  inst = instance_find(&pax->ilist, fresh->pi_hdr.ph_inum);
+  if ((inst != NULL && inst->pi_committed) ||
+      fresh->pi_hdr.ph_inum < pax->ihole) {
+    instance_destroy(fresh);
     return 0;
   }
 
-  // Initialize a new instance if necessary.  Our commit flags are all
-  // zeroed so we don't need to initialize them.
   if (inst == NULL) {
-    inst = g_malloc0(sizeof(*inst));
-    memcpy(&inst->pi_hdr, hdr, sizeof(*hdr));
-    instance_insert_and_upstart(inst);
+    inst = fresh;
+    instance_insert(&pax->ilist, inst);
   } else {
-    memcpy(&inst->pi_hdr, hdr, sizeof(*hdr));
-  }
+    // If we decreed a different value as an owner, find it another instance.
+    r = mencius_reclaim(inst, &fresh->pi_val);
+    if (r) {
+      instance_destroy(fresh);
+      return r;
+    }
 
-  // Unpack the value.
-  paxos_value_unpack(&inst->pi_val, o);
+    // Take on the committed value.
+    memcpy(&inst->pi_hdr, &fresh->pi_hdr, sizeof(fresh->pi_hdr));
+    memcpy(&inst->pi_val, &fresh->pi_val, sizeof(fresh->pi_val));
+    g_free(inst->pi_batch);
+    inst->pi_batch = fresh->pi_batch;
+    fresh->pi_batch = NULL;
+    instance_destroy(fresh);
+  }
 
   // Commit it.
   return paxos_commit(inst);
 }
+
+/**
+ * acceptor_ack_recommit - Fill in a batch of missing commits.
+ */
+int
+acceptor_ack_recommit(struct paxos_header *hdr, msgpack_object *o)
+{
+  int r = 0;
+  msgpack_object *p, *pend;
+  struct paxos_instance *fresh;
+
+  // Make sure the payload is well-formed.
+  assert(o->type == MSGPACK_OBJECT_ARRAY);
+  assert(o->via.array.size == 2);
+  p = o->via.array.ptr;
+
+  // If the acceptor we retried with was too busy to answer, don't count the
+  // retry against it, and make sure we ask someone else next time.
+  if (hdr->ph_inum == 0) {
+    if (pax->htries > 0) {
+      pax->htries--;
+    }
+    pax->hpeer = 0;
+    return 0;
+  }
+
+  // Cache the inlined requests first, so that we can learn the commits
+  // which decree them right away.
+  request_unpack_cache(p + 1);
+
+  // Commit in order, so that we learn as we go.  Any holes we pass over
+  // just keep our hole timer armed.
+  assert(p->type == MSGPACK_OBJECT_ARRAY);
+  pend = p->via.array.ptr + p->via.array.size;
+  p = p->via.array.ptr;
+  for (; p != pend && r == 0; ++p) {
+    fresh = instance_new();
+    paxos_instance_unpack(fresh, p);
+    r = acceptor_recommit(fresh);
+  }
+
+  return r;
+}
@@ -0,0 +1,241 @@
+/**
+ * paxos_snapshot.c - Compact snapshots of learned session state, sent to new
+ * acceptors in place of our log.
+ *
+ * A newcomer has little use for the log before its JOIN: everyone has
+ * learned all of it already, and what the newcomer needs is the state that
+ * it left behind.  So rather than the log, we send a snapshot of that state
+ * as of our last learn along with the welcome, consisting of
+ *
+ *  - the membership, which is just our alist;
+ *  - for each acceptor, the highest request ID we have learned from it, so
+ *    that the newcomer can ignore stragglers of requests which it will never
+ *    see decreed; and
+ *  - the last SNAPSHOT_CHATS chats we learned, which the newcomer hands to
+ *    its client as scrollback before anything else.
+ *
+ * The cost of joining is then bounded by the size of the snapshot and of the
+ * log from the newcomer's JOIN onward, however far truncation lags.  Every
+ * acceptor keeps the scrollback, since any of them may become the proposer.
+ *
+ * We send the same snapshot to acceptors who fell behind a truncation; see
+ * paxos_catchup.  These have already learned some of the scrollback, so
+ * each chat carries its request ID, and we skip those which are no newer
+ * than the sender's high-water mark.
+ */
+
+#include <assert.h>
+#include <glib.h>
+
+#include "common/yakyak.h"
+
+#include "paxos.h"
+#include "paxos_connect.h"
+#include "paxos_protocol.h"
+#include "paxos_state.h"
+#include "paxos_util.h"
+#include "containers/list.h"
+#include "util/paxos_buf.h"
+#include "util/paxos_io.h"
+#include "util/paxos_print.h"
+
+#define SNAPSHOT_CHATS  64              // chats kept for scrollback
+#define SNAPSHOT_BYTES  (256 * 1024)    // most scrollback sent to a newcomer
+
+/**
+ * snapshot_mark - Note that we have learned a request, raising the request
+ * ID high-water mark of its sender.
+ */
+void
+snapshot_mark(reqid_t reqid)
+{
+  struct paxos_acceptor *acc;
+
+  acc = acceptor_find(&pax->alist, reqid.id);
+  if (acc != NULL) {
+    acc->pa_reqhigh = MAX(acc->pa_reqhigh, reqid.gen);
+  }
+}
+
+/**
+ * scrollback_push - Keep a chat in our scrollback, pushing out the oldest if
+ * it is full.  We take references to the buffers behind the chat and alias
+ * rather than copying them.
+ */
+static void
+scrollback_push(reqid_t reqid, void *data, size_t size,
+    struct paxos_buf *buf, void *alias, size_t alias_size,
+    struct paxos_buf *alias_buf)
+{
+  struct paxos_scrollback *sb = &pax->scrollback;
+  struct paxos_chat *chat;
+
+  if (sb->sb_chats == NULL) {
+    sb->sb_size = SNAPSHOT_CHATS;
+    sb->sb_chats = g_new0(struct paxos_chat, sb->sb_size);
+  }
+
+  if (sb->sb_count == sb->sb_size) {
+    chat = &sb->sb_chats[sb->sb_head];
+    paxos_buf_unref(chat->pc_buf);
+    paxos_buf_unref(chat->pc_alias_buf);
+    sb->sb_head = (sb->sb_head + 1) % sb->sb_size;
+    sb->sb_count--;
+  }
+
+  chat = &sb->sb_chats[(sb->sb_head + sb->sb_count) % sb->sb_size];
+  chat->pc_reqid = reqid;
+  chat->pc_size = size;
+  chat->pc_data = data;
+  chat->pc_buf = paxos_buf_ref(buf);
+  chat->pc_alias_size = alias_size;
+  chat->pc_alias = alias;
+  chat->pc_alias_buf = paxos_buf_ref(alias_buf);
+  sb->sb_count++;
+}
+
+/**
+ * snapshot_chat - Account for a chat we have just learned.
+ */
+void
+snapshot_chat(struct paxos_request *req, struct paxos_acceptor *acc)
+{
+  acc->pa_reqhigh = MAX(acc->pa_reqhigh, req->pr_val.pv_reqid.gen);
+  scrollback_push(req->pr_val.pv_reqid, req->pr_data, req->pr_size,
+      req->pr_buf, acc->pa_desc, acc->pa_size, acc->pa_buf);
+}
+
+/**
+ * snapshot_pack - Pack a snapshot of our learned state
+ *
+ * struct {
+ *   paxid_t inum;
+ *   struct {
+ *     paxid_t paxid;
+ *     paxid_t reqhigh;
+ *   } marks[];
+ *   struct {
+ *     paxid_t id;
+ *     paxid_t gen;
+ *     char alias[];
+ *     char data[];
+ *   } chats[];
+ * }
+ *
+ * where inum is the last instance the snapshot reflects, and the chats are
+ * the most recent which fit in SNAPSHOT_BYTES, oldest first.
+ */
+void
+snapshot_pack(struct yakyak *yy)
+{
+  unsigned i, count;
+  size_t bytes;
+  struct paxos_scrollback *sb = &pax->scrollback;
+  struct paxos_acceptor *acc;
+  struct paxos_chat *chat;
+
+  yakyak_begin_array(yy, 3);
+  paxos_paxid_pack(yy, pax->ihole - 1);
+
+  yakyak_begin_array(yy, LIST_COUNT(&pax->alist));
+  LIST_FOREACH(acc, &pax->alist, pa_le) {
+    yakyak_begin_array(yy, 2);
+    paxos_paxid_pack(yy, acc->pa_paxid);
+    paxos_paxid_pack(yy, acc->pa_reqhigh);
+  }
+
+  // Count back from the newest chat until we run out of room.
+  bytes = 0;
+  for (count = 0; count < sb->sb_count; ++count) {
+    chat = &sb->sb_chats[(sb->sb_head + sb->sb_count - count - 1) %
+        sb->sb_size];
+    bytes += chat->pc_size + chat->pc_alias_size;
+    if (bytes > SNAPSHOT_BYTES) {
+      break;
+    }
+  }
+
+  yakyak_begin_array(yy, count);
+  for (i = sb->sb_count - count; i < sb->sb_count; ++i) {
+    chat = &sb->sb_chats[(sb->sb_head + i) % sb->sb_size];
+    yakyak_begin_array(yy, 4);
+    paxos_paxid_pack(yy, chat->pc_reqid.id);
+    paxos_paxid_pack(yy, chat->pc_reqid.gen);
+    msgpack_pack_raw(yy->pk, chat->pc_alias_size);
+    msgpack_pack_raw_body(yy->pk, chat->pc_alias, chat->pc_alias_size);
+    msgpack_pack_raw(yy->pk, chat->pc_size);
+    msgpack_pack_raw_body(yy->pk, chat->pc_data, chat->pc_size);
+  }
+}
+
+/**
+ * snapshot_unpack - Take on the state of a snapshot, passing those of its
+ * chats we have not yet learned on to the client as scrollback.  Our alist
+ * must already be in place.  Returns the last instance the snapshot
+ * reflects.
+ */
+paxid_t
+snapshot_unpack(msgpack_object *o)
+{
+  paxid_t inum, paxid;
+  reqid_t reqid;
+  msgpack_object *marks, *chats, *p, *pend, *alias, *data;
+  struct paxos_acceptor *acc;
+
+  // Make sure the snapshot is well-formed.
+  assert(o->type == MSGPACK_OBJECT_ARRAY);
+  assert(o->via.array.size == 3);
+  paxos_paxid_unpack(&inum, o->via.array.ptr);
+  marks = o->via.array.ptr + 1;
+  chats = o->via.array.ptr + 2;
+
+  // Deliver the scrollback, keeping our own in case we become the proposer;
+  // it refers into the message it came in rather than copying out of it.
+  // The chats are learned as having been sent under the aliases their
+  // senders had at the time.  We do this before taking on the marks, which
+  // cover every chat in the scrollback.
+  assert(chats->type == MSGPACK_OBJECT_ARRAY);
+  p = chats->via.array.ptr;
+  pend = p + chats->via.array.size;
+  if (p != pend) {
+    state.learn_buf = paxos_buf_recv();
+  }
+  for (; p != pend; ++p) {
+    assert(p->type == MSGPACK_OBJECT_ARRAY && p->via.array.size == 4);
+    paxos_paxid_unpack(&reqid.id, p->via.array.ptr);
+    paxos_paxid_unpack(&reqid.gen, p->via.array.ptr + 1);
+    alias = p->via.array.ptr + 2;
+    data = p->via.array.ptr + 3;
+    assert(alias->type == MSGPACK_OBJECT_RAW);
+    assert(data->type == MSGPACK_OBJECT_RAW);
+
+    if (request_learned(reqid)) {
+      continue;
+    }
+
+    scrollback_push(reqid, (void *)data->via.raw.ptr, data->via.raw.size,
+        state.learn_buf, (void *)alias->via.raw.ptr, alias->via.raw.size,
+        state.learn_buf);
+    history_append(inum, alias->via.raw.ptr, alias->via.raw.size,
+        data->via.raw.ptr, data->via.raw.size);
+    state.learn.chat(data->via.raw.ptr, data->via.raw.size,
+        alias->via.raw.ptr, alias->via.raw.size, pax->client_data);
+  }
+  paxos_buf_unref(state.learn_buf);
+  state.learn_buf = NULL;
+
+  // Unpack the request ID high-water marks.
+  assert(marks->type == MSGPACK_OBJECT_ARRAY);
+  p = marks->via.array.ptr;
+  pend = p + marks->via.array.size;
+  for (; p != pend; ++p) {
+    assert(p->type == MSGPACK_OBJECT_ARRAY && p->via.array.size == 2);
+    paxos_paxid_unpack(&paxid, p->via.array.ptr);
+    acc = acceptor_find(&pax->alist, paxid);
+    if (acc != NULL) {
+      paxos_paxid_unpack(&acc->pa_reqhigh, p->via.array.ptr + 1);
+    }
+  }
+
+  return inum;
+}
@@ -6,16 +6,45 @@
 
 #include "paxos.h"
 
+/* Counters for checking the allocation behavior of message dispatch. */
+struct paxos_stats {
+  unsigned long ps_allocs;            // objects, payloads and frames allocated
+  unsigned long ps_dispatched;        // messages dispatched
+  unsigned long ps_allocating;        // dispatched messages which allocated
+  unsigned long ps_retries;           // retries sent for holes in our log
+  unsigned long ps_unretried;         // holes filled without our retrying
+  unsigned long ps_hole_repeats;      // holes noted while waiting on one
+  unsigned long ps_peer_retries;      // retries sent to acceptors not proposing
+  unsigned long ps_throttled;         // retries cut short to spare live traffic
+};
+
 struct paxos_state {
   struct paxos_connect *self;         // null connection for ourselves
 
   connect_t connect;                  // callback for initiating connections
   enter_t enter;                      // callback for entering chat
   leave_t leave;                      // callback for leaving chat
+  writable_t writable;                // callback for resuming sends
   struct learn_table learn;           // callbacks for paxos_learn
+  struct paxos_buf *learn_buf;        // buffer behind the message being learned
+
+  unsigned batch_size;                // maximum number of chats per decree
+  unsigned batch_window;              // milliseconds to coalesce chats for
+  bool mencius;                       // do sessions we start share instances?
+  bool thrifty;                       // do we send decrees to a quorum only?
+  bool sync_majority;                 // do we truncate past lagging minorities?
+  bool wal;                           // do we log sessions for recovery?
+  unsigned wal_source;                // GLib source ID of the idle log sync
+  bool history;                       // do we keep chat history on disk?
 
-  session_container sessions;         // list of active Paxos sessions
+  session_container *sessions;        // hash table of active Paxos sessions
+  session_list slist;                 // list of active Paxos sessions
   connect_container *connections;     // hash table of connections
+
+  gint64 serve_tokens;                // recommit bytes we may send right now
+  gint64 serve_stamp;                 // when we last added to serve_tokens
+
+  struct paxos_stats stats;           // allocation and retry statistics
 };
 
 extern struct paxos_state state;
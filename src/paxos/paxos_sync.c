@@ -1,9 +1,24 @@
 /**
  * paxos_sync.c - Log synchronization for Paxos.
+ *
+ * The proposer periodically asks every live acceptor for its last
+ * contiguous learn and then has everyone truncate their logs up to the
+ * point that all of them have reached.  How often we do so adapts to the
+ * session: we sync every SYNC_WAIT milliseconds while the log is growing,
+ * back off exponentially while it is idle, and hurry along whenever the
+ * learned part of the log grows past SYNC_MAX_INSTANCES instances or
+ * SYNC_MAX_BYTES bytes of chats.
+ *
+ * Acceptors which are not live don't hold up truncation, and in majority
+ * mode, neither do live acceptors who are slow to learn: we truncate as far
+ * as a majority has learned.  Anyone we leave behind finds out when it asks
+ * us to retry an instance we have since dropped, and catches up from a
+ * snapshot instead; see paxos_catchup.
  */
 
 #include <assert.h>
 #include <glib.h>
+#include <stdlib.h>
 
 #include "common/yakyak.h"
 
@@ -16,33 +31,110 @@
 #include "util/paxos_io.h"
 #include "util/paxos_print.h"
 
-#define SYNC_SKIP_THRESH  30
+#define SYNC_SKIP_THRESH    30                  // syncs to wait on a stall
+#define SYNC_WAIT           1000                // ms between syncs normally
+#define SYNC_WAIT_MIN       100                 // ms between hurried syncs
+#define SYNC_WAIT_MAX       32000               // longest idle back-off, ms
+#define SYNC_MAX_INSTANCES  4096                // learns which hurry a sync
+#define SYNC_MAX_BYTES      (8 * 1024 * 1024)   // chat bytes which do also
 
 /**
- * paxos_sync - GEvent-friendly wrapper around proposer_sync.
+ * sync_schedule - Arrange for our next sync in the given number of
+ * milliseconds.
  */
-int paxos_sync(void *data)
+static void
+sync_schedule(unsigned wait)
 {
   pax_uuid_t *uuid;
 
+  if (pax->sync_source != 0) {
+    g_source_remove(pax->sync_source);
+  }
+
+  pax->sync_wait = wait;
+
+  uuid = g_malloc0(sizeof(*uuid));
+  *uuid = *pax->session_id;
+  pax->sync_source = g_timeout_add_full(G_PRIORITY_DEFAULT, wait, paxos_sync,
+      uuid, g_free);
+}
+
+/**
+ * sync_start - Start syncing the current session.
+ */
+void
+sync_start()
+{
+  sync_schedule(SYNC_WAIT);
+}
+
+/**
+ * sync_overdue - Check whether the learned part of our log has grown large
+ * enough that we should truncate it without delay.
+ */
+static bool
+sync_overdue()
+{
+  return pax->ihole - RING_BASE(&pax->ilist) > SYNC_MAX_INSTANCES ||
+      pax->sync_bytes > SYNC_MAX_BYTES;
+}
+
+/**
+ * sync_check - Hurry along our next sync if we are the proposer and our log
+ * has grown too large.  Called whenever we learn.
+ */
+void
+sync_check()
+{
+  if (is_proposer() && pax->sync_wait > SYNC_WAIT_MIN && sync_overdue()) {
+    sync_schedule(SYNC_WAIT_MIN);
+  }
+}
+
+/**
+ * paxos_sync - GEvent-friendly wrapper around proposer_sync, which also
+ * schedules the next sync.
+ */
+int paxos_sync(void *data)
+{
+  bool idle;
+
   // Set the session.  We parametrize paxos_sync with a pointer to a session
   // ID when we add it to the main event loop.
-  uuid = (pax_uuid_t *)data;
-  pax = session_find(&state.sessions, uuid);
+  pax = session_find(state.sessions, (pax_uuid_t *)data);
+  if (pax == NULL) {
+    return FALSE;
+  }
+
+  // The source is removed when we return.
+  pax->sync_source = 0;
+
+  // We've been idle if we have learned nothing since our last sync.
+  idle = (pax->ihole == pax->sync_seen);
+  pax->sync_seen = pax->ihole;
 
   if (is_proposer()) {
     proposer_sync();
   }
 
-  return TRUE;
+  if (sync_overdue()) {
+    sync_schedule(SYNC_WAIT_MIN);
+  } else if (idle) {
+    sync_schedule(MIN(MAX(2 * pax->sync_wait, SYNC_WAIT), SYNC_WAIT_MAX));
+  } else {
+    sync_schedule(SYNC_WAIT);
+  }
+
+  return FALSE;
 }
 
 /**
- * proposer_sync - Send a sync command to all acceptors.
+ * proposer_sync - Send a sync command to all live acceptors.
  *
- * For a sync to succeed, all acceptors need to tell us the instance number
- * of their last contiguous learn.  We take the minimum of these values
- * and then command everyone to truncate everything before this minimum.
+ * For a sync to succeed, all live acceptors need to tell us the instance
+ * number of their last contiguous learn.  We take the minimum of these
+ * values---or in majority mode, the highest which a majority has reached---
+ * and then command everyone to truncate everything before it.
  */
 int
 proposer_sync()
@@ -56,11 +148,6 @@ proposer_sync()
     return 1;
   }
 
-  // If not everyone is live, we should delay syncing.
-  if (pax->live_count != LIST_COUNT(&pax->alist)) {
-    return 1;
-  }
-
   // If our local last contiguous learn is the same as the previous sync
   // point, we don't need to sync.
   if (pax->ihole - 1 == pax->sync_prev) {
@@ -69,20 +156,27 @@ proposer_sync()
 
   // If we're already syncing, increment the skip counter.
   if (pax->sync != NULL) {
+    // In majority mode, don't wait on stragglers once a majority has acked.
+    if (state.sync_majority && pax->sync->ps_acks >= majority()) {
+      header_init(&hdr, OP_LAST, pax->sync_id);
+      return proposer_truncate(&hdr);
+    }
+
     // Resync if we've waited too long for the sync to finish.
     if (++pax->sync->ps_skips < SYNC_SKIP_THRESH) {
       return 1;
     } else {
-      g_free(pax->sync);
+      sync_destroy(pax->sync);
     }
   }
 
-  // Create a new sync.
+  // Create a new sync.  Acceptors who aren't live won't hear it, so we
+  // don't wait on them.
   pax->sync = g_malloc0(sizeof(*(pax->sync)));
-  pax->sync->ps_total = LIST_COUNT(&pax->alist);
+  pax->sync->ps_total = pax->live_count;
   pax->sync->ps_acks = 1;  // Including ourselves.
   pax->sync->ps_skips = 0;
-  pax->sync->ps_last = 0;
+  pax->sync->ps_lasts = g_new0(paxid_t, pax->sync->ps_total);
 
   // Initialize a header.
   header_init(&hdr, OP_SYNC, ++pax->sync_id);
@@ -92,8 +186,16 @@ proposer_sync()
   paxos_header_pack(&yy, &hdr);
   r = paxos_broadcast(&yy);
   yakyak_destroy(&yy);
+  if (r) {
+    return r;
+  }
 
-  return r;
+  // If no one else is live, we're already done.
+  if (pax->sync->ps_acks == pax->sync->ps_total) {
+    return proposer_truncate(&hdr);
+  }
+
+  return 0;
 }
 
 /**
@@ -141,18 +243,15 @@ int acceptor_last(struct paxos_header *hdr)
 int
 proposer_ack_last(struct paxos_header *hdr, msgpack_object *o)
 {
-  paxid_t last;
-
-  // Ignore replies to older sync commands.
-  if (hdr->ph_inum != pax->sync_id) {
+  // Ignore replies to older sync commands, including late replies to the
+  // latest sync if it has already completed.
+  if (pax->sync == NULL || hdr->ph_inum != pax->sync_id ||
+      pax->sync->ps_acks == pax->sync->ps_total) {
     return 0;
   }
 
-  // Update our knowledge of the system's last contiguous learn.
-  paxos_paxid_unpack(&last, o);
-  if (last < pax->sync->ps_last || pax->sync->ps_last == 0) {
-    pax->sync->ps_last = last;
-  }
+  // Record the acceptor's last contiguous learn.
+  paxos_paxid_unpack(&pax->sync->ps_lasts[pax->sync->ps_acks], o);
 
   // Increment acks and command a truncate if the sync is over.
   pax->sync->ps_acks++;
@@ -163,56 +262,218 @@ proposer_ack_last(struct paxos_header *hdr, msgpack_object *o)
   return 0;
 }
 
+/**
+ * sync_compare - Order last contiguous learns from latest to earliest.
+ */
+static int
+sync_compare(const void *p1, const void *p2)
+{
+  paxid_t l1 = *(const paxid_t *)p1;
+  paxid_t l2 = *(const paxid_t *)p2;
+
+  return l1 > l2 ? -1 : (l1 < l2);
+}
+
+/**
+ * sync_point - Work out how far to truncate from the lasts we've been sent,
+ * returning 0 if there weren't enough of them.
+ */
+static paxid_t
+sync_point()
+{
+  unsigned i, acks = pax->sync->ps_acks;
+  paxid_t point, *lasts = pax->sync->ps_lasts;
+
+  // Obtain our own last contiguous learn.
+  lasts[0] = pax->ihole - 1;
+
+  // In majority mode, find the last learn which a majority has reached.  We
+  // never truncate past what we have learned ourselves, though, since we may
+  // still be filling holes which the majority is beyond.
+  if (state.sync_majority) {
+    if (acks < majority()) {
+      return 0;
+    }
+    qsort(lasts, acks, sizeof(*lasts), sync_compare);
+    return MIN(lasts[majority() - 1], pax->ihole - 1);
+  }
+
+  point = lasts[0];
+  for (i = 1; i < acks; ++i) {
+    point = MIN(point, lasts[i]);
+  }
+  return point;
+}
+
+/**
+ * instance_deferred - Check whether an instance is on our idefer list.  Only
+ * the instances we have deferred are live without an instance number.
+ */
+static bool
+instance_deferred(struct paxos_instance *inst)
+{
+  struct paxos_instance *prev = LIST_PREV(inst, pi_le);
+
+  if (inst->pi_hdr.ph_inum != 0 || prev == NULL) {
+    return false;
+  } else if (prev == (void *)&pax->idefer) {
+    return LIST_FIRST(&pax->idefer) == inst;
+  } else {
+    return LIST_NEXT(prev, pi_le) == inst;
+  }
+}
+
+/**
+ * epoch_compact_instance - Move an instance surviving in a stale epoch into
+ * the current one, in place in whichever of our containers holds it.
+ */
+static void
+epoch_compact_instance(struct paxos_instance *inst)
+{
+  paxid_t inum = inst->pi_hdr.ph_inum;
+  struct paxos_instance **slot, *prev;
+
+  if (inum != 0 && instance_find(&pax->ilist, inum) == inst) {
+    slot = RING_SLOT(&pax->ilist, inum - RING_BASE(&pax->ilist));
+    *slot = instance_move(inst);
+  } else if (instance_deferred(inst)) {
+    // Deferred instances keep their order.
+    prev = LIST_PREV(inst, pi_le);
+    LIST_REMOVE(&pax->idefer, inst, pi_le);
+    inst = instance_move(inst);
+    if (prev == (void *)&pax->idefer) {
+      LIST_INSERT_HEAD(&pax->idefer, inst, pi_le);
+    } else {
+      LIST_INSERT_AFTER(&pax->idefer, prev, inst, pi_le);
+    }
+  }
+}
+
+/**
+ * epoch_compact - Move whatever is still alive in stale epochs into the
+ * current one, so that a few long-lived instances and requests can't pin
+ * whole epochs in memory.  We visit only the survivors of stale epochs, not
+ * everything we hold.
+ *
+ * Moving the last survivor of an epoch releases it, so we count the
+ * survivors up front rather than check the epoch's lists as we go.
+ */
+static void
+epoch_compact()
+{
+  unsigned ninsts, nreqs;
+  struct paxos_epoch *epoch, *enext;
+  struct paxos_instance *inst, *inext;
+  struct paxos_request *req, *rnext;
+
+  for (epoch = LIST_FIRST(&pax->epochs); epoch_stale(&pax->epochs, epoch);
+      epoch = enext) {
+    enext = LIST_NEXT(epoch, pe_le);
+    ninsts = LIST_COUNT(&epoch->pe_insts);
+    nreqs = LIST_COUNT(&epoch->pe_reqs);
+
+    for (inst = LIST_FIRST(&epoch->pe_insts); ninsts > 0; --ninsts,
+        inst = inext) {
+      inext = LIST_NEXT(inst, pi_ele);
+      epoch_compact_instance(inst);
+    }
+
+    // Requests outside our cache are left where they are.  If there are
+    // none to visit, the epoch may already be gone.
+    req = nreqs > 0 ? LIST_FIRST(&epoch->pe_reqs) : NULL;
+    for (; nreqs > 0; --nreqs, req = rnext) {
+      rnext = LIST_NEXT(req, pr_ele);
+      if (request_find(&pax->rcache, req->pr_val.pv_reqid) == req) {
+        request_replace(&pax->rcache, req, request_move(req));
+      }
+    }
+  }
+}
+
 /**
  * Truncate an ilist up to (but not including) a given inum.
  *
  * We also free all associated requests.
  */
-static void
+void
 ilist_truncate_prefix(instance_container *ilist, paxid_t inum)
 {
-  struct paxos_instance *it;
+  paxid_t it;
+  unsigned i;
+  struct paxos_instance *inst;
   struct paxos_request *req;
 
-  for (it = LIST_FIRST(ilist); it != (void *)ilist; it = LIST_FIRST(ilist)) {
-    // Break if we've hit the desired stopping point.
-    if (it->pi_hdr.ph_inum >= inum) {
-      break;
+  // Free the requests associated with the instances being dropped.
+  for (it = RING_BASE(ilist); it < inum && it < RING_END(ilist); ++it) {
+    inst = instance_find(ilist, it);
+    if (inst == NULL) {
+      continue;
     }
 
-    // Free the instance and its associated request.
-    req = request_find(&pax->rcache, it->pi_val.pv_reqid);
+    req = request_find(&pax->rcache, inst->pi_val.pv_reqid);
     if (req != NULL) {
-      LIST_REMOVE(&pax->rcache, req, pr_le);
+      request_remove(&pax->rcache, req);
       request_destroy(req);
     }
-    LIST_REMOVE(ilist, it, pi_le);
-    instance_destroy(it);
+
+    // Batches also own the requests of each of their members.
+    for (i = 0; inst->pi_batch != NULL && i < inst->pi_val.pv_extra; ++i) {
+      req = request_find(&pax->rcache, inst->pi_batch[i]);
+      if (req != NULL) {
+        request_remove(&pax->rcache, req);
+        request_destroy(req);
+      }
+    }
   }
+
+  // Free the instances and advance the head of the log.
+  instance_truncate(ilist, inum);
+
+  // Everything we had learned is gone.  We don't track which instances our
+  // chat bytes came from, so any learned past the truncation point are
+  // forgotten as well; this only delays the next hurried sync.
+  pax->sync_bytes = 0;
+
+  // Everything allocated from here on is newer than the truncation point,
+  // so start a new epoch; older epochs are released as they drain.
+  epoch_open(&pax->epochs, inum);
+  epoch_compact();
+
+#ifdef DEBUG
+  paxos_epoch_list_print(&pax->epochs, "", "\n");
+  paxos_stats_print(&state.stats, "", "\n");
+#endif
 }
 
 /**
  * proposer_truncate - Command all acceptors to drop the contiguous prefix
- * of Paxos instances for which every participant has learned.
+ * of Paxos instances which every live participant (or a majority of them)
+ * has learned.
  */
 int
 proposer_truncate(struct paxos_header *hdr)
 {
   int r;
+  paxid_t point;
   struct yakyak yy;
 
-  // Obtain our own last contiguous learn.
-  if (pax->ihole - 1 < pax->sync->ps_last) {
-    pax->sync->ps_last = pax->ihole - 1;
+  // Find the truncation point and end the sync.
+  point = sync_point();
+  sync_destroy(pax->sync);
+  pax->sync = NULL;
+
+  // An acceptor who has just come back may not even have reached our base,
+  // in which case there's nothing to do until it catches up.
+  if (point <= pax->ibase) {
+    return 0;
   }
 
   // Record the sync point.
-  pax->sync_prev = pax->sync->ps_last;
+  pax->sync_prev = point;
 
   // Make this instance our new ibase; this ensures that our list always has
   // at least one committed instance.
-  assert(pax->sync->ps_last >= pax->ibase);
-  pax->ibase = pax->sync->ps_last;
+  pax->ibase = point;
 
   // Modify the header.
   hdr->ph_opcode = OP_TRUNCATE;
@@ -229,24 +490,36 @@ proposer_truncate(struct paxos_header *hdr)
     return r;
   }
 
-  // Do the truncate (< pax->ibase).
+  // Do the truncate (< pax->ibase), and log it.
   ilist_truncate_prefix(&pax->ilist, pax->ibase);
 
-  // End the sync.
-  g_free(pax->sync);
-  pax->sync = NULL;
-
-  return 0;
+  return wal_truncate();
 }
 
+/**
+ * acceptor_ack_truncate - Drop the prefix of our log that the proposer
+ * tells us to.
+ */
 int
 acceptor_ack_truncate(struct paxos_header *hdr, msgpack_object *o)
 {
+  paxid_t ibase;
+
   // Unpack the new ibase.
-  paxos_paxid_unpack(&pax->ibase, o);
+  paxos_paxid_unpack(&ibase, o);
 
-  // Do the truncate (< pax->ibase).
+  // If we haven't learned everything being truncated, we'll never hear of
+  // it again.  Ask the proposer for our hole, which it will answer with a
+  // catch-up.
+  if (ibase > pax->ihole) {
+    return acceptor_retry(pax->ihole, ibase);
+  }
+
+  // Do the truncate (< pax->ibase), recording the sync point in case we
+  // become the proposer.
+  pax->ibase = ibase;
+  pax->sync_prev = ibase;
   ilist_truncate_prefix(&pax->ilist, pax->ibase);
 
-  return 0;
+  return wal_truncate();
 }
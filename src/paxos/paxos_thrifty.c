@@ -0,0 +1,352 @@
+/**
+ * paxos_thrifty.c - Sending decrees to just enough acceptors to choose them.
+ *
+ * A decree is chosen once a majority of acceptors accept it, so in a large
+ * session, broadcasting it to every acceptor spends nearly half of our
+ * egress on votes we will never need.  In thrifty mode, we instead pick out
+ * a quorum of majority() - 1 other live acceptors, preferring those which
+ * have been quickest to return our accepts, and send our decrees to them
+ * alone.  Everyone else hears of the decree only when we commit it, by way
+ * of an explicit commit carrying the value.
+ *
+ * If any member of the quorum fails to vote promptly, we cannot commit
+ * without the others, so once a decree has waited too long, we send it and
+ * every other decree still waiting on the quorum to the rest of the
+ * acceptors, penalize the members who have gone quiet, and choose a new
+ * quorum.  We also choose anew every THRIFTY_RESELECT decrees, which gives
+ * acceptors we have never measured a chance to join the quorum.
+ *
+ * Each acceptor must receive a decree at most once under a given ballot,
+ * since we count votes rather than voters.  We thus only ever change the
+ * quorum once every outstanding thrifty decree has been sent to everyone.
+ */
+
+#include <assert.h>
+#include <glib.h>
+#include <stdlib.h>
+
+#include "common/yakyak.h"
+
+#include "paxos.h"
+#include "paxos_connect.h"
+#include "paxos_protocol.h"
+#include "paxos_state.h"
+#include "paxos_util.h"
+#include "containers/list.h"
+#include "util/paxos_io.h"
+#include "util/paxos_print.h"
+
+#define THRIFTY_MIN_ACCEPTORS   5     // smallest session worth being thrifty in
+#define THRIFTY_RESELECT        1024  // decrees between choosing quorums
+#define THRIFTY_RTT_WEIGHT      8     // inverse weight of a new RTT sample
+#define THRIFTY_WAIT_FACTOR     4     // multiple of the slowest RTT to wait
+#define THRIFTY_WAIT_MIN        200   // least milliseconds to wait for votes
+
+/**
+ * thrifty_decrees - Check whether we should send a decree of the given kind
+ * to just a quorum of acceptors.  Decrees which must be committed explicitly
+ * already go to everyone, and the proposer relies on hearing from every
+ * acceptor to settle contested parts, so we only spare the others decrees
+ * whose commits can ride along with our watermark.
+ */
+bool
+thrifty_decrees(dkind_t dkind)
+{
+  return state.thrifty && !commit_needs_sent(dkind) &&
+      LIST_COUNT(&pax->alist) >= THRIFTY_MIN_ACCEPTORS;
+}
+
+/**
+ * thrifty_send - Pack an instance and send it to the live acceptors either
+ * in or out of the quorum.
+ */
+static int
+thrifty_send(struct paxos_instance *inst, bool members)
+{
+  int r = 0;
+  struct paxos_acceptor *acc;
+  struct paxos_frame *frame;
+  struct yakyak yy;
+
+  yakyak_init(&yy, 2);
+  paxos_header_pack(&yy, &inst->pi_hdr);
+  paxos_value_pack_batch(&yy, &inst->pi_val, inst->pi_batch);
+  frame = paxos_frame_new(&yy);
+  yakyak_destroy(&yy);
+
+  LIST_FOREACH(acc, &pax->alist, pa_le) {
+    if (acc->pa_peer == NULL || acc->pa_thrifty != members) {
+      continue;
+    }
+
+    ERR_ACCUM(r, paxos_peer_send_frame(acc->pa_peer, frame));
+  }
+
+  paxos_frame_unref(frame);
+  return r;
+}
+
+/**
+ * thrifty_pending - Get the first of our decrees which is still waiting on
+ * the quorum, or NULL if there are none.
+ */
+static struct paxos_instance *
+thrifty_pending()
+{
+  paxid_t inum;
+  struct paxos_instance *inst;
+
+  for (inum = pax->ihole; inum < RING_END(&pax->ilist); ++inum) {
+    inst = instance_find(&pax->ilist, inum);
+    if (inst != NULL && inst->pi_thrifty && !inst->pi_committed) {
+      return inst;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * thrifty_fallback - Send every decree still waiting on the quorum to the
+ * rest of the acceptors.
+ */
+static int
+thrifty_fallback()
+{
+  int r = 0;
+  paxid_t inum;
+  struct paxos_instance *inst;
+
+  for (inum = pax->ihole; inum < RING_END(&pax->ilist); ++inum) {
+    inst = instance_find(&pax->ilist, inum);
+    if (inst == NULL || !inst->pi_thrifty) {
+      continue;
+    }
+    inst->pi_thrifty = false;
+
+    // Skip anything which has since been committed, or which another
+    // decree has taken over.
+    if (inst->pi_committed || inst->pi_hdr.ph_opcode != OP_DECREE ||
+        inst->pi_hdr.ph_ballot.id != pax->self_id ||
+        inst->pi_hdr.ph_ballot.gen != pax->ballot.gen) {
+      continue;
+    }
+
+    ERR_ACCUM(r, thrifty_send(inst, false));
+  }
+
+  return r;
+}
+
+/**
+ * thrifty_compare - Order acceptors by their smoothed RTTs, with acceptors
+ * we have not yet measured first.
+ */
+static int
+thrifty_compare(const void *p1, const void *p2)
+{
+  const struct paxos_acceptor *a1 = *(struct paxos_acceptor * const *)p1;
+  const struct paxos_acceptor *a2 = *(struct paxos_acceptor * const *)p2;
+
+  if (a1->pa_srtt != a2->pa_srtt) {
+    return a1->pa_srtt < a2->pa_srtt ? -1 : 1;
+  }
+  return a1->pa_paxid < a2->pa_paxid ? -1 : (a1->pa_paxid > a2->pa_paxid);
+}
+
+/**
+ * thrifty_select - Choose a new quorum of the fastest live acceptors.
+ * Returns false if there are too few live acceptors to make one.
+ */
+static bool
+thrifty_select()
+{
+  unsigned i, n, need;
+  gint64 slowest;
+  struct paxos_acceptor *acc, **live;
+
+  pax->tdecrees = 0;
+  need = majority() - 1;
+
+  live = g_new(struct paxos_acceptor *, LIST_COUNT(&pax->alist));
+  n = 0;
+  LIST_FOREACH(acc, &pax->alist, pa_le) {
+    acc->pa_thrifty = false;
+    if (acc->pa_peer != NULL && acc->pa_paxid != pax->self_id) {
+      live[n++] = acc;
+    }
+  }
+
+  if (n < need) {
+    g_free(live);
+    return false;
+  }
+
+  qsort(live, n, sizeof(*live), thrifty_compare);
+
+  slowest = 0;
+  for (i = 0; i < need; ++i) {
+    live[i]->pa_thrifty = true;
+    slowest = MAX(slowest, live[i]->pa_srtt);
+  }
+  g_free(live);
+
+  // Wait a few of the slowest member's round trips for votes.
+  pax->twait = MAX(THRIFTY_WAIT_MIN,
+      slowest * THRIFTY_WAIT_FACTOR / 1000);
+
+  return true;
+}
+
+/**
+ * thrifty_valid - Check that every member of the quorum is still live and
+ * that there are enough of them.
+ */
+static bool
+thrifty_valid()
+{
+  unsigned count = 0;
+  struct paxos_acceptor *acc;
+
+  LIST_FOREACH(acc, &pax->alist, pa_le) {
+    if (acc->pa_thrifty) {
+      if (acc->pa_peer == NULL) {
+        return false;
+      }
+      count++;
+    }
+  }
+
+  return count == majority() - 1;
+}
+
+/**
+ * thrifty_timeout - Fall back to the rest of the acceptors if the oldest of
+ * our thrifty decrees has waited too long for the quorum.
+ */
+static int
+thrifty_timeout(void *data)
+{
+  unsigned waited;
+  struct paxos_acceptor *acc;
+  struct paxos_instance *inst;
+  pax_uuid_t *uuid;
+
+  // Set the session.  We parametrize the source with a pointer to a session
+  // ID when we add it to the main event loop.
+  pax = session_find(state.sessions, (pax_uuid_t *)data);
+  if (pax == NULL) {
+    return FALSE;
+  }
+
+  // The source is removed when we return.
+  pax->tsource = 0;
+
+  inst = thrifty_pending();
+  if (inst == NULL) {
+    return FALSE;
+  }
+
+  // If the oldest decree hasn't waited long enough yet, wait out the rest.
+  waited = (g_get_monotonic_time() - inst->pi_sent) / 1000;
+  if (waited < pax->twait) {
+    uuid = g_malloc0(sizeof(*uuid));
+    *uuid = *pax->session_id;
+    pax->tsource = g_timeout_add_full(G_PRIORITY_DEFAULT,
+        pax->twait - waited, thrifty_timeout, uuid, g_free);
+    return FALSE;
+  }
+
+  // Anyone in the quorum who hasn't voted since we sent the decree is at
+  // least as slow as our patience.
+  LIST_FOREACH(acc, &pax->alist, pa_le) {
+    if (acc->pa_thrifty && acc->pa_heard < inst->pi_sent) {
+      acc->pa_srtt = MAX(2 * acc->pa_srtt, (gint64)pax->twait * 1000);
+    }
+  }
+
+  thrifty_fallback();
+  thrifty_select();
+
+  return FALSE;
+}
+
+/**
+ * thrifty_decree - Send a decree to the quorum, choosing a new quorum first
+ * if need be.  If there is no quorum to be had, we broadcast it.
+ */
+int
+thrifty_decree(struct paxos_instance *inst)
+{
+  int r;
+  pax_uuid_t *uuid;
+
+  if (pax->tdecrees >= THRIFTY_RESELECT || !thrifty_valid()) {
+    ERR_RET(r, thrifty_fallback());
+    if (!thrifty_select()) {
+      return paxos_broadcast_instance(inst);
+    }
+  }
+  pax->tdecrees++;
+
+  inst->pi_thrifty = true;
+  inst->pi_sent = g_get_monotonic_time();
+  ERR_RET(r, thrifty_send(inst, true));
+
+  if (pax->tsource == 0) {
+    uuid = g_malloc0(sizeof(*uuid));
+    *uuid = *pax->session_id;
+    pax->tsource = g_timeout_add_full(G_PRIORITY_DEFAULT, pax->twait,
+        thrifty_timeout, uuid, g_free);
+  }
+
+  return 0;
+}
+
+/**
+ * thrifty_commit - Send a commit to the acceptors who never received the
+ * decree, along with our commit watermark.
+ */
+int
+thrifty_commit(struct paxos_instance *inst)
+{
+  int r;
+
+  inst->pi_hdr.ph_commit = pax->ihole - 1;
+  r = thrifty_send(inst, false);
+  inst->pi_hdr.ph_commit = 0;
+
+  return r;
+}
+
+/**
+ * thrifty_sample - Fold the round trip of an accept from a member of the
+ * quorum into its smoothed RTT.
+ */
+void
+thrifty_sample(struct paxos_peer *source, paxid_t inum)
+{
+  gint64 now, rtt;
+  struct paxos_acceptor *acc;
+  struct paxos_instance *inst;
+
+  inst = instance_find(&pax->ilist, inum);
+  if (inst == NULL || !inst->pi_thrifty) {
+    return;
+  }
+
+  acc = peer_acceptor(source);
+  if (acc == NULL || !acc->pa_thrifty) {
+    return;
+  }
+
+  now = g_get_monotonic_time();
+  rtt = MAX(now - inst->pi_sent, 1);
+
+  if (acc->pa_srtt == 0) {
+    acc->pa_srtt = rtt;
+  } else {
+    acc->pa_srtt += (rtt - acc->pa_srtt) / THRIFTY_RTT_WEIGHT;
+  }
+  acc->pa_heard = now;
+}
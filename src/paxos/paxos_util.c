@@ -48,12 +48,17 @@ reset_proposer()
 }
 
 /**
- * next_instance - Gets the next free instance number.
+ * next_instance - Gets the next free instance number.  If acceptors own
+ * instances of their own, this is the next of ours, or 0 if we can't decree
+ * in one yet.
  */
 paxid_t
 next_instance()
 {
-  return LIST_EMPTY(&pax->ilist) ? 1 : LIST_LAST(&pax->ilist)->pi_hdr.ph_inum + 1;
+  if (pax->mencius) {
+    return mencius_next();
+  }
+  return RING_EMPTY(&pax->ilist) ? 1 : RING_END(&pax->ilist);
 }
 
 /**
@@ -75,27 +80,123 @@ request_needs_cached(dkind_t dkind)
   return (dkind == DEC_CHAT || dkind == DEC_JOIN);
 }
 
-///////////////////////////////////////////////////////////////////////////
-//
-//  Protocol utilities.
-//
+/**
+ * commit_needs_sent - Convenience function for denoting which dkinds must be
+ * committed with an explicit commit rather than by a commit watermark.
+ *
+ * These are the decrees which change membership.  Parts in particular may
+ * be replaced by null decrees at the same ballot, so acceptors cannot infer
+ * their committed value from the decree they accepted.
+ */
+int
+commit_needs_sent(dkind_t dkind)
+{
+  return (dkind == DEC_JOIN || dkind == DEC_PART || dkind == DEC_KILL);
+}
 
 /**
- * instance_insert_and_upstart - Insert a newly allocated instance into the
- * ilist and update istart.
+ * instance_has_requests - Check whether every request decreed by an instance
+ * is in our request cache.
  */
-void
-instance_insert_and_upstart(struct paxos_instance *inst)
+int
+instance_has_requests(struct paxos_instance *inst)
+{
+  unsigned i;
+
+  if (inst->pi_val.pv_dkind == DEC_BATCH) {
+    for (i = 0; i < inst->pi_val.pv_extra; ++i) {
+      if (request_find(&pax->rcache, inst->pi_batch[i]) == NULL) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  return !request_needs_cached(inst->pi_val.pv_dkind) ||
+      request_find(&pax->rcache, inst->pi_val.pv_reqid) != NULL;
+}
+
+/**
+ * instance_nrequests - The number of requests an instance decrees.
+ */
+unsigned
+instance_nrequests(struct paxos_instance *inst)
+{
+  if (inst->pi_val.pv_dkind == DEC_BATCH) {
+    return inst->pi_val.pv_extra;
+  }
+  return request_needs_cached(inst->pi_val.pv_dkind) ? 1 : 0;
+}
+
+/**
+ * instance_request - Find the ith request decreed by an instance in our
+ * request cache, or return NULL if we don't have it.
+ */
+struct paxos_request *
+instance_request(struct paxos_instance *inst, unsigned i)
+{
+  if (inst->pi_val.pv_dkind == DEC_BATCH) {
+    return request_find(&pax->rcache, inst->pi_batch[i]);
+  }
+  return request_find(&pax->rcache, inst->pi_val.pv_reqid);
+}
+
+/**
+ * request_learned - Check whether a request is no newer than the last one
+ * we learned from its sender.  An acceptor's requests are decreed in the
+ * order it makes them, barring the odd one rerouted after a change of
+ * proposer, so such a request has almost certainly been learned already.
+ */
+int
+request_learned(reqid_t reqid)
+{
+  struct paxos_acceptor *acc;
+
+  acc = acceptor_find(&pax->alist, reqid.id);
+  return acc != NULL && reqid.gen <= acc->pa_reqhigh;
+}
+
+/**
+ * peer_acceptor - Find the acceptor of the current session at the other end
+ * of a peer, or NULL if it is not one of ours.
+ */
+struct paxos_acceptor *
+peer_acceptor(struct paxos_peer *peer)
+{
+  struct paxos_acceptor *acc;
+
+  LIST_FOREACH(acc, paxos_peer_acceptors(peer), pa_peer_le) {
+    if (acc->pa_session == pax) {
+      return acc;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * session_congested - Check whether the connection to any acceptor in the
+ * session is backed up, in which case we should not take on new requests.
+ */
+int
+session_congested()
 {
-  // Insert into the ilist.
-  instance_insert(&pax->ilist, inst);
+  struct paxos_acceptor *acc;
 
-  // Update istart if we just instantiated the hole.
-  if (inst->pi_hdr.ph_inum == pax->ihole) {
-    pax->istart = inst;
+  LIST_FOREACH(acc, &pax->alist, pa_le) {
+    if (acc->pa_peer != NULL && paxos_peer_congested(acc->pa_peer)) {
+      return true;
+    }
   }
+
+  return false;
 }
 
+///////////////////////////////////////////////////////////////////////////
+//
+//  Protocol utilities.
+//
+
 /**
  * paxos_broadcast_instance - Pack the header and value of an instance and
  * broadcast.
@@ -108,7 +209,7 @@ paxos_broadcast_instance(struct paxos_instance *inst)
 
   yakyak_init(&yy, 2);
   paxos_header_pack(&yy, &(inst->pi_hdr));
-  paxos_value_pack(&yy, &(inst->pi_val));
+  paxos_value_pack_batch(&yy, &inst->pi_val, inst->pi_batch);
   r = paxos_broadcast(&yy);
   yakyak_destroy(&yy);
 
@@ -121,9 +222,13 @@ paxos_broadcast_instance(struct paxos_instance *inst)
 int
 proposer_decree_part(struct paxos_acceptor *acc, int force)
 {
+  int r;
   struct paxos_instance *inst;
 
-  inst = g_malloc0(sizeof(*inst));
+  // Don't let the part overtake any chats we are batching.
+  ERR_RET(r, proposer_batch_flush());
+
+  inst = instance_new();
 
   if (force) {
     inst->pi_val.pv_dkind = DEC_KILL;
@@ -148,12 +253,20 @@ proposer_decree_part(struct paxos_acceptor *acc, int force)
 //
 
 /**
- * Send a message to any acceptor.
+ * Send a message to any acceptor.  The message is handed off to the peer
+ * without copying, leaving the yak empty.
  */
 int
 paxos_send(struct paxos_acceptor *acc, struct yakyak *yy)
 {
-  return paxos_peer_send(acc->pa_peer, yakyak_data(yy), yakyak_size(yy));
+  int r;
+  struct paxos_frame *frame;
+
+  frame = paxos_frame_new(yy);
+  r = paxos_peer_send_frame(acc->pa_peer, frame);
+  paxos_frame_unref(frame);
+
+  return r;
 }
 
 /**
@@ -170,21 +283,26 @@ paxos_send_to_proposer(struct yakyak *yy)
 }
 
 /**
- * Broadcast a message to all acceptors.
+ * Broadcast a message to all acceptors.  The message is serialized once and
+ * the resulting frame is shared by every peer, leaving the yak empty.
  */
 int
 paxos_broadcast(struct yakyak *yy)
 {
   int r = 0;
   struct paxos_acceptor *acc;
+  struct paxos_frame *frame;
+
+  frame = paxos_frame_new(yy);
 
   LIST_FOREACH(acc, &(pax->alist), pa_le) {
     if (acc->pa_peer == NULL) {
       continue;
     }
 
-    ERR_ACCUM(r, paxos_send(acc, yy));
+    ERR_ACCUM(r, paxos_peer_send_frame(acc->pa_peer, frame));
   }
 
+  paxos_frame_unref(frame);
   return r;
 }
@@ -21,10 +21,16 @@ inline int is_proposer(void);
 inline void reset_proposer(void);
 inline paxid_t next_instance(void);
 inline int request_needs_cached(dkind_t dkind);
+inline int commit_needs_sent(dkind_t dkind);
 unsigned majority(void);
+int instance_has_requests(struct paxos_instance *);
+unsigned instance_nrequests(struct paxos_instance *);
+struct paxos_request *instance_request(struct paxos_instance *, unsigned);
+int session_congested(void);
+int request_learned(reqid_t);
+struct paxos_acceptor *peer_acceptor(struct paxos_peer *);
 
 /* Protocol utilities. */
-void instance_insert_and_upstart(struct paxos_instance *);
 int paxos_broadcast_instance(struct paxos_instance *);
 int proposer_decree_part(struct paxos_acceptor *, int force);
 
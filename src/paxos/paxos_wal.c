@@ -0,0 +1,775 @@
+/**
+ * paxos_wal.c - Write-ahead log of acceptor state, for recovering sessions
+ * after a crash.
+ *
+ * When logging is enabled, each session keeps an append-only log under
+ * WAL_DIR in the Motmot home directory, named after its session ID.  The log
+ * is a stream of msgpack records, each a pair of a record type and a body:
+ *
+ *  - WAL_SESSION: [session_id, self_id, req_id, mencius]
+ *  - WAL_BALLOT: [ballot.id, ballot.gen, gen_high]
+ *  - WAL_CHECKPOINT: [ibase, alist, snapshot]
+ *  - WAL_INSTANCE: [instance, requests], where requests holds whichever of
+ *    the requests decreed by a committed instance we have cached
+ *
+ * A log always opens with a session, a ballot, and a checkpoint, followed by
+ * every instance we had at the time.  Every promise we make, and every vote
+ * we cast, whether by accepting or by decreeing, is appended before we let
+ * anyone know of it, as is every commit once we have its requests.
+ *
+ * A truncation appends a further checkpoint, which supersedes everything
+ * logged before it.  Only once the log has grown to WAL_REWRITE_RATIO times
+ * its size when last written afresh (and past WAL_REWRITE_MIN) do we rewrite
+ * it from our current state, so that its size stays within a constant factor
+ * of how much we keep in memory without copying it all at every truncation.
+ *
+ * Appends are only written, not synced.  Instead, we fdatasync a session's
+ * log just before we send out anything which depends on it: promises,
+ * prepares, commits, and our pending accepts, which are themselves held
+ * until the end of the pass of the main loop.  All the votes cast in a pass
+ * thus share a single sync, and anything else we appended is synced once
+ * the main loop goes idle.
+ *
+ * On startup, the client may recover the sessions we were logging: each is
+ * rebuilt from its log much as if we had been welcomed to it, is handed to
+ * the client, and says hello to the rest of its acceptors.  If the session
+ * parted us in the meantime, we find out as soon as we catch up, and leave.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <unistd.h>
+
+#include "common/yakyak.h"
+#include "config.h"
+
+#include "paxos.h"
+#include "paxos_connect.h"
+#include "paxos_protocol.h"
+#include "paxos_state.h"
+#include "paxos_util.h"
+#include "containers/list.h"
+#include "util/paxos_buf.h"
+#include "util/paxos_io.h"
+#include "util/paxos_print.h"
+
+#define WAL_DIR             "wal"         // directory of our logs in the home
+#define WAL_BUFSIZE         (64 * 1024)   // bytes read at once during recovery
+#define WAL_REQID_SKIP      (1 << 16)     // request IDs skipped on recovery
+#define WAL_REWRITE_RATIO   4             // growth of our log before rewriting
+#define WAL_REWRITE_MIN     (1024 * 1024) // size our log may always grow to
+
+enum wal_record {
+  WAL_SESSION,
+  WAL_BALLOT,
+  WAL_CHECKPOINT,
+  WAL_INSTANCE,
+};
+
+/**
+ * wal_path - Get the path of a session's log, or of the file we write its
+ * replacement to.  The caller must g_free the path.
+ */
+static char *
+wal_path(pax_uuid_t *uuid, bool tmp)
+{
+  char name[32];
+
+  g_snprintf(name, sizeof(name), "%016" G_GINT64_MODIFIER "x.%s",
+      (guint64)*uuid, tmp ? "tmp" : "wal");
+  return g_build_filename(motmot_home_dir(), WAL_DIR, name, NULL);
+}
+
+/**
+ * wal_write - Write a packed record out to a log in full.
+ */
+static int
+wal_write(int fd, struct yakyak *yy)
+{
+  ssize_t n;
+  size_t size;
+  char *data;
+
+  data = yakyak_data(yy);
+  size = yakyak_size(yy);
+  while (size > 0) {
+    n = write(fd, data, size);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      g_warning("wal_write: Write to log failed.");
+      return 1;
+    }
+    data += n;
+    size -= n;
+  }
+
+  return 0;
+}
+
+/**
+ * wal_pack_session - Pack a record of our identity in the session.
+ */
+static void
+wal_pack_session(struct yakyak *yy)
+{
+  msgpack_pack_int(yy->pk, WAL_SESSION);
+  yakyak_begin_array(yy, 4);
+  paxos_uuid_pack(yy, pax->session_id);
+  paxos_paxid_pack(yy, pax->self_id);
+  paxos_paxid_pack(yy, pax->req_id);
+  pax->mencius ? msgpack_pack_true(yy->pk) : msgpack_pack_false(yy->pk);
+}
+
+/**
+ * wal_pack_ballot - Pack a record of our ballot and our ballot high-water
+ * mark.
+ */
+static void
+wal_pack_ballot(struct yakyak *yy)
+{
+  msgpack_pack_int(yy->pk, WAL_BALLOT);
+  yakyak_begin_array(yy, 3);
+  paxos_paxid_pack(yy, pax->ballot.id);
+  paxos_paxid_pack(yy, pax->ballot.gen);
+  paxos_paxid_pack(yy, pax->gen_high);
+}
+
+/**
+ * wal_pack_checkpoint - Pack a record of our learned state, which stands in
+ * for our log before the hole.
+ */
+static void
+wal_pack_checkpoint(struct yakyak *yy)
+{
+  struct paxos_acceptor *acc;
+
+  msgpack_pack_int(yy->pk, WAL_CHECKPOINT);
+  yakyak_begin_array(yy, 3);
+  paxos_paxid_pack(yy, pax->ibase);
+
+  yakyak_begin_array(yy, LIST_COUNT(&pax->alist));
+  LIST_FOREACH(acc, &pax->alist, pa_le) {
+    paxos_acceptor_pack(yy, acc);
+  }
+
+  snapshot_pack(yy);
+}
+
+/**
+ * wal_pack_instance - Pack a record of an instance, along with the requests
+ * it decrees if it has committed.
+ */
+static void
+wal_pack_instance(struct yakyak *yy, struct paxos_instance *inst)
+{
+  unsigned i, nreqs;
+  struct paxos_request *req;
+
+  msgpack_pack_int(yy->pk, WAL_INSTANCE);
+  yakyak_begin_array(yy, 2);
+  paxos_instance_pack(yy, inst);
+
+  nreqs = 0;
+  for (i = 0; inst->pi_committed && i < instance_nrequests(inst); ++i) {
+    nreqs += instance_request(inst, i) != NULL;
+  }
+
+  yakyak_begin_array(yy, nreqs);
+  for (i = 0; inst->pi_committed && i < instance_nrequests(inst); ++i) {
+    req = instance_request(inst, i);
+    if (req != NULL) {
+      paxos_request_pack(yy, req);
+    }
+  }
+}
+
+/**
+ * wal_idle - Sync the logs of every session, once per pass of the main loop
+ * in which we have appended to any.
+ */
+static int
+wal_idle(void *data)
+{
+  struct paxos_session *session;
+
+  // The source is removed when we return.
+  state.wal_source = 0;
+
+  LIST_FOREACH(session, &state.slist, session_le) {
+    pax = session;
+    wal_sync();
+  }
+
+  return FALSE;
+}
+
+/**
+ * wal_append - Append a record to our log, leaving it to be synced before
+ * we depend on it.
+ */
+static int
+wal_append(struct yakyak *yy)
+{
+  int r;
+
+  ERR_RET(r, wal_write(pax->wal_fd, yy));
+  pax->wal_dirty = true;
+  pax->wal_size += yakyak_size(yy);
+
+  if (state.wal_source == 0) {
+    state.wal_source = g_idle_add_full(G_PRIORITY_DEFAULT_IDLE, wal_idle,
+        NULL, NULL);
+  }
+
+  return 0;
+}
+
+/**
+ * wal_sync - Make sure everything we have appended to our log is on disk.
+ */
+int
+wal_sync()
+{
+  if (pax->wal_fd <= 0 || !pax->wal_dirty) {
+    return 0;
+  }
+
+  if (fdatasync(pax->wal_fd)) {
+    g_warning("wal_sync: Sync of log failed.");
+    return 1;
+  }
+  pax->wal_dirty = false;
+
+  return 0;
+}
+
+/**
+ * wal_ballot - Log a change to our ballot.
+ */
+int
+wal_ballot()
+{
+  int r;
+  struct yakyak yy;
+
+  if (pax->wal_fd <= 0) {
+    return 0;
+  }
+
+  yakyak_init(&yy, 2);
+  wal_pack_ballot(&yy);
+  r = wal_append(&yy);
+  yakyak_destroy(&yy);
+
+  return r;
+}
+
+/**
+ * wal_instance - Log a vote we are casting for an instance, or its commit.
+ */
+int
+wal_instance(struct paxos_instance *inst)
+{
+  int r;
+  struct yakyak yy;
+
+  if (pax->wal_fd <= 0) {
+    return 0;
+  }
+
+  yakyak_init(&yy, 2);
+  wal_pack_instance(&yy, inst);
+  r = wal_append(&yy);
+  yakyak_destroy(&yy);
+
+  return r;
+}
+
+/**
+ * wal_checkpoint - Start our log afresh from our current state, replacing
+ * whatever we had logged before.  We write the new log out in full before
+ * moving it into place, so that a crash in the meantime leaves us with the
+ * old one.
+ */
+int
+wal_checkpoint()
+{
+  int r, fd, dirfd;
+  size_t size;
+  paxid_t inum;
+  char *path, *tmp, *dir;
+  struct paxos_instance *inst;
+  struct yakyak yy;
+
+  if (!state.wal) {
+    return 0;
+  }
+
+  dir = g_build_filename(motmot_home_dir(), WAL_DIR, NULL);
+  path = wal_path(pax->session_id, false);
+  tmp = wal_path(pax->session_id, true);
+  size = 0;
+  r = 1;
+
+  g_mkdir_with_parents(dir, 0700);
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+  if (fd < 0) {
+    g_warning("wal_checkpoint: Could not create log.");
+    goto out;
+  }
+
+  // Write out who we are, our ballot, and our learned state.
+  yakyak_init(&yy, 2);
+  wal_pack_session(&yy);
+  if (wal_write(fd, &yy)) {
+    goto fail;
+  }
+  size += yakyak_size(&yy);
+  yakyak_destroy(&yy);
+
+  yakyak_init(&yy, 2);
+  wal_pack_ballot(&yy);
+  if (wal_write(fd, &yy)) {
+    goto fail;
+  }
+  size += yakyak_size(&yy);
+  yakyak_destroy(&yy);
+
+  yakyak_init(&yy, 2);
+  wal_pack_checkpoint(&yy);
+  if (wal_write(fd, &yy)) {
+    goto fail;
+  }
+  size += yakyak_size(&yy);
+  yakyak_destroy(&yy);
+
+  // Write out every instance we have.
+  for (inum = pax->ibase; inum < RING_END(&pax->ilist); ++inum) {
+    inst = instance_find(&pax->ilist, inum);
+    if (inst == NULL) {
+      continue;
+    }
+
+    yakyak_init(&yy, 2);
+    wal_pack_instance(&yy, inst);
+    if (wal_write(fd, &yy)) {
+      goto fail;
+    }
+    size += yakyak_size(&yy);
+    yakyak_destroy(&yy);
+  }
+
+  // Move the new log into place, making sure the rename sticks as well.
+  if (fdatasync(fd) || g_rename(tmp, path)) {
+    g_warning("wal_checkpoint: Could not replace log.");
+    close(fd);
+    goto out;
+  }
+  dirfd = open(dir, O_RDONLY);
+  if (dirfd >= 0) {
+    fsync(dirfd);
+    close(dirfd);
+  }
+
+  if (pax->wal_fd > 0) {
+    close(pax->wal_fd);
+  }
+  pax->wal_fd = fd;
+  pax->wal_dirty = false;
+  pax->wal_size = size;
+  pax->wal_live = size;
+  r = 0;
+  goto out;
+
+fail:
+  yakyak_destroy(&yy);
+  close(fd);
+  g_unlink(tmp);
+out:
+  g_free(dir);
+  g_free(path);
+  g_free(tmp);
+  return r;
+}
+
+/**
+ * wal_truncate - Log a truncation of our ilist.  We append a checkpoint of
+ * our new learned state, unless our log has grown enough since it was last
+ * rewritten that we should start it afresh instead.
+ */
+int
+wal_truncate()
+{
+  int r;
+  struct yakyak yy;
+
+  if (pax->wal_fd <= 0) {
+    return 0;
+  }
+
+  if (pax->wal_size > WAL_REWRITE_MIN &&
+      pax->wal_size > WAL_REWRITE_RATIO * pax->wal_live) {
+    return wal_checkpoint();
+  }
+
+  yakyak_init(&yy, 2);
+  wal_pack_checkpoint(&yy);
+  r = wal_append(&yy);
+  yakyak_destroy(&yy);
+
+  return r;
+}
+
+/**
+ * wal_remove - Stop logging the session and delete its log, since we won't
+ * be back.
+ */
+void
+wal_remove()
+{
+  char *path;
+
+  if (!state.wal) {
+    return;
+  }
+
+  if (pax->wal_fd > 0) {
+    close(pax->wal_fd);
+    pax->wal_fd = 0;
+  }
+
+  path = wal_path(pax->session_id, false);
+  g_unlink(path);
+  g_free(path);
+}
+
+/**
+ * wal_replay_session - Start rebuilding a session from its log, handing it
+ * to the client.  Returns nonzero if we have the session already.
+ */
+static int
+wal_replay_session(msgpack_object *o)
+{
+  msgpack_object *p;
+  pax_uuid_t uuid;
+
+  assert(o->type == MSGPACK_OBJECT_ARRAY && o->via.array.size == 4);
+  p = o->via.array.ptr;
+
+  paxos_uuid_unpack(&uuid, p++);
+  if (session_find(state.sessions, &uuid) != NULL) {
+    return 1;
+  }
+
+  pax = session_new(NULL, 0);
+  *pax->session_id = uuid;
+  paxos_paxid_unpack(&pax->self_id, p++);
+  paxos_paxid_unpack(&pax->req_id, p++);
+  assert(p->type == MSGPACK_OBJECT_BOOLEAN);
+  pax->mencius = p->via.boolean;
+
+  session_insert(state.sessions, pax);
+  pax->client_data = state.enter(pax);
+
+  return 0;
+}
+
+/**
+ * wal_replay_checkpoint - Take on the learned state a log starts from, or
+ * which a truncation left us with, dropping whatever it supersedes.
+ */
+static void
+wal_replay_checkpoint(msgpack_object *o)
+{
+  msgpack_object *p, *pend;
+  acceptor_container alist;
+  struct paxos_acceptor *acc, *old;
+
+  assert(o->type == MSGPACK_OBJECT_ARRAY && o->via.array.size == 3);
+  paxos_paxid_unpack(&pax->ibase, o->via.array.ptr);
+  pax->sync_prev = pax->ibase;
+
+  // A later checkpoint truncates our ilist.
+  if (pax->ihole != 0) {
+    ilist_truncate_prefix(&pax->ilist, pax->ibase);
+  }
+
+  // Unpack the alist, which must be in place before the snapshot.  Members
+  // keep the request ID marks of any earlier checkpoint, so that we don't
+  // hand the client the scrollback it already has from that one.
+  o = o->via.array.ptr + 1;
+  assert(o->type == MSGPACK_OBJECT_ARRAY);
+  acceptor_container_init(&alist);
+  p = o->via.array.ptr;
+  pend = p + o->via.array.size;
+  for (; p != pend; ++p) {
+    acc = g_malloc0(sizeof(*acc));
+    paxos_acceptor_unpack(acc, p);
+    old = acceptor_find(&pax->alist, acc->pa_paxid);
+    if (old != NULL) {
+      acc->pa_reqhigh = old->pa_reqhigh;
+    }
+    LIST_INSERT_TAIL(&alist, acc, pa_le);
+  }
+
+  // Replace whatever alist we had.
+  acceptor_container_destroy(&pax->alist);
+  LIST_WHILE_FIRST(acc, &alist) {
+    LIST_REMOVE(&alist, acc, pa_le);
+    LIST_INSERT_TAIL(&pax->alist, acc, pa_le);
+  }
+
+  // Give the client its scrollback, and move our hole past everything the
+  // snapshot reflects.
+  pax->ihole = snapshot_unpack(o + 1) + 1;
+}
+
+/**
+ * wal_replay_instance - Take on an instance from our log.  Later records of
+ * an instance supersede earlier ones, except that commits are final.
+ */
+static void
+wal_replay_instance(msgpack_object *o)
+{
+  struct paxos_instance *inst, *it;
+
+  assert(o->type == MSGPACK_OBJECT_ARRAY && o->via.array.size == 2);
+
+  request_unpack_cache(o->via.array.ptr + 1);
+
+  inst = instance_new();
+  paxos_instance_unpack(inst, o->via.array.ptr);
+
+  // Note our own request IDs, so that we don't reuse any.
+  if (inst->pi_val.pv_reqid.id == pax->self_id) {
+    pax->req_id = MAX(pax->req_id, inst->pi_val.pv_reqid.gen);
+  }
+
+  if (inst->pi_hdr.ph_inum < pax->ibase) {
+    instance_destroy(inst);
+    return;
+  }
+
+  it = instance_insert(&pax->ilist, inst);
+  if (it == inst) {
+    return;
+  }
+
+  if (!it->pi_committed) {
+    memcpy(&it->pi_hdr, &inst->pi_hdr, sizeof(inst->pi_hdr));
+    memcpy(&it->pi_val, &inst->pi_val, sizeof(inst->pi_val));
+    g_free(it->pi_batch);
+    it->pi_batch = inst->pi_batch;
+    inst->pi_batch = NULL;
+    it->pi_committed = inst->pi_committed;
+  }
+  instance_destroy(inst);
+}
+
+/**
+ * wal_replay_record - Replay a single record of a log.  Returns nonzero if
+ * we should stop replaying.
+ */
+static int
+wal_replay_record(msgpack_object *o)
+{
+  enum wal_record type;
+  msgpack_object *body;
+
+  assert(o->type == MSGPACK_OBJECT_ARRAY && o->via.array.size == 2);
+  assert(o->via.array.ptr->type == MSGPACK_OBJECT_POSITIVE_INTEGER);
+  type = o->via.array.ptr->via.u64;
+  body = o->via.array.ptr + 1;
+
+  // Every log starts by identifying its session.
+  if (type == WAL_SESSION) {
+    return pax != NULL || wal_replay_session(body);
+  } else if (pax == NULL) {
+    return 1;
+  }
+
+  switch (type) {
+    case WAL_SESSION:
+      break;
+
+    case WAL_BALLOT:
+      assert(body->type == MSGPACK_OBJECT_ARRAY);
+      assert(body->via.array.size == 3);
+      paxos_paxid_unpack(&pax->ballot.id, body->via.array.ptr);
+      paxos_paxid_unpack(&pax->ballot.gen, body->via.array.ptr + 1);
+      paxos_paxid_unpack(&pax->gen_high, body->via.array.ptr + 2);
+      break;
+
+    case WAL_CHECKPOINT:
+      wal_replay_checkpoint(body);
+      break;
+
+    case WAL_INSTANCE:
+      wal_replay_instance(body);
+      break;
+  }
+
+  return 0;
+}
+
+/**
+ * wal_resume - Rejoin a session we have rebuilt from its log.
+ */
+static int
+wal_resume()
+{
+  int r;
+  paxid_t inum;
+  struct paxos_acceptor *acc;
+  struct paxos_instance *inst;
+  struct paxos_continuation *k;
+
+  // Everything before our hole was learned before we crashed.
+  for (inum = pax->ibase; inum < pax->ihole; ++inum) {
+    inst = instance_find(&pax->ilist, inum);
+    if (inst != NULL) {
+      inst->pi_cached = true;
+      inst->pi_learned = true;
+    }
+  }
+
+  // We may have used request IDs we never got around to logging, so skip
+  // well past any we know of.
+  acc = acceptor_find(&pax->alist, pax->self_id);
+  if (acc != NULL) {
+    pax->req_id = MAX(pax->req_id, acc->pa_reqhigh);
+  }
+  pax->req_id += WAL_REQID_SKIP;
+
+  // Take whoever held our ballot to be the proposer.  If it was us, the
+  // others will have replaced us by now, unless there are none.
+  pax->proposer = acceptor_find(&pax->alist, pax->ballot.id);
+  if (pax->proposer == NULL || is_proposer()) {
+    pax->proposer = acceptor_find(&pax->alist, pax->self_id);
+    LIST_FOREACH(acc, &pax->alist, pa_le) {
+      if (acc->pa_paxid != pax->self_id) {
+        pax->proposer = acc;
+        break;
+      }
+    }
+  }
+  pax->live_count = 1;
+
+  // Reconnect to everyone but ourselves, saying hello once we do.
+  LIST_FOREACH(acc, &pax->alist, pa_le) {
+    if (acc->pa_paxid != pax->self_id) {
+      k = continuation_new(continue_ack_welcome, acc->pa_paxid);
+      ERR_RET(r, state.connect(acc->pa_desc, acc->pa_size, &k->pk_cb));
+    }
+  }
+
+  sync_start();
+  if (pax->mencius) {
+    mencius_join();
+  }
+
+  // Start our log afresh, dropping anything torn off its end.
+  ERR_RET(r, wal_checkpoint());
+
+  // Learn whatever we committed but had yet to learn.
+  inst = instance_find(&pax->ilist, pax->ihole);
+  if (inst != NULL && inst->pi_committed) {
+    return paxos_commit(inst);
+  }
+
+  return 0;
+}
+
+/**
+ * wal_replay - Rebuild a session from its log.
+ */
+static int
+wal_replay(const char *path)
+{
+  int r = 0, fd;
+  ssize_t n;
+  msgpack_unpacker unpacker;
+  msgpack_unpacked result;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return 1;
+  }
+
+  pax = NULL;
+  msgpack_unpacker_init(&unpacker, WAL_BUFSIZE);
+  msgpack_unpacked_init(&result);
+
+  // Replay every complete record; a crash may have torn off the last.
+  for (;;) {
+    msgpack_unpacker_reserve_buffer(&unpacker, WAL_BUFSIZE);
+    n = read(fd, msgpack_unpacker_buffer(&unpacker), WAL_BUFSIZE);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      break;
+    }
+    msgpack_unpacker_buffer_consumed(&unpacker, n);
+
+    while (r == 0 && msgpack_unpacker_next(&unpacker, &result)) {
+      paxos_buf_recv_begin(&result);
+      r = wal_replay_record(&result.data);
+      paxos_buf_recv_end();
+    }
+    if (r) {
+      break;
+    }
+  }
+
+  msgpack_unpacked_destroy(&result);
+  msgpack_unpacker_destroy(&unpacker);
+  close(fd);
+
+  // If we got as far as our learned state, pick up where we left off.
+  if (pax != NULL && pax->ihole != 0) {
+    return wal_resume();
+  } else if (pax != NULL) {
+    return paxos_end(pax);
+  }
+
+  return r;
+}
+
+/**
+ * wal_recover - Rebuild every session we were logging.
+ */
+int
+wal_recover()
+{
+  const char *name;
+  char *dir, *path;
+  GDir *gdir;
+
+  dir = g_build_filename(motmot_home_dir(), WAL_DIR, NULL);
+  gdir = g_dir_open(dir, 0, NULL);
+  if (gdir == NULL) {
+    g_free(dir);
+    return 0;
+  }
+
+  while ((name = g_dir_read_name(gdir)) != NULL) {
+    path = g_build_filename(dir, name, NULL);
+    if (g_str_has_suffix(name, ".wal")) {
+      // A session which fails to come back simply ends.
+      wal_replay(path);
+    } else if (g_str_has_suffix(name, ".tmp")) {
+      // Replacement logs we never moved into place are incomplete.
+      g_unlink(path);
+    }
+    g_free(path);
+  }
+
+  g_dir_close(gdir);
+  g_free(dir);
+  return 0;
+}
@@ -5,8 +5,10 @@
 #include <assert.h>
 #include <glib.h>
 
+#include "paxos_state.h"
 #include "containers/list_factory.h"
 #include "types/acceptor.h"
+#include "util/paxos_buf.h"
 #include "util/paxos_io.h"
 
 LIST_IMPLEMENT(acceptor, paxid_t, pa_le, pa_paxid, paxid_compare,
@@ -15,13 +17,60 @@ LIST_IMPLEMENT(acceptor, paxid_t, pa_le, pa_paxid, paxid_compare,
 void
 acceptor_destroy(struct paxos_acceptor *acc)
 {
+  struct paxos_peer *peer;
+
   if (acc != NULL) {
-    paxos_peer_destroy(acc->pa_peer);
-    g_free(acc->pa_desc);
+    // Only tear down the peer if no other session is still using it.
+    peer = acc->pa_peer;
+    acceptor_set_peer(acc, NULL);
+    if (peer != NULL && LIST_EMPTY(paxos_peer_acceptors(peer))) {
+      paxos_peer_destroy(peer);
+    }
+    paxos_buf_unref(acc->pa_buf);
   }
   g_free(acc);
 }
 
+/**
+ * acceptor_set_desc - Copy an identity descriptor into an acceptor.
+ */
+void
+acceptor_set_desc(struct paxos_acceptor *acc, const void *desc, size_t size)
+{
+  acc->pa_size = size;
+  if (size > 0) {
+    acc->pa_buf = paxos_buf_copy(desc, size);
+    acc->pa_desc = PAXOS_BUF_DATA(acc->pa_buf);
+  }
+}
+
+/**
+ * acceptor_set_peer - Attach an acceptor of the current session to a peer,
+ * detaching it from its old peer (which is not destroyed).  Passing NULL just
+ * detaches the acceptor.
+ *
+ * All changes to pa_peer should go through here, so that each peer's list of
+ * acceptors contains exactly those acceptors whose pa_peer points to it.
+ */
+void
+acceptor_set_peer(struct paxos_acceptor *acc, struct paxos_peer *peer)
+{
+  if (acc->pa_peer == peer) {
+    return;
+  }
+
+  if (acc->pa_peer != NULL) {
+    LIST_REMOVE(paxos_peer_acceptors(acc->pa_peer), acc, pa_peer_le);
+  }
+
+  acc->pa_peer = peer;
+
+  if (peer != NULL) {
+    acc->pa_session = pax;
+    LIST_INSERT_TAIL(paxos_peer_acceptors(peer), acc, pa_peer_le);
+  }
+}
+
 ///////////////////////////////////////////////////////////////////////////
 //
 //  Msgpack helpers.
@@ -51,6 +100,5 @@ paxos_acceptor_unpack(struct paxos_acceptor *acc, msgpack_object *o)
   assert(p->type == MSGPACK_OBJECT_POSITIVE_INTEGER);
   acc->pa_paxid = (p++)->via.u64;
   assert(p->type == MSGPACK_OBJECT_RAW);
-  acc->pa_size = p->via.raw.size;
-  acc->pa_desc = g_memdup(p->via.raw.ptr, p->via.raw.size);
+  acceptor_set_desc(acc, p->via.raw.ptr, p->via.raw.size);
 }
@@ -18,10 +18,26 @@ struct paxos_acceptor {
   struct paxos_peer *pa_peer;
   size_t pa_size;
   void *pa_desc;
+  struct paxos_buf *pa_buf;           // buffer keeping pa_desc alive
+
+  struct paxos_session *pa_session;   // session the acceptor belongs to
+  LIST_ENTRY(paxos_acceptor) pa_peer_le;  // acceptors sharing pa_peer
+
+  bool pa_thrifty;                    // are we sending decrees to this one?
+  gint64 pa_srtt;                     // smoothed accept RTT in us; 0 if unknown
+  gint64 pa_heard;                    // monotonic time of its last RTT sample
+
+  paxid_t pa_reqhigh;                 // highest request ID gen learned from it
+  gint64 pa_caughtup;                 // monotonic time of its last catch-up
 };
 
 LIST_DECLARE(acceptor, paxid_t);
 void acceptor_destroy(struct paxos_acceptor *);
+void acceptor_set_desc(struct paxos_acceptor *, const void *, size_t);
+
+/* Reverse index of the (session, acceptor) memberships using a peer. */
+typedef LIST_HEAD(acceptor_peer_list, paxos_acceptor) acceptor_peer_list;
+void acceptor_set_peer(struct paxos_acceptor *, struct paxos_peer *);
 
 /* Msgpack helpers. */
 void paxos_acceptor_pack(struct yakyak *, struct paxos_acceptor *);
@@ -23,6 +23,7 @@ struct paxos_connect *connect_new(const char *, size_t);
 void connect_deref(struct paxos_connect **);
 
 /* Paxos connection GLib hashtable utilities. */
+extern uint32_t murmurseed;
 void connect_hashinit(void);
 unsigned connect_key_hash(const void *);
 int connect_key_equals(const void *, const void *);
@@ -2,6 +2,8 @@
  * core.c - Utilities for Paxos core types.
  */
 
+#include <glib.h>
+
 #include "common/yakyak.h"
 
 #include "paxos_state.h"
@@ -32,6 +34,7 @@ header_init(struct paxos_header *hdr, paxop_t opcode, paxid_t inum)
   hdr->ph_ballot.gen = pax->ballot.gen;
   hdr->ph_opcode = opcode;
   hdr->ph_inum = inum;
+  hdr->ph_commit = 0;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -45,6 +48,17 @@ reqid_compare(reqid_t x, reqid_t y)
   return ppair_compare(x, y);
 }
 
+/**
+ * Hash a request ID.  We use Fibonacci hashing on the concatenated pair and
+ * keep the high bits, which are the well-mixed ones.
+ */
+unsigned
+reqid_hash(reqid_t x)
+{
+  uint64_t k = ((uint64_t)x.id << 32) | x.gen;
+  return (unsigned)((k * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 //  Msgpack utilities.
@@ -53,12 +67,15 @@ reqid_compare(reqid_t x, reqid_t y)
 void
 paxos_header_pack(struct yakyak *yy, struct paxos_header *hdr)
 {
-  msgpack_pack_array(yy->pk, 5);
+  msgpack_pack_array(yy->pk, hdr->ph_commit == 0 ? 5 : 6);
   paxos_uuid_pack(yy, &hdr->ph_session);
   msgpack_pack_paxid(yy->pk, hdr->ph_ballot.id);
   msgpack_pack_paxid(yy->pk, hdr->ph_ballot.gen);
   msgpack_pack_int(yy->pk, hdr->ph_opcode);
   msgpack_pack_paxid(yy->pk, hdr->ph_inum);
+  if (hdr->ph_commit != 0) {
+    msgpack_pack_paxid(yy->pk, hdr->ph_commit);
+  }
 }
 
 void
@@ -68,7 +85,7 @@ paxos_header_unpack(struct paxos_header *hdr, msgpack_object *o)
 
   // Make sure the input is well-formed.
   assert(o->type == MSGPACK_OBJECT_ARRAY);
-  assert(o->via.array.size == 5);
+  assert(o->via.array.size == 5 || o->via.array.size == 6);
 
   p = o->via.array.ptr;
   paxos_uuid_unpack(&hdr->ph_session, p++);
@@ -80,16 +97,19 @@ paxos_header_unpack(struct paxos_header *hdr, msgpack_object *o)
   hdr->ph_opcode = (p++)->via.u64;
   assert(p->type == MSGPACK_OBJECT_POSITIVE_INTEGER);
   hdr->ph_inum = (p++)->via.u64;
+
+  // Unpack the commit watermark if there is one.
+  hdr->ph_commit = 0;
+  if (o->via.array.size == 6) {
+    assert(p->type == MSGPACK_OBJECT_POSITIVE_INTEGER);
+    hdr->ph_commit = (p++)->via.u64;
+  }
 }
 
 void
 paxos_value_pack(struct yakyak *yy, struct paxos_value *val)
 {
-  msgpack_pack_array(yy->pk, 4);
-  msgpack_pack_int(yy->pk, val->pv_dkind);
-  msgpack_pack_paxid(yy->pk, val->pv_reqid.id);
-  msgpack_pack_paxid(yy->pk, val->pv_reqid.gen);
-  msgpack_pack_paxid(yy->pk, val->pv_extra);
+  paxos_value_pack_batch(yy, val, NULL);
 }
 
 void
@@ -97,9 +117,10 @@ paxos_value_unpack(struct paxos_value *val, msgpack_object *o)
 {
   msgpack_object *p;
 
-  // Make sure the input is well-formed.
+  // Make sure the input is well-formed.  Batches carry their members as a
+  // fifth element, which we leave to paxos_value_unpack_batch.
   assert(o->type == MSGPACK_OBJECT_ARRAY);
-  assert(o->via.array.size == 4);
+  assert(o->via.array.size == 4 || o->via.array.size == 5);
 
   p = o->via.array.ptr;
   assert(p->type == MSGPACK_OBJECT_POSITIVE_INTEGER);
@@ -111,3 +132,68 @@ paxos_value_unpack(struct paxos_value *val, msgpack_object *o)
   assert(p->type == MSGPACK_OBJECT_POSITIVE_INTEGER);
   val->pv_extra = (p++)->via.u64;
 }
+
+/**
+ * Pack a value along with the request IDs of its members, which must be
+ * given iff the value decrees a batch.  The members are flattened into a
+ * single array of (id, gen) pairs.
+ */
+void
+paxos_value_pack_batch(struct yakyak *yy, struct paxos_value *val,
+    reqid_t *batch)
+{
+  unsigned i;
+
+  assert((val->pv_dkind == DEC_BATCH) == (batch != NULL));
+
+  msgpack_pack_array(yy->pk, batch == NULL ? 4 : 5);
+  msgpack_pack_int(yy->pk, val->pv_dkind);
+  msgpack_pack_paxid(yy->pk, val->pv_reqid.id);
+  msgpack_pack_paxid(yy->pk, val->pv_reqid.gen);
+  msgpack_pack_paxid(yy->pk, val->pv_extra);
+
+  if (batch != NULL) {
+    msgpack_pack_array(yy->pk, 2 * val->pv_extra);
+    for (i = 0; i < val->pv_extra; ++i) {
+      msgpack_pack_paxid(yy->pk, batch[i].id);
+      msgpack_pack_paxid(yy->pk, batch[i].gen);
+    }
+  }
+}
+
+/**
+ * Unpack a value along with the request IDs of its members.  Any member
+ * array previously stored in *batch is freed and replaced; it is left NULL
+ * if the value is not a batch.
+ */
+void
+paxos_value_unpack_batch(struct paxos_value *val, reqid_t **batch,
+    msgpack_object *o)
+{
+  unsigned i;
+  msgpack_object *p;
+
+  paxos_value_unpack(val, o);
+
+  g_free(*batch);
+  *batch = NULL;
+
+  if (val->pv_dkind != DEC_BATCH) {
+    return;
+  }
+
+  // Make sure the member array is well-formed.
+  assert(o->via.array.size == 5);
+  p = o->via.array.ptr + 4;
+  assert(p->type == MSGPACK_OBJECT_ARRAY);
+  assert(p->via.array.size == 2 * val->pv_extra);
+
+  *batch = g_new(reqid_t, val->pv_extra);
+  state.stats.ps_allocs++;
+  for (i = 0, p = p->via.array.ptr; i < val->pv_extra; ++i) {
+    assert(p->type == MSGPACK_OBJECT_POSITIVE_INTEGER);
+    (*batch)[i].id = (p++)->via.u64;
+    assert(p->type == MSGPACK_OBJECT_POSITIVE_INTEGER);
+    (*batch)[i].gen = (p++)->via.u64;
+  }
+}
@@ -50,6 +50,13 @@ typedef enum paxos_opcode {
   OP_SYNC,                // sync up ilists in preparation for a truncate
   OP_LAST,                // give the proposer our sync information
   OP_TRUNCATE,            // order acceptors to truncate their ilists
+  OP_CATCHUP,             // bring an acceptor left behind up to date
+
+  /* Extensions to the standard protocol operations, kept at the end so that
+   * the opcodes above keep their values on the wire. */
+  OP_ACCEPTS,             // accept a range of consecutive decrees
+  OP_FENCE,               // hand instances past a recovery back to owners
+  OP_HISTORY,             // stream the rest of a welcome to the new acceptor
 } paxop_t;
 
 /* Paxos message header that is included with any message. */
@@ -58,6 +65,7 @@ struct paxos_header {
   ballot_t ph_ballot;     // ballot ID
   paxop_t ph_opcode;      // protocol opcode
   paxid_t ph_inum;        // Multi-Paxos instance number
+  paxid_t ph_commit;      // proposer's commit watermark; 0 if none
   /**
    * The ph_inum field means different things for the different opcodes:
    *
@@ -71,27 +79,47 @@ struct paxos_header {
    *
    * - OP_DECREE, OP_ACCEPT, OP_COMMIT: The instance number of the decree.
    *
+   * - OP_ACCEPTS: The instance number of the first decree accepted.
+   *
+   * - OP_FENCE: The last instance recovered by the proposer's prepare.
+   *
    * - OP_WELCOME: The new acceptor's assigned paxid (which is, in fact, the
    *   instance number of its JOIN).
    *
    * - OP_HELLO: The ID of the greeter.
    *
+   * - OP_HISTORY: The instance number of the first instance in the chunk.
+   *
    * - OP_REQUEST: The paxid of the acceptor who we think is the proposer who
    *   will send our request.  This allows us to send a redirect appropriately.
+   *   A chat which the requester will decree in an instance of its own (see
+   *   paxos_mencius.c) instead carries 0.
    *
-   * - OP_RETRIEVE, OP_RESEND: The instance number associated with the
-   *   desired request.
+   * - OP_RETRIEVE, OP_RESEND: The ID of the retrieve as determined by the
+   *   retriever; this is simply echoed in the resends answering it.
    *
    * - OP_REDIRECT, OP_REFUSE: The ID of the proposer we are redirecting to.
    *
    * - OP_REJECT: The instance number of the decree.
    *
-   * - OP_RETRY, OP_RECOMMIT: The instance number of the decree.
+   * - OP_RETRY, OP_RECOMMIT: The first instance number of the range of
+   *   commits being asked for or resent.  A recommit for instance 0 says that
+   *   the sender is too busy to answer the retry.
    *
    * - OP_SYNC, OP_LAST, OP_TRUNCATE: The ID of the sync as determined by the
    *   proposer; this is used only by the proposer and is simply echoed across
    *   all messages in the sync operation.
    *
+   * - OP_CATCHUP: The first instance of the log sent along, which is also
+   *   the last instance reflected by the accompanying snapshot.
+   *
+   * Decrees and commits sent by the proposer may also carry a commit
+   * watermark in ph_commit: the proposer has committed every instance up to
+   * and including it.  Acceptors commit the instances in that range which
+   * they accepted at the same ballot as the message, so that the proposer
+   * needs only send standalone commits when it is otherwise idle.  The
+   * watermark is packed only when nonzero.
+   *
    * Note that ALL of our ID's start counting at 1; 0 is always a sentinel
    * value.
    */
@@ -118,7 +146,8 @@ typedef enum decree_kind {
   DEC_CHAT,           // chat message
   DEC_JOIN,           // add an acceptor
   DEC_PART,           // remove an acceptor
-  DEC_KILL            // remove an acceptor with force
+  DEC_KILL,           // remove an acceptor with force
+  DEC_BATCH           // several chat requests, learned in order
 } dkind_t;
 
 /* Decree value type. */
@@ -133,12 +162,20 @@ struct paxos_value {
    * an incrementing requester-local request number).  Any data they pass
    * along is cached by the acceptors.  The proposer then makes decrees and
    * orders commits with values taking the form of this request ID.
+   *
+   * A DEC_BATCH value carries a fresh request ID of the proposer's own and
+   * the number of member requests in pv_extra.  The member request IDs are
+   * kept alongside the value (see paxos_instance) and packed after it.
    */
 };
 
 int reqid_compare(reqid_t, reqid_t);
+unsigned reqid_hash(reqid_t);
 
 void paxos_value_pack(struct yakyak *, struct paxos_value *);
 void paxos_value_unpack(struct paxos_value *, msgpack_object *);
+void paxos_value_pack_batch(struct yakyak *, struct paxos_value *, reqid_t *);
+void paxos_value_unpack_batch(struct paxos_value *, reqid_t **,
+    msgpack_object *);
 
 #endif /* __PAXOS_TYPES_CORE_H__ */
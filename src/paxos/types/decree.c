@@ -4,8 +4,13 @@
 
 #include <glib.h>
 
+#include "paxos_state.h"
 #include "containers/list_factory.h"
+#include "containers/openhash_factory.h"
+#include "containers/ring_factory.h"
 #include "types/decree.h"
+#include "types/epoch.h"
+#include "util/paxos_buf.h"
 
 /**
  * Reset the metadata fields of a Paxos instance.
@@ -16,6 +21,7 @@ instance_init_metadata(struct paxos_instance *inst)
   inst->pi_committed = false;
   inst->pi_cached = false;
   inst->pi_learned = false;
+  inst->pi_thrifty = false;
   inst->pi_votes = 1;
   inst->pi_rejects = 0;
 }
@@ -25,29 +31,144 @@ instance_init_metadata(struct paxos_instance *inst)
 //  Container manufacturing.
 //
 
-LIST_IMPLEMENT(instance, paxid_t, pi_le, pi_hdr.ph_inum, paxid_compare,
-    instance_destroy, _REV, _REV);
-LIST_IMPLEMENT(request, reqid_t, pr_le, pr_val.pv_reqid, reqid_compare,
-    request_destroy, _FWD, _REV);
+RING_IMPLEMENT(instance, paxid_t, pi_hdr.ph_inum, instance_destroy);
+OPENHASH_IMPLEMENT(request, reqid_t, pr_le, pr_val.pv_reqid, reqid_hash,
+    reqid_compare, request_destroy);
 
 ///////////////////////////////////////////////////////////////////////////
 //
-//  Destructor routines.
+//  Constructor and destructor routines.
 //
+//  Instances and requests are allocated from the current epoch of the current
+//  session, so `pax' must be bound to the owning session whenever they are
+//  created or destroyed.  Destroying the last live object of an old epoch
+//  releases the whole epoch.  Objects which survive too long are moved into
+//  the current epoch, leaving the caller to swap them into their containers.
+//  Request data is held by reference-counted buffers, since the client may
+//  retain it past truncation.
+//
+
+struct paxos_instance *
+instance_new()
+{
+  struct paxos_epoch *epoch = EPOCH_CURRENT(&pax->epochs);
+  struct paxos_instance *inst;
+
+  inst = slab_alloc(&epoch->pe_islab);
+  inst->pi_epoch = epoch;
+  LIST_INSERT_TAIL(&epoch->pe_insts, inst, pi_ele);
+  state.stats.ps_allocs++;
+
+  return inst;
+}
 
 void
 instance_destroy(struct paxos_instance *inst)
 {
-  g_free(inst);
+  struct paxos_epoch *epoch;
+
+  if (inst == NULL) {
+    return;
+  }
+
+  g_free(inst->pi_batch);
+
+  epoch = inst->pi_epoch;
+  LIST_REMOVE(&epoch->pe_insts, inst, pi_ele);
+  slab_free(&epoch->pe_islab, inst);
+  epoch_release(&pax->epochs, epoch);
+}
+
+struct paxos_instance *
+instance_move(struct paxos_instance *inst)
+{
+  struct paxos_epoch *epoch = inst->pi_epoch;
+  struct paxos_instance *copy;
+
+  LIST_REMOVE(&epoch->pe_insts, inst, pi_ele);
+  copy = slab_alloc(&EPOCH_CURRENT(&pax->epochs)->pe_islab);
+  memcpy(copy, inst, sizeof(*inst));
+  copy->pi_epoch = EPOCH_CURRENT(&pax->epochs);
+  LIST_INSERT_TAIL(&copy->pi_epoch->pe_insts, copy, pi_ele);
+
+  slab_free(&epoch->pe_islab, inst);
+  epoch_release(&pax->epochs, epoch);
+
+  return copy;
+}
+
+void
+instance_list_destroy(instance_list *head)
+{
+  struct paxos_instance *it;
+
+  LIST_WHILE_FIRST(it, head) {
+    LIST_REMOVE(head, it, pi_le);
+    instance_destroy(it);
+  }
+}
+
+struct paxos_request *
+request_new()
+{
+  struct paxos_epoch *epoch = EPOCH_CURRENT(&pax->epochs);
+  struct paxos_request *req;
+
+  req = slab_alloc(&epoch->pe_rslab);
+  req->pr_epoch = epoch;
+  LIST_INSERT_TAIL(&epoch->pe_reqs, req, pr_ele);
+  state.stats.ps_allocs++;
+
+  return req;
 }
 
 void
 request_destroy(struct paxos_request *req)
 {
-  if (req != NULL) {
-    g_free(req->pr_data);
+  struct paxos_epoch *epoch;
+
+  if (req == NULL) {
+    return;
+  }
+
+  paxos_buf_unref(req->pr_buf);
+
+  epoch = req->pr_epoch;
+  LIST_REMOVE(&epoch->pe_reqs, req, pr_ele);
+  slab_free(&epoch->pe_rslab, req);
+  epoch_release(&pax->epochs, epoch);
+}
+
+struct paxos_request *
+request_move(struct paxos_request *req)
+{
+  struct paxos_epoch *epoch = req->pr_epoch;
+  struct paxos_request *copy;
+
+  LIST_REMOVE(&epoch->pe_reqs, req, pr_ele);
+  copy = slab_alloc(&EPOCH_CURRENT(&pax->epochs)->pe_rslab);
+  memcpy(copy, req, sizeof(*req));
+  copy->pr_epoch = EPOCH_CURRENT(&pax->epochs);
+  LIST_INSERT_TAIL(&copy->pr_epoch->pe_reqs, copy, pr_ele);
+
+  slab_free(&epoch->pe_rslab, req);
+  epoch_release(&pax->epochs, epoch);
+
+  return copy;
+}
+
+/**
+ * Copy locally originated data into a request.
+ */
+void
+request_set_data(struct paxos_request *req, const void *data, size_t size)
+{
+  req->pr_size = size;
+  if (size > 0) {
+    req->pr_buf = paxos_buf_copy(data, size);
+    req->pr_data = PAXOS_BUF_DATA(req->pr_buf);
+    state.stats.ps_allocs++;
   }
-  g_free(req);
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -61,7 +182,7 @@ paxos_instance_pack(struct yakyak *yy, struct paxos_instance *inst)
   msgpack_pack_array(yy->pk, 3);
   paxos_header_pack(yy, &inst->pi_hdr);
   inst->pi_committed ? msgpack_pack_true(yy->pk) : msgpack_pack_false(yy->pk);
-  paxos_value_pack(yy, &inst->pi_val);
+  paxos_value_pack_batch(yy, &inst->pi_val, inst->pi_batch);
 }
 
 void
@@ -79,7 +200,7 @@ paxos_instance_unpack(struct paxos_instance *inst, msgpack_object *o)
   paxos_header_unpack(&inst->pi_hdr, p++);
   assert(p->type == MSGPACK_OBJECT_BOOLEAN);
   inst->pi_committed = (p++)->via.boolean;
-  paxos_value_unpack(&inst->pi_val, p++);
+  paxos_value_unpack_batch(&inst->pi_val, &inst->pi_batch, p++);
 
   // Set everything else to 0.
   inst->pi_cached = false;
@@ -110,8 +231,25 @@ paxos_request_unpack(struct paxos_request *req, msgpack_object *o)
   p = o->via.array.ptr;
   paxos_value_unpack(&req->pr_val, p++);
 
-  // Unpack the raw data.
+  // Keep the raw data alive, referencing it in place if it is large enough
+  // to be worth keeping the message we are unpacking from alive for.
   assert(p->type == MSGPACK_OBJECT_RAW);
   req->pr_size = p->via.raw.size;
-  req->pr_data = g_memdup(p->via.raw.ptr, p->via.raw.size);
+  if (req->pr_size > 0) {
+    req->pr_data = paxos_buf_recv_data(&req->pr_buf, p->via.raw.ptr,
+        req->pr_size);
+  }
+}
+
+/**
+ * Unpack only the value of a packed request, leaving the data in place.
+ */
+void
+paxos_request_unpack_value(struct paxos_value *val, msgpack_object *o)
+{
+  // Make sure the input is well-formed.
+  assert(o->type == MSGPACK_OBJECT_ARRAY);
+  assert(o->via.array.size == 2);
+
+  paxos_value_unpack(val, o->via.array.ptr);
 }
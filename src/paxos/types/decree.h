@@ -7,40 +7,70 @@
 #include "common/yakyak.h"
 
 #include "containers/list_factory.h"
+#include "containers/openhash_factory.h"
+#include "containers/ring_factory.h"
 #include "types/primitives.h"
 #include "types/core.h"
 
-/* An instance of the "synod" algorithm. */
+struct paxos_epoch;
+struct paxos_buf;
+
+/**
+ * An instance of the "synod" algorithm.
+ *
+ * The fields touched on every accept and learn are packed at the front of
+ * the struct; the list entry is only used while the instance is deferred.
+ */
 struct paxos_instance {
-  struct paxos_header pi_hdr;         // Paxos header identifying the instance
+  unsigned pi_votes;                  // number of accepts; not sent
+  unsigned pi_rejects;                // number of rejects; not sent
   bool pi_committed;                  // true if a commit has been received
   bool pi_cached;                     // true if the request is cached; not sent
   bool pi_learned;                    // true if learned; not sent
-  unsigned pi_votes;                  // number of accepts; not sent
-  unsigned pi_rejects;                // number of rejects; not sent
-  LIST_ENTRY(paxos_instance) pi_le;   // sorted linked list of instances
+  bool pi_thrifty;                    // true if only sent to a quorum; not sent
+  struct paxos_header pi_hdr;         // Paxos header identifying the instance
   struct paxos_value pi_val;          // value of the decree
+  LIST_ENTRY(paxos_instance) pi_le;   // list of deferred instances
+  struct paxos_epoch *pi_epoch;       // epoch the instance was allocated in
+  LIST_ENTRY(paxos_instance) pi_ele;  // live instances of the epoch
+  reqid_t *pi_batch;                  // member requests of a DEC_BATCH
+  gint64 pi_sent;                     // monotonic time of our thrifty decree
 };
 
-LIST_DECLARE(instance, paxid_t);
+/* Log of instances, indexed by instance number. */
+RING_DECLARE(instance, paxid_t);
+struct paxos_instance *instance_new(void);
 void instance_destroy(struct paxos_instance *);
+struct paxos_instance *instance_move(struct paxos_instance *);
 void instance_init_metadata(struct paxos_instance *);
 
+/* List of instances not yet assigned an instance number. */
+typedef LIST_HEAD(instance_list, paxos_instance) instance_list;
+void instance_list_destroy(instance_list *);
+
 /* Request containing data, pending proposer commit. */
 struct paxos_request {
   struct paxos_value pr_val;          // request ID and kind
   size_t pr_size;                     // size of data
   void *pr_data;                      // data pointer dependent on kind
-  LIST_ENTRY(paxos_request) pr_le;    // sorted linked list of requests
+  struct paxos_buf *pr_buf;           // buffer keeping pr_data alive
+  LIST_ENTRY(paxos_request) pr_le;    // requests in order of caching
+  struct paxos_epoch *pr_epoch;       // epoch the request was allocated in
+  LIST_ENTRY(paxos_request) pr_ele;   // live requests of the epoch
 };
 
-LIST_DECLARE(request, reqid_t);
+/* Cache of requests, hashed by request ID. */
+OPENHASH_DECLARE(request, reqid_t);
+struct paxos_request *request_new(void);
 void request_destroy(struct paxos_request *);
+struct paxos_request *request_move(struct paxos_request *);
+void request_set_data(struct paxos_request *, const void *, size_t);
 
 /* Msgpack helpers. */
 void paxos_instance_pack(struct yakyak *, struct paxos_instance *);
 void paxos_instance_unpack(struct paxos_instance *, msgpack_object *);
 void paxos_request_pack(struct yakyak *, struct paxos_request *);
 void paxos_request_unpack(struct paxos_request *, msgpack_object *);
+void paxos_request_unpack_value(struct paxos_value *, msgpack_object *);
 
 #endif /* __PAXOS_TYPES_DECREE_H__ */
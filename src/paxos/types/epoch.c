@@ -0,0 +1,110 @@
+/**
+ * epoch.c - Utilities for allocation epochs.
+ */
+
+#include <glib.h>
+
+#include "types/decree.h"
+#include "types/epoch.h"
+#include "util/paxos_slab.h"
+
+// Number of objects carved from each chunk of an epoch's slabs.
+#define EPOCH_SLAB_PERCHUNK   256
+
+static struct paxos_epoch *
+epoch_new(paxid_t base)
+{
+  struct paxos_epoch *epoch;
+
+  epoch = g_malloc0(sizeof(*epoch));
+  epoch->pe_base = base;
+  LIST_INIT(&epoch->pe_insts);
+  LIST_INIT(&epoch->pe_reqs);
+  slab_init(&epoch->pe_islab, sizeof(struct paxos_instance),
+      EPOCH_SLAB_PERCHUNK);
+  slab_init(&epoch->pe_rslab, sizeof(struct paxos_request),
+      EPOCH_SLAB_PERCHUNK);
+
+  return epoch;
+}
+
+static void
+epoch_destroy(struct paxos_epoch *epoch)
+{
+  slab_destroy(&epoch->pe_islab);
+  slab_destroy(&epoch->pe_rslab);
+  g_free(epoch);
+}
+
+void
+epoch_list_destroy(epoch_list *head)
+{
+  struct paxos_epoch *it;
+
+  LIST_WHILE_FIRST(it, head) {
+    LIST_REMOVE(head, it, pe_le);
+    epoch_destroy(it);
+  }
+}
+
+/**
+ * epoch_live - Get the number of objects still alive in an epoch.
+ */
+unsigned
+epoch_live(struct paxos_epoch *epoch)
+{
+  return epoch->pe_islab.ps_live + epoch->pe_rslab.ps_live;
+}
+
+/**
+ * epoch_open - Start allocating from a new epoch, releasing any older epochs
+ * whose objects have all been destroyed.
+ */
+void
+epoch_open(epoch_list *head, paxid_t base)
+{
+  struct paxos_epoch *epoch, *it, *next;
+
+  epoch = epoch_new(base);
+  LIST_INSERT_TAIL(head, epoch, pe_le);
+
+  for (it = LIST_FIRST(head); it != epoch; it = next) {
+    next = LIST_NEXT(it, pe_le);
+    epoch_release(head, it);
+  }
+}
+
+/**
+ * epoch_release - Release an epoch wholesale if it is no longer current and
+ * none of its objects remain alive.  Its slabs are handed on to the current
+ * epoch, which reuses as much of them as it is likely to need.
+ */
+void
+epoch_release(epoch_list *head, struct paxos_epoch *epoch)
+{
+  struct paxos_epoch *current = EPOCH_CURRENT(head);
+
+  if (epoch == current || epoch_live(epoch) != 0) {
+    return;
+  }
+
+  slab_adopt(&current->pe_islab, &epoch->pe_islab);
+  slab_adopt(&current->pe_rslab, &epoch->pe_rslab);
+
+  LIST_REMOVE(head, epoch, pe_le);
+  epoch_destroy(epoch);
+}
+
+/**
+ * epoch_stale - Check whether an epoch has had a full truncation to drain
+ * since it stopped being current, i.e., whether it is older than the epoch
+ * before the current one.  Anything still alive in a stale epoch is a
+ * straggler which would pin the whole epoch, and should be moved out.
+ */
+bool
+epoch_stale(epoch_list *head, struct paxos_epoch *epoch)
+{
+  struct paxos_epoch *current = EPOCH_CURRENT(head);
+
+  return epoch != current && epoch != LIST_PREV(current, pe_le);
+}
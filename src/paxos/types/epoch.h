@@ -0,0 +1,45 @@
+/**
+ * epoch.h - Allocation epochs, which group together the instances and
+ * requests created between two log truncations.
+ */
+#ifndef __PAXOS_TYPES_EPOCH_H__
+#define __PAXOS_TYPES_EPOCH_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "containers/list.h"
+#include "types/primitives.h"
+#include "util/paxos_slab.h"
+
+/**
+ * An arena for objects which tend to die together.  Instances and requests
+ * are carved from the epoch's slabs; nothing is returned to the heap until
+ * every object in the epoch has been destroyed, at which point the entire
+ * epoch is released at once, its chunks going to the current epoch.  The few
+ * objects which outlive the truncation after their own are moved into the
+ * current epoch rather than left to pin theirs; each epoch lists its live
+ * objects so that these can be found without searching for them.
+ */
+struct paxos_epoch {
+  paxid_t pe_base;                    // ibase when the epoch was opened
+  struct paxos_slab pe_islab;         // pool of paxos_instance objects
+  struct paxos_slab pe_rslab;         // pool of paxos_request objects
+  LIST_HEAD(, paxos_instance) pe_insts; // live instances of the epoch
+  LIST_HEAD(, paxos_request) pe_reqs; // live requests of the epoch
+  LIST_ENTRY(paxos_epoch) pe_le;      // list of epochs, oldest first
+};
+
+/* Epoch list.  The last epoch is the one currently being allocated from. */
+typedef LIST_HEAD(epoch_list, paxos_epoch) epoch_list;
+void epoch_list_destroy(epoch_list *);
+
+#define EPOCH_CURRENT(head)   LIST_LAST(head)
+
+/* Epoch lifecycle. */
+void epoch_open(epoch_list *, paxid_t);
+void epoch_release(epoch_list *, struct paxos_epoch *);
+unsigned epoch_live(struct paxos_epoch *);
+bool epoch_stale(epoch_list *, struct paxos_epoch *);
+
+#endif /* __PAXOS_TYPES_EPOCH_H__ */
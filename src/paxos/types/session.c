@@ -3,10 +3,22 @@
  */
 
 #include <glib.h>
+#include <unistd.h>
+
+#include <murmurhash/murmurhash3.h>
 
 #include "paxos_state.h"
+#include "containers/hashtable_factory.h"
 #include "containers/list_factory.h"
+#include "types/connect.h"
+#include "types/epoch.h"
 #include "types/session.h"
+#include "util/paxos_buf.h"
+
+HASHTABLE_IMPLEMENT(session, session_id, session_key_hash,
+    session_key_equals, _PTR);
+OPENHASH_IMPLEMENT(missing, reqid_t, pm_le, pm_val.pv_reqid, reqid_hash,
+    reqid_compare, missing_destroy);
 
 struct paxos_session *
 session_new(void *data, int gen_uuid)
@@ -22,16 +34,28 @@ session_new(void *data, int gen_uuid)
   }
   session->client_data = data;
 
-  // Insert into the sessions list.
-  session_insert(&state.sessions, session);
+  // Insert into the sessions list.  If we generated our own UUID, we can
+  // also make the session available for lookup; otherwise, the caller must
+  // do so once the UUID is known.
+  LIST_INSERT_TAIL(&state.slist, session, session_le);
+  if (gen_uuid) {
+    session_insert(state.sessions, session);
+  }
 
   // Initialize all our lists.
   LIST_INIT(&session->alist);
   LIST_INIT(&session->adefer);
   LIST_INIT(&session->clist);
-  LIST_INIT(&session->ilist);
+  instance_container_init(&session->ilist);
   LIST_INIT(&session->idefer);
-  LIST_INIT(&session->rcache);
+  request_container_init(&session->rcache);
+  missing_container_init(&session->retrieval.pr_missing);
+  LIST_INIT(&session->slots);
+  LIST_INIT(&session->wlist);
+
+  // Open our first allocation epoch.
+  LIST_INIT(&session->epochs);
+  epoch_open(&session->epochs, 0);
 
   return session;
 }
@@ -44,11 +68,169 @@ session_destroy(struct paxos_session *session)
   acceptor_container_destroy(&pax->adefer);
   continuation_list_destroy(&pax->clist);
   instance_container_destroy(&pax->ilist);
-  instance_container_destroy(&pax->idefer);
+  instance_list_destroy(&pax->idefer);
   request_container_destroy(&pax->rcache);
 
+  // Drop any batch we were coalescing, any accepts we were holding, and any
+  // retrieves we were making.
+  batch_destroy(pax->batch);
+  retrieval_destroy(&pax->retrieval);
+  if (pax->arange.ar_source != 0) {
+    g_source_remove(pax->arange.ar_source);
+  }
+  if (pax->cmark_source != 0) {
+    g_source_remove(pax->cmark_source);
+  }
+  if (pax->mskip_source != 0) {
+    g_source_remove(pax->mskip_source);
+  }
+  slots_list_destroy(&pax->slots);
+  if (pax->tsource != 0) {
+    g_source_remove(pax->tsource);
+  }
+  if (pax->wsource != 0) {
+    g_source_remove(pax->wsource);
+  }
+  welcome_list_destroy(&pax->wlist);
+  if (pax->hsource != 0) {
+    g_source_remove(pax->hsource);
+  }
+  sync_destroy(pax->sync);
+  if (pax->sync_source != 0) {
+    g_source_remove(pax->sync_source);
+  }
+  scrollback_destroy(&pax->scrollback);
+  if (pax->wal_fd > 0) {
+    close(pax->wal_fd);
+  }
+  history_destroy(pax->history);
+
+  // Release all our allocation epochs.
+  epoch_list_destroy(&pax->epochs);
+
   g_free(session);
 }
 
-LIST_IMPLEMENT(session, pax_uuid_t *, session_le, session_id, pax_uuid_compare,
-    session_destroy, _FWD, _FWD);
+/**
+ * Free the state of a sync in progress.
+ */
+void
+sync_destroy(struct paxos_sync *sync)
+{
+  if (sync == NULL) {
+    return;
+  }
+
+  g_free(sync->ps_lasts);
+  g_free(sync);
+}
+
+/**
+ * Free a batch of requests which will not be decreed, cancelling its flush.
+ */
+void
+batch_destroy(struct paxos_batch *batch)
+{
+  if (batch == NULL) {
+    return;
+  }
+
+  if (batch->pb_timer != 0) {
+    g_source_remove(batch->pb_timer);
+  }
+  g_free(batch->pb_reqids);
+  g_free(batch);
+}
+
+/**
+ * Forget the requests we were retrieving, cancelling any pending flush.
+ */
+void
+retrieval_destroy(struct paxos_retrieval *rv)
+{
+  if (rv->pr_source != 0) {
+    g_source_remove(rv->pr_source);
+  }
+  missing_container_destroy(&rv->pr_missing);
+}
+
+/**
+ * Free an entry for a missing request.
+ */
+void
+missing_destroy(struct paxos_missing *pm)
+{
+  g_free(pm);
+}
+
+/**
+ * Free a list of instance owner assignments.
+ */
+void
+slots_list_destroy(slots_list *head)
+{
+  struct paxos_slots *it;
+
+  LIST_WHILE_FIRST(it, head) {
+    LIST_REMOVE(head, it, ps_le);
+    g_free(it->ps_owners);
+    g_free(it);
+  }
+}
+
+/**
+ * Free a list of welcome transfers.
+ */
+void
+welcome_list_destroy(welcome_list *head)
+{
+  struct paxos_welcome *it;
+
+  LIST_WHILE_FIRST(it, head) {
+    LIST_REMOVE(head, it, pw_le);
+    g_free(it);
+  }
+}
+
+/**
+ * Free the chats kept for scrollback.
+ */
+void
+scrollback_destroy(struct paxos_scrollback *sb)
+{
+  unsigned i;
+  struct paxos_chat *chat;
+
+  for (i = 0; i < sb->sb_count; ++i) {
+    chat = &sb->sb_chats[(sb->sb_head + i) % sb->sb_size];
+    paxos_buf_unref(chat->pc_buf);
+    paxos_buf_unref(chat->pc_alias_buf);
+  }
+  g_free(sb->sb_chats);
+}
+
+///////////////////////////////////////////////////////////////////////////
+//
+//  Hashtable callbacks.
+//
+
+/**
+ * Hash a session ID.  We share the Murmurhash seed with the connection table.
+ */
+unsigned
+session_key_hash(const void *data)
+{
+  uint32_t r;
+
+  MurmurHash3_x86_32(data, sizeof(pax_uuid_t), murmurseed, &r);
+  return r;
+}
+
+/**
+ * Check two session IDs for equality.
+ */
+int
+session_key_equals(const void *x, const void *y)
+{
+  return !pax_uuid_compare((pax_uuid_t *)x, (pax_uuid_t *)y);
+}
@@ -7,19 +7,21 @@
 
 #include "common/yakyak.h"
 
+#include "containers/hashtable_factory.h"
 #include "containers/list_factory.h"
+#include "containers/openhash_factory.h"
 #include "types/primitives.h"
 #include "types/core.h"
 #include "types/decree.h"
 #include "types/acceptor.h"
 #include "types/continuation.h"
+#include "types/epoch.h"
 
 /* Preparation state used by new proposers. */
 struct paxos_prep {
   ballot_t pp_ballot;                 // ballot being prepared
   unsigned pp_acks;                   // number of prepare acks
   unsigned pp_redirects;              // number of prepare rejects
-  struct paxos_instance *pp_istart;   // last contiguous instance at prep time
 };
 
 /* Sync state used by proposers during sync. */
@@ -27,9 +29,106 @@ struct paxos_sync {
   unsigned ps_total;      // number of acceptors syncing
   unsigned ps_acks;       // number of sync acks
   unsigned ps_skips;      // number of times we skipped starting a new sync
-  paxid_t ps_last;        // the last contiguous learn across the system
+  paxid_t *ps_lasts;      // last contiguous learn of each acker, ours first
 };
 
+void sync_destroy(struct paxos_sync *);
+
+/* Range of consecutive accepts which we have yet to send to the proposer. */
+struct paxos_arange {
+  ballot_t ar_ballot;     // ballot of the accepted decrees
+  paxid_t ar_first;       // first instance accepted; 0 if none pending
+  paxid_t ar_last;        // last instance accepted
+  unsigned ar_source;     // GLib source ID of the pending flush
+};
+
+/* Chat requests being coalesced by the proposer into a single decree. */
+struct paxos_batch {
+  unsigned pb_size;       // capacity of the batch
+  unsigned pb_count;      // number of requests queued
+  unsigned pb_timer;      // GLib source ID of the flush timeout
+  reqid_t *pb_reqids;     // IDs of the queued requests, in order
+};
+
+void batch_destroy(struct paxos_batch *);
+
+/* A request we are missing, along with the instance which decrees it. */
+struct paxos_missing {
+  paxid_t pm_inum;            // instance decreeing the request
+  struct paxos_value pm_val;  // value referencing the request
+  paxid_t pm_retrieve;        // ID of the retrieve asking for it; 0 if none
+  bool pm_direct;             // must we ask the request's originator?
+  struct paxos_missing *pm_next;  // next request in the same retrieve
+  LIST_ENTRY(paxos_missing) pm_le;  // missing requests, in commit order
+};
+
+OPENHASH_DECLARE(missing, reqid_t);
+void missing_destroy(struct paxos_missing *);
+
+/* Requests we are missing, to be retrieved in bulk. */
+struct paxos_retrieval {
+  missing_container pr_missing;   // missing requests, by request ID
+  paxid_t pr_id;          // ID of our last retrieve
+  unsigned pr_source;     // GLib source ID of the pending flush
+};
+
+void retrieval_destroy(struct paxos_retrieval *);
+
+/* Owners of the instances from some instance onward, when every acceptor
+ * decrees in instances of its own. */
+struct paxos_slots {
+  paxid_t ps_from;        // first instance owned under this assignment
+  unsigned ps_count;      // number of owners
+  paxid_t *ps_owners;     // owner IDs, in rank order
+  LIST_ENTRY(paxos_slots) ps_le;  // list of assignments, newest first
+};
+
+typedef LIST_HEAD(slots_list, paxos_slots) slots_list;
+void slots_list_destroy(slots_list *);
+
+/* The rest of a welcome still to be streamed to a newly welcomed acceptor. */
+struct paxos_welcome {
+  paxid_t pw_paxid;       // ID of the new acceptor
+  paxid_t pw_next;        // next instance to send
+  paxid_t pw_end;         // first instance past the end of the welcome
+  LIST_ENTRY(paxos_welcome) pw_le;  // list of transfers in progress
+};
+
+typedef LIST_HEAD(welcome_list, paxos_welcome) welcome_list;
+void welcome_list_destroy(welcome_list *);
+
+/* A learned chat, kept for the scrollback of new acceptors. */
+struct paxos_chat {
+  reqid_t pc_reqid;               // ID of the chat request
+  size_t pc_size;                 // size of the chat
+  void *pc_data;                  // the chat
+  struct paxos_buf *pc_buf;       // buffer keeping pc_data alive
+  size_t pc_alias_size;           // size of the sender's alias
+  void *pc_alias;                 // sender's alias when the chat was learned
+  struct paxos_buf *pc_alias_buf; // buffer keeping pc_alias alive
+};
+
+/* Ring of the most recently learned chats. */
+struct paxos_scrollback {
+  unsigned sb_size;       // capacity of the ring; 0 until first used
+  unsigned sb_head;       // index of the oldest chat
+  unsigned sb_count;      // number of chats
+  struct paxos_chat *sb_chats;  // the ring itself
+};
+
+void scrollback_destroy(struct paxos_scrollback *);
+
+/* Mapped on-disk history of the chats we have learned. */
+struct paxos_history {
+  char *hs_dir;           // directory holding the segments
+  unsigned hs_count;      // number of segments
+  unsigned hs_size;       // capacity of hs_segs
+  struct history_segment *hs_segs;  // mapped segments, oldest first
+  paxid_t hs_resume;      // last instance filed before we reopened it
+};
+
+void history_destroy(struct paxos_history *);
+
 /* Session state. */
 struct paxos_session {
   pax_uuid_t *session_id;             // ID of the Paxos session
@@ -46,25 +145,76 @@ struct paxos_session {
   paxid_t sync_id;                    // locally-unique sync ID
   paxid_t sync_prev;                  // sync point of the last sync
   struct paxos_sync *sync;            // sync state; NULL if not syncing
+  paxid_t sync_seen;                  // our hole as of our last sync
+  unsigned sync_wait;                 // milliseconds between our syncs
+  unsigned sync_source;               // GLib source ID of the next sync
+  size_t sync_bytes;                  // chat bytes learned since truncation
+
+  struct paxos_batch *batch;          // batch being coalesced; NULL if none
+  struct paxos_arange arange;         // accepts pending for the proposer
+
+  paxid_t hlast;                      // last commit we know of past our hole
+  unsigned hwait;                     // ms to wait on our hole; 0 if unarmed
+  unsigned hsource;                   // GLib source ID of the hole timer
+  paxid_t hpeer;                      // acceptor we last retried our hole with
+  unsigned htries;                    // retries of our hole since it shrank
+  paxid_t hfirst;                     // our hole as of our last retry
+  bool hretried;                      // whether we have retried our hole
 
   unsigned live_count;                // number of acceptors we think are live
   acceptor_container alist;           // list of all Paxos participants
   acceptor_container adefer;          // list of deferred hello acks
   continuation_list clist;            // list of connectinuations
 
-  instance_container ilist;           // list of all instances
-  instance_container idefer;          // list of deferred instances
+  instance_container ilist;           // log of all instances
+  instance_list idefer;               // list of deferred instances
   request_container rcache;           // cached requests waiting for commit
+  struct paxos_retrieval retrieval;   // requests we are missing
 
   paxid_t ibase;                      // base value for instance numbers
   paxid_t ihole;                      // number of first uncommitted instance
-  struct paxos_instance *istart;      // lower bound instance of first hole
+  paxid_t cmark;                      // last commit watermark we sent
+  unsigned cmark_source;              // GLib source ID of the idle commit
+
+  bool mencius;                       // do acceptors own instances in turn?
+  bool marmed;                        // may owners decree at this ballot?
+  bool mreprep;                       // must we prepare again to fence?
+  paxid_t mfence;                     // last instance recovered by a prepare
+  paxid_t mnext;                      // lower bound on our next instance
+  paxid_t mseen;                      // highest instance taken by others
+  paxid_t mrouted;                    // last chat sent to the proposer
+  unsigned mskip_source;              // GLib source ID of the pending skips
+  slots_list slots;                   // instance owner assignments
+
+  unsigned tdecrees;                  // thrifty decrees sent to this quorum
+  unsigned twait;                     // milliseconds to wait on the quorum
+  unsigned tsource;                   // GLib source ID of the quorum timeout
+
+  welcome_list wlist;                 // welcomes still being streamed
+  unsigned wsource;                   // GLib source ID of the welcome pump
+
+  struct paxos_scrollback scrollback; // recent chats, for new acceptors
+
+  int wal_fd;                         // descriptor of our log; 0 if none
+  bool wal_dirty;                     // appended to our log since syncing?
+  size_t wal_size;                    // bytes in our log
+  size_t wal_live;                    // bytes in our log when last rewritten
+
+  struct paxos_history *history;      // chat history; NULL until first used
+
+  epoch_list epochs;                  // allocation epochs, oldest first
 
   LIST_ENTRY(paxos_session) session_le; // session list entry
 };
 
-LIST_DECLARE(session, pax_uuid_t *);
+HASHTABLE_DECLARE(session);
+typedef LIST_HEAD(session_list, paxos_session) session_list;
+
 struct paxos_session *session_new(void *, int);
 void session_destroy(struct paxos_session *);
 
+/* Paxos session GLib hashtable utilities. */
+unsigned session_key_hash(const void *);
+int session_key_equals(const void *, const void *);
+
 #endif /* __PAXOS_TYPES_SESSION_H__ */
@@ -0,0 +1,132 @@
+/**
+ * paxos_buf.c - Reference-counted payload buffers.
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <glib.h>
+
+#include "paxos_state.h"
+#include "util/paxos_buf.h"
+
+// Received payloads smaller than this are copied rather than referenced in
+// place.  Read buffers are several times larger, so referencing a small
+// payload would keep mostly unrelated bytes alive for as long as it lives.
+#define BUF_RECV_COPY_MAX   1024
+
+// The unpacked message currently being dispatched, and the buffer which has
+// taken over its zone, if any.
+static msgpack_unpacked *buf_recv_msg;
+static struct paxos_buf *buf_recv_buf;
+
+/**
+ * paxos_buf_copy - Copy a payload into a new buffer with one reference.
+ */
+struct paxos_buf *
+paxos_buf_copy(const void *data, size_t size)
+{
+  struct paxos_buf *buf;
+
+  buf = g_malloc(sizeof(*buf) + size);
+  buf->pb_refs = 1;
+  buf->pb_zone = NULL;
+  memcpy(PAXOS_BUF_DATA(buf), data, size);
+
+  return buf;
+}
+
+/**
+ * paxos_buf_ref - Take a reference to a buffer.
+ */
+struct paxos_buf *
+paxos_buf_ref(struct paxos_buf *buf)
+{
+  if (buf != NULL) {
+    buf->pb_refs++;
+  }
+  return buf;
+}
+
+/**
+ * paxos_buf_unref - Drop a reference to a buffer, freeing it along with the
+ * zone it holds once no references remain.
+ */
+void
+paxos_buf_unref(struct paxos_buf *buf)
+{
+  if (buf == NULL || --buf->pb_refs > 0) {
+    return;
+  }
+
+  if (buf->pb_zone != NULL) {
+    msgpack_zone_free(buf->pb_zone);
+  }
+  g_free(buf);
+}
+
+/**
+ * paxos_buf_recv_begin - Note the message about to be dispatched, so that
+ * handlers may retain pieces of it with paxos_buf_recv().
+ */
+void
+paxos_buf_recv_begin(msgpack_unpacked *msg)
+{
+  buf_recv_msg = msg;
+  buf_recv_buf = NULL;
+}
+
+/**
+ * paxos_buf_recv_end - Finish dispatching a message.
+ */
+void
+paxos_buf_recv_end()
+{
+  paxos_buf_unref(buf_recv_buf);
+  buf_recv_msg = NULL;
+  buf_recv_buf = NULL;
+}
+
+/**
+ * paxos_buf_recv - Get a reference to a buffer which keeps every object of
+ * the message being dispatched alive.
+ *
+ * The first call for a given message takes the zone away from the unpacked
+ * message, so that it outlives the dispatch; messages for which this is never
+ * called are freed with no extra work as usual.
+ */
+struct paxos_buf *
+paxos_buf_recv()
+{
+  assert(buf_recv_msg != NULL);
+
+  if (buf_recv_buf == NULL) {
+    buf_recv_buf = g_malloc(sizeof(*buf_recv_buf));
+    buf_recv_buf->pb_refs = 1;  // Held until the end of the dispatch.
+    buf_recv_buf->pb_zone = msgpack_unpacked_release_zone(buf_recv_msg);
+    state.stats.ps_allocs++;
+  }
+
+  return paxos_buf_ref(buf_recv_buf);
+}
+
+/**
+ * paxos_buf_recv_data - Keep a payload of the message being dispatched alive
+ * in a buffer, returning where the payload may be found from now on.
+ *
+ * Small payloads are copied out unless the message's zone has already been
+ * taken over, so that a single short chat doesn't pin a whole read buffer.
+ */
+void *
+paxos_buf_recv_data(struct paxos_buf **buf, const void *data, size_t size)
+{
+  assert(buf_recv_msg != NULL);
+
+  if (buf_recv_buf == NULL && size < BUF_RECV_COPY_MAX) {
+    *buf = paxos_buf_copy(data, size);
+    state.stats.ps_allocs++;
+    return PAXOS_BUF_DATA(*buf);
+  }
+
+  *buf = paxos_buf_recv();
+  return (void *)data;
+}
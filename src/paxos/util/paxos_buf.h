@@ -0,0 +1,35 @@
+/**
+ * paxos_buf.h - Reference-counted payload buffers.
+ */
+#ifndef __PAXOS_BUF_H__
+#define __PAXOS_BUF_H__
+
+#include <stddef.h>
+#include <msgpack.h>
+
+/**
+ * A buffer keeps payload bytes alive for as long as anyone holds a reference.
+ * Large payloads which we receive are not copied at all; instead, the buffer
+ * takes over the msgpack zone of the message they arrived in, which in turn
+ * holds a reference to the peer's read buffer.  Small received payloads, and
+ * payloads which originate locally, are copied once, inline after the buffer
+ * header.
+ */
+struct paxos_buf {
+  unsigned pb_refs;         // number of references
+  msgpack_zone *pb_zone;    // zone of a received message; NULL for copies
+};
+
+#define PAXOS_BUF_DATA(buf)   ((void *)((struct paxos_buf *)(buf) + 1))
+
+struct paxos_buf *paxos_buf_copy(const void *, size_t);
+struct paxos_buf *paxos_buf_ref(struct paxos_buf *);
+void paxos_buf_unref(struct paxos_buf *);
+
+/* Zero-copy retention of the message currently being dispatched. */
+void paxos_buf_recv_begin(msgpack_unpacked *);
+void paxos_buf_recv_end(void);
+struct paxos_buf *paxos_buf_recv(void);
+void *paxos_buf_recv_data(struct paxos_buf **, const void *, size_t);
+
+#endif /* __PAXOS_BUF_H__ */
@@ -2,24 +2,162 @@
  * paxos_io.c - Paxos reliable IO utilities
  */
 
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
 #include <glib.h>
 
 #include "paxos.h"
 #include "paxos_protocol.h"
 #include "paxos_state.h"
+#include "containers/list.h"
+#include "util/paxos_buf.h"
 #include "util/paxos_io.h"
 
 #define PIO_BUFSIZE 4096
+#define PIO_IOV_MAX 64
+
+#define PIO_LOW_WATER   (256 * 1024)      // resume taking client requests
+#define PIO_HIGH_WATER  (1024 * 1024)     // stop taking client requests
+#define PIO_HARD_WATER  (64 * 1024 * 1024)  // give up on the peer
+#define PIO_SLOW_USECS  (30 * G_USEC_PER_SEC)   // longest we stay congested
 
 struct paxos_peer {
   GIOChannel *pp_channel;         // Channel to the peer.
   msgpack_unpacker pp_unpacker;   // Unpacker (and its associated read buffer).
-  GString *pp_write_buffer;       // Write buffer.
+  GQueue pp_frames;               // Queue of frames waiting to be written.
+  size_t pp_offset;               // Bytes of the head frame already written.
+  size_t pp_queued;               // Bytes queued and not yet written.
+  gint64 pp_congested;            // When we passed the high watermark, or 0.
+  bool pp_slow;                   // Whether we've given up on the peer.
+  unsigned pp_in_watch;           // Source ID of our read watch.
+  unsigned pp_out_watch;          // Source ID of our write watch, if any.
+  bool pp_dirty;                  // Whether we're on the dirty list.
+  LIST_ENTRY(paxos_peer) pp_dirty_le;   // Peers waiting to be flushed.
+  acceptor_peer_list pp_acceptors;  // Acceptors, across sessions, using us.
 };
 
 // Private stuff.
 int paxos_peer_read(GIOChannel *, GIOCondition, void *);
 int paxos_peer_write(GIOChannel *, GIOCondition, void *);
+static int paxos_peer_flush(struct paxos_peer *);
+
+/**
+ * Rather than writing to a peer as soon as a frame is queued on it, we mark
+ * the peer dirty, and a main loop source writes out every dirty peer once
+ * per iteration of the loop.  All the messages we send to a peer while
+ * handling one batch of events are thereby gathered into a single writev().
+ * Peers whose sockets fill up fall back to a write watch until they drain.
+ *
+ * Flushing can also be corked, e.g., to gather messages across several
+ * iterations.
+ */
+static LIST_HEAD(, paxos_peer) dirty;   // peers with unflushed frames
+static GSource *flusher;                // source which flushes dirty peers
+static unsigned corked;                 // nesting depth of corks
+
+/**
+ * paxos_io_ready - Whether we should flush dirty peers in this iteration.
+ */
+static gboolean
+paxos_io_ready()
+{
+  return !LIST_EMPTY(&dirty) && corked == 0;
+}
+
+static gboolean
+paxos_io_prepare(GSource *source, gint *timeout)
+{
+  *timeout = -1;
+  return paxos_io_ready();
+}
+
+static gboolean
+paxos_io_check(GSource *source)
+{
+  return paxos_io_ready();
+}
+
+/**
+ * paxos_io_dispatch - Flush every dirty peer.
+ */
+static gboolean
+paxos_io_dispatch(GSource *source, GSourceFunc callback, gpointer data)
+{
+  struct paxos_peer *peer;
+
+  // Flushing a peer may drop its connection, which may in turn cause
+  // messages to be queued on other peers; so, just keep popping.
+  LIST_WHILE_FIRST(peer, &dirty) {
+    LIST_REMOVE(&dirty, peer, pp_dirty_le);
+    peer->pp_dirty = false;
+
+    // Rather than buffer without bound for a peer which can't keep up, drop
+    // it.  If we are the proposer, this parts it from our sessions.  Peers
+    // we can't do without are kept, and judged afresh as we send to them.
+    if (peer->pp_slow) {
+      if (paxos_slow_connection(peer)) {
+        continue;
+      }
+      peer->pp_slow = false;
+    }
+
+    if (paxos_peer_flush(peer)) {
+      // Flush the read buffer.  If the peer has gone away, we will detect
+      // the EOF in paxos_peer_read, which will destroy the peer for us.
+      paxos_peer_read(peer->pp_channel, G_IO_IN, peer);
+    }
+  }
+
+  return TRUE;
+}
+
+static GSourceFuncs paxos_io_funcs = {
+  paxos_io_prepare,
+  paxos_io_check,
+  paxos_io_dispatch,
+  NULL
+};
+
+/**
+ * paxos_io_init - Set up the flushing of peer write buffers.
+ */
+void
+paxos_io_init()
+{
+  if (flusher != NULL) {
+    return;
+  }
+
+  LIST_INIT(&dirty);
+  corked = 0;
+
+  flusher = g_source_new(&paxos_io_funcs, sizeof(GSource));
+  g_source_attach(flusher, NULL);
+}
+
+/**
+ * paxos_io_cork - Hold all peer writes until a matching paxos_io_uncork.
+ * Corks nest.
+ */
+void
+paxos_io_cork()
+{
+  corked++;
+}
+
+/**
+ * paxos_io_uncork - Release a cork.  Once the last cork is released, dirty
+ * peers are flushed on the next iteration of the main loop.
+ */
+void
+paxos_io_uncork()
+{
+  if (corked > 0) {
+    corked--;
+  }
+}
 
 /**
  * paxos_peer_init - Set up peer read/write buffering.
@@ -45,10 +183,19 @@ paxos_peer_init(GIOChannel *channel)
 
   // Set up the read listener.
   msgpack_unpacker_init(&peer->pp_unpacker, PIO_BUFSIZE);
-  g_io_add_watch(channel, G_IO_IN, paxos_peer_read, peer);
+  peer->pp_in_watch = g_io_add_watch(channel, G_IO_IN, paxos_peer_read, peer);
+
+  // Set up the write queue.  We only watch for writability when the socket
+  // has filled up.
+  g_queue_init(&peer->pp_frames);
+  peer->pp_offset = 0;
+  peer->pp_queued = 0;
+  peer->pp_congested = 0;
+  peer->pp_slow = false;
+  peer->pp_out_watch = 0;
+  peer->pp_dirty = false;
 
-  // Set up the write buffer.
-  peer->pp_write_buffer = g_string_sized_new(PIO_BUFSIZE);
+  LIST_INIT(&peer->pp_acceptors);
 
   return peer;
 }
@@ -59,6 +206,9 @@ paxos_peer_init(GIOChannel *channel)
 void
 paxos_peer_destroy(struct paxos_peer *peer)
 {
+  struct paxos_acceptor *acc;
+  struct paxos_frame *frame;
+
   GIOStatus status;
   GError *error = NULL;
 
@@ -66,11 +216,29 @@ paxos_peer_destroy(struct paxos_peer *peer)
     return;
   }
 
+  // Detach any acceptors still using the peer.
+  LIST_WHILE_FIRST(acc, &peer->pp_acceptors) {
+    acceptor_set_peer(acc, NULL);
+  }
+
   // Clean up the msgpack read buffer / unpacker.
   msgpack_unpacker_destroy(&peer->pp_unpacker);
 
-  // Get rid of our event listeners.
-  while (g_source_remove_by_user_data(peer));
+  // Drop any frames we never got around to writing.
+  while ((frame = g_queue_pop_head(&peer->pp_frames)) != NULL) {
+    paxos_frame_unref(frame);
+  }
+
+  // Get rid of our event listeners, and stop waiting to be flushed.
+  if (peer->pp_in_watch != 0) {
+    g_source_remove(peer->pp_in_watch);
+  }
+  if (peer->pp_out_watch != 0) {
+    g_source_remove(peer->pp_out_watch);
+  }
+  if (peer->pp_dirty) {
+    LIST_REMOVE(&dirty, peer, pp_dirty_le);
+  }
 
   // Flush and destroy the GIOChannel.
   status = g_io_channel_shutdown(peer->pp_channel, TRUE, &error);
@@ -119,9 +287,17 @@ paxos_peer_read(GIOChannel *channel, GIOCondition condition, void *data)
 
     // Pop as many msgpack objects as we can get our hands on.
     while (msgpack_unpacker_next(&peer->pp_unpacker, &result)) {
+      paxos_buf_recv_begin(&result);
       if (paxos_dispatch(peer, &result.data) != 0 && pax->self_id != 0) {
         g_warning("paxos_read_peer: Dispatch failed.");
         r = FALSE;
+
+        // Stop listening, whether or not we were called by our watch.
+        g_source_remove(peer->pp_in_watch);
+        peer->pp_in_watch = 0;
+      }
+      paxos_buf_recv_end();
+      if (!r) {
         break;
       }
     }
@@ -140,70 +316,227 @@ paxos_peer_read(GIOChannel *channel, GIOCondition condition, void *data)
 }
 
 /**
- * paxos_peer_write - Write data reliably to a peer.
+ * paxos_peer_flush - Write as many queued frames to a peer as the socket
+ * will take.
+ *
+ * We gather as many queued frames as we can into each writev(), so that
+ * frames shared with other peers are written straight from their one copy.
+ * If the socket fills up, we watch for it to become writable again.
+ *
+ * Returns nonzero if the write failed.
+ */
+static int
+paxos_peer_flush(struct paxos_peer *peer)
+{
+  struct paxos_frame *frame;
+  struct iovec iov[PIO_IOV_MAX];
+  GList *it;
+  ssize_t bytes_written, bytes_wanted;
+  int n;
+
+  while (!g_queue_is_empty(&peer->pp_frames)) {
+    // Gather the unwritten parts of the queued frames.
+    n = 0;
+    bytes_wanted = -peer->pp_offset;
+    for (it = peer->pp_frames.head; it != NULL && n < PIO_IOV_MAX;
+        it = it->next) {
+      frame = it->data;
+      iov[n].iov_base = frame->pf_data;
+      iov[n].iov_len = frame->pf_size;
+      bytes_wanted += frame->pf_size;
+      ++n;
+    }
+    iov[0].iov_base = (char *)iov[0].iov_base + peer->pp_offset;
+    iov[0].iov_len -= peer->pp_offset;
+
+    // Write to the channel.
+    bytes_written = writev(g_io_channel_unix_get_fd(peer->pp_channel), iov, n);
+
+    if (bytes_written < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        break;
+      }
+      g_warning("paxos_peer_write: Write to socket failed.");
+      return 1;
+    }
+
+    // Release every frame which has been written in full.
+    peer->pp_offset += bytes_written;
+    while ((frame = g_queue_peek_head(&peer->pp_frames)) != NULL &&
+        peer->pp_offset >= frame->pf_size) {
+      peer->pp_offset -= frame->pf_size;
+      peer->pp_queued -= frame->pf_size;
+      g_queue_pop_head(&peer->pp_frames);
+      paxos_frame_unref(frame);
+    }
+
+    // If the socket didn't take everything, it's full.
+    if (bytes_written < bytes_wanted) {
+      break;
+    }
+  }
+
+  // Wait for the socket to drain if we have more to write.
+  if (!g_queue_is_empty(&peer->pp_frames) && peer->pp_out_watch == 0) {
+    peer->pp_out_watch = g_io_add_watch(peer->pp_channel, G_IO_OUT,
+        paxos_peer_write, peer);
+  }
+
+  // If we have drained below the low watermark, the client may send again.
+  if (peer->pp_congested != 0 && peer->pp_queued <= PIO_LOW_WATER) {
+    peer->pp_congested = 0;
+    paxos_drain_connection(peer);
+  }
+
+  return 0;
+}
+
+/**
+ * paxos_peer_write - Resume writing to a peer whose socket had filled up.
  */
 int
 paxos_peer_write(GIOChannel *channel, GIOCondition condition, void *data)
 {
   struct paxos_peer *peer = (struct paxos_peer *)data;
-  size_t bytes_written;
 
-  GIOStatus status;
-  GError *error = NULL;
+  if (paxos_peer_flush(peer)) {
+    // Flush the read buffer.  If the peer has gone away, we will detect the
+    // EOF in paxos_peer_read, which will destroy the peer for us.
+    peer->pp_out_watch = 0;
+    paxos_peer_read(channel, G_IO_IN, data);
+    return FALSE;
+  }
 
-  // If there's nothing to write, do nothing.
-  if (peer->pp_write_buffer->len == 0) {
+  // Keep watching until we've drained the queue.
+  if (!g_queue_is_empty(&peer->pp_frames)) {
     return TRUE;
   }
 
-  // Write to the channel.
-  status = g_io_channel_write_chars(channel, peer->pp_write_buffer->str,
-      peer->pp_write_buffer->len, &bytes_written, &error);
-
-  if (status == G_IO_STATUS_ERROR) {
-    g_warning("paxos_peer_write: Write to socket failed.");
-  }
+  peer->pp_out_watch = 0;
+  return FALSE;
+}
 
-  g_string_erase(peer->pp_write_buffer, 0, bytes_written);
+/**
+ * paxos_peer_acceptors - Get the list of acceptors, across all sessions,
+ * which are attached to a peer.
+ */
+struct acceptor_peer_list *
+paxos_peer_acceptors(struct paxos_peer *peer)
+{
+  return &peer->pp_acceptors;
+}
 
-  if (peer->pp_write_buffer->len == 0) {
-    // XXX: this is kind of hax
-    while (g_source_remove_by_user_data(peer));
-    g_io_add_watch(peer->pp_channel, G_IO_IN, paxos_peer_read, peer);
+/**
+ * paxos_peer_send_frame - Queue a frame to be sent to a peer.
+ */
+int
+paxos_peer_send_frame(struct paxos_peer *peer, struct paxos_frame *frame)
+{
+  frame->pf_refs++;
+  g_queue_push_tail(&peer->pp_frames, frame);
+  peer->pp_queued += frame->pf_size;
+
+  // Note when we pass the high watermark, and give up on the peer if it
+  // falls hopelessly behind or stays congested for too long.  We must keep
+  // queueing protocol messages in the meantime; only client requests are
+  // refused.
+  if (peer->pp_queued > PIO_HIGH_WATER && peer->pp_congested == 0) {
+    peer->pp_congested = g_get_monotonic_time();
   }
-
-  // Flush the channel.
-  error = NULL;
-  if (g_io_channel_flush(peer->pp_channel, &error) == G_IO_STATUS_ERROR) {
-    g_critical("paxos_peer_write: Could not flush channel.");
+  if (peer->pp_congested != 0 && (peer->pp_queued > PIO_HARD_WATER ||
+        g_get_monotonic_time() - peer->pp_congested > PIO_SLOW_USECS)) {
+    peer->pp_slow = true;
   }
 
-  if (status == G_IO_STATUS_EOF) {
-    // Flush the read buffer.  We will also detect the EOF in paxos_peer_read,
-    // which will destroy the peer for us.
-    if (g_io_channel_get_buffer_condition(channel) & G_IO_IN) {
-      paxos_peer_read(channel, G_IO_IN, data);
-    }
-    return FALSE;
+  // Mark the peer to be flushed, unless we're already waiting for it to
+  // become writable.  Slow peers are dealt with at flush time.
+  if (!peer->pp_dirty && (peer->pp_out_watch == 0 || peer->pp_slow)) {
+    LIST_INSERT_TAIL(&dirty, peer, pp_dirty_le);
+    peer->pp_dirty = true;
   }
 
-  return TRUE;
+  return 0;
 }
 
 /**
- * paxos_peer_send - Send the contents of a buffer to a peer.
+ * paxos_peer_congested - Whether a peer has more queued than we'd like, in
+ * which case we should not take on any more client requests for it.
+ */
+bool
+paxos_peer_congested(struct paxos_peer *peer)
+{
+  return peer->pp_congested != 0;
+}
+
+/**
+ * paxos_peer_queued - The number of bytes queued to a peer and not yet
+ * written, for pacing bulk transfers.
+ */
+size_t
+paxos_peer_queued(struct paxos_peer *peer)
+{
+  return peer->pp_queued;
+}
+
+/**
+ * paxos_peer_send - Send a copy of the contents of a buffer to a peer.
  */
 int
 paxos_peer_send(struct paxos_peer *peer, const char *buffer, size_t length)
 {
-  // If there was no data in the buffer to begin with, it means we weren't
-  // subscribed to write events. Since we're populating the buffer now, let's
-  // start listening.
-  if (peer->pp_write_buffer->len == 0 && length > 0) {
-    g_io_add_watch(peer->pp_channel, G_IO_OUT, paxos_peer_write, peer);
+  int r;
+  struct paxos_frame *frame;
+
+  if (length == 0) {
+    return 0;
   }
 
-  g_string_append_len(peer->pp_write_buffer, buffer, length);
+  frame = g_malloc(sizeof(*frame));
+  frame->pf_refs = 1;
+  frame->pf_size = length;
+  frame->pf_data = malloc(length);
+  memcpy(frame->pf_data, buffer, length);
+  state.stats.ps_allocs++;
 
-  return 0;
+  r = paxos_peer_send_frame(peer, frame);
+  paxos_frame_unref(frame);
+
+  return r;
+}
+
+///////////////////////////////////////////////////////////////////////////
+//
+//  Frames.
+//
+
+/**
+ * paxos_frame_new - Make a frame out of a packed message.  The frame takes
+ * over the yak's data, leaving the yak empty.
+ */
+struct paxos_frame *
+paxos_frame_new(struct yakyak *yy)
+{
+  struct paxos_frame *frame;
+
+  frame = g_malloc(sizeof(*frame));
+  frame->pf_refs = 1;
+  frame->pf_data = yakyak_release(yy, &frame->pf_size);
+  state.stats.ps_allocs++;
+
+  return frame;
+}
+
+/**
+ * paxos_frame_unref - Drop a reference to a frame, freeing it if it was the
+ * last one.
+ */
+void
+paxos_frame_unref(struct paxos_frame *frame)
+{
+  if (frame == NULL || --frame->pf_refs > 0) {
+    return;
+  }
+
+  free(frame->pf_data);
+  g_free(frame);
 }
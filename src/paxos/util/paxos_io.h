@@ -4,13 +4,39 @@
 #ifndef __PAXOS_IO_H__
 #define __PAXOS_IO_H__
 
+#include <stdbool.h>
 #include <glib.h>
 #include <msgpack.h>
 
+#include "common/yakyak.h"
+
 struct paxos_peer;
+struct acceptor_peer_list;
+
+/**
+ * An immutable, reference-counted serialized message.  A frame is queued by
+ * reference on every peer it is sent to, so a broadcast is packed once and
+ * never copied.
+ */
+struct paxos_frame {
+  unsigned pf_refs;         // number of references
+  size_t pf_size;           // length of the message
+  char *pf_data;            // the message
+};
+
+struct paxos_frame *paxos_frame_new(struct yakyak *);
+void paxos_frame_unref(struct paxos_frame *);
+
+void paxos_io_init(void);
+void paxos_io_cork(void);
+void paxos_io_uncork(void);
 
 struct paxos_peer *paxos_peer_init(GIOChannel *);
 void paxos_peer_destroy(struct paxos_peer *);
 int paxos_peer_send(struct paxos_peer *, const char *, size_t);
+int paxos_peer_send_frame(struct paxos_peer *, struct paxos_frame *);
+bool paxos_peer_congested(struct paxos_peer *);
+size_t paxos_peer_queued(struct paxos_peer *);
+struct acceptor_peer_list *paxos_peer_acceptors(struct paxos_peer *);
 
 #endif /* __PAXOS_IO_H__ */
@@ -5,6 +5,7 @@
 #include <stdio.h>
 
 #include "paxos.h"
+#include "paxos_state.h"
 #include "util/paxos_print.h"
 
 void
@@ -41,12 +42,21 @@ paxop_print(paxop_t op, const char *lead, const char *trail)
     case OP_ACCEPT:
       printf("OP_ACCEPT  ");
       break;
+    case OP_ACCEPTS:
+      printf("OP_ACCEPTS ");
+      break;
     case OP_COMMIT:
       printf("OP_COMMIT  ");
       break;
+    case OP_FENCE:
+      printf("OP_FENCE   ");
+      break;
     case OP_WELCOME:
       printf("OP_WELCOME ");
       break;
+    case OP_HISTORY:
+      printf("OP_HISTORY ");
+      break;
     case OP_HELLO:
       printf("OP_HELLO   ");
       break;
@@ -83,6 +93,9 @@ paxop_print(paxop_t op, const char *lead, const char *trail)
     case OP_TRUNCATE:
       printf("OP_TRUNCATE");
       break;
+    case OP_CATCHUP:
+      printf("OP_CATCHUP ");
+      break;
   }
   printf("%s", trail);
 }
@@ -107,6 +120,9 @@ dkind_print(dkind_t dkind, const char *lead, const char *trail)
     case DEC_KILL:
       printf("DEC_KILL");
       break;
+    case DEC_BATCH:
+      printf("DEC_BATCH");
+      break;
   }
   printf("%s", trail);
 }
@@ -162,3 +178,41 @@ paxos_request_print(struct paxos_request *req, const char *lead,
   printf("%*s", (int)req->pr_size, (char *)req->pr_data);
   printf("%s", trail);
 }
+
+void
+paxos_slab_print(struct paxos_slab *slab, const char *lead,
+    const char *trail)
+{
+  printf("%s", lead);
+  printf("%u / %u live (peak %u) in %u chunks", slab->ps_live,
+      slab_capacity(slab), slab->ps_peak, slab->ps_nchunks);
+  printf("%s", trail);
+}
+
+void
+paxos_epoch_list_print(epoch_list *head, const char *lead,
+    const char *trail)
+{
+  struct paxos_epoch *it;
+
+  LIST_FOREACH(it, head, pe_le) {
+    printf("%sepoch @ ", lead);
+    paxid_print(it->pe_base, "", "\n");
+    paxos_slab_print(&it->pe_islab, "  instances: ", "\n");
+    paxos_slab_print(&it->pe_rslab, "  requests:  ", trail);
+  }
+}
+
+void
+paxos_stats_print(struct paxos_stats *stats, const char *lead,
+    const char *trail)
+{
+  printf("%s", lead);
+  printf("dispatched: %lu / allocating: %lu / allocs: %lu",
+      stats->ps_dispatched, stats->ps_allocating, stats->ps_allocs);
+  printf(" / retries: %lu / unretried: %lu / hole repeats: %lu",
+      stats->ps_retries, stats->ps_unretried, stats->ps_hole_repeats);
+  printf(" / peer retries: %lu / throttled: %lu",
+      stats->ps_peer_retries, stats->ps_throttled);
+  printf("%s", trail);
+}
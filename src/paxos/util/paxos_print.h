@@ -6,6 +6,8 @@
 
 #include "paxos.h"
 
+struct paxos_stats;
+
 void paxid_print(paxid_t, const char *, const char *);
 void ppair_print(ppair_t, const char *, const char *);
 void paxop_print(paxop_t, const char *, const char *);
@@ -17,4 +19,8 @@ void paxos_acceptor_print(struct paxos_acceptor *, const char *, const char *);
 void paxos_instance_print(struct paxos_instance *, const char *, const char *);
 void paxos_request_print(struct paxos_request *, const char *, const char *);
 
+void paxos_slab_print(struct paxos_slab *, const char *, const char *);
+void paxos_epoch_list_print(epoch_list *, const char *, const char *);
+void paxos_stats_print(struct paxos_stats *, const char *, const char *);
+
 #endif /* __PAXOS_PRINT_H__ */
@@ -0,0 +1,161 @@
+/**
+ * paxos_slab.c - Fixed-size object pools with free lists.
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <glib.h>
+
+#include "util/paxos_slab.h"
+
+// Objects and chunk headers are padded to a multiple of this size.
+#define SLAB_ALIGN  (2 * sizeof(void *))
+#define SLAB_ROUND(n)  (((n) + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1))
+
+/**
+ * slab_init - Initialize an empty slab of objects of a given size.
+ */
+void
+slab_init(struct paxos_slab *slab, size_t objsize, unsigned perchunk)
+{
+  slab->ps_objsize = SLAB_ROUND(objsize < sizeof(void *) ?
+      sizeof(void *) : objsize);
+  slab->ps_perchunk = perchunk;
+  slab->ps_free = NULL;
+  slab->ps_chunks = NULL;
+
+  slab->ps_nchunks = 0;
+  slab->ps_live = 0;
+  slab->ps_peak = 0;
+}
+
+/**
+ * slab_destroy - Return all of a slab's chunks to the heap.  Any objects
+ * still allocated from the slab become invalid.
+ */
+void
+slab_destroy(struct paxos_slab *slab)
+{
+  void *chunk;
+
+  while ((chunk = slab->ps_chunks) != NULL) {
+    slab->ps_chunks = *(void **)chunk;
+    g_free(chunk);
+  }
+
+  slab->ps_free = NULL;
+  slab->ps_nchunks = 0;
+  slab->ps_live = 0;
+}
+
+/**
+ * slab_add_chunk - Link a chunk into the slab and thread its objects onto the
+ * free list.
+ */
+static void
+slab_add_chunk(struct paxos_slab *slab, char *chunk)
+{
+  unsigned i;
+  char *obj;
+
+  // Link the chunk into the chunk list.
+  *(void **)chunk = slab->ps_chunks;
+  slab->ps_chunks = chunk;
+  slab->ps_nchunks++;
+
+  // Push the chunk's objects onto the free list, back to front, so that we
+  // hand them out in address order.
+  obj = chunk + SLAB_ROUND(sizeof(void *)) +
+      slab->ps_perchunk * slab->ps_objsize;
+  for (i = 0; i < slab->ps_perchunk; ++i) {
+    obj -= slab->ps_objsize;
+    *(void **)obj = slab->ps_free;
+    slab->ps_free = obj;
+  }
+}
+
+/**
+ * slab_grow - Allocate a new chunk and thread its objects onto the free list.
+ */
+static void
+slab_grow(struct paxos_slab *slab)
+{
+  slab_add_chunk(slab, g_malloc(SLAB_ROUND(sizeof(void *)) +
+      slab->ps_perchunk * slab->ps_objsize));
+}
+
+/**
+ * slab_adopt - Take over the chunks of a drained slab of the same shape, so
+ * that its memory is reused rather than returned to the heap.  We only keep
+ * as many chunks as either slab has ever needed at once, and free the rest.
+ */
+void
+slab_adopt(struct paxos_slab *slab, struct paxos_slab *from)
+{
+  void *chunk;
+  unsigned want;
+
+  assert(from->ps_live == 0);
+  assert(from->ps_objsize == slab->ps_objsize);
+  assert(from->ps_perchunk == slab->ps_perchunk);
+
+  want = MAX(from->ps_peak, slab->ps_peak);
+  while ((chunk = from->ps_chunks) != NULL) {
+    from->ps_chunks = *(void **)chunk;
+    if (slab_capacity(slab) < want) {
+      slab_add_chunk(slab, chunk);
+    } else {
+      g_free(chunk);
+    }
+  }
+
+  from->ps_free = NULL;
+  from->ps_nchunks = 0;
+}
+
+/**
+ * slab_alloc - Allocate a zeroed object from the slab.
+ */
+void *
+slab_alloc(struct paxos_slab *slab)
+{
+  void *obj;
+
+  if (slab->ps_free == NULL) {
+    slab_grow(slab);
+  }
+
+  obj = slab->ps_free;
+  slab->ps_free = *(void **)obj;
+
+  if (++slab->ps_live > slab->ps_peak) {
+    slab->ps_peak = slab->ps_live;
+  }
+
+  return memset(obj, 0, slab->ps_objsize);
+}
+
+/**
+ * slab_free - Return an object to the slab's free list.
+ */
+void
+slab_free(struct paxos_slab *slab, void *obj)
+{
+  if (obj == NULL) {
+    return;
+  }
+
+  *(void **)obj = slab->ps_free;
+  slab->ps_free = obj;
+  slab->ps_live--;
+}
+
+/**
+ * slab_capacity - Get the number of objects the slab can hold without
+ * growing.
+ */
+unsigned
+slab_capacity(struct paxos_slab *slab)
+{
+  return slab->ps_nchunks * slab->ps_perchunk;
+}
@@ -0,0 +1,34 @@
+/**
+ * paxos_slab.h - Fixed-size object pools with free lists.
+ */
+#ifndef __PAXOS_SLAB_H__
+#define __PAXOS_SLAB_H__
+
+#include <stddef.h>
+
+/**
+ * A slab hands out objects of a single size, carved from chunks which are
+ * allocated on demand and only returned to the heap when the slab itself is
+ * destroyed, or handed on to another slab.  Freed objects are threaded onto
+ * a free list and reused first.
+ */
+struct paxos_slab {
+  size_t ps_objsize;        // size of each object, padded for alignment
+  unsigned ps_perchunk;     // number of objects carved from each chunk
+  void *ps_free;            // free list, threaded through the free objects
+  void *ps_chunks;          // chunk list, threaded through the chunk headers
+
+  /* Occupancy counters. */
+  unsigned ps_nchunks;      // number of chunks allocated
+  unsigned ps_live;         // number of objects currently allocated
+  unsigned ps_peak;         // high water mark of ps_live
+};
+
+void slab_init(struct paxos_slab *, size_t, unsigned);
+void slab_destroy(struct paxos_slab *);
+void *slab_alloc(struct paxos_slab *);
+void slab_free(struct paxos_slab *, void *);
+void slab_adopt(struct paxos_slab *, struct paxos_slab *);
+unsigned slab_capacity(struct paxos_slab *);
+
+#endif /* __PAXOS_SLAB_H__ */
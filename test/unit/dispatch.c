@@ -0,0 +1,161 @@
+/**
+ * dispatch.c - Check that ignored messages stay off the heap in dispatch.
+ *
+ * We start a session of our own, replay late accepts and stale sync replies
+ * at it through paxos_dispatch, and check that none of them allocated.  Every
+ * heap allocation in the process is counted toward the dispatch statistics,
+ * not only the ones which the library counts itself.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <glib.h>
+
+#include "common/yakyak.h"
+
+#include "paxos.h"
+#include "paxos_protocol.h"
+#include "paxos_state.h"
+#include "types/primitives.h"
+#include "util/paxos_buf.h"
+
+void *__libc_malloc(size_t);
+void *__libc_calloc(size_t, size_t);
+void *__libc_realloc(void *, size_t);
+
+void *
+malloc(size_t size)
+{
+  state.stats.ps_allocs++;
+  return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+  state.stats.ps_allocs++;
+  return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+  state.stats.ps_allocs++;
+  return __libc_realloc(ptr, size);
+}
+
+static int
+test_connect(const char *alias, size_t size, struct motmot_connect_cb *cb)
+{
+  return 0;
+}
+
+static int
+test_learn(const void *message, size_t len, const char *alias, size_t size,
+    void *data)
+{
+  return 0;
+}
+
+static void *
+test_enter(void *data)
+{
+  return data;
+}
+
+static void
+test_leave(void *data)
+{
+}
+
+/**
+ * replay - Pack a message and dispatch it as though it had been received,
+ * checking that dispatching it did not allocate.
+ */
+static void
+replay(const char *what, struct paxos_header *hdr, bool payload, paxid_t inum)
+{
+  int r;
+  struct yakyak yy;
+  msgpack_unpacked msg;
+  unsigned long dispatched, allocating;
+
+  yakyak_init(&yy, payload ? 2 : 1);
+  paxos_header_pack(&yy, hdr);
+  if (payload) {
+    paxos_paxid_pack(&yy, inum);
+  }
+
+  msgpack_unpacked_init(&msg);
+  if (!msgpack_unpack_next(&msg, yakyak_data(&yy), yakyak_size(&yy), NULL)) {
+    fprintf(stderr, "dispatch: %s did not unpack\n", what);
+    exit(1);
+  }
+
+  dispatched = state.stats.ps_dispatched;
+  allocating = state.stats.ps_allocating;
+
+  paxos_buf_recv_begin(&msg);
+  r = paxos_dispatch(NULL, &msg.data);
+  paxos_buf_recv_end();
+
+  if (r != 0) {
+    fprintf(stderr, "dispatch: %s failed\n", what);
+    exit(1);
+  }
+  if (state.stats.ps_dispatched != dispatched + 1 ||
+      state.stats.ps_allocating != allocating) {
+    fprintf(stderr, "dispatch: %s allocated\n", what);
+    exit(1);
+  }
+
+  msgpack_unpacked_destroy(&msg);
+  yakyak_destroy(&yy);
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct learn_table learn = { test_learn, test_learn, test_learn };
+  struct paxos_header hdr;
+  struct paxos_session *session;
+
+  // Don't let stdio allocate a buffer in the middle of a dispatch.
+  setvbuf(stdout, NULL, _IONBF, 0);
+
+  if (paxos_init(test_connect, &learn, test_enter, test_leave, "test", 4)) {
+    fprintf(stderr, "dispatch: init failed\n");
+    return 1;
+  }
+  session = paxos_start(NULL);
+
+  // An accept for the instance we committed on startup, under our ballot.
+  pax = session;
+  header_init(&hdr, OP_ACCEPT, 1);
+  replay("late accept", &hdr, false, 0);
+
+  // An accept meant for an earlier ballot.
+  pax = session;
+  header_init(&hdr, OP_ACCEPT, 2);
+  hdr.ph_ballot.gen--;
+  replay("accept for an old ballot", &hdr, false, 0);
+
+  // A range of accepts for an earlier ballot.
+  pax = session;
+  header_init(&hdr, OP_ACCEPTS, 2);
+  hdr.ph_ballot.gen--;
+  replay("accepts for an old ballot", &hdr, true, 8);
+
+  // Replies to a sync which we never started.
+  pax = session;
+  header_init(&hdr, OP_LAST, pax->sync_id + 1);
+  replay("stale last", &hdr, true, 1);
+
+  pax = session;
+  header_init(&hdr, OP_LAST, pax->sync_id);
+  replay("last with no sync", &hdr, true, 1);
+
+  printf("dispatch: ok\n");
+  return 0;
+}
@@ -0,0 +1,204 @@
+/**
+ * history.c - Check that a session's history pages by whole instances.
+ *
+ * We start a session of our own with history on and file two chats apiece
+ * for forty instances, more than one index stride, then one chat too big to
+ * share a segment and twenty more instances after it, so that the history
+ * spans three segments.  We then page through it forward and backward,
+ * including across the segment boundaries, checking that every page starts
+ * and ends on an instance boundary.  Finally, we reopen the history as though
+ * we had recovered the session, and check that relearning the chats it
+ * already holds files nothing new.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "config.h"
+
+#include "paxos.h"
+#include "paxos_protocol.h"
+#include "paxos_state.h"
+
+#define TEST_ALIAS      "test"
+#define TEST_CHAT       "hello"
+#define TEST_BIG_SIZE   (16 * 1024 * 1024)  // at least a whole segment
+#define TEST_BIG_INUM   41                  // instance of the big chat
+#define TEST_LAST_INUM  60                  // last instance filed
+
+static unsigned delivered;    // chats handed to us by the last page
+static paxid_t first;         // instance of the first of them
+static paxid_t last;          // instance of the last of them
+
+static int
+test_connect(const char *alias, size_t size, struct motmot_connect_cb *cb)
+{
+  return 0;
+}
+
+static int
+test_learn(const void *message, size_t len, const char *alias, size_t size,
+    void *data)
+{
+  return 0;
+}
+
+static void *
+test_enter(void *data)
+{
+  return data;
+}
+
+static void
+test_leave(void *data)
+{
+}
+
+/**
+ * check - Fail the test if a condition does not hold.
+ */
+static void
+check(bool cond, const char *what)
+{
+  if (!cond) {
+    fprintf(stderr, "history: %s\n", what);
+    exit(1);
+  }
+}
+
+static int
+test_history(unsigned inum, long long timestamp, const void *message,
+    size_t len, const char *alias, size_t size, void *data)
+{
+  check(inum >= last, "chats out of order");
+  check(size == sizeof(TEST_ALIAS) - 1 &&
+      memcmp(alias, TEST_ALIAS, size) == 0, "wrong alias");
+  check(inum == TEST_BIG_INUM ? len == TEST_BIG_SIZE :
+      len == sizeof(TEST_CHAT) - 1 && memcmp(message, TEST_CHAT, len) == 0,
+      "wrong chat");
+
+  if (delivered++ == 0) {
+    first = inum;
+  }
+  last = inum;
+  return 0;
+}
+
+/**
+ * page - Read a page of the history, checking how many chats it held and
+ * which instances it spanned.
+ */
+static void
+page(paxid_t inum, int count, unsigned expected, paxid_t efirst,
+    paxid_t elast, const char *what)
+{
+  delivered = 0;
+  first = 0;
+  last = 0;
+
+  check(paxos_history(pax, inum, count, test_history) == 0,
+      "could not read history");
+  check(delivered == expected, what);
+  check(expected == 0 || (first == efirst && last == elast), what);
+}
+
+/**
+ * file_instance - File two chats learned in an instance.
+ */
+static void
+file_instance(paxid_t inum)
+{
+  history_append(inum, TEST_ALIAS, sizeof(TEST_ALIAS) - 1, TEST_CHAT,
+      sizeof(TEST_CHAT) - 1);
+  history_append(inum, TEST_ALIAS, sizeof(TEST_ALIAS) - 1, TEST_CHAT,
+      sizeof(TEST_CHAT) - 1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct learn_table learn = { test_learn, test_learn, test_learn };
+  struct paxos_session *session;
+  char home[] = "/tmp/motmot-history-XXXXXX";
+  char *big, *dir;
+  paxid_t inum;
+
+  // Keep our history out of the real home directory.
+  check(g_mkdtemp(home) != NULL, "could not make home");
+  g_setenv("HOME", home, TRUE);
+
+  check(paxos_init(test_connect, &learn, test_enter, test_leave, "test", 4)
+      == 0, "init failed");
+  paxos_set_history(1);
+  session = paxos_start(NULL);
+  pax = session;
+
+  // Fill the first segment past one index stride, give the big chat a
+  // segment to itself, and start a third.
+  for (inum = 1; inum < TEST_BIG_INUM; ++inum) {
+    file_instance(inum);
+  }
+  big = g_malloc0(TEST_BIG_SIZE);
+  history_append(TEST_BIG_INUM, TEST_ALIAS, sizeof(TEST_ALIAS) - 1, big,
+      TEST_BIG_SIZE);
+  g_free(big);
+  for (inum = TEST_BIG_INUM + 1; inum <= TEST_LAST_INUM; ++inum) {
+    file_instance(inum);
+  }
+  check(pax->history != NULL && pax->history->hs_count == 3,
+      "history not split across segments");
+
+  // Paging forward rounds up to a whole instance.
+  page(1, 5, 6, 1, 3, "wrong first page");
+  page(4, 2, 2, 4, 4, "wrong page of one instance");
+
+  // Seeking past the first index entry walks from the right one.
+  page(35, 1, 2, 35, 35, "wrong page past first stride");
+
+  // Pages run on into the next segment.
+  page(40, 3, 3, 40, TEST_BIG_INUM, "wrong page into big segment");
+  page(TEST_BIG_INUM, 2, 3, TEST_BIG_INUM, TEST_BIG_INUM + 1,
+      "wrong page out of big segment");
+  page(TEST_LAST_INUM, 10, 2, TEST_LAST_INUM, TEST_LAST_INUM,
+      "wrong last page");
+  page(TEST_LAST_INUM + 1, 10, 0, 0, 0, "chats past the end");
+
+  // Paging backward rounds back to the start of an instance, and never
+  // delivers the instance paged back from.
+  page(10, -3, 4, 8, 9, "wrong page back");
+  page(TEST_BIG_INUM + 2, -3, 3, TEST_BIG_INUM, TEST_BIG_INUM + 1,
+      "wrong page back across segments");
+  page(MOTMOT_HISTORY_END, -2, 2, TEST_LAST_INUM, TEST_LAST_INUM,
+      "wrong newest page");
+  page(1, -5, 0, 0, 0, "chats before the start");
+
+  // Reopen the history, as after recovery.  Relearning what it holds files
+  // nothing, but the next instance is filed as usual.
+  history_destroy(pax->history);
+  pax->history = NULL;
+  for (inum = 1; inum <= TEST_LAST_INUM; ++inum) {
+    file_instance(inum);
+  }
+  page(TEST_LAST_INUM - 1, -10, 10, TEST_LAST_INUM - 6, TEST_LAST_INUM - 2,
+      "wrong page after reopening");
+  page(TEST_LAST_INUM, 10, 2, TEST_LAST_INUM, TEST_LAST_INUM,
+      "instances filed twice");
+  file_instance(TEST_LAST_INUM + 1);
+  page(TEST_LAST_INUM, 10, 4, TEST_LAST_INUM, TEST_LAST_INUM + 1,
+      "instance lost after reopening");
+
+  // Ending the session removes its history.
+  paxos_end(session);
+  dir = g_build_filename(motmot_home_dir(), "history", NULL);
+  g_rmdir(dir);
+  g_free(dir);
+  g_rmdir(motmot_home_dir());
+  g_rmdir(home);
+
+  printf("history: ok\n");
+  return 0;
+}
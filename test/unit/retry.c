@@ -0,0 +1,314 @@
+/**
+ * retry.c - Check whom we retry holes with, and how retries are answered.
+ *
+ * We start a session of our own and add four acceptors on socket pairs,
+ * taking the place of an acceptor which is not the proposer ourselves.  We
+ * first replay retries from another acceptor through paxos_dispatch, and
+ * check that they are answered in full, in part, or with the busy sentinel
+ * as our serving budget allows.  We then open a hole and let its timer fire
+ * repeatedly, checking that we retry with an acceptor other than the
+ * proposer, stick with one which shrank our hole, move on to another when it
+ * did not, and fall back on the proposer once those retries are spent; and
+ * that a busy answer does not count against the acceptor.
+ *
+ * Network IO is corked throughout, so every message we send stays queued on
+ * its peer, where we can see whom it went to.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <glib.h>
+
+#include "common/yakyak.h"
+
+#include "paxos.h"
+#include "paxos_protocol.h"
+#include "paxos_state.h"
+#include "paxos_util.h"
+#include "types/decree.h"
+#include "util/paxos_buf.h"
+#include "util/paxos_io.h"
+
+#define TEST_ACCEPTORS    5                   // acceptors in the session
+#define TEST_SELF         3                   // the one we play
+#define TEST_PROPOSER     2                   // the one proposing
+#define TEST_RETRIER      4                   // the one retrying with us
+#define TEST_CHAT_SIZE    1024                // size of each chat we serve
+#define TEST_SERVE_LAST   201                 // last instance we serve
+#define TEST_BUDGET       (128 * 1024)        // a full burst of serving budget
+#define TEST_HOLE_LAST    (TEST_SERVE_LAST + 10)  // last commit past our hole
+
+static char chat[TEST_CHAT_SIZE];
+
+static int
+test_connect(const char *alias, size_t size, struct motmot_connect_cb *cb)
+{
+  return 0;
+}
+
+static int
+test_learn(const void *message, size_t len, const char *alias, size_t size,
+    void *data)
+{
+  return 0;
+}
+
+static void *
+test_enter(void *data)
+{
+  return data;
+}
+
+static void
+test_leave(void *data)
+{
+}
+
+/**
+ * check - Fail the test if a condition does not hold.
+ */
+static void
+check(bool cond, const char *what)
+{
+  if (!cond) {
+    fprintf(stderr, "retry: %s\n", what);
+    exit(1);
+  }
+}
+
+/**
+ * add_acceptor - Add an acceptor to the session, connected on one end of a
+ * socket pair unless it is us or has left.
+ */
+static void
+add_acceptor(paxid_t paxid, bool live)
+{
+  int fds[2];
+  struct paxos_acceptor *acc;
+
+  acc = g_malloc0(sizeof(*acc));
+  acc->pa_paxid = paxid;
+  if (live) {
+    check(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0,
+        "could not make socket pair");
+    acceptor_set_peer(acc, paxos_peer_init(g_io_channel_unix_new(fds[0])));
+  }
+  acceptor_insert(&pax->alist, acc);
+}
+
+/**
+ * queued - Get the bytes queued to an acceptor.
+ */
+static size_t
+queued(paxid_t paxid)
+{
+  struct paxos_acceptor *acc;
+
+  acc = acceptor_find(&pax->alist, paxid);
+  return acc->pa_peer != NULL ? paxos_peer_queued(acc->pa_peer) : 0;
+}
+
+/**
+ * commit_instance - Add a committed instance decreeing a chat of our own.
+ */
+static void
+commit_instance(paxid_t inum)
+{
+  struct paxos_request *req;
+  struct paxos_instance *inst;
+
+  req = request_new();
+  req->pr_val.pv_dkind = DEC_CHAT;
+  req->pr_val.pv_reqid.id = pax->self_id;
+  req->pr_val.pv_reqid.gen = (++pax->req_id);
+  request_set_data(req, chat, sizeof(chat));
+  request_insert(&pax->rcache, req);
+
+  inst = instance_new();
+  header_init(&inst->pi_hdr, OP_DECREE, inum);
+  memcpy(&inst->pi_val, &req->pr_val, sizeof(req->pr_val));
+  inst->pi_committed = true;
+  inst->pi_votes = 1;
+  instance_insert(&pax->ilist, inst);
+}
+
+/**
+ * replay - Dispatch a packed message as though it had been received from
+ * an acceptor.
+ */
+static void
+replay(const char *what, paxid_t from, struct yakyak *yy)
+{
+  int r;
+  msgpack_unpacked msg;
+  struct paxos_session *session = pax;
+
+  msgpack_unpacked_init(&msg);
+  check(msgpack_unpack_next(&msg, yakyak_data(yy), yakyak_size(yy), NULL),
+      what);
+
+  paxos_buf_recv_begin(&msg);
+  r = paxos_dispatch(acceptor_find(&pax->alist, from)->pa_peer, &msg.data);
+  paxos_buf_recv_end();
+  check(r == 0, what);
+
+  msgpack_unpacked_destroy(&msg);
+  yakyak_destroy(yy);
+  pax = session;
+}
+
+/**
+ * replay_retry - Replay a retry for [first, last] from the retrier, with the
+ * given serving budget, and check whether it was answered and throttled.
+ */
+static void
+replay_retry(const char *what, paxid_t first, paxid_t last, gint64 budget,
+    bool throttled)
+{
+  struct paxos_header hdr;
+  struct yakyak yy;
+  size_t before;
+  unsigned long nthrottled;
+
+  state.serve_tokens = budget;
+  state.serve_stamp = g_get_monotonic_time();
+  before = queued(TEST_RETRIER);
+  nthrottled = state.stats.ps_throttled;
+
+  header_init(&hdr, OP_RETRY, first);
+  yakyak_init(&yy, 2);
+  paxos_header_pack(&yy, &hdr);
+  paxos_paxid_pack(&yy, last);
+  replay(what, TEST_RETRIER, &yy);
+
+  check(queued(TEST_RETRIER) > before, what);
+  check(state.stats.ps_throttled == nthrottled + throttled, what);
+}
+
+/**
+ * replay_busy - Replay the busy sentinel from whomever we last retried with.
+ */
+static void
+replay_busy(paxid_t from)
+{
+  struct paxos_header hdr;
+  struct yakyak yy;
+
+  header_init(&hdr, OP_RECOMMIT, 0);
+  yakyak_init(&yy, 2);
+  paxos_header_pack(&yy, &hdr);
+  yakyak_begin_array(&yy, 2);
+  yakyak_begin_array(&yy, 0);
+  yakyak_begin_array(&yy, 0);
+  replay("busy recommit", from, &yy);
+}
+
+/**
+ * retry_fire - Let the hole timer fire, and get the acceptor we retried with.
+ */
+static paxid_t
+retry_fire()
+{
+  paxid_t paxid, chosen;
+  size_t before[TEST_ACCEPTORS + 1];
+  unsigned long retries;
+  struct paxos_session *session = pax;
+
+  for (paxid = 1; paxid <= TEST_ACCEPTORS; ++paxid) {
+    before[paxid] = queued(paxid);
+  }
+
+  retries = state.stats.ps_retries;
+  while (state.stats.ps_retries == retries) {
+    g_main_context_iteration(NULL, TRUE);
+  }
+  pax = session;
+
+  chosen = 0;
+  for (paxid = 1; paxid <= TEST_ACCEPTORS; ++paxid) {
+    if (queued(paxid) > before[paxid]) {
+      check(chosen == 0, "retried with more than one acceptor");
+      chosen = paxid;
+    }
+  }
+  check(chosen != 0, "retried with no one");
+
+  return chosen;
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct learn_table learn = { test_learn, test_learn, test_learn };
+  struct paxos_session *session;
+  paxid_t paxid, first, second;
+  unsigned long peer_retries;
+
+  check(paxos_init(test_connect, &learn, test_enter, test_leave, "test", 4)
+      == 0, "init failed");
+  session = paxos_start(NULL);
+  pax = session;
+  paxos_io_cork();
+
+  // Take the place of an acceptor in the middle of the session.  The
+  // acceptor we started out as has left.
+  check(LIST_FIRST(&pax->alist)->pa_paxid == 1 &&
+      LIST_FIRST(&pax->alist)->pa_peer == NULL, "no startup acceptor");
+  for (paxid = 2; paxid <= TEST_ACCEPTORS; ++paxid) {
+    add_acceptor(paxid, paxid != TEST_SELF);
+  }
+  pax->self_id = TEST_SELF;
+  reset_proposer();
+  check(pax->proposer->pa_paxid == TEST_PROPOSER && !is_proposer(),
+      "wrong proposer");
+
+  // Serve a retry in full when we have the budget, in part when we run out
+  // after the first recommit, and not at all when we have none.
+  for (paxid = 2; paxid <= TEST_SERVE_LAST; ++paxid) {
+    commit_instance(paxid);
+  }
+  replay_retry("retry not answered in full", 2, 33, TEST_BUDGET, false);
+  replay_retry("retry not answered in part", 2, TEST_SERVE_LAST, 1, true);
+  replay_retry("retry not answered busy", 2, 33, -TEST_BUDGET, true);
+
+  // Our first retry goes to an acceptor other than the proposer.
+  check(acceptor_hole(TEST_HOLE_LAST) == 0, "could not open hole");
+  peer_retries = state.stats.ps_peer_retries;
+  first = retry_fire();
+  check(first != TEST_PROPOSER && first != TEST_SELF && first != 1,
+      "first retry not with a live acceptor");
+  check(pax->hpeer == first && pax->htries == 1, "first retry not noted");
+  check(state.stats.ps_peer_retries == peer_retries + 1,
+      "first retry not counted");
+
+  // If it shrank our hole, we stick with it.
+  pax->ihole++;
+  check(retry_fire() == first, "did not stick with a helpful acceptor");
+  check(pax->htries == 1, "tries not reset on progress");
+
+  // If it didn't, we try the other.
+  second = retry_fire();
+  check(second != TEST_PROPOSER && second != TEST_SELF && second != 1 &&
+      second != first, "did not move on from an unhelpful acceptor");
+  check(pax->hpeer == second && pax->htries == 2, "second retry not noted");
+
+  // A busy answer is not counted against it, and we ask someone else.
+  replay_busy(second);
+  check(pax->hpeer == 0 && pax->htries == 1, "busy retry counted");
+  paxid = retry_fire();
+  check(paxid != TEST_PROPOSER && paxid != TEST_SELF && paxid != 1,
+      "fell back on the proposer after a busy retry");
+
+  // Once those retries are spent, we ask the proposer.
+  peer_retries = state.stats.ps_peer_retries;
+  check(retry_fire() == TEST_PROPOSER, "did not fall back on the proposer");
+  check(pax->htries == 3, "proposer retry not noted");
+  check(state.stats.ps_peer_retries == peer_retries,
+      "proposer retry counted as a peer retry");
+
+  printf("retry: ok\n");
+  return 0;
+}
@@ -0,0 +1,195 @@
+/**
+ * wal.c - Check that a session comes back from its log as we left it.
+ *
+ * We start a session of our own with logging on, raise our ballot, and log
+ * a commit and an accept, then drop the session as though we had crashed and
+ * recover it.  We then truncate the recovered session, which appends a
+ * checkpoint rather than rewriting the log, and recover it once more,
+ * checking that the client is handed its scrollback only once.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "config.h"
+
+#include "paxos.h"
+#include "paxos_protocol.h"
+#include "paxos_state.h"
+#include "types/decree.h"
+
+#define TEST_CHAT  "hello"
+
+static struct paxos_session *recovered;
+static unsigned chats;
+
+static int
+test_connect(const char *alias, size_t size, struct motmot_connect_cb *cb)
+{
+  return 0;
+}
+
+static int
+test_chat(const void *message, size_t len, const char *alias, size_t size,
+    void *data)
+{
+  chats++;
+  return 0;
+}
+
+static int
+test_learn(const void *message, size_t len, const char *alias, size_t size,
+    void *data)
+{
+  return 0;
+}
+
+static void *
+test_enter(void *data)
+{
+  // Sessions we recover are handed to us in place of client data.
+  recovered = data;
+  return data;
+}
+
+static void
+test_leave(void *data)
+{
+}
+
+/**
+ * check - Fail the test if a condition does not hold.
+ */
+static void
+check(bool cond, const char *what)
+{
+  if (!cond) {
+    fprintf(stderr, "wal: %s\n", what);
+    exit(1);
+  }
+}
+
+/**
+ * log_instance - Add an instance decreeing a chat of our own, and log it.
+ */
+static void
+log_instance(paxid_t inum, bool committed)
+{
+  struct paxos_request *req;
+  struct paxos_instance *inst;
+
+  req = request_new();
+  req->pr_val.pv_dkind = DEC_CHAT;
+  req->pr_val.pv_reqid.id = pax->self_id;
+  req->pr_val.pv_reqid.gen = (++pax->req_id);
+  request_set_data(req, TEST_CHAT, sizeof(TEST_CHAT) - 1);
+  request_insert(&pax->rcache, req);
+
+  inst = instance_new();
+  header_init(&inst->pi_hdr, OP_DECREE, inum);
+  memcpy(&inst->pi_val, &req->pr_val, sizeof(req->pr_val));
+  inst->pi_committed = committed;
+  inst->pi_votes = 1;
+  instance_insert(&pax->ilist, inst);
+
+  check(wal_instance(inst) == 0, "could not log instance");
+}
+
+/**
+ * crash - Drop a session without ending it, leaving its log behind, and
+ * recover it.
+ */
+static struct paxos_session *
+crash(struct paxos_session *session)
+{
+  pax = session;
+  check(wal_sync() == 0, "could not sync log");
+
+  session_remove(state.sessions, pax);
+  LIST_REMOVE(&state.slist, pax, session_le);
+  session_destroy(pax);
+
+  recovered = NULL;
+  check(wal_recover() == 0, "recovery failed");
+  check(recovered != NULL, "session not recovered");
+
+  pax = recovered;
+  return recovered;
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct learn_table learn = { test_chat, test_learn, test_learn };
+  struct paxos_session *session;
+  struct paxos_instance *inst;
+  char home[] = "/tmp/motmot-wal-XXXXXX";
+  char *dir;
+
+  // Keep our logs out of the real home directory.
+  check(g_mkdtemp(home) != NULL, "could not make home");
+  g_setenv("HOME", home, TRUE);
+
+  check(paxos_init(test_connect, &learn, test_enter, test_leave, "test", 4)
+      == 0, "init failed");
+  check(paxos_set_wal(1) == 0, "could not turn on logging");
+  session = paxos_start(NULL);
+
+  // Raise our ballot, commit a chat, and accept another.
+  pax = session;
+  pax->ballot.gen = 5;
+  pax->gen_high = 5;
+  check(wal_ballot() == 0, "could not log ballot");
+  log_instance(2, true);
+  log_instance(3, false);
+
+  // Everything we logged comes back, and we learn the commit we hadn't.
+  session = crash(session);
+  check(pax->ballot.id == pax->self_id && pax->ballot.gen == 5,
+      "ballot not recovered");
+  check(pax->gen_high == 5, "ballot high-water mark not recovered");
+  check(pax->ibase == 1, "wrong ibase");
+  check(instance_find(&pax->ilist, 1) != NULL, "lost startup instance");
+  inst = instance_find(&pax->ilist, 2);
+  check(inst != NULL && inst->pi_committed && inst->pi_learned,
+      "commit not recovered");
+  inst = instance_find(&pax->ilist, 3);
+  check(inst != NULL && !inst->pi_committed, "accept not recovered");
+  check(inst->pi_hdr.ph_ballot.gen == 5, "accept under wrong ballot");
+  check(pax->ihole == 3, "wrong hole");
+  check(chats == 1, "commit not learned");
+
+  // Truncating appends a checkpoint, which supersedes what came before.  We
+  // truncate twice, so that the chat we learned is in the scrollback of both
+  // checkpoints.
+  pax->ibase = 3;
+  pax->sync_prev = 3;
+  ilist_truncate_prefix(&pax->ilist, pax->ibase);
+  check(wal_truncate() == 0, "could not log truncation");
+  check(wal_truncate() == 0, "could not log truncation");
+
+  session = crash(session);
+  check(pax->ibase == 3, "truncation not recovered");
+  check(instance_find(&pax->ilist, 1) == NULL &&
+      instance_find(&pax->ilist, 2) == NULL, "truncated instances recovered");
+  inst = instance_find(&pax->ilist, 3);
+  check(inst != NULL && !inst->pi_committed, "accept lost at truncation");
+  check(pax->ihole == 3, "wrong hole after truncation");
+  check(LIST_COUNT(&pax->alist) == 1, "wrong alist after truncation");
+  check(chats == 2, "scrollback not delivered exactly once");
+
+  // Ending the session removes its log.
+  paxos_end(session);
+  dir = g_build_filename(motmot_home_dir(), "wal", NULL);
+  g_rmdir(dir);
+  g_free(dir);
+  g_rmdir(motmot_home_dir());
+  g_rmdir(home);
+
+  printf("wal: ok\n");
+  return 0;
+}